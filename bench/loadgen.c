@@ -0,0 +1,683 @@
+#include "logging.h"
+#include "utils/metrics.h"
+#include "utils/tools.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Load generator: starts a broker, creates boxes, and runs publishers and
+ * subscribers against it (threads of this process, speaking the protocol
+ * like pub and sub do), then reports the throughput seen by the subscribers
+ * and the latency of the messages from being sent to being received, as
+ * JSON. With -c, the results are compared against a baseline saved with -o,
+ * and the exit status tells whether they regressed.
+ *
+ * Each message starts with the time it was meant to be sent (with -r, the
+ * slot of the publisher's schedule, so that a stalled publisher does not
+ * hide the latency of the messages it owed), in hex, and is padded to the
+ * message size.
+ */
+
+// How long the broker has to come up, and the subscribers to receive the
+// last messages, in milliseconds
+#define BROKER_START_MS (5000)
+#define DRAIN_MS (2000)
+
+// How often subscribers check whether they are done, in milliseconds
+#define POLL_MS (100)
+
+// Digits of the timestamp at the start of each message
+#define STAMP_LEN (16)
+
+typedef struct {
+    char const *broker_path;
+    long publishers;
+    long subscribers;
+    long boxes;
+    long msg_size;
+    long rate; // messages per second of each publisher (0: as fast as it can)
+    long duration_s;
+    bool use_socket;
+    long box_size; // bytes (0: sized after the rate and duration)
+    char const *output_path;
+    char const *baseline_path;
+    double tolerance_pct;
+} bench_config_t;
+
+static bench_config_t config = {
+    .broker_path = "mbroker/mbroker",
+    .publishers = 1,
+    .subscribers = 1,
+    .boxes = 1,
+    .msg_size = 64,
+    .rate = 10000,
+    .duration_s = 5,
+    .use_socket = false,
+    .box_size = 0,
+    .output_path = NULL,
+    .baseline_path = NULL,
+    .tolerance_pct = 10.0,
+};
+
+// Where the pipes (or the socket) go, removed at the end
+static char work_dir[] = "/tmp/loadgen.XXXXXX";
+static char register_path[MAX_PIPE_NAME];
+
+// Messages sent to each box (config.boxes of them), final once the
+// publishers are done
+static _Atomic uint64_t *published;
+static _Atomic bool publishers_done = false;
+static _Atomic bool box_full = false;
+
+// Messages received (METRIC_MSGS_OUT and METRIC_BYTES_OUT) and their
+// latencies (LATENCY_DELIVER), and when the last one arrived
+static metrics_t results;
+static _Atomic uint64_t last_received = 0;
+static uint64_t started_at;
+
+static void print_usage_and_exit() {
+    fprintf(stderr,
+            "usage: loadgen [-B broker] [-p publishers] [-s subscribers] "
+            "[-m boxes] [-z msg_size] [-r rate] [-d duration_s] "
+            "[-t fifo|socket] [-b box_size] [-o output.json] "
+            "[-c baseline.json [-x tolerance_pct]]\n");
+    exit(EXIT_FAILURE);
+}
+
+static void box_name(char *name, long box) {
+    snprintf(name, MAX_BOX_NAME, "bench%ld", box);
+}
+
+/**
+ * Register a session, and open what it goes through: its pipe, created
+ * here, or a connection to the broker's socket.
+ * Returns the file descriptor if successful, -1 otherwise.
+ */
+static int open_session(uint8_t opcode, char const *pipe_path, long box) {
+    request_t request = {.opcode = opcode, .flags = REGISTER_FLAG_LEN_PREFIX};
+    strncpy(request.client_path, pipe_path, MAX_PIPE_NAME);
+    box_name(request.box_name, box);
+    uint8_t packet[MAX_REQUEST_LEN];
+    size_t packet_len = encode_request(packet, &request);
+
+    if (config.use_socket) {
+        int fd = connect_broker(register_path);
+        if (fd >= 0 && safe_write(fd, packet, packet_len) != packet_len) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    unlink(pipe_path);
+    if (mkfifo(pipe_path, 0666) < 0) {
+        return -1;
+    }
+    int reg_fd = open(register_path, O_WRONLY);
+    if (reg_fd < 0) {
+        return -1;
+    }
+    ssize_t written = safe_write(reg_fd, packet, packet_len);
+    close(reg_fd);
+    if (written != packet_len) {
+        return -1;
+    }
+    // blocks until the broker accepts the session
+    return open(pipe_path,
+                opcode == TFS_OPCODE_REG_PUB_EXT ? O_WRONLY : O_RDONLY);
+}
+
+static int create_box(long box) {
+    char pipe_path[MAX_PIPE_NAME];
+    snprintf(pipe_path, sizeof(pipe_path), "%s/m%ld", work_dir, box);
+    request_t request = {.opcode = TFS_OPCODE_CRT_BOX};
+    strncpy(request.client_path, pipe_path, MAX_PIPE_NAME);
+    box_name(request.box_name, box);
+    uint8_t packet[MAX_REQUEST_LEN];
+    size_t packet_len = encode_request(packet, &request);
+
+    int fd;
+    if (config.use_socket) {
+        fd = connect_broker(register_path);
+        if (fd >= 0 && safe_write(fd, packet, packet_len) != packet_len) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        int reg_fd = -1;
+        if (mkfifo(pipe_path, 0666) < 0 ||
+            (reg_fd = open(register_path, O_WRONLY)) < 0 ||
+            safe_write(reg_fd, packet, packet_len) != packet_len) {
+            if (reg_fd >= 0) {
+                close(reg_fd);
+            }
+            return -1;
+        }
+        close(reg_fd);
+        fd = open(pipe_path, O_RDONLY);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+
+    uint8_t frame[BOX_ANSWER_LEN];
+    box_answer_t answer;
+    ssize_t bytes_read = config.use_socket
+                             ? recv(fd, frame, sizeof(frame), 0)
+                             : read_all(fd, frame, sizeof(frame));
+    close(fd);
+    unlink(pipe_path);
+    if (bytes_read != BOX_ANSWER_LEN) {
+        return -1;
+    }
+    decode_box_answer(frame, &answer);
+    if (answer.status != 0) {
+        WARN("Failed to create box: %s", answer.error);
+        return -1;
+    }
+    return 0;
+}
+
+static void *publisher_thread(void *arg) {
+    long id = (long)(intptr_t)arg;
+    char pipe_path[MAX_PIPE_NAME];
+    snprintf(pipe_path, sizeof(pipe_path), "%s/p%ld", work_dir, id);
+    int fd = open_session(TFS_OPCODE_REG_PUB_EXT, pipe_path, id);
+    if (fd < 0) {
+        WARN("Publisher %ld failed to register: %s", id, strerror(errno));
+        return NULL;
+    }
+
+    char message[MAX_PUB_MSG];
+    for (long i = STAMP_LEN; i < config.msg_size; i++) {
+        message[i] = (char)('a' + i % 26);
+    }
+    uint8_t frame[MSG_HEADER_LEN + MAX_PUB_MSG];
+    uint64_t interval = config.rate > 0 ? 1000000000 / (uint64_t)config.rate
+                                        : 0;
+    uint64_t end = started_at + (uint64_t)config.duration_s * 1000000000;
+    uint64_t next = started_at;
+
+    while (true) {
+        uint64_t now = metrics_now();
+        if ((interval > 0 ? next : now) >= end) {
+            break;
+        }
+        uint64_t stamp = now;
+        if (interval > 0) {
+            if (now < next) {
+                struct timespec ts = {
+                    .tv_sec = (time_t)(next / 1000000000),
+                    .tv_nsec = (long)(next % 1000000000)};
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            }
+            stamp = next;
+            next += interval;
+        }
+        char digits[STAMP_LEN + 1];
+        snprintf(digits, sizeof(digits), "%016lx", stamp);
+        memcpy(message, digits, STAMP_LEN);
+
+        size_t frame_len =
+            encode_message(frame, TFS_OPCODE_PUB_MSG, message,
+                           (size_t)config.msg_size, REGISTER_FLAG_LEN_PREFIX);
+        if (safe_write(fd, frame, frame_len) != frame_len) {
+            // the broker ends the session once the box is full
+            atomic_store(&box_full, true);
+            break;
+        }
+        atomic_fetch_add(&published[id], 1);
+    }
+
+    close(fd);
+    if (!config.use_socket) {
+        unlink(pipe_path);
+    }
+    return NULL;
+}
+
+/**
+ * Take in the messages of the whole frames at the start of buf.
+ * Returns how many bytes they took up.
+ */
+static size_t receive_frames(uint8_t const *data, size_t len,
+                             uint64_t *received) {
+    size_t offset = 0;
+    while (len - offset >= MSG_HEADER_LEN) {
+        ssize_t frame_len =
+            message_frame_len(data + offset, REGISTER_FLAG_LEN_PREFIX);
+        if (frame_len < 0) {
+            PANIC("Invalid frame from the broker");
+        }
+        if (len - offset < (size_t)frame_len) {
+            break;
+        }
+
+        uint8_t const *message;
+        size_t message_len;
+        decode_message(data + offset, (size_t)frame_len,
+                       REGISTER_FLAG_LEN_PREFIX, &message, &message_len);
+        char digits[STAMP_LEN + 1] = {0};
+        memcpy(digits, message, message_len < STAMP_LEN ? message_len
+                                                        : STAMP_LEN);
+        uint64_t stamp = strtoull(digits, NULL, 16);
+        uint64_t now = metrics_now();
+        metrics_record(&results, LATENCY_DELIVER, now > stamp ? now - stamp
+                                                              : 0);
+        metrics_add(&results, METRIC_MSGS_OUT, 1);
+        metrics_add(&results, METRIC_BYTES_OUT, message_len);
+        (*received)++;
+
+        uint64_t last = atomic_load(&last_received);
+        while (last < now &&
+               !atomic_compare_exchange_weak(&last_received, &last, now)) {
+        }
+        offset += (size_t)frame_len;
+    }
+    return offset;
+}
+
+static void *subscriber_thread(void *arg) {
+    long id = (long)(intptr_t)arg;
+    long box = id % config.boxes;
+    char pipe_path[MAX_PIPE_NAME];
+    snprintf(pipe_path, sizeof(pipe_path), "%s/s%ld", work_dir, id);
+    int fd = open_session(TFS_OPCODE_REG_SUB_EXT, pipe_path, box);
+    if (fd < 0) {
+        WARN("Subscriber %ld failed to register: %s", id, strerror(errno));
+        return NULL;
+    }
+
+    // room for a whole packet of the socket after any partial frame
+    size_t capacity = 2 * MAX_SUB_PACKET_LEN;
+    uint8_t *rx_buf = malloc(capacity);
+    if (rx_buf == NULL) {
+        PANIC("Out of memory");
+    }
+    size_t len = 0;
+    uint64_t received = 0;
+    uint64_t drain_deadline = 0;
+
+    while (true) {
+        if (atomic_load(&publishers_done)) {
+            if (drain_deadline == 0) {
+                drain_deadline = metrics_now() + DRAIN_MS * 1000000ull;
+            }
+            if (received >= atomic_load(&published[box]) ||
+                metrics_now() > drain_deadline) {
+                break;
+            }
+        }
+
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        ssize_t bytes_read = config.use_socket
+                                 ? recv(fd, rx_buf + len, capacity - len, 0)
+                                 : read(fd, rx_buf + len, capacity - len);
+        if (bytes_read <= 0) {
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        len += (size_t)bytes_read;
+        size_t consumed = receive_frames(rx_buf, len, &received);
+        len -= consumed;
+        memmove(rx_buf, rx_buf + consumed, len);
+    }
+
+    free(rx_buf);
+    close(fd);
+    if (!config.use_socket) {
+        unlink(pipe_path);
+    }
+    return NULL;
+}
+
+static pid_t start_broker(long box_size) {
+    char box_arg[32];
+    char sessions_arg[32];
+    snprintf(box_arg, sizeof(box_arg), "%ld", box_size);
+    snprintf(sessions_arg, sizeof(sessions_arg), "%ld",
+             config.publishers + config.subscribers + 1);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // keep the broker's logs off the terminal
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execl(config.broker_path, config.broker_path, "-t",
+              config.use_socket ? "socket" : "fifo", "-b", box_arg,
+              register_path, sessions_arg, (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0) {
+        return -1;
+    }
+
+    // ready once its register pipe (or socket) is there
+    for (long waited = 0; waited < BROKER_START_MS; waited += 10) {
+        struct stat st;
+        if (stat(register_path, &st) == 0 &&
+            (config.use_socket ? S_ISSOCK(st.st_mode) : S_ISFIFO(st.st_mode))) {
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            return -1;
+        }
+        nanosleep(&(struct timespec){.tv_nsec = 10000000}, NULL);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void stop_broker(pid_t pid) {
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+}
+
+typedef struct {
+    double msgs_per_s;
+    double mb_per_s;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+} bench_result_t;
+
+/**
+ * The value of the first occurrence of a key in a JSON document written by
+ * write_results (which does not nest the keys compared).
+ */
+static int json_number(char const *json, char const *key, double *value) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    char const *found = strstr(json, pattern);
+    if (found == NULL) {
+        return -1;
+    }
+    char *end;
+    *value = strtod(found + strlen(pattern), &end);
+    return end == found + strlen(pattern) ? -1 : 0;
+}
+
+static int read_baseline(char const *path, bench_result_t *baseline) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char json[8192];
+    size_t len = fread(json, 1, sizeof(json) - 1, file);
+    fclose(file);
+    json[len] = '\0';
+
+    if (json_number(json, "msgs_per_s", &baseline->msgs_per_s) != 0 ||
+        json_number(json, "mb_per_s", &baseline->mb_per_s) != 0 ||
+        json_number(json, "p50", &baseline->p50_us) != 0 ||
+        json_number(json, "p99", &baseline->p99_us) != 0 ||
+        json_number(json, "p999", &baseline->p999_us) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void write_results(FILE *out, stats_info_t const *stats,
+                          uint64_t sent, double elapsed_s,
+                          bench_result_t const *result) {
+    fprintf(out,
+            "{\n"
+            "  \"config\": {\"publishers\": %ld, \"subscribers\": %ld, "
+            "\"boxes\": %ld, \"msg_size\": %ld, \"rate\": %ld, "
+            "\"duration_s\": %ld, \"transport\": \"%s\"},\n",
+            config.publishers, config.subscribers, config.boxes,
+            config.msg_size, config.rate, config.duration_s,
+            config.use_socket ? "socket" : "fifo");
+    fprintf(out,
+            "  \"sent\": %lu,\n"
+            "  \"received\": %lu,\n"
+            "  \"box_full\": %s,\n"
+            "  \"elapsed_s\": %.3f,\n"
+            "  \"msgs_per_s\": %.1f,\n"
+            "  \"mb_per_s\": %.3f,\n"
+            "  \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+            "\"p999\": %.1f, \"max\": %.1f}",
+            sent, stats->msgs_out, atomic_load(&box_full) ? "true" : "false",
+            elapsed_s, result->msgs_per_s, result->mb_per_s, result->p50_us,
+            (double)stats->deliver.p90 / 1000, result->p99_us,
+            result->p999_us, (double)stats->deliver.max / 1000);
+}
+
+/**
+ * Write how the results compare to the baseline, as the end of the JSON
+ * object.
+ * Returns the number of metrics that regressed past the tolerance.
+ */
+static int write_comparison(FILE *out, bench_result_t const *current,
+                            bench_result_t const *baseline) {
+    struct {
+        char const *name;
+        double current;
+        double baseline;
+        bool higher_is_better;
+    } metrics[] = {
+        {"msgs_per_s", current->msgs_per_s, baseline->msgs_per_s, true},
+        {"mb_per_s", current->mb_per_s, baseline->mb_per_s, true},
+        {"p50_us", current->p50_us, baseline->p50_us, false},
+        {"p99_us", current->p99_us, baseline->p99_us, false},
+        {"p999_us", current->p999_us, baseline->p999_us, false},
+    };
+
+    int regressions = 0;
+    fprintf(out, ",\n  \"comparison\": {\"baseline\": \"%s\", "
+                 "\"tolerance_pct\": %.1f",
+            config.baseline_path, config.tolerance_pct);
+    for (size_t i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++) {
+        double change = 0;
+        if (metrics[i].baseline > 0) {
+            change = (metrics[i].current - metrics[i].baseline) * 100 /
+                     metrics[i].baseline;
+        }
+        double worse = metrics[i].higher_is_better ? -change : change;
+        bool regressed = worse > config.tolerance_pct;
+        regressions += regressed;
+        fprintf(out,
+                ",\n    \"%s\": {\"baseline\": %.3f, \"current\": %.3f, "
+                "\"change_pct\": %.1f, \"regressed\": %s}",
+                metrics[i].name, metrics[i].baseline, metrics[i].current,
+                change, regressed ? "true" : "false");
+    }
+    fprintf(out, ",\n    \"regressions\": %d}", regressions);
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "B:p:s:m:z:r:d:t:b:o:c:x:")) != -1) {
+        switch (opt) {
+        case 'B':
+            config.broker_path = optarg;
+            break;
+        case 'p':
+            config.publishers = atol(optarg);
+            break;
+        case 's':
+            config.subscribers = atol(optarg);
+            break;
+        case 'm':
+            config.boxes = atol(optarg);
+            break;
+        case 'z':
+            config.msg_size = atol(optarg);
+            break;
+        case 'r':
+            config.rate = atol(optarg);
+            break;
+        case 'd':
+            config.duration_s = atol(optarg);
+            break;
+        case 't':
+            if (strcmp(optarg, "fifo") == 0) {
+                config.use_socket = false;
+            } else if (strcmp(optarg, "socket") == 0) {
+                config.use_socket = true;
+            } else {
+                print_usage_and_exit();
+            }
+            break;
+        case 'b':
+            config.box_size = atol(optarg);
+            break;
+        case 'o':
+            config.output_path = optarg;
+            break;
+        case 'c':
+            config.baseline_path = optarg;
+            break;
+        case 'x':
+            config.tolerance_pct = atof(optarg);
+            break;
+        default:
+            print_usage_and_exit();
+        }
+    }
+
+    // a box takes a single publisher at a time
+    if (optind != argc || config.publishers < 0 || config.subscribers < 0 ||
+        config.boxes <= 0 || config.publishers > config.boxes ||
+        config.msg_size < STAMP_LEN || config.msg_size >= MAX_PUB_MSG ||
+        config.rate < 0 || config.duration_s <= 0 || config.box_size < 0 ||
+        config.tolerance_pct < 0) {
+        print_usage_and_exit();
+    }
+
+    bench_result_t baseline;
+    if (config.baseline_path != NULL &&
+        read_baseline(config.baseline_path, &baseline) != 0) {
+        PANIC("Failed to read the baseline '%s'", config.baseline_path);
+    }
+
+    // boxes hold every message sent to them (and their record headers)
+    long record_size = config.msg_size + (long)RECORD_HEADER_LEN;
+    long box_size = config.box_size;
+    if (box_size == 0) {
+        box_size = config.rate > 0
+                       ? config.rate * config.duration_s * record_size * 5 / 4
+                       : 16 << 20;
+    }
+
+    if (mkdtemp(work_dir) == NULL) {
+        PANIC("Failed to create a directory for the pipes: %s",
+              strerror(errno));
+    }
+    snprintf(register_path, sizeof(register_path), "%s/register", work_dir);
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t broker = start_broker(box_size);
+    if (broker < 0) {
+        rmdir(work_dir);
+        PANIC("Failed to start the broker '%s'", config.broker_path);
+    }
+    for (long i = 0; i < config.boxes; i++) {
+        if (create_box(i) != 0) {
+            stop_broker(broker);
+            rmdir(work_dir);
+            PANIC("Failed to create box %ld", i);
+        }
+    }
+
+    metrics_init(&results);
+    started_at = metrics_now();
+    pthread_t *threads = malloc(
+        (size_t)(config.publishers + config.subscribers) * sizeof(pthread_t));
+    published = calloc((size_t)config.boxes, sizeof(*published));
+    if (threads == NULL || published == NULL) {
+        PANIC("Out of memory");
+    }
+    // subscribers first, so that they see every message
+    for (long i = 0; i < config.subscribers; i++) {
+        if (pthread_create(&threads[i], NULL, subscriber_thread,
+                           (void *)(intptr_t)i) != 0) {
+            PANIC("Failed to start subscriber %ld", i);
+        }
+    }
+    nanosleep(&(struct timespec){.tv_nsec = 100000000}, NULL);
+    started_at = metrics_now();
+    for (long i = 0; i < config.publishers; i++) {
+        if (pthread_create(&threads[config.subscribers + i], NULL,
+                           publisher_thread, (void *)(intptr_t)i) != 0) {
+            PANIC("Failed to start publisher %ld", i);
+        }
+    }
+    for (long i = 0; i < config.publishers; i++) {
+        pthread_join(threads[config.subscribers + i], NULL);
+    }
+    atomic_store(&publishers_done, true);
+    for (long i = 0; i < config.subscribers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    stop_broker(broker);
+    unlink(register_path);
+    rmdir(work_dir);
+
+    uint64_t sent = 0;
+    for (long i = 0; i < config.publishers; i++) {
+        sent += atomic_load(&published[i]);
+    }
+    free(published);
+    stats_info_t stats;
+    metrics_read(&results, &stats);
+    uint64_t last = atomic_load(&last_received);
+    double elapsed_s =
+        last > started_at ? (double)(last - started_at) / 1e9 : 0;
+    bench_result_t result = {
+        .msgs_per_s = elapsed_s > 0 ? (double)stats.msgs_out / elapsed_s : 0,
+        .mb_per_s =
+            elapsed_s > 0 ? (double)stats.bytes_out / elapsed_s / 1e6 : 0,
+        .p50_us = (double)stats.deliver.p50 / 1000,
+        .p99_us = (double)stats.deliver.p99 / 1000,
+        .p999_us = (double)stats.deliver.p999 / 1000,
+    };
+
+    if (config.output_path != NULL) {
+        FILE *out = fopen(config.output_path, "w");
+        if (out == NULL) {
+            PANIC("Failed to write '%s': %s", config.output_path,
+                  strerror(errno));
+        }
+        write_results(out, &stats, sent, elapsed_s, &result);
+        fprintf(out, "\n}\n");
+        fclose(out);
+    }
+    write_results(stdout, &stats, sent, elapsed_s, &result);
+    int regressions = 0;
+    if (config.baseline_path != NULL) {
+        regressions = write_comparison(stdout, &result, &baseline);
+    }
+    fprintf(stdout, "\n}\n");
+    return regressions > 0 ? 2 : 0;
+}
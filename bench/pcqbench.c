@@ -0,0 +1,300 @@
+#include "logging.h"
+#include "producer-consumer/producer-consumer.h"
+#include "utils/metrics.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Producer-consumer queue benchmark and stress test: N producers hand
+ * tagged elements (producer, sequence number, time of the handoff) to M
+ * consumers through a queue, as fast as they can, and the consumers check
+ * that
+ *   - every element is taken exactly once (none lost nor duplicated), and
+ *   - each consumer takes the elements of a producer in the order they were
+ *     put in (which any FIFO queue guarantees, whatever the interleaving).
+ * It then prints the handoffs per second and the histogram of the time from
+ * an element being put in to it being taken out, as JSON, and exits with
+ * status 1 if a check failed.
+ *
+ * Queues are behind queue_ops_t, so that implementations are compared on
+ * equal terms: pc_queue_t, and a baseline of a ring behind a single lock.
+ */
+
+typedef struct {
+    uint32_t producer;
+    uint32_t seq;
+    uint64_t enqueued_at;
+} element_t;
+
+typedef struct {
+    char const *name;
+    void *(*create)(size_t capacity);
+    void (*destroy)(void *queue);
+    void (*enqueue)(void *queue, void *elem);
+    void *(*dequeue)(void *queue);
+} queue_ops_t;
+
+static void *pcq_ops_create(size_t capacity) {
+    pc_queue_t *queue = malloc(sizeof(pc_queue_t));
+    if (queue != NULL && pcq_create(queue, capacity) != 0) {
+        free(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+static void pcq_ops_destroy(void *queue) {
+    pcq_destroy(queue);
+    free(queue);
+}
+
+static void pcq_ops_enqueue(void *queue, void *elem) {
+    pcq_enqueue(queue, elem);
+}
+
+static void *pcq_ops_dequeue(void *queue) { return pcq_dequeue(queue); }
+
+/**
+ * The baseline: a ring, its counters and both condition variables behind a
+ * single lock.
+ */
+typedef struct {
+    void **buffer;
+    size_t capacity;
+    size_t head;
+    size_t size;
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+} locked_queue_t;
+
+static void *locked_create(size_t capacity) {
+    locked_queue_t *queue = malloc(sizeof(locked_queue_t));
+    if (queue == NULL) {
+        return NULL;
+    }
+    queue->buffer = malloc(capacity * sizeof(void *));
+    if (queue->buffer == NULL) {
+        free(queue);
+        return NULL;
+    }
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->size = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    return queue;
+}
+
+static void locked_destroy(void *arg) {
+    locked_queue_t *queue = arg;
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    free(queue->buffer);
+    free(queue);
+}
+
+static void locked_enqueue(void *arg, void *elem) {
+    locked_queue_t *queue = arg;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->size == queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->buffer[(queue->head + queue->size) % queue->capacity] = elem;
+    queue->size++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void *locked_dequeue(void *arg) {
+    locked_queue_t *queue = arg;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->size == 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    void *elem = queue->buffer[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->size--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return elem;
+}
+
+static queue_ops_t const queues[] = {
+    {"pcq", pcq_ops_create, pcq_ops_destroy, pcq_ops_enqueue, pcq_ops_dequeue},
+    {"locked", locked_create, locked_destroy, locked_enqueue, locked_dequeue},
+};
+
+static queue_ops_t const *ops = &queues[0];
+static void *queue;
+static long n_producers = 4;
+static long n_consumers = 4;
+static long items = 100000; // per producer
+static long capacity = 64;
+
+static element_t *elements;         // items per producer, in order
+static _Atomic uint8_t *taken;       // times each element was taken
+static element_t stop_element;       // one per consumer ends the run
+static _Atomic uint64_t reordered = 0;
+static metrics_t results; // handoff latencies (LATENCY_DELIVER)
+
+static void print_usage_and_exit() {
+    fprintf(stderr, "usage: pcqbench [-q pcq|locked] [-p producers] "
+                    "[-c consumers] [-n items_per_producer] "
+                    "[-k capacity]\n");
+    exit(EXIT_FAILURE);
+}
+
+static void *producer_thread(void *arg) {
+    long producer = (long)(intptr_t)arg;
+    element_t *mine = &elements[producer * items];
+    for (long i = 0; i < items; i++) {
+        mine[i].enqueued_at = metrics_now();
+        ops->enqueue(queue, &mine[i]);
+    }
+    return NULL;
+}
+
+static void *consumer_thread(void *arg) {
+    (void)arg;
+    // sequence number of the next element expected from each producer, at
+    // least (taken by this consumer)
+    uint32_t *next_seq = calloc((size_t)n_producers, sizeof(uint32_t));
+    if (next_seq == NULL) {
+        PANIC("Out of memory");
+    }
+
+    while (true) {
+        element_t *elem = ops->dequeue(queue);
+        uint64_t now = metrics_now();
+        if (elem == &stop_element) {
+            break;
+        }
+        metrics_record(&results, LATENCY_DELIVER,
+                       now > elem->enqueued_at ? now - elem->enqueued_at : 0);
+        atomic_fetch_add(&taken[elem->producer * (uint64_t)items + elem->seq],
+                         1);
+        if (elem->seq < next_seq[elem->producer]) {
+            atomic_fetch_add(&reordered, 1);
+        }
+        next_seq[elem->producer] = elem->seq + 1;
+    }
+    free(next_seq);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "q:p:c:n:k:")) != -1) {
+        switch (opt) {
+        case 'q':
+            ops = NULL;
+            for (size_t i = 0; i < sizeof(queues) / sizeof(queues[0]); i++) {
+                if (strcmp(optarg, queues[i].name) == 0) {
+                    ops = &queues[i];
+                }
+            }
+            if (ops == NULL) {
+                print_usage_and_exit();
+            }
+            break;
+        case 'p':
+            n_producers = atol(optarg);
+            break;
+        case 'c':
+            n_consumers = atol(optarg);
+            break;
+        case 'n':
+            items = atol(optarg);
+            break;
+        case 'k':
+            capacity = atol(optarg);
+            break;
+        default:
+            print_usage_and_exit();
+        }
+    }
+    if (optind != argc || n_producers <= 0 || n_consumers <= 0 ||
+        items <= 0 || items > UINT32_MAX || capacity <= 0) {
+        print_usage_and_exit();
+    }
+
+    size_t total = (size_t)n_producers * (size_t)items;
+    elements = malloc(total * sizeof(element_t));
+    taken = calloc(total, sizeof(*taken));
+    pthread_t *threads =
+        malloc((size_t)(n_producers + n_consumers) * sizeof(pthread_t));
+    queue = ops->create((size_t)capacity);
+    if (elements == NULL || taken == NULL || threads == NULL ||
+        queue == NULL) {
+        PANIC("Out of memory");
+    }
+    for (size_t i = 0; i < total; i++) {
+        elements[i].producer = (uint32_t)(i / (size_t)items);
+        elements[i].seq = (uint32_t)(i % (size_t)items);
+    }
+    metrics_init(&results);
+
+    uint64_t start = metrics_now();
+    for (long i = 0; i < n_consumers; i++) {
+        if (pthread_create(&threads[i], NULL, consumer_thread, NULL) != 0) {
+            PANIC("Failed to start consumer %ld", i);
+        }
+    }
+    for (long i = 0; i < n_producers; i++) {
+        if (pthread_create(&threads[n_consumers + i], NULL, producer_thread,
+                           (void *)(intptr_t)i) != 0) {
+            PANIC("Failed to start producer %ld", i);
+        }
+    }
+    for (long i = 0; i < n_producers; i++) {
+        pthread_join(threads[n_consumers + i], NULL);
+    }
+    // every element is ahead of the stop elements
+    for (long i = 0; i < n_consumers; i++) {
+        ops->enqueue(queue, &stop_element);
+    }
+    for (long i = 0; i < n_consumers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed_ns = metrics_now() - start;
+    ops->destroy(queue);
+
+    uint64_t lost = 0;
+    uint64_t duplicated = 0;
+    for (size_t i = 0; i < total; i++) {
+        uint8_t times = atomic_load(&taken[i]);
+        lost += times == 0;
+        duplicated += times > 1;
+    }
+    uint64_t out_of_order = atomic_load(&reordered);
+    bool ok = lost == 0 && duplicated == 0 && out_of_order == 0;
+
+    stats_info_t stats;
+    metrics_read(&results, &stats);
+    fprintf(stdout,
+            "{\"queue\": \"%s\", \"producers\": %ld, \"consumers\": %ld, "
+            "\"capacity\": %ld, \"handoffs\": %zu, \"elapsed_s\": %.3f, "
+            "\"ops_per_s\": %.0f, "
+            "\"latency_ns\": {\"p50\": %lu, \"p90\": %lu, \"p99\": %lu, "
+            "\"p999\": %lu, \"max\": %lu}, "
+            "\"lost\": %lu, \"duplicated\": %lu, \"reordered\": %lu, "
+            "\"ok\": %s}\n",
+            ops->name, n_producers, n_consumers, capacity, total,
+            (double)elapsed_ns / 1e9, (double)total * 1e9 / (double)elapsed_ns,
+            stats.deliver.p50, stats.deliver.p90, stats.deliver.p99,
+            stats.deliver.p999, stats.deliver.max, lost, duplicated,
+            out_of_order, ok ? "true" : "false");
+
+    free(elements);
+    free((void *)taken);
+    free(threads);
+    return ok ? 0 : 1;
+}
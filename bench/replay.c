@@ -0,0 +1,483 @@
+#include "logging.h"
+#include "utils/capture.h"
+#include "utils/metrics.h"
+#include "utils/tools.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Replay of a capture (see utils/capture.h) against a broker, freshly
+ * started with as many sessions as the captured one: the boxes are created
+ * and removed, the publishers and subscribers registered and closed, and the
+ * messages published (filled with 'x', in the sizes and frames they were
+ * captured in) in the order they were captured, either at the pace they were
+ * (sped up with -x) or, with -f, as fast as the broker takes them. The
+ * subscribers drain what they are sent (as fast as they can, so that one
+ * closed right after a burst may close before it got all of it). A summary
+ * is printed as JSON.
+ *
+ * Sessions speak the framing they were captured with, and subscribers
+ * register with the filter they were captured with, if any; the options the
+ * replay cannot stand in for (shared memory rings, acknowledgements, trace
+ * contexts) are left out, and bulk requests of managers are replayed as a
+ * request per box.
+ */
+
+// How often subscribers check whether they are closed, in milliseconds
+#define POLL_MS (100)
+
+// How long the subscribers may go without receiving anything at the end,
+// and receive for at most, in milliseconds
+#define DRAIN_IDLE_MS (200)
+#define DRAIN_MS (2000)
+
+// Room for an answer that is only counted
+#define ANSWER_BUF_LEN (4096)
+
+typedef struct {
+    uint64_t token; // of the session in the capture
+    int fd;
+    bool publisher;
+    uint32_t flags;
+    char pipe_path[MAX_PIPE_NAME];
+    pthread_t reader; // of subscribers, draining their session
+    _Atomic bool closing;
+    bool closed;
+} client_t;
+
+static bool fast = false;
+static double speed = 1.0;
+static bool use_socket;
+static char const *register_path;
+
+// Where the pipes go, removed at the end
+static char work_dir[] = "/tmp/replay.XXXXXX";
+static long next_pipe = 0;
+
+static client_t **clients = NULL;
+static size_t n_clients = 0;
+static size_t clients_capacity = 0;
+
+static _Atomic uint64_t bytes_received = 0;
+static _Atomic uint64_t last_received = 0;
+
+typedef struct {
+    uint64_t records;
+    uint64_t requests;
+    uint64_t registers;
+    uint64_t publishes;
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t closes;
+    uint64_t failed; // requests refused, or that could not be sent
+    uint64_t skipped; // of sessions that failed to register
+} replay_stats_t;
+
+static replay_stats_t stats;
+
+static void print_usage_and_exit() {
+    fprintf(stderr, "usage: replay [-f | -x speed] <capture_file> "
+                    "<register_pipe_name>\n");
+    exit(EXIT_FAILURE);
+}
+
+static void sleep_until(uint64_t deadline) {
+    uint64_t now = metrics_now();
+    if (now >= deadline) {
+        return;
+    }
+    struct timespec pause = {
+        .tv_sec = (time_t)((deadline - now) / 1000000000),
+        .tv_nsec = (long)((deadline - now) % 1000000000)};
+    while (nanosleep(&pause, &pause) != 0 && errno == EINTR) {
+    }
+}
+
+/**
+ * Send a request, through its pipe, created here, or a connection to the
+ * broker's socket, and open what the answer (or the session) comes through.
+ * Returns the file descriptor if successful, -1 otherwise.
+ */
+static int send_request(request_t *request, char *pipe_path, int pipe_flags) {
+    snprintf(pipe_path, MAX_PIPE_NAME, "%s/c%ld", work_dir, next_pipe++);
+    strncpy(request->client_path, pipe_path, MAX_PIPE_NAME);
+    uint8_t packet[MAX_REQUEST_LEN];
+    size_t packet_len = encode_request(packet, request);
+
+    if (use_socket) {
+        pipe_path[0] = '\0';
+        int fd = connect_broker(register_path);
+        if (fd >= 0 && safe_write(fd, packet, packet_len) != packet_len) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    if (mkfifo(pipe_path, 0666) < 0) {
+        return -1;
+    }
+    int reg_fd = open(register_path, O_WRONLY);
+    if (reg_fd < 0) {
+        unlink(pipe_path);
+        return -1;
+    }
+    ssize_t written = safe_write(reg_fd, packet, packet_len);
+    close(reg_fd);
+    if (written != packet_len) {
+        unlink(pipe_path);
+        return -1;
+    }
+    // blocks until the broker takes the request up
+    int fd = open(pipe_path, pipe_flags);
+    if (fd < 0) {
+        unlink(pipe_path);
+    }
+    return fd;
+}
+
+/**
+ * Replay a request on its own, reading its whole answer.
+ * Returns 0 if it was served, -1 otherwise.
+ */
+static int replay_request(capture_record_t const *record) {
+    request_t request = {.opcode = record->opcode};
+    if (record->opcode == TFS_OPCODE_CRT_BOXES) {
+        request.opcode = TFS_OPCODE_CRT_BOX;
+    } else if (record->opcode == TFS_OPCODE_RMV_BOXES) {
+        request.opcode = TFS_OPCODE_RMV_BOX;
+    }
+    strcpy(request.box_name, record->box_name);
+
+    char pipe_path[MAX_PIPE_NAME];
+    int fd = send_request(&request, pipe_path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    // answers end with the pipe (or the connection) being closed
+    uint8_t answer[ANSWER_BUF_LEN];
+    size_t len = 0;
+    ssize_t bytes_read;
+    do {
+        size_t room = sizeof(answer) - len;
+        bytes_read = use_socket ? recv(fd, answer + len, room, 0)
+                                : read(fd, answer + len, room);
+        if (bytes_read > 0 && len + (size_t)bytes_read < BOX_ANSWER_LEN) {
+            len += (size_t)bytes_read;
+        } else if (bytes_read > 0) {
+            len = BOX_ANSWER_LEN; // the status is all that is kept
+        }
+    } while (bytes_read > 0 || (bytes_read < 0 && errno == EINTR));
+    close(fd);
+    if (pipe_path[0] != '\0') {
+        unlink(pipe_path);
+    }
+
+    if (request.opcode == TFS_OPCODE_CRT_BOX ||
+        request.opcode == TFS_OPCODE_RMV_BOX) {
+        box_answer_t box_answer;
+        if (len < BOX_ANSWER_LEN) {
+            return -1;
+        }
+        decode_box_answer(answer, &box_answer);
+        return box_answer.status == 0 ? 0 : -1;
+    }
+    return len > 0 ? 0 : -1;
+}
+
+static client_t *find_client(uint64_t token) {
+    for (size_t i = 0; i < n_clients; i++) {
+        if (clients[i]->token == token && !clients[i]->closed) {
+            return clients[i];
+        }
+    }
+    return NULL;
+}
+
+static void *subscriber_thread(void *arg) {
+    client_t *client = arg;
+    uint8_t *rx_buf = malloc(MAX_SUB_PACKET_LEN);
+    if (rx_buf == NULL) {
+        PANIC("Out of memory");
+    }
+
+    while (!atomic_load(&client->closing)) {
+        struct pollfd pfd = {.fd = client->fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        ssize_t bytes_read =
+            use_socket ? recv(client->fd, rx_buf, MAX_SUB_PACKET_LEN, 0)
+                       : read(client->fd, rx_buf, MAX_SUB_PACKET_LEN);
+        if (bytes_read <= 0) {
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            break; // closed by the broker
+        }
+        atomic_fetch_add(&bytes_received, (uint64_t)bytes_read);
+        atomic_store(&last_received, metrics_now());
+    }
+
+    free(rx_buf);
+    return NULL;
+}
+
+static void replay_register(capture_record_t const *record) {
+    bool is_publisher = record->opcode == TFS_OPCODE_REG_PUB ||
+                        record->opcode == TFS_OPCODE_REG_PUB_EXT ||
+                        record->opcode == TFS_OPCODE_REG_PUB_IDEM;
+    uint32_t flags = record->flags & REGISTER_FLAG_LEN_PREFIX;
+    request_t request = {.flags = flags};
+    if (is_publisher) {
+        request.opcode =
+            flags != 0 ? TFS_OPCODE_REG_PUB_EXT : TFS_OPCODE_REG_PUB;
+    } else if (record->filter[0] != '\0') {
+        request.opcode = TFS_OPCODE_REG_SUB_FILTER;
+        strcpy(request.filter, record->filter);
+    } else {
+        request.opcode =
+            flags != 0 ? TFS_OPCODE_REG_SUB_EXT : TFS_OPCODE_REG_SUB;
+    }
+    strcpy(request.box_name, record->box_name);
+
+    client_t *client = calloc(1, sizeof(client_t));
+    if (client == NULL) {
+        PANIC("Out of memory");
+    }
+    client->token = record->session;
+    client->publisher = is_publisher;
+    client->flags = flags;
+    client->fd = send_request(&request, client->pipe_path,
+                              is_publisher ? O_WRONLY : O_RDONLY);
+    if (client->fd < 0) {
+        WARN("Failed to register %s of '%s'",
+             is_publisher ? "publisher" : "subscriber", record->box_name);
+        free(client);
+        stats.failed++;
+        return;
+    }
+    if (!is_publisher && pthread_create(&client->reader, NULL,
+                                        subscriber_thread, client) != 0) {
+        PANIC("Failed to start subscriber");
+    }
+
+    if (n_clients == clients_capacity) {
+        clients_capacity = clients_capacity > 0 ? 2 * clients_capacity : 64;
+        clients = realloc(clients, clients_capacity * sizeof(client_t *));
+        if (clients == NULL) {
+            PANIC("Out of memory");
+        }
+    }
+    clients[n_clients++] = client;
+}
+
+static void close_client(client_t *client) {
+    if (client->closed) {
+        return;
+    }
+    client->closed = true;
+    if (!client->publisher) {
+        atomic_store(&client->closing, true);
+        pthread_join(client->reader, NULL);
+    }
+    close(client->fd);
+    if (client->pipe_path[0] != '\0') {
+        unlink(client->pipe_path);
+    }
+}
+
+/**
+ * Publish a frame of the same kind and sizes as the one captured.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int replay_publish(client_t *client, capture_record_t const *record) {
+    static uint8_t filler[MAX_BATCH_LEN];
+    static uint8_t frame[BATCH_HEADER_LEN + MAX_BATCH_LEN];
+    if (filler[0] == 0) {
+        memset(filler, 'x', sizeof(filler));
+    }
+
+    size_t frame_len;
+    if (record->opcode == TFS_OPCODE_PUB_CHUNK) {
+        if (!(client->flags & REGISTER_FLAG_LEN_PREFIX) ||
+            record->len > MAX_CHUNK_LEN) {
+            return -1;
+        }
+        encode_chunk_header(frame, TFS_OPCODE_PUB_CHUNK, record->len,
+                            (uint8_t)record->flags);
+        memcpy(frame + CHUNK_HEADER_LEN, filler, record->len);
+        frame_len = CHUNK_HEADER_LEN + record->len;
+    } else if (record->count == 1 && record->opcode == TFS_OPCODE_PUB_MSG) {
+        if (record->sizes[0] > MAX_PUB_MSG) {
+            return -1;
+        }
+        frame_len = encode_message(frame, TFS_OPCODE_PUB_MSG, filler,
+                                   record->sizes[0], client->flags);
+    } else {
+        // acknowledged batches go as they would unacknowledged
+        if (!(client->flags & REGISTER_FLAG_LEN_PREFIX)) {
+            return -1;
+        }
+        size_t body_len = 0;
+        for (uint32_t i = 0; i < record->count; i++) {
+            if (record->sizes[i] > MAX_PUB_MSG ||
+                body_len + sizeof(uint32_t) + record->sizes[i] >
+                    MAX_BATCH_LEN) {
+                return -1;
+            }
+            body_len += encode_batch_record(frame + BATCH_HEADER_LEN + body_len,
+                                            filler, record->sizes[i]);
+        }
+        encode_batch_header(frame, record->count, (uint32_t)body_len);
+        frame_len = BATCH_HEADER_LEN + body_len;
+    }
+
+    if (safe_write(client->fd, frame, frame_len) != (ssize_t)frame_len) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "fx:")) != -1) {
+        switch (opt) {
+        case 'f':
+            fast = true;
+            break;
+        case 'x':
+            speed = atof(optarg);
+            if (speed <= 0) {
+                print_usage_and_exit();
+            }
+            break;
+        default:
+            print_usage_and_exit();
+        }
+    }
+    if (argc - optind != 2) {
+        print_usage_and_exit();
+    }
+    char const *capture_path = argv[optind];
+    register_path = argv[optind + 1];
+
+    FILE *capture = capture_open(capture_path);
+    if (capture == NULL) {
+        PANIC("Failed to open capture '%s'", capture_path);
+    }
+    if (mkdtemp(work_dir) == NULL) {
+        PANIC("Failed to create a directory for the pipes: %s",
+              strerror(errno));
+    }
+    use_socket = broker_uses_socket(register_path);
+    // sessions the broker closed are noticed by their writes failing
+    signal(SIGPIPE, SIG_IGN);
+
+    capture_record_t record;
+    int ret;
+    uint64_t captured_ns = 0;
+    uint64_t start = metrics_now();
+    while ((ret = capture_read(capture, &record)) > 0) {
+        stats.records++;
+        captured_ns = record.time;
+        if (!fast) {
+            sleep_until(start + (uint64_t)((double)record.time / speed));
+        }
+
+        client_t *client;
+        switch ((capture_kind_t)record.kind) {
+        case CAPTURE_REQUEST:
+            stats.requests++;
+            if (replay_request(&record) != 0) {
+                stats.failed++;
+            }
+            break;
+        case CAPTURE_REGISTER:
+            stats.registers++;
+            replay_register(&record);
+            break;
+        case CAPTURE_PUBLISH:
+            client = find_client(record.session);
+            if (client == NULL || !client->publisher) {
+                stats.skipped++;
+            } else if (replay_publish(client, &record) != 0) {
+                WARN("Failed to publish to '%s'", record.box_name);
+                stats.failed++;
+                close_client(client);
+            } else {
+                stats.publishes++;
+                stats.messages += record.count;
+                stats.bytes += record.len;
+            }
+            break;
+        case CAPTURE_CLOSE:
+            client = find_client(record.session);
+            if (client != NULL) {
+                stats.closes++;
+                close_client(client);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    if (ret < 0) {
+        WARN("Invalid record %lu of the capture, stopping there",
+             stats.records + 1);
+    }
+    fclose(capture);
+    uint64_t elapsed_ns = metrics_now() - start;
+
+    // what is still on its way to the subscribers
+    for (size_t i = 0; i < n_clients; i++) {
+        if (clients[i]->publisher) {
+            close_client(clients[i]);
+        }
+    }
+    uint64_t drain_start = metrics_now();
+    atomic_store(&last_received, drain_start);
+    while (metrics_now() - atomic_load(&last_received) <
+               DRAIN_IDLE_MS * 1000000ull &&
+           metrics_now() - drain_start < DRAIN_MS * 1000000ull) {
+        sleep_until(metrics_now() + POLL_MS * 1000000ull / 10);
+    }
+    for (size_t i = 0; i < n_clients; i++) {
+        close_client(clients[i]);
+        free(clients[i]);
+    }
+    free(clients);
+    rmdir(work_dir);
+
+    fprintf(stdout,
+            "{\"mode\": \"%s\", \"records\": %lu, \"requests\": %lu, "
+            "\"registers\": %lu, \"publishes\": %lu, \"messages\": %lu, "
+            "\"bytes\": %lu, \"closes\": %lu, \"failed\": %lu, "
+            "\"skipped\": %lu, \"captured_s\": %.3f, \"elapsed_s\": %.3f, "
+            "\"msgs_per_s\": %.0f, \"bytes_received\": %lu}\n",
+            fast ? "fast" : "timed", stats.records, stats.requests,
+            stats.registers, stats.publishes, stats.messages, stats.bytes,
+            stats.closes, stats.failed, stats.skipped,
+            (double)captured_ns / 1e9, (double)elapsed_ns / 1e9,
+            elapsed_ns > 0 ? (double)stats.messages * 1e9 / (double)elapsed_ns
+                           : 0.0,
+            atomic_load(&bytes_received));
+    return stats.failed == 0 && ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,384 @@
+#include "fs/operations.h"
+#include "fs/state.h"
+#include "logging.h"
+#include "utils/metrics.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * TFS microbenchmark: runs each workload against TFS, linked in directly,
+ * for every combination of the parameters given (each option takes a comma
+ * separated list), and prints a JSON object per configuration, with the
+ * operations done per second (by all the threads) and the average time an
+ * operation takes (seen by the thread doing it).
+ *
+ * Workloads, an operation each:
+ *   open   - open and close one of the files created beforehand
+ *   append - write APPEND_LEN bytes to a file of the thread's own (truncated
+ *            with a reopen once its block is full)
+ *   read   - read APPEND_LEN bytes of a full file of the thread's own
+ *            (rewound with a reopen once read through)
+ *   churn  - create a file, write to it, close and unlink it
+ *
+ * The open workload looks its files up among as many as the root directory
+ * and the inode table have room for, so that it shows the cost of lookups.
+ */
+
+#define MAX_LIST (16)
+#define APPEND_LEN (64)
+
+typedef enum {
+    WORKLOAD_OPEN = 0,
+    WORKLOAD_APPEND,
+    WORKLOAD_READ,
+    WORKLOAD_CHURN,
+    WORKLOAD_COUNT,
+} workload_t;
+
+static char const *const workload_names[WORKLOAD_COUNT] = {"open", "append",
+                                                           "read", "churn"};
+
+typedef struct {
+    long values[MAX_LIST];
+    size_t count;
+} list_t;
+
+typedef struct {
+    workload_t workload;
+    long thread;
+    long n_files; // created beforehand, for the open workload
+    uint64_t ops;
+    uint64_t busy_ns;
+    bool failed;
+} worker_t;
+
+static _Atomic bool stop = false;
+static pthread_barrier_t start_barrier;
+
+static void print_usage_and_exit() {
+    fprintf(stderr,
+            "usage: tfsbench [-i inode_counts] [-k block_counts] "
+            "[-b block_sizes] [-t thread_counts] [-w workloads] "
+            "[-D on,off] [-d ms_per_run]\n"
+            "   (lists are comma separated, workloads are "
+            "open,append,read,churn)\n");
+    exit(EXIT_FAILURE);
+}
+
+static void parse_list(char const *arg, list_t *list) {
+    list->count = 0;
+    char const *value = arg;
+    while (*value != '\0') {
+        char *end;
+        long n = strtol(value, &end, 10);
+        if (end == value || n <= 0 || list->count == MAX_LIST ||
+            (*end != ',' && *end != '\0')) {
+            print_usage_and_exit();
+        }
+        list->values[list->count++] = n;
+        value = *end == ',' ? end + 1 : end;
+    }
+}
+
+/**
+ * Parse a list of names, into the indices of the names they match.
+ */
+static void parse_names(char const *arg, char const *const *names,
+                        size_t n_names, list_t *list) {
+    list->count = 0;
+    char const *value = arg;
+    while (*value != '\0') {
+        size_t len = strcspn(value, ",");
+        size_t i = 0;
+        while (i < n_names && (strlen(names[i]) != len ||
+                               strncmp(names[i], value, len) != 0)) {
+            i++;
+        }
+        if (i == n_names || list->count == MAX_LIST) {
+            print_usage_and_exit();
+        }
+        list->values[list->count++] = (long)i;
+        value += len;
+        value += *value == ',';
+    }
+}
+
+static void file_name(char *name, char prefix, long i) {
+    snprintf(name, MAX_FILE_NAME, "/%c%ld", prefix, i);
+}
+
+/**
+ * Open a file, filled up to its block if full is set.
+ */
+static int open_file(char const *name, bool full, size_t block_size) {
+    int fhandle = tfs_open(name, TFS_O_CREAT | TFS_O_TRUNC);
+    if (fhandle < 0 || !full) {
+        return fhandle;
+    }
+    char data[APPEND_LEN];
+    memset(data, 'x', sizeof(data));
+    for (size_t written = 0; written < block_size; written += sizeof(data)) {
+        if (tfs_write(fhandle, data, sizeof(data)) <= 0) {
+            break;
+        }
+    }
+    tfs_close(fhandle);
+    return tfs_open(name, 0);
+}
+
+static int run_op(worker_t *worker, int *fhandle, char const *own_name,
+                  uint64_t op) {
+    char data[APPEND_LEN];
+    char name[MAX_FILE_NAME];
+    switch (worker->workload) {
+    case WORKLOAD_OPEN: {
+        file_name(name, 'f', (long)(op % (uint64_t)worker->n_files));
+        int handle = tfs_open(name, 0);
+        return handle < 0 ? -1 : tfs_close(handle);
+    }
+    case WORKLOAD_APPEND: {
+        memset(data, 'a', sizeof(data));
+        ssize_t written = tfs_write(*fhandle, data, sizeof(data));
+        if (written < (ssize_t)sizeof(data)) {
+            tfs_close(*fhandle);
+            *fhandle = tfs_open(own_name, TFS_O_TRUNC);
+        }
+        return written < 0 || *fhandle < 0 ? -1 : 0;
+    }
+    case WORKLOAD_READ: {
+        ssize_t bytes_read = tfs_read(*fhandle, data, sizeof(data));
+        if (bytes_read < (ssize_t)sizeof(data)) {
+            tfs_close(*fhandle);
+            *fhandle = tfs_open(own_name, 0);
+        }
+        return bytes_read < 0 || *fhandle < 0 ? -1 : 0;
+    }
+    case WORKLOAD_CHURN: {
+        int handle = tfs_open(own_name, TFS_O_CREAT);
+        if (handle < 0) {
+            return -1;
+        }
+        memset(data, 'c', sizeof(data));
+        ssize_t written = tfs_write(handle, data, sizeof(data));
+        tfs_close(handle);
+        return written < 0 ? -1 : tfs_unlink(own_name);
+    }
+    case WORKLOAD_COUNT:
+    default:
+        return -1;
+    }
+}
+
+static void *worker_thread(void *arg) {
+    worker_t *worker = arg;
+    size_t block_size = state_block_size();
+    char own_name[MAX_FILE_NAME];
+    file_name(own_name, 'w', worker->thread);
+
+    int fhandle = -1;
+    if (worker->workload == WORKLOAD_APPEND ||
+        worker->workload == WORKLOAD_READ) {
+        fhandle = open_file(own_name, worker->workload == WORKLOAD_READ,
+                            block_size);
+        worker->failed = fhandle < 0;
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = metrics_now();
+    uint64_t op = (uint64_t)worker->thread;
+    while (!worker->failed &&
+           !atomic_load_explicit(&stop, memory_order_relaxed)) {
+        if (run_op(worker, &fhandle, own_name, op) != 0) {
+            worker->failed = true;
+        }
+        op++;
+        worker->ops++;
+    }
+    worker->busy_ns = metrics_now() - start;
+
+    if (fhandle >= 0) {
+        tfs_close(fhandle);
+    }
+    return NULL;
+}
+
+/**
+ * Run a workload on a fresh TFS, and print how it went.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int run_config(tfs_params const *params, workload_t workload,
+                      long threads, long duration_ms) {
+    if (tfs_init(params) != 0) {
+        tfs_destroy();
+        return -1;
+    }
+
+    // files to look up, as many as there is room for next to the threads'
+    long n_files = 0;
+    if (workload == WORKLOAD_OPEN) {
+        long room = (long)(params->block_size / sizeof(dir_entry_t));
+        if ((long)params->max_inode_count - 1 < room) {
+            room = (long)params->max_inode_count - 1;
+        }
+        for (; n_files < room - threads; n_files++) {
+            char name[MAX_FILE_NAME];
+            file_name(name, 'f', n_files);
+            int fhandle = tfs_open(name, TFS_O_CREAT);
+            if (fhandle < 0) {
+                break;
+            }
+            tfs_close(fhandle);
+        }
+        if (n_files == 0) {
+            tfs_destroy();
+            return -1;
+        }
+    }
+
+    worker_t *workers = calloc((size_t)threads, sizeof(worker_t));
+    pthread_t *tids = calloc((size_t)threads, sizeof(pthread_t));
+    if (workers == NULL || tids == NULL) {
+        PANIC("Out of memory");
+    }
+    uint64_t wait_ns_before;
+    uint64_t waits_before;
+    tfs_lock_stats(&wait_ns_before, &waits_before);
+
+    atomic_store(&stop, false);
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)threads + 1);
+    for (long i = 0; i < threads; i++) {
+        workers[i].workload = workload;
+        workers[i].thread = i;
+        workers[i].n_files = n_files;
+        if (pthread_create(&tids[i], NULL, worker_thread, &workers[i]) != 0) {
+            PANIC("Failed to start a thread");
+        }
+    }
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = metrics_now();
+    struct timespec duration = {.tv_sec = duration_ms / 1000,
+                                .tv_nsec = duration_ms % 1000 * 1000000};
+    nanosleep(&duration, NULL);
+    atomic_store(&stop, true);
+
+    uint64_t ops = 0;
+    uint64_t busy_ns = 0;
+    bool failed = false;
+    for (long i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        ops += workers[i].ops;
+        busy_ns += workers[i].busy_ns;
+        failed |= workers[i].failed;
+    }
+    uint64_t elapsed_ns = metrics_now() - start;
+    pthread_barrier_destroy(&start_barrier);
+    uint64_t wait_ns;
+    uint64_t waits;
+    tfs_lock_stats(&wait_ns, &waits);
+    free(workers);
+    free(tids);
+    tfs_destroy();
+
+    fprintf(stdout,
+            "{\"workload\": \"%s\", \"inodes\": %zu, \"blocks\": %zu, "
+            "\"block_size\": %zu, \"threads\": %ld, \"delay\": %s, "
+            "\"ops\": %lu, \"ops_per_s\": %.0f, \"ns_per_op\": %.0f, "
+            "\"lock_waits\": %lu, \"lock_wait_ns_per_op\": %.0f, "
+            "\"failed\": %s}\n",
+            workload_names[workload], params->max_inode_count,
+            params->max_block_count, params->block_size, threads,
+            params->storage_delay ? "true" : "false", ops,
+            (double)ops * 1e9 / (double)elapsed_ns,
+            ops > 0 ? (double)busy_ns / (double)ops : 0, waits - waits_before,
+            ops > 0 ? (double)(wait_ns - wait_ns_before) / (double)ops : 0,
+            failed ? "true" : "false");
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    list_t inode_counts = {.values = {64, 1024}, .count = 2};
+    list_t block_counts = {.values = {1024}, .count = 1};
+    list_t block_sizes = {.values = {1024, 16384}, .count = 2};
+    list_t thread_counts = {.values = {1, 4}, .count = 2};
+    list_t workloads = {.values = {0, 1, 2, 3}, .count = WORKLOAD_COUNT};
+    list_t delays = {.values = {1, 0}, .count = 2};
+    long duration_ms = 100;
+
+    char const *const delay_names[] = {"off", "on"};
+    int opt;
+    while ((opt = getopt(argc, argv, "i:k:b:t:w:D:d:")) != -1) {
+        switch (opt) {
+        case 'i':
+            parse_list(optarg, &inode_counts);
+            break;
+        case 'k':
+            parse_list(optarg, &block_counts);
+            break;
+        case 'b':
+            parse_list(optarg, &block_sizes);
+            break;
+        case 't':
+            parse_list(optarg, &thread_counts);
+            break;
+        case 'w':
+            parse_names(optarg, workload_names, WORKLOAD_COUNT, &workloads);
+            break;
+        case 'D':
+            parse_names(optarg, delay_names, 2, &delays);
+            break;
+        case 'd':
+            duration_ms = atol(optarg);
+            if (duration_ms <= 0) {
+                print_usage_and_exit();
+            }
+            break;
+        default:
+            print_usage_and_exit();
+        }
+    }
+    if (optind != argc) {
+        print_usage_and_exit();
+    }
+
+    // every thread keeps a file open at most
+    for (size_t t = 0; t < thread_counts.count; t++) {
+        if (thread_counts.values[t] >
+            (long)tfs_default_params().max_open_files_count) {
+            print_usage_and_exit();
+        }
+    }
+
+    for (size_t d = 0; d < delays.count; d++) {
+        for (size_t w = 0; w < workloads.count; w++) {
+            for (size_t i = 0; i < inode_counts.count; i++) {
+                for (size_t k = 0; k < block_counts.count; k++) {
+                    for (size_t b = 0; b < block_sizes.count; b++) {
+                        for (size_t t = 0; t < thread_counts.count; t++) {
+                            tfs_params params = tfs_default_params();
+                            params.max_inode_count =
+                                (size_t)inode_counts.values[i];
+                            params.max_block_count =
+                                (size_t)block_counts.values[k];
+                            params.block_size = (size_t)block_sizes.values[b];
+                            params.storage_delay = delays.values[d] != 0;
+                            if (run_config(&params,
+                                           (workload_t)workloads.values[w],
+                                           thread_counts.values[t],
+                                           duration_ms) != 0) {
+                                WARN("Configuration failed to start");
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
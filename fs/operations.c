@@ -3,15 +3,61 @@
 #include "state.h"
 #include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "betterassert.h"
+#include "utils/probes.h"
 
 pthread_mutex_t g_library_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Time spent waiting for the library's lock, and how many times it was found
+// taken (only updated on contention, so not worth spreading across threads)
+static _Atomic uint64_t g_lock_wait_ns = 0;
+static _Atomic uint64_t g_lock_waits = 0;
+
+/**
+ * Take the library's lock, timing the wait if another thread holds it.
+ */
+static int library_lock() 
+{
+    if (pthread_mutex_trylock(&g_library_mutex) == 0) 
+    {
+        PROBE1(tfs, lock_acquire, 0);
+        return 0;
+    }
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = pthread_mutex_lock(&g_library_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int64_t waited = (int64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+                     (end.tv_nsec - start.tv_nsec);
+    atomic_fetch_add_explicit(&g_lock_wait_ns, (uint64_t)waited,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_lock_waits, 1, memory_order_relaxed);
+    PROBE1(tfs, lock_acquire, waited);
+    return ret;
+}
+
+static int library_unlock() 
+{
+    PROBE(tfs, lock_release);
+    return pthread_mutex_unlock(&g_library_mutex);
+}
+
+void tfs_lock_stats(uint64_t *wait_ns, uint64_t *waits) 
+{
+    *wait_ns = atomic_load_explicit(&g_lock_wait_ns, memory_order_relaxed);
+    *waits = atomic_load_explicit(&g_lock_waits, memory_order_relaxed);
+}
+
 tfs_params tfs_default_params() 
 {
     tfs_params params = {
@@ -19,6 +65,7 @@ tfs_params tfs_default_params()
         .max_block_count = 1024,
         .max_open_files_count = 16,
         .block_size = 1024,
+        .storage_delay = true,
     };
     return params;
 }
@@ -89,7 +136,7 @@ static int tfs_lookup(char const *name, inode_t const *root_inode)
 
 int tfs_open(char const *name, tfs_file_mode_t mode) 
 {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) 
+    if (library_lock() == -1) 
     {
         WARN("failed to lock mutex: %s", strerror(errno));
         return -1;
@@ -97,7 +144,7 @@ int tfs_open(char const *name, tfs_file_mode_t mode)
     // Checks if the path name is valid
     if (!valid_pathname(name)) 
     {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+        if (library_unlock() == -1) 
         {
             WARN("failed to unlock mutex: %s", strerror(errno));
             return -1;
@@ -143,7 +190,7 @@ int tfs_open(char const *name, tfs_file_mode_t mode)
         inum = inode_create(T_FILE);
         if (inum == -1) 
         {
-            if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+            if (library_unlock() == -1) 
             {
                 WARN("failed to unlock mutex: %s", strerror(errno));
                 return -1;
@@ -155,7 +202,7 @@ int tfs_open(char const *name, tfs_file_mode_t mode)
         if (add_dir_entry(root_dir_inode, name + 1, inum) == -1) 
         {
             inode_delete(inum);
-            if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+            if (library_unlock() == -1) 
             {
                 WARN("failed to unlock mutex: %s", strerror(errno));
                 return -1;
@@ -166,7 +213,7 @@ int tfs_open(char const *name, tfs_file_mode_t mode)
         offset = 0;
     } else 
     {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+        if (library_unlock() == -1) 
         {
             WARN("failed to unlock mutex: %s", strerror(errno));
             return -1;
@@ -177,7 +224,8 @@ int tfs_open(char const *name, tfs_file_mode_t mode)
     // Finally, add entry to the open file table and return the corresponding
     // handle
     int ret = add_to_open_file_table(inum, offset);
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+    PROBE2(tfs, open, inum, ret);
+    if (library_unlock() == -1) 
     {
         WARN("failed to unlock mutex: %s", strerror(errno));
         return -1;
@@ -190,7 +238,7 @@ int tfs_open(char const *name, tfs_file_mode_t mode)
 }
 
 int tfs_close(int fhandle) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) 
+    if (library_lock() == -1) 
     {
         WARN("failed to lock mutex: %s", strerror(errno));
         return -1;
@@ -198,7 +246,7 @@ int tfs_close(int fhandle) {
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) 
     {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+        if (library_unlock() == -1) 
         {
             WARN("failed to unlock mutex: %s", strerror(errno));
             return -1;
@@ -208,7 +256,7 @@ int tfs_close(int fhandle) {
 
     remove_from_open_file_table(fhandle);
 
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+    if (library_unlock() == -1) 
     {
         WARN("failed to unlock mutex: %s", strerror(errno));
         return -1;
@@ -218,7 +266,7 @@ int tfs_close(int fhandle) {
 
 ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) 
 {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) 
+    if (library_lock() == -1) 
     {
         WARN("failed to lock mutex: %s", strerror(errno));
         return -1;
@@ -226,7 +274,7 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write)
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) 
     {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+        if (library_unlock() == -1) 
         {
             WARN("failed to unlock mutex: %s", strerror(errno));
             return -1;
@@ -252,7 +300,7 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write)
             // If empty file, allocate new block
             int bnum = data_block_alloc();
             if (bnum == -1) {
-                if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+                if (library_unlock() == -1) 
                 {
                     WARN("failed to unlock mutex: %s", strerror(errno));
                     return -1;
@@ -276,8 +324,9 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write)
             inode->i_size = file->of_offset;
         }
     }
+    PROBE3(tfs, write, fhandle, file->of_inumber, to_write);
 
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+    if (library_unlock() == -1) 
     {
         WARN("failed to unlock mutex: %s", strerror(errno));
         return -1;
@@ -285,9 +334,14 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write)
     return (ssize_t)to_write;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) 
+/**
+ * Read from an open file, starting at offset, or at the current offset of the
+ * file handle if advance is set, which then moves past the bytes read.
+ */
+static ssize_t read_at(int fhandle, void *buffer, size_t len, size_t offset,
+                       bool advance) 
 {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) 
+    if (library_lock() == -1) 
     {
         WARN("failed to lock mutex: %s", strerror(errno));
         return -1;
@@ -295,20 +349,24 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len)
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) 
     {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+        if (library_unlock() == -1) 
         {
             WARN("failed to unlock mutex: %s", strerror(errno));
             return -1;
         }
         return -1;
     }
+    if (advance) 
+    {
+        offset = file->of_offset;
+    }
 
     // From the open file table entry, we get the inode
     inode_t const *inode = inode_get(file->of_inumber);
     ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
 
     // Determine how many bytes to read
-    size_t to_read = inode->i_size - file->of_offset;
+    size_t to_read = inode->i_size > offset ? inode->i_size - offset : 0;
     if (to_read > len) 
     {
         to_read = len;
@@ -320,12 +378,16 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len)
         ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
 
         // Perform the actual read
-        memcpy(buffer, block + file->of_offset, to_read);
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_read;
+        memcpy(buffer, block + offset, to_read);
+        if (advance) 
+        {
+            // The offset associated with the file handle is incremented
+            // accordingly
+            file->of_offset += to_read;
+        }
     }
 
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+    if (library_unlock() == -1) 
     {
         WARN("failed to unlock mutex: %s", strerror(errno));
         return -1;
@@ -333,9 +395,19 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len)
     return (ssize_t)to_read;
 }
 
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) 
+{
+    return read_at(fhandle, buffer, len, 0, true);
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) 
+{
+    return read_at(fhandle, buffer, len, offset, false);
+}
+
 int tfs_unlink(char const *target) 
 {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) 
+    if (library_lock() == -1) 
     {
         WARN("failed to lock mutex: %s", strerror(errno));
         return -1;
@@ -343,7 +415,7 @@ int tfs_unlink(char const *target)
     // Checks if the path name is valid
     if (!valid_pathname(target)) 
     {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+        if (library_unlock() == -1) 
         {
             WARN("failed to unlock mutex: %s", strerror(errno));
             return -1;
@@ -358,7 +430,7 @@ int tfs_unlink(char const *target)
 
     if (inum == -1) 
     {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+        if (library_unlock() == -1) 
         {
             WARN("failed to unlock mutex: %s", strerror(errno));
             return -1;
@@ -369,7 +441,7 @@ int tfs_unlink(char const *target)
     inode_delete(inum);
     if (clear_dir_entry(root_dir_inode, target + 1) == -1) 
     {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+        if (library_unlock() == -1) 
         {
             WARN("failed to unlock mutex: %s", strerror(errno));
             return -1;
@@ -377,7 +449,7 @@ int tfs_unlink(char const *target)
         return -1;
     }
 
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) 
+    if (library_unlock() == -1) 
     {
         WARN("failed to unlock mutex: %s", strerror(errno));
         return -1;
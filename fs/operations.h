@@ -2,6 +2,8 @@
 #define OPERATIONS_H
 
 #include "config.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 /**
@@ -13,6 +15,10 @@ typedef struct {
     size_t max_open_files_count;
 
     size_t block_size;
+
+    // whether accesses to the persistent state are delayed, as if it were in
+    // secondary storage (see DELAY)
+    bool storage_delay;
 } tfs_params;
 
 /**
@@ -113,6 +119,21 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Read from an open file, starting at the given offset instead of the current
+ * one, which is left unchanged.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: position in the file of the first byte to read
+ *
+ * Returns the number of bytes that were copied from the file to the buffer (can
+ * be lower than 'len' if the file size was reached), or -1 in case of error.
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
@@ -137,4 +158,10 @@ int tfs_unlink(char const *target);
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
 
+/**
+ * Report how long threads waited for the lock of TécnicoFS in total (in
+ * nanoseconds), and how many times they found it taken.
+ */
+void tfs_lock_stats(uint64_t *wait_ns, uint64_t *waits);
+
 #endif // OPERATIONS_H
@@ -1,5 +1,6 @@
 #include "state.h"
 #include "betterassert.h"
+#include "utils/probes.h"
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -75,6 +76,9 @@ static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
  * latencies as if such data structures were really stored in secondary memory.
  */
 static void insert_delay(void) {
+    if (!fs_params.storage_delay) {
+        return;
+    }
     for (int i = 0; i < DELAY; i++) {
         touch_all_memory();
     }
@@ -416,9 +420,11 @@ int data_block_alloc(void) {
         if (free_blocks[i] == FREE) {
             free_blocks[i] = TAKEN;
 
+            PROBE1(tfs, block_alloc, i);
             return (int)i;
         }
     }
+    PROBE1(tfs, block_alloc, -1);
     return -1;
 }
 
@@ -2,22 +2,90 @@
 #include "utils/tools.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+// Number of box records read from the pipe at a time when listing
+#define LIST_PAGE (256)
+
+// Room for a line of commands read by an admin session
+#define COMMAND_LINE_BUF (4096)
+
+// Suffix of the pipe the requests of an admin session are written to
+#define REQUEST_PIPE_SUFFIX ".req"
+
+// Room for the largest answer read from the broker's socket
+#define MAX_ANSWER_LEN (1 << 20)
+
 static char out_pipe_path[MAX_PIPE_NAME + 1] = {0};
 static char in_pipe_path[MAX_PIPE_NAME + 1] = {0};
 
+// Set when the broker listens on a socket: requests and answers then go
+// through a connection, and no client pipe is created
+static bool use_socket = false;
+static uint8_t answer_buf[MAX_ANSWER_LEN];
+static packet_reader_t answers = {
+    .fd = -1, .buf = answer_buf, .capacity = sizeof(answer_buf)};
+
+/**
+ * Send a request to the broker, through its register pipe or as the first
+ * packet of a new connection to its socket.
+ * Returns the connection (or 0 with the pipe) if successful, -1 otherwise.
+ */
+static int send_request(void const *packet, size_t len) {
+    int out_fd = use_socket ? connect_broker(out_pipe_path)
+                            : open(out_pipe_path, O_WRONLY);
+    if (out_fd < 0) {
+        PANIC("Failed to open register pipe: %s\n", strerror(errno));
+    }
+
+    if (safe_write(out_fd, packet, len) != len) {
+        close(out_fd);
+        return -1;
+    }
+    if (use_socket) {
+        answers.fd = out_fd;
+        return out_fd;
+    }
+    close(out_fd);
+    return 0;
+}
+
+/**
+ * Open what the answer is read from: the connection the request went
+ * through, or the client pipe.
+ */
+static int open_answer(int conn_fd) {
+    return use_socket ? conn_fd : open(in_pipe_path, O_RDONLY);
+}
+
+/**
+ * Read exactly len bytes of an answer, unless it ends first.
+ */
+static ssize_t read_answer(int in_fd, void *buf, size_t len) {
+    if (use_socket) {
+        return packet_read(&answers, buf, len);
+    }
+    return read_all(in_fd, buf, len);
+}
+
 static void print_usage() {
     fprintf(stderr,
             "usage: \n"
             "   manager <register_pipe_name> <pipe_name> create <box_name>\n"
             "   manager <register_pipe_name> <pipe_name> remove <box_name>\n"
-            "   manager <register_pipe_name> <pipe_name> list\n");
+            "   manager <register_pipe_name> <pipe_name> list\n"
+            "   manager <register_pipe_name> <pipe_name> stats [box_name]\n"
+            "   manager <register_pipe_name> <pipe_name> session "
+            "[commands_file]\n");
 }
 
 static void print_usage_and_exit() {
@@ -26,131 +94,517 @@ static void print_usage_and_exit() {
 }
 
 int commands_to_box(char *box_name, tfs_opcode_t op_code) {
-    int out_fd = open(out_pipe_path, O_WRONLY);
-    if (out_fd < 0) {
-        PANIC("Failed to open register pipe: %s\n", strerror(errno));
-    }
-
-    size_t packet_len = sizeof(uint8_t);
-    packet_len += sizeof(char) * (MAX_PIPE_NAME + MAX_BOX_NAME);
-
-    void *packet = malloc(packet_len);
-    size_t offset = 0;
-    const uint8_t code = op_code;
-
-    packet_cpy(packet, &offset, &code, sizeof(uint8_t));
-    packet_cpy(packet, &offset, in_pipe_path, sizeof(char) * MAX_PIPE_NAME);
-    packet_cpy(packet, &offset, box_name, sizeof(char) * MAX_BOX_NAME);
+    request_t request = {.opcode = (uint8_t)op_code};
+    memcpy(request.client_path, in_pipe_path, sizeof(in_pipe_path));
+    strncpy(request.box_name, box_name, MAX_BOX_NAME);
 
-    if (safe_write(out_fd, packet, packet_len) != packet_len) {
+    uint8_t packet[MAX_REQUEST_LEN];
+    int conn_fd = send_request(packet, encode_request(packet, &request));
+    if (conn_fd < 0) {
         PANIC("Error writing to pipe %s\n", out_pipe_path);
     }
 
-    int in_fd = open(in_pipe_path, O_RDONLY);
+    int in_fd = open_answer(conn_fd);
     if (in_fd < 0) {
         WARN("Error opening client pipe '%s'", in_pipe_path);
         return -1;
     }
 
-    uint8_t ret_op_code = '\0';
-    int32_t ret_status;
+    uint8_t frame[BOX_ANSWER_LEN];
+    box_answer_t answer;
+
+    if (read_answer(in_fd, frame, BOX_ANSWER_LEN) != BOX_ANSWER_LEN) {
+        WARN("Error reading from pipe: %s\n", in_pipe_path);
+        return -1;
+    }
+    decode_box_answer(frame, &answer);
+
+    if (answer.opcode != TFS_OPCODE_ANS_CRT_BOX &&
+        answer.opcode != TFS_OPCODE_ANS_RMV_BOX) {
+        PANIC("Invalid opcode %d\n", answer.opcode);
+    }
+    if (answer.status != 0) {
+        fprintf(stdout, "ERROR %s\n", answer.error);
+    }
+
+    close(in_fd);
+    unlink(in_pipe_path);
+    return answer.status;
+}
+
+/**
+ * Read and print a listing, past its opcode.
+ * Returns 0 if successful, the broker's status or -1 otherwise.
+ */
+static int print_box_list_body(int in_fd) {
+    uint8_t header[LIST_ANSWER_HEADER_LEN] = {TFS_OPCODE_ANS_LST_BOX};
     char error_msg[MAX_ERROR_MSG + 1];
+    uint64_t box_count = 0;
 
-    if (ret_op_code != TFS_OPCODE_ANS_CRT_BOX &&
-        ret_op_code != TFS_OPCODE_ANS_RMV_BOX) {
-        PANIC("Invalid opcode %d\n", ret_op_code);
+    if (read_answer(in_fd, header + 1, LIST_ANSWER_HEADER_LEN - 1) !=
+        LIST_ANSWER_HEADER_LEN - 1) {
+        WARN("Error reading from pipe: %s\n", in_pipe_path);
+        return -1;
     }
+    int32_t ret_status = decode_list_answer(header);
 
     if (ret_status != 0) {
-        if (safe_read(in_fd, error_msg, sizeof(char) * MAX_ERROR_MSG) != sizeof(char) * MAX_ERROR_MSG) {
+        if (read_answer(in_fd, error_msg, sizeof(char) * MAX_ERROR_MSG) !=
+            sizeof(char) * MAX_ERROR_MSG) {
             WARN("Error reading from pipe: %s\n", in_pipe_path);
             return -1;
         }
         error_msg[MAX_ERROR_MSG] = '\0';
-        WARN("[ERROR] %s\n", error_msg);
+        printf("Error: %s\n", error_msg);
+        return ret_status;
     }
 
-    close(in_fd);
-    unlink(in_pipe_path);
-    close(out_fd);
-    return ret_status;
-}
+    if (read_answer(in_fd, &box_count, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        WARN("Error reading from pipe: %s\n", in_pipe_path);
+        return -1;
+    }
 
-int list_boxes() {
-    int out_fd = open(out_pipe_path, O_WRONLY);
-    if (out_fd < 0) {
-        PANIC("Failed to open register pipe: %s\n", strerror(errno));
+    if (box_count == 0) {
+        printf("No boxes found\n");
     }
 
-    size_t packet_len = sizeof(uint8_t);
-    packet_len += sizeof(char) * MAX_PIPE_NAME;
+    // the records are streamed a page at a time, however many boxes there are
+    static box_info_t page[LIST_PAGE];
+    uint64_t remaining = box_count;
+    while (remaining > 0) {
+        size_t n = remaining < LIST_PAGE ? (size_t)remaining : LIST_PAGE;
+        if (read_answer(in_fd, page, n * sizeof(box_info_t)) !=
+            n * sizeof(box_info_t)) {
+            WARN("Error reading from pipe: %s\n", in_pipe_path);
+            return -1;
+        }
 
-    void *packet = malloc(packet_len);
+        for (size_t i = 0; i < n; i++) {
+            page[i].name[MAX_BOX_NAME] = '\0';
+            printf("Box name: %s\n", page[i].name);
+            printf("Size: %lu\n", page[i].size);
+            printf("Publishers: %lu\n", page[i].n_publishers);
+            printf("Subscribers: %lu\n", page[i].n_subscribers);
+        }
+        remaining -= n;
+    }
 
-    size_t offset = 0;
-    const uint8_t code = TFS_OPCODE_LST_BOX;
+    return 0;
+}
 
-    packet_cpy(packet, &offset, &code, sizeof(uint8_t));
-    packet_cpy(packet, &offset, in_pipe_path, sizeof(char) * MAX_PIPE_NAME);
+/**
+ * Read and print the answer to a list request.
+ * Returns 0 if successful, the broker's status or -1 otherwise.
+ */
+static int print_box_list(int in_fd) {
+    uint8_t ret_op_code = '\0';
 
-    ssize_t bytes_written = safe_write(out_fd, packet, packet_len);
-    free(packet);
-    close(out_fd);
+    if (read_answer(in_fd, &ret_op_code, sizeof(uint8_t)) != sizeof(uint8_t)) {
+        WARN("Error reading from pipe: %s\n", in_pipe_path);
+        return -1;
+    }
+
+    if (ret_op_code != TFS_OPCODE_ANS_LST_BOX) {
+        PANIC("Invalid opcode %d\n", ret_op_code);
+    }
+
+    return print_box_list_body(in_fd);
+}
+
+int list_boxes() {
+    request_t request = {.opcode = TFS_OPCODE_LST_BOX};
+    memcpy(request.client_path, in_pipe_path, sizeof(in_pipe_path));
 
-    if (bytes_written != packet_len) {
+    uint8_t packet[MAX_REQUEST_LEN];
+    int conn_fd = send_request(packet, encode_request(packet, &request));
+    if (conn_fd < 0) {
         PANIC("Error writing to pipe %s\n", out_pipe_path);
     }
 
-    int in_fd = open(in_pipe_path, O_RDONLY);
+    int in_fd = open_answer(conn_fd);
     if (in_fd < 0) {
         unlink(in_pipe_path);
         WARN("Error opening client pipe '%s'", in_pipe_path);
         return -1;
     }
 
-    uint8_t ret_op_code = '\0';
-    int32_t ret_status;
-    char error_msg[MAX_ERROR_MSG + 1];
-    uint64_t box_count = 0;
+    int ret = print_box_list(in_fd);
+    if (ret != 0) {
+        return ret;
+    }
 
-    if (ret_op_code != TFS_OPCODE_ANS_LST_BOX) {
-        PANIC("Invalid opcode %d\n", ret_op_code);
+    close(in_fd);
+    unlink(in_pipe_path);
+    return 0;
+}
+
+static void print_latency(char const *name, latency_info_t const *latency) {
+    if (latency->count == 0) {
+        printf("%s latency: no samples\n", name);
+        return;
     }
+    printf("%s latency (us): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, "
+           "max %.1f (%lu samples)\n",
+           name, (double)latency->p50 / 1e3, (double)latency->p90 / 1e3,
+           (double)latency->p99 / 1e3, (double)latency->p999 / 1e3,
+           (double)latency->max / 1e3, latency->count);
+}
 
-    if (safe_read(in_fd, &ret_status, sizeof(int32_t)) != sizeof(int32_t)) {
+static void print_stats(char const *box_name, stats_info_t const *stats) {
+    double seconds = (double)stats->uptime_ns / 1e9;
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+
+    if (box_name[0] != '\0') {
+        printf("Box name: %s\n", box_name);
+    } else {
+        printf("Boxes: %lu\n", stats->n_boxes);
+    }
+    printf("Uptime: %.3f s\n", seconds);
+    printf("Messages in: %lu (%.1f msgs/s)\n", stats->msgs_in,
+           (double)stats->msgs_in / seconds);
+    printf("Bytes in: %lu (%.3f MB/s)\n", stats->bytes_in,
+           (double)stats->bytes_in / seconds / 1e6);
+    printf("Messages out: %lu (%.1f msgs/s)\n", stats->msgs_out,
+           (double)stats->msgs_out / seconds);
+    printf("Bytes out: %lu (%.3f MB/s)\n", stats->bytes_out,
+           (double)stats->bytes_out / seconds / 1e6);
+    printf("Messages dropped: %lu\n", stats->msgs_dropped);
+    printf("Sessions: %lu (%lu publishers, %lu subscribers)\n",
+           stats->n_sessions, stats->n_publishers, stats->n_subscribers);
+    printf("Queued frames: %lu (at most %lu for a subscriber)\n",
+           stats->queued_frames, stats->max_queued);
+    if (box_name[0] == '\0') {
+        printf("TFS lock wait: %.3f ms (%lu waits)\n",
+               (double)stats->tfs_lock_wait_ns / 1e6, stats->tfs_lock_waits);
+    }
+    print_latency("Ingest", &stats->ingest);
+    print_latency("Deliver", &stats->deliver);
+}
+
+/**
+ * Ask for the metrics of a box, or of the whole broker if box_name is empty,
+ * and print them.
+ * Returns 0 if successful, the broker's status or -1 otherwise.
+ */
+int show_stats(char const *box_name) {
+    request_t request = {.opcode = TFS_OPCODE_STATS};
+    memcpy(request.client_path, in_pipe_path, sizeof(in_pipe_path));
+    strncpy(request.box_name, box_name, MAX_BOX_NAME);
+
+    uint8_t packet[MAX_REQUEST_LEN];
+    int conn_fd = send_request(packet, encode_request(packet, &request));
+    if (conn_fd < 0) {
+        PANIC("Error writing to pipe %s\n", out_pipe_path);
+    }
+
+    int in_fd = open_answer(conn_fd);
+    if (in_fd < 0) {
+        unlink(in_pipe_path);
+        WARN("Error opening client pipe '%s'", in_pipe_path);
+        return -1;
+    }
+
+    uint8_t header[STATS_ANSWER_HEADER_LEN];
+    if (read_answer(in_fd, header, STATS_ANSWER_HEADER_LEN) !=
+        STATS_ANSWER_HEADER_LEN) {
         WARN("Error reading from pipe: %s\n", in_pipe_path);
         return -1;
     }
+    if (header[0] != TFS_OPCODE_ANS_STATS) {
+        PANIC("Invalid opcode %d\n", header[0]);
+    }
 
-    if (ret_status != 0) {
-        if (safe_read(in_fd, error_msg, sizeof(char) * MAX_ERROR_MSG) != sizeof(char) * MAX_ERROR_MSG) {
+    int32_t ret = decode_stats_answer(header);
+    if (ret != 0) {
+        char error_msg[MAX_ERROR_MSG + 1];
+        if (read_answer(in_fd, error_msg, MAX_ERROR_MSG) != MAX_ERROR_MSG) {
             WARN("Error reading from pipe: %s\n", in_pipe_path);
             return -1;
         }
-        printf("Error: %s\n", error_msg);
-        return ret_status;
+        error_msg[MAX_ERROR_MSG] = '\0';
+        printf("ERROR %s\n", error_msg);
+    } else {
+        stats_info_t stats;
+        if (read_answer(in_fd, &stats, sizeof(stats)) != sizeof(stats)) {
+            WARN("Error reading from pipe: %s\n", in_pipe_path);
+            return -1;
+        }
+        print_stats(box_name, &stats);
     }
 
-    if (box_count == 0) {
-        printf("No boxes found\n");
+    close(in_fd);
+    unlink(in_pipe_path);
+    return ret;
+}
+
+/**
+ * Requests of an admin session not sent yet: consecutive creations (or
+ * removals) are sent as a single bulk request.
+ */
+static uint8_t bulk_frame[MAX_BOXES_FRAME_LEN];
+static uint32_t bulk_count;
+
+// set when a command could not be sent or failed
+static _Atomic bool admin_failed;
+
+static int flush_bulk(int request_fd) {
+    if (bulk_count == 0) {
+        return 0;
+    }
+
+    encode_boxes_header(bulk_frame, bulk_frame[0], bulk_count);
+    size_t len = BOXES_HEADER_LEN + bulk_count * MAX_BOX_NAME;
+    bulk_count = 0;
+    return safe_write(request_fd, bulk_frame, len) == len ? 0 : -1;
+}
+
+/**
+ * Queue the request for a command line ("create <box>", "remove <box>" or
+ * "list"); blank lines and lines starting with '#' are skipped.
+ * Returns 0 if successful, -1 if the requests could not be sent.
+ */
+static int queue_command(int request_fd, char *line) {
+    char *save;
+    char *command = strtok_r(line, " \t\r", &save);
+    if (command == NULL || command[0] == '#') {
         return 0;
     }
 
-    box_t boxes[box_count];
+    if (strcmp(command, "list") == 0) {
+        const uint8_t code = TFS_OPCODE_LST_BOX;
+        if (flush_bulk(request_fd) != 0 ||
+            safe_write(request_fd, &code, sizeof(uint8_t)) != sizeof(uint8_t)) {
+            return -1;
+        }
+        return 0;
+    }
 
+    uint8_t code;
+    if (strcmp(command, "create") == 0) {
+        code = TFS_OPCODE_CRT_BOXES;
+    } else if (strcmp(command, "remove") == 0) {
+        code = TFS_OPCODE_RMV_BOXES;
+    } else {
+        fprintf(stderr, "Invalid command: %s\n", command);
+        admin_failed = true;
+        return 0;
+    }
 
-    for (uint64_t i = 0; i < box_count; i++) {
-        printf("Box name: %s\n", boxes[i].name);
-        printf("Size: %lu\n", boxes[i].size);
-        printf("Publishers: %lu\n", boxes[i].n_publishers);
-        printf("Subscribers: %lu\n", boxes[i].n_subscribers);
+    char *box_name = strtok_r(NULL, " \t\r", &save);
+    if (box_name == NULL || strlen(box_name) > MAX_BOX_NAME) {
+        fprintf(stderr, "Invalid box name for %s\n", command);
+        admin_failed = true;
+        return 0;
     }
 
-    close(in_fd);
-    unlink(in_pipe_path);
+    // requests are applied in order: a different command ends the bulk
+    if (bulk_count > 0 &&
+        (bulk_frame[0] != code || bulk_count == MAX_BULK_BOXES) &&
+        flush_bulk(request_fd) != 0) {
+        return -1;
+    }
+    bulk_frame[0] = code;
+    encode_boxes_name(bulk_frame, bulk_count++, box_name);
+    return 0;
+}
+
+typedef struct {
+    int commands_fd;
+    int request_fd;
+} admin_writer_t;
+
+/**
+ * Send the requests for every command read, without waiting for the answers.
+ * Requests are held back to be sent in bulk while more commands are ready to
+ * be read.
+ */
+static void *admin_writer(void *arg) {
+    admin_writer_t *writer = arg;
+    char line[COMMAND_LINE_BUF + 1];
+    size_t len = 0;
+    int ret = 0;
+
+    while (ret == 0) {
+        char *end;
+        while (ret == 0 && (end = memchr(line, '\n', len)) != NULL) {
+            *end = '\0';
+            ret = queue_command(writer->request_fd, line);
+            len -= (size_t)(end + 1 - line);
+            memmove(line, end + 1, len);
+        }
+        if (len == COMMAND_LINE_BUF) {
+            fprintf(stderr, "Command line too long\n");
+            admin_failed = true;
+            len = 0;
+        }
+
+        struct pollfd pfd = {.fd = writer->commands_fd, .events = POLLIN};
+        if (ret == 0 && poll(&pfd, 1, 0) == 0) {
+            // nothing else to read for now: send what is pending
+            ret = flush_bulk(writer->request_fd);
+        }
+        if (ret != 0) {
+            break;
+        }
+
+        ssize_t bytes_read = safe_read(writer->commands_fd, line + len,
+                                       COMMAND_LINE_BUF - len);
+        if (bytes_read <= 0) {
+            // the last line may not end with a newline
+            line[len] = '\0';
+            ret = queue_command(writer->request_fd, line);
+            break;
+        }
+        len += (size_t)bytes_read;
+    }
+
+    if (ret != 0 || flush_bulk(writer->request_fd) != 0) {
+        WARN("Error writing to pipe: %s", strerror(errno));
+        admin_failed = true;
+    }
+    // the broker ends the session once it has answered everything
+    if (use_socket) {
+        shutdown(writer->request_fd, SHUT_WR);
+    } else {
+        close(writer->request_fd);
+    }
+    return NULL;
+}
+
+/**
+ * Read and print the answer to a bulk create or remove request, past its
+ * opcode.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int print_bulk_answer(int in_fd, uint8_t code) {
+    uint8_t header[BOXES_HEADER_LEN] = {code};
+    if (read_answer(in_fd, header + 1, BOXES_HEADER_LEN - 1) !=
+        BOXES_HEADER_LEN - 1) {
+        return -1;
+    }
+
+    uint32_t count = decode_boxes_count(header);
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t entry[BOXES_ENTRY_LEN];
+        char box_name[MAX_BOX_NAME + 1];
+        int32_t status;
+        uint32_t error_len;
+        char error_msg[MAX_ERROR_MSG + 1] = {0};
+        if (read_answer(in_fd, entry, BOXES_ENTRY_LEN) != BOXES_ENTRY_LEN) {
+            return -1;
+        }
+        decode_boxes_entry(entry, box_name, &status, &error_len);
+        if (error_len > MAX_ERROR_MSG ||
+            read_answer(in_fd, error_msg, error_len) != error_len) {
+            return -1;
+        }
+
+        if (status != 0) {
+            printf("%s: ERROR %s\n", box_name, error_msg);
+            admin_failed = true;
+        } else if (code == TFS_OPCODE_ANS_CRT_BOXES) {
+            printf("%s: Box created successfully\n", box_name);
+        } else {
+            printf("%s: Box removed successfully\n", box_name);
+        }
+    }
     return 0;
 }
-           
+
+/**
+ * Run the commands read from commands_path (or the standard input, if NULL)
+ * in a single session with the broker, pipelining the requests.
+ * Returns 0 if every command succeeded, -1 otherwise.
+ */
+int admin_session(char const *commands_path) {
+    char request_path[MAX_PIPE_NAME + sizeof(REQUEST_PIPE_SUFFIX)] = {0};
+    // the broker is sent at most MAX_PIPE_NAME bytes of it
+    if (!use_socket &&
+        strlen(in_pipe_path) + strlen(REQUEST_PIPE_SUFFIX) > MAX_PIPE_NAME) {
+        WARN("Pipe name too long: %s", in_pipe_path);
+        unlink(in_pipe_path);
+        return -1;
+    }
+    snprintf(request_path, sizeof(request_path), "%s%s", in_pipe_path,
+             REQUEST_PIPE_SUFFIX);
+
+    admin_writer_t writer;
+    writer.commands_fd =
+        commands_path != NULL ? open(commands_path, O_RDONLY) : STDIN_FILENO;
+    if (writer.commands_fd < 0) {
+        WARN("Failed to open %s: %s", commands_path, strerror(errno));
+        unlink(in_pipe_path);
+        return -1;
+    }
+    if (!use_socket && mkfifo(request_path, 0666) < 0) {
+        unlink(in_pipe_path);
+        PANIC("Failed to create pipe %s\n", request_path);
+    }
+
+    request_t request = {.opcode = TFS_OPCODE_REG_ADMIN};
+    memcpy(request.client_path, request_path, sizeof(request_path));
+    memcpy(request.answer_path, in_pipe_path, sizeof(in_pipe_path));
+
+    uint8_t packet[MAX_REQUEST_LEN];
+    int conn_fd = send_request(packet, encode_request(packet, &request));
+    if (conn_fd < 0) {
+        PANIC("Error writing to pipe %s\n", out_pipe_path);
+    }
+
+    // the broker opens the answer pipe first, once this end is being opened,
+    // then the request pipe
+    int in_fd = open_answer(conn_fd);
+    if (use_socket) {
+        writer.request_fd = conn_fd;
+    } else {
+        writer.request_fd = in_fd < 0 ? -1 : open(request_path, O_WRONLY);
+        unlink(in_pipe_path);
+        unlink(request_path);
+    }
+    if (in_fd < 0 || writer.request_fd < 0) {
+        WARN("Error opening client pipes '%s'", in_pipe_path);
+        return -1;
+    }
+
+    // a broker going away is reported by the writes failing
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, admin_writer, &writer) != 0) {
+        PANIC("Failed to create thread\n");
+    }
+    // left running if the broker goes away while it waits for commands
+    pthread_detach(tid);
+
+    uint8_t ret_op_code;
+    while (read_answer(in_fd, &ret_op_code, sizeof(uint8_t)) ==
+           sizeof(uint8_t)) {
+        int ret;
+        switch (ret_op_code) {
+        case TFS_OPCODE_ANS_LST_BOX:
+            ret = print_box_list_body(in_fd);
+            break;
+        case TFS_OPCODE_ANS_CRT_BOXES:
+        case TFS_OPCODE_ANS_RMV_BOXES:
+            ret = print_bulk_answer(in_fd, ret_op_code);
+            break;
+        default:
+            PANIC("Invalid opcode %d\n", ret_op_code);
+        }
+        if (ret != 0) {
+            admin_failed = true;
+            if (ret < 0) {
+                WARN("Error reading from pipe: %s\n", in_pipe_path);
+                break;
+            }
+        }
+    }
+
+    close(in_fd);
+    return admin_failed ? -1 : 0;
+}
 
 int main(int argc, char *argv[]) {
     if (argc < 4) {
@@ -160,7 +614,11 @@ int main(int argc, char *argv[]) {
     strncpy(out_pipe_path, argv[1], MAX_PIPE_NAME);
     strncpy(in_pipe_path, argv[2], MAX_PIPE_NAME);
 
-    if (mkfifo(in_pipe_path, 0666) < 0) {
+    if (broker_uses_socket(out_pipe_path)) {
+        // answers come back through the connection of each request
+        use_socket = true;
+        in_pipe_path[0] = '\0';
+    } else if (mkfifo(in_pipe_path, 0666) < 0) {
         PANIC("Failed to create pipe %s\n", in_pipe_path);
     }
 
@@ -194,6 +652,15 @@ int main(int argc, char *argv[]) {
             WARN("Command failed\n");
             exit(EXIT_FAILURE);
         }
+    } else if (strcmp(command, "stats") == 0) {
+        if (show_stats(argc > 4 ? argv[4] : "") != 0) {
+            WARN("Command failed\n");
+            exit(EXIT_FAILURE);
+        }
+    } else if (strcmp(command, "session") == 0) {
+        if (admin_session(argc > 4 ? argv[4] : NULL) != 0) {
+            exit(EXIT_FAILURE);
+        }
     } else {
         print_usage_and_exit();
     }
@@ -0,0 +1,148 @@
+#include "event_loop.h"
+#include "logging.h"
+#include "metrics.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define MAX_EVENTS (16)
+
+// Set in the tokens of the second descriptors of sessions (slots never go
+// that high)
+#define OUT_FD_TOKEN (1ull << 31)
+
+// Token of the descriptor that stops the workers
+#define STOP_TOKEN UINT64_MAX
+
+#if EVENT_LOOP_WORKERS > METRICS_SHARDS
+#error "every worker of the event loop needs a metrics shard of its own"
+#endif
+
+static int epoll_fd = -1;
+static event_handler_t event_handler;
+static atomic_bool stopping = false;
+
+int event_loop_init(void) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        WARN("Failed to create epoll instance: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int event_loop_ctl(int op, session_t *session, uint32_t events) {
+    struct epoll_event event = {0};
+    event.events = events | EPOLLONESHOT;
+    event.data.u64 = session_token(session);
+
+    if (epoll_ctl(epoll_fd, op, session->fd, &event) != 0) {
+        WARN("epoll_ctl failed on fd %d: %s", session->fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_add(session_t *session, uint32_t events) {
+    return event_loop_ctl(EPOLL_CTL_ADD, session, events);
+}
+
+int event_loop_rearm(session_t *session, uint32_t events) {
+    return event_loop_ctl(EPOLL_CTL_MOD, session, events);
+}
+
+int event_loop_watch_out(session_t *session, uint32_t events) {
+    struct epoll_event event = {0};
+    event.events = events | EPOLLONESHOT;
+    event.data.u64 = session_token(session) | OUT_FD_TOKEN;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->out_fd, &event) != 0 &&
+        (errno != ENOENT ||
+         epoll_ctl(epoll_fd, EPOLL_CTL_ADD, session->out_fd, &event) != 0)) {
+        WARN("epoll_ctl failed on fd %d: %s", session->out_fd,
+             strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void event_loop_remove(session_t *session) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+    if (session->out_fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->out_fd, NULL);
+    }
+}
+
+static void *event_loop_worker(void *arg) {
+    // the worker's index, which picks its metrics shard
+    metrics_set_shard((unsigned)(uintptr_t)arg);
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            WARN("epoll_wait failed: %s", strerror(errno));
+            return NULL;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            uint64_t token = events[i].data.u64;
+            uint32_t flags = events[i].events;
+            if (token == STOP_TOKEN) {
+                atomic_store(&stopping, true);
+                return NULL;
+            }
+            if (token & OUT_FD_TOKEN) {
+                token &= ~OUT_FD_TOKEN;
+                flags |= EVENT_LOOP_OUT_FD;
+            }
+            uint32_t generation;
+            session_t *session = session_from_token(token, &generation);
+            event_handler(session, generation, flags);
+        }
+    }
+}
+
+int event_loop_run(size_t n_workers, int stop_fd, event_handler_t handler) {
+    event_handler = handler;
+
+    // level-triggered, as every worker has to see it
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.u64 = STOP_TOKEN;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &event) != 0) {
+        WARN("epoll_ctl failed on fd %d: %s", stop_fd, strerror(errno));
+        return -1;
+    }
+
+    pthread_t *workers = calloc(n_workers, sizeof(pthread_t));
+    if (workers == NULL) {
+        WARN("Failed to allocate worker threads");
+        return -1;
+    }
+    for (size_t i = 1; i < n_workers; i++) {
+        if (pthread_create(&workers[i], NULL, event_loop_worker,
+                           (void *)(uintptr_t)i) != 0) {
+            WARN("Failed to create worker thread");
+            return -1;
+        }
+    }
+
+    event_loop_worker((void *)(uintptr_t)0);
+    if (!atomic_load(&stopping)) {
+        return -1;
+    }
+    for (size_t i = 1; i < n_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef __MBROKER_EVENT_LOOP_H__
+#define __MBROKER_EVENT_LOOP_H__
+
+#include "session.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Number of threads serving the event loop
+#define EVENT_LOOP_WORKERS (4)
+
+// Set in the events of a session's second descriptor (out_fd), a bit epoll
+// never reports
+#define EVENT_LOOP_OUT_FD (1u << 31)
+
+/**
+ * Called by a worker thread when the session's file descriptor is ready.
+ *
+ * Sessions are registered in one-shot mode, so no other thread handles the
+ * same session until the handler re-arms it (with event_loop_rearm) or
+ * releases it (with event_loop_remove).
+ *
+ * The generation is the one of the session when it was armed: the session may
+ * have been closed (and its slot reused) since.
+ */
+typedef void (*event_handler_t)(session_t *session, uint32_t generation,
+                                uint32_t events);
+
+/**
+ * Create the epoll instance.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int event_loop_init(void);
+
+/**
+ * Start watching a session's file descriptor for the given epoll events.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int event_loop_add(session_t *session, uint32_t events);
+
+/**
+ * Watch a session again after it has been handled.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int event_loop_rearm(session_t *session, uint32_t events);
+
+/**
+ * Watch a session's second descriptor (out_fd) for the given epoll events,
+ * which are then reported with EVENT_LOOP_OUT_FD set. It is watched in
+ * one-shot mode as well, independently of the session's file descriptor.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int event_loop_watch_out(session_t *session, uint32_t events);
+
+/**
+ * Stop watching a session's file descriptors.
+ */
+void event_loop_remove(session_t *session);
+
+/**
+ * Serve events with n_workers threads (the caller being one of them), until
+ * stop_fd is readable. stop_fd is never read, so that every worker sees it.
+ * Each worker updates the metrics shard of its index (the caller's being 0).
+ * Returns 0 once all the workers have stopped, -1 on error (some may still be
+ * running).
+ */
+int event_loop_run(size_t n_workers, int stop_fd, event_handler_t handler);
+
+#endif // __MBROKER_EVENT_LOOP_H__
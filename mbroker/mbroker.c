@@ -1,27 +1,114 @@
 #include "fs/operations.h"
 #include "logging.h"
+#include "mbroker/event_loop.h"
+#include "mbroker/session.h"
+#include "utils/capture.h"
+#include "utils/probes.h"
 #include "utils/tools.h"
+#include "utils/trace.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <pthread.h>
 
-pthread_mutex_t new_box_lock = PTHREAD_MUTEX_INITIALIZER;
-
 static int fd_in;
+// write end of the register pipe, kept open so that the pipe never reports
+// end of file when the last client closes it
+static int fd_in_keepalive;
 static char *in_pipe_path;
 
-static int box_count = 0;
-static node_t *head = NULL;
+// Number of buckets of the box registry
+#define BOX_TABLE_BUCKETS (1024)
+
+static box_table_t boxes;
+
+/**
+ * What to do with a subscriber whose send queue is full when a message is
+ * published.
+ */
+typedef enum {
+    SLOW_BLOCK,       // stop reading from the publisher until it catches up
+    SLOW_DROP_OLDEST, // drop the oldest message not yet sent to it
+    SLOW_DISCONNECT,  // close its session
+} slow_policy_t;
+
+static slow_policy_t slow_policy = SLOW_BLOCK;
+
+// listen on a SOCK_SEQPACKET socket instead of the register pipe
+static bool use_socket = false;
+
+// Bound on the connections taken in by a single event of the socket
+#define MAX_ACCEPTS_PER_EVENT (16)
+
+// Room for a message frame in either framing
+#define MAX_FRAME_LEN (MSG_HEADER_LEN + MAX_PUB_MSG)
+
+// Records each box keeps in memory, sent to new subscribers without reading
+// its file (at most a block's worth of bytes, all a box file can hold)
+#define BOX_TAIL_RECORDS (4096)
+
+static size_t tail_records = BOX_TAIL_RECORDS;
+static size_t tail_capacity;
+
+// Bound on the subscribers disconnected by a single message; the others
+// lose the message and are disconnected by the next one
+#define MAX_LAGGING (16)
+
+// Room for the frames sent at once to a subscriber catching up with its box
+// (a single packet, for the clients of the broker's socket)
+#define CATCH_UP_FRAME_LEN (MAX_BATCH_LEN)
+// Longest frame delivering a single stored record: a message, or a chunk
+#define MAX_RECORD_FRAME_LEN                                                   \
+    (MAX_FRAME_LEN > CHUNK_HEADER_LEN + MAX_CHUNK_LEN                          \
+         ? MAX_FRAME_LEN                                                       \
+         : CHUNK_HEADER_LEN + MAX_CHUNK_LEN)
+
+// Bound on the time a manager is waited for to read a one-shot answer
+#define ANSWER_TIMEOUT_MS (1000)
+
+// Bound on the requests waiting for their client to open its pipe
+#define MAX_PENDING_OPENS (64)
+// The pipe is tried again after OPEN_RETRY_MIN_MS, then after twice as long
+// each time up to OPEN_RETRY_MAX_MS, until OPEN_TIMEOUT_MS have passed
+#define OPEN_RETRY_MIN_MS (1)
+#define OPEN_RETRY_MAX_MS (64)
+#define OPEN_TIMEOUT_MS (5000)
+
+/**
+ * A request set aside until its client opens the pipe it reads from.
+ * Times are metrics_now() nanoseconds.
+ */
+typedef struct {
+    request_t request;
+    uint64_t retry_at; // when to try opening the pipe again
+    uint64_t delay;    // the wait before retry_at
+    uint64_t deadline; // when to give up on the client
+} pending_open_t;
+
+static pending_open_t pending[MAX_PENDING_OPENS];
+static size_t n_pending;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+// fires when the first request set aside is due
+static int timer_fd;
 
 static void print_instructions() {
-    fprintf(stderr, "usage: mbroker <pipename> <max_sessions>\n");
+    fprintf(stderr, "usage: mbroker [-b box_size] [-p block|drop|disconnect] "
+                    "[-q queue_len] [-t fifo|socket] [-T trace_file] "
+                    "[-C capture_file] [-c tail_records] [-v] "
+                    "<pipename> <max_sessions>\n");
     exit(EXIT_FAILURE);
 }
 
@@ -29,334 +116,2417 @@ void safe_close(int status) {
     if (close(fd_in) < 0) {
         PANIC("Failed to close pipe on exit\n");
     }
+    if (fd_in_keepalive >= 0) {
+        close(fd_in_keepalive);
+    }
 
     if (unlink(in_pipe_path) != 0) {
         PANIC("Failed to delete pipe on exit: %s\n", strerror(errno));
     }
 
-    while (head) {
-        node_t *next = head->next;
-        free(head);
-        head = next;
-    }
-
     fprintf(stdout, "Successfully closing mbroker...\n");
     exit(status);
 }
 
-int subscriber() {
-    ssize_t bytes_read;
-    char client_path[MAX_PIPE_NAME + 1] = {0};
-    char box_name[MAX_BOX_NAME + 1] = {0};
+/**
+ * Boxes are stored as files in the root directory of TFS.
+ */
+static void box_path(char *path, char const *box_name) {
+    snprintf(path, MAX_BOX_NAME + 2, "/%s", box_name);
+}
 
-    bytes_read = read(fd_in, client_path, sizeof(char) * MAX_PIPE_NAME);
-    if (bytes_read != sizeof(char) * MAX_PIPE_NAME) {
-        if (bytes_read == -1) {
-            WARN("Error reading from register pipe: %s", strerror(errno));
-        } else {
-            WARN("Unexpected number of bytes read from register pipe. \
-                    Expected %lu, got %lu", sizeof(char) * MAX_PIPE_NAME, bytes_read);
+/**
+ * Capture a request that concerns a box (box_name, which may be NULL), made
+ * by a publisher's or subscriber's session (NULL for requests on their own),
+ * along with the subscriber's filter for registrations.
+ */
+static void capture_request(uint8_t kind, uint8_t opcode,
+                            session_t const *session, char const *box_name,
+                            uint32_t flags) {
+    if (!capture_on()) {
+        return;
+    }
+    capture_record_t record = {.kind = kind,
+                               .opcode = opcode,
+                               .flags = flags,
+                               .session =
+                                   session != NULL ? session_token(session)
+                                                   : 0};
+    if (box_name != NULL) {
+        memcpy(record.box_name, box_name, strnlen(box_name, MAX_BOX_NAME));
+    }
+    if (kind == CAPTURE_REGISTER && session != NULL) {
+        memcpy(record.filter, session->filter,
+               strnlen(session->filter, MAX_FILTER_LEN));
+    }
+    capture_write(&record);
+}
+
+/**
+ * Release a session that is no longer attached to its box. Called with the
+ * session's lock held.
+ */
+static void release_session(session_t *session) {
+    box_t *box = session->box;
+
+    if (session->kind == SESSION_SUBSCRIBER) {
+        INFO("Subscriber of '%s': %lu sent, %lu dropped, %zu queued at most",
+             session->box_name, session->tx_sent, session->tx_dropped,
+             session->tx_max_lag);
+    }
+
+    event_loop_remove(session);
+    session_free(session);
+    if (box != NULL) {
+        box_put(box);
+    }
+}
+
+/**
+ * Detach a session from its box and release it. Called with the session's
+ * lock held, which is dropped while the box's lock is taken (the box's lock
+ * is always taken first).
+ */
+static void resume_publisher(uint64_t token);
+
+static void close_session(session_t *session) {
+    box_t *box = session->box;
+    uint32_t generation = session->generation;
+
+    if (session->kind == SESSION_PUBLISHER ||
+        session->kind == SESSION_SUBSCRIBER) {
+        capture_request(CAPTURE_CLOSE, 0, session, NULL, 0);
+    }
+
+    if (box != NULL) {
+        session->closing = true;
+        pthread_mutex_unlock(&session->lock);
+
+        pthread_mutex_lock(&box->lock);
+        if (session->kind == SESSION_SUBSCRIBER && session->linked) {
+            session_unlink(box, session);
+            atomic_fetch_sub(&box->n_subscribers, 1);
+        } else if (session->kind == SESSION_PUBLISHER &&
+                   box->publisher == session) {
+            box->publisher = NULL;
+            atomic_fetch_sub(&box->n_publishers, 1);
+        }
+        box_list_update(box);
+        pthread_mutex_unlock(&box->lock);
+
+        if (session->kind == SESSION_SUBSCRIBER) {
+            // the publisher may have been waiting for this subscriber
+            resume_publisher(atomic_exchange(&box->parked_publisher,
+                                             NO_PARKED_PUBLISHER));
+        }
+
+        pthread_mutex_lock(&session->lock);
+        if (session->generation != generation) {
+            return; // closed by the removal of its box meanwhile
         }
-        return -1;
     }
 
-    bytes_read = read(fd_in, box_name, sizeof(char) * MAX_BOX_NAME);
-    if (bytes_read != sizeof(char) * MAX_BOX_NAME) {
-        if (bytes_read == -1) {
-            WARN("Error reading from register pipe: %s", strerror(errno));
-        } else {
-            WARN("Unexpected number of bytes read from register pipe. \
-                    Expected %lu, got %lu", sizeof(char) * MAX_BOX_NAME, bytes_read);
+    release_session(session);
+}
+
+/**
+ * Close every session attached to a box that is being removed.
+ */
+static void evict_sessions(box_t *box) {
+    pthread_mutex_lock(&box->lock);
+    box->removed = true;
+
+    size_t count = atomic_load(&box->n_subscribers) + 1;
+    session_t **sessions = malloc(count * sizeof(session_t *));
+    uint32_t *generations = malloc(count * sizeof(uint32_t));
+    if (sessions == NULL || generations == NULL) {
+        // sessions will notice the removal on their own
+        pthread_mutex_unlock(&box->lock);
+        free(sessions);
+        free(generations);
+        return;
+    }
+
+    count = 0;
+    if (box->publisher != NULL) {
+        sessions[count] = box->publisher;
+        generations[count++] = box->publisher->generation;
+        box->publisher = NULL;
+        atomic_store(&box->n_publishers, 0);
+    }
+    while (box->subscribers != NULL) {
+        session_t *session = box->subscribers;
+        sessions[count] = session;
+        generations[count++] = session->generation;
+        session_unlink(box, session);
+    }
+    atomic_store(&box->n_subscribers, 0);
+    box_list_update(box);
+    pthread_mutex_unlock(&box->lock);
+
+    for (size_t i = 0; i < count; i++) {
+        pthread_mutex_lock(&sessions[i]->lock);
+        if (sessions[i]->generation == generations[i]) {
+            release_session(sessions[i]);
         }
-        return -1;
+        pthread_mutex_unlock(&sessions[i]->lock);
     }
 
-    return 0;
+    free(sessions);
+    free(generations);
 }
 
-int publisher() {
-    ssize_t bytes_read;
-    char client_path[MAX_PIPE_NAME + 1] = {0};
-    char box_name[MAX_BOX_NAME + 1] = {0};
+// Room for the records of a batch, each a byte longer than in the frame
+#define MAX_BATCH_RECORDS_LEN (MAX_BATCH_LEN + MAX_BATCH_MSGS)
 
-    bytes_read = read(fd_in, client_path, sizeof(char) * MAX_PIPE_NAME);
-    if (bytes_read != sizeof(char) * MAX_PIPE_NAME) {
-        WARN("Error reading from register pipe");
-        return -1;
+/**
+ * Messages decoded from a publisher frame: count records laid out one after
+ * the other, as they are stored in the box (see RECORD_HEADER_LEN). A chunk
+ * of a streamed message is kept (and stored) as a record of its own, and
+ * only counts as a message if it is the last one.
+ */
+typedef struct {
+    uint8_t data[MAX_BATCH_RECORDS_LEN];
+    size_t len;
+    size_t count;
+    uint64_t first_seq; // of numbered batches (0 otherwise)
+    bool chunk;
+    uint8_t chunk_flags; // of the chunk, if chunk
+    // set (with nothing else) by a trace context, for the frame that follows
+    trace_context_t trace;
+} batch_t;
+
+static void batch_add(batch_t *batch, uint8_t const *payload, size_t len) {
+    // messages end at their first null byte, if any
+    len = strnlen((char const *)payload, len);
+    encode_record_header(batch->data + batch->len, RECORD_MESSAGE,
+                         (uint32_t)len);
+    memcpy(batch->data + batch->len + RECORD_HEADER_LEN, payload, len);
+    batch->len += RECORD_HEADER_LEN + len;
+    batch->count++;
+}
+
+/**
+ * The payload of the record at offset in a batch: a message, or the chunk of
+ * a chunk batch. Returns the offset of the next record.
+ */
+static size_t batch_record(batch_t const *batch, size_t offset,
+                           uint8_t const **payload, uint32_t *len) {
+    uint8_t kind;
+    return offset + decode_record(batch->data + offset, batch->len - offset,
+                                  &kind, payload, len);
+}
+
+/**
+ * Drop the first n messages of a batch.
+ */
+static void batch_skip(batch_t *batch, size_t n) {
+    size_t offset = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint8_t const *message;
+        uint32_t message_len;
+        offset = batch_record(batch, offset, &message, &message_len);
     }
-    bytes_read = read(fd_in, box_name, sizeof(char) * MAX_BOX_NAME);
-    if (bytes_read != sizeof(char) * MAX_BOX_NAME) {
-        WARN("Error reading from register pipe");
+    memmove(batch->data, batch->data + offset, batch->len - offset);
+    batch->len -= offset;
+    batch->count -= n;
+    batch->first_seq += n;
+}
+
+/**
+ * Decode the batch frame at the start of a publisher's reassembly buffer.
+ * Returns the length of the frame, 0 if it is not complete yet, or -1 if it
+ * is not valid.
+ */
+static ssize_t decode_batch(session_t const *session, batch_t *batch) {
+    uint32_t count;
+    uint32_t body_len;
+    ssize_t header_len =
+        decode_batch_header(session->rx_buf, session->rx_len,
+                            &batch->first_seq, &count, &body_len);
+    if (header_len < 0) {
+        WARN("Batch too large (%u messages, %u bytes)", count, body_len);
         return -1;
     }
+    if (header_len == 0 || session->rx_len < (size_t)header_len + body_len) {
+        return 0;
+    }
 
-    int client_fd = open(client_path, O_RDONLY);
-    if (client_fd < 0) {
-        WARN("Error opening pipe: '%s' - %s", client_path, strerror(errno));
+    // every message takes at most a byte more stored than in the body, so
+    // they all fit
+    uint8_t const *body = session->rx_buf + header_len;
+    size_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t const *payload;
+        uint32_t len;
+        ssize_t record_len =
+            decode_batch_record(body + offset, body_len - offset, &payload,
+                                &len);
+        if (record_len < 0) {
+            WARN("Truncated batch");
+            return -1;
+        }
+        batch_add(batch, payload, len);
+        offset += (size_t)record_len;
+    }
+    if (offset != body_len) {
+        WARN("Trailing bytes in batch");
         return -1;
     }
 
-    box_t *box = find_box(head, box_name);
-    if (box == NULL || box->n_publishers > 0) {
-        close(client_fd);
-        WARN("Error registering publisher");
+    return header_len + (ssize_t)body_len;
+}
+
+/**
+ * Decode the chunk frame at the start of a publisher's reassembly buffer.
+ * Returns the length of the frame, 0 if it is not complete yet, or -1 if it
+ * is not valid.
+ */
+static ssize_t decode_stream_chunk(session_t const *session, batch_t *batch) {
+    uint8_t const *payload;
+    uint32_t len;
+    uint8_t chunk_flags;
+    ssize_t frame_len = decode_chunk(session->rx_buf, session->rx_len,
+                                     &payload, &len, &chunk_flags);
+    if (frame_len < 0) {
+        WARN("Chunk too long");
         return -1;
     }
+    if (frame_len > 0) {
+        encode_record_header(batch->data, RECORD_CHUNK | chunk_flags, len);
+        memcpy(batch->data + RECORD_HEADER_LEN, payload, len);
+        batch->len = RECORD_HEADER_LEN + len;
+        batch->count = (chunk_flags & CHUNK_FLAG_LAST) ? 1 : 0;
+        batch->chunk = true;
+        batch->chunk_flags = chunk_flags;
+    }
+    return frame_len;
+}
 
-    box->n_publishers++;
-
-    uint8_t pub_opcode;
-    char message[MAX_PUB_MSG + 1] = {0};
+/**
+ * Decode the first frame in a publisher's reassembly buffer: a single message
+ * or, for length-prefixed sessions, a batch of messages, a chunk of a
+ * streamed message, or the trace context of the next frame.
+ *
+ * Returns the length of the frame, 0 if the frame is not complete yet, or -1
+ * if it is not valid.
+ */
+static ssize_t decode_frame(session_t const *session, batch_t *batch) {
+    batch->len = 0;
+    batch->count = 0;
+    batch->first_seq = 0;
+    batch->chunk = false;
+    batch->trace.trace_id = 0;
+    if (session->rx_len == 0) {
+        return 0;
+    }
 
-    bytes_read = safe_read(client_fd, &pub_opcode, sizeof(uint8_t));
-    while (bytes_read > 0) {
-        if (pub_opcode != TFS_OPCODE_PUB_MSG) {
-            PANIC("Invalid opcode %u\n", pub_opcode);
-        }
-        bytes_read = safe_read(client_fd, message, MAX_PUB_MSG);
-        if (bytes_read != MAX_PUB_MSG) {
-            PANIC("Error reading from pipe: '%s'", client_path);
-        }
-        INFO("Received message: %s", message);
-        int fhandle = tfs_open(box_name, TFS_O_APPEND);
-        if (fhandle == -1) {
-            WARN("Can't open tfs file");
+    if ((session->flags & REGISTER_FLAG_LEN_PREFIX) &&
+        session->rx_buf[0] == TFS_OPCODE_TRACE) {
+        ssize_t frame_len =
+            decode_trace(session->rx_buf, session->rx_len, &batch->trace);
+        if (frame_len < 0 || (frame_len > 0 && batch->trace.trace_id == 0)) {
+            WARN("Invalid trace context");
             return -1;
         }
+        return frame_len;
+    }
 
-        ssize_t bytes_written =
-            tfs_write(fhandle, message, strlen(message) + 1);
-        tfs_close(fhandle);
-        if (bytes_written != strlen(message) + 1) {
-            WARN("Error writing to tfs file");
+    if (session->flags & REGISTER_FLAG_ACK) {
+        // acknowledged publishers number every frame
+        if (session->rx_buf[0] != TFS_OPCODE_PUB_SEQ_BATCH) {
+            WARN("Invalid opcode %u", session->rx_buf[0]);
             return -1;
         }
-        memset(message, 0, MAX_PUB_MSG);
-        bytes_read = safe_read(client_fd, &pub_opcode, sizeof(uint8_t));
+        return decode_batch(session, batch);
     }
-
-    if (bytes_read < 0) {
-        WARN("Error reading from pipe: '%s'", in_pipe_path);
+    if ((session->flags & REGISTER_FLAG_LEN_PREFIX) &&
+        session->rx_buf[0] == TFS_OPCODE_PUB_BATCH) {
+        return decode_batch(session, batch);
+    }
+    if ((session->flags & REGISTER_FLAG_LEN_PREFIX) &&
+        session->rx_buf[0] == TFS_OPCODE_PUB_CHUNK) {
+        return decode_stream_chunk(session, batch);
+    }
+    if (session->rx_buf[0] != TFS_OPCODE_PUB_MSG) {
+        WARN("Invalid opcode %u", session->rx_buf[0]);
         return -1;
     }
 
-    INFO("Publisher closed the session");
-    box->n_publishers--;
-
-    return 0;
+    uint8_t const *payload;
+    size_t payload_len;
+    ssize_t frame_len = decode_message(session->rx_buf, session->rx_len,
+                                       session->flags, &payload, &payload_len);
+    if (frame_len < 0) {
+        WARN("Message too long");
+        return -1;
+    }
+    if (frame_len > 0) {
+        batch_add(batch, payload, payload_len);
+    }
+    return frame_len;
 }
 
-static int new_box(char *box_name, char *error_msg) {
-    int ret_status = -1;
-    box_t *box;
-
-    pthread_mutex_init(&new_box_lock, NULL);
-    pthread_mutex_lock(&new_box_lock); // acquire the mutex
-    
-    box = malloc(sizeof(box_t));
-    init_tfs_box(box, box_name);
+static bool passes(uint64_t const *pass, size_t i) {
+    return pass == NULL || (pass[i / 64] & (1ull << (i % 64))) != 0;
+}
 
-    int fhandle = tfs_open(box_name, TFS_O_APPEND);
-    if (fhandle == -1) {
-        fhandle = tfs_open(box_name, TFS_O_CREAT);
-        if (fhandle != -1) {
-            ret_status = 0;
-            if (tfs_close(fhandle) != 0) {
-                snprintf(error_msg, MAX_ERROR_MSG, "Error closing box.");
+/**
+ * Build the frames delivering a batch of messages to subscribers using the
+ * given framing, back to back so that they take a single write, after the
+ * trace context of the batch if trace is not NULL. Only the messages whose
+ * bit is set in pass are delivered, if it is not NULL (see match_filters).
+ * Returns NULL on failure.
+ */
+static msg_t *encode_batch(batch_t const *batch, uint32_t flags,
+                           trace_context_t const *trace,
+                           uint64_t const *pass) {
+    size_t count = batch->count;
+    size_t bytes = batch->len; // record headers included
+    if (pass != NULL && !batch->chunk) {
+        count = 0;
+        bytes = 0;
+        for (size_t i = 0, record = 0; i < batch->count; i++) {
+            uint8_t const *message;
+            uint32_t message_len;
+            record = batch_record(batch, record, &message, &message_len);
+            if (passes(pass, i)) {
+                count++;
+                bytes += RECORD_HEADER_LEN + message_len;
             }
-        } else {
-            snprintf(error_msg, MAX_ERROR_MSG, "Error creating file.");
-        }
-    } else {
-        snprintf(error_msg, MAX_ERROR_MSG, "Box name already exists.");
-        if (tfs_close(fhandle) != 0) {
-            snprintf(error_msg, MAX_ERROR_MSG, "Error closing box.");
         }
     }
-    if (ret_status == 0) {
-        append_box(&head, box);
-        box_count++;
-    } else {
-        free(box);
+
+    size_t len = count * MSG_FRAME_LEN;
+    if (batch->chunk) {
+        len = CHUNK_HEADER_LEN + batch->len - RECORD_HEADER_LEN;
+    } else if (flags & REGISTER_FLAG_LEN_PREFIX) {
+        // the record headers are replaced by the frame headers
+        len = count * MSG_HEADER_LEN + bytes - count * RECORD_HEADER_LEN;
+    }
+
+    size_t offset = trace != NULL ? TRACE_FRAME_LEN : 0;
+    msg_t *msg = msg_alloc(offset + len, count);
+    if (msg == NULL) {
+        return NULL;
+    }
+    if (trace != NULL) {
+        encode_trace(msg->data, trace);
+        msg->trace_id = trace->trace_id;
+    }
+
+    size_t record = 0;
+    if (batch->chunk) {
+        uint8_t const *payload;
+        uint32_t payload_len;
+        batch_record(batch, record, &payload, &payload_len);
+        encode_chunk_header(msg->data + offset, TFS_OPCODE_SUB_CHUNK,
+                            payload_len, batch->chunk_flags);
+        memcpy(msg->data + offset + CHUNK_HEADER_LEN, payload, payload_len);
+        return msg;
+    }
+    for (size_t i = 0; i < batch->count; i++) {
+        uint8_t const *message;
+        uint32_t message_len;
+        record = batch_record(batch, record, &message, &message_len);
+        if (passes(pass, i)) {
+            offset += encode_message(msg->data + offset, TFS_OPCODE_SUB_MSG,
+                                     message, message_len, flags);
+        }
     }
-    pthread_mutex_unlock(&new_box_lock); // release the mutex
-    pthread_mutex_destroy(&new_box_lock);
-    return ret_status;
+    return msg;
 }
 
-static int remove_box(char *box_name, char *error_msg) 
-{
-    delete_box(&head, box_name);
-    box_count--;
+// Length of the longest row of hits: a bit per message of a batch
+#define MAX_HIT_WORDS ((MAX_BATCH_MSGS + 63) / 64)
 
-    if (tfs_unlink(box_name) != 0) {
-        strcpy(error_msg, "Error deleting box.");
-        return -1;
+/**
+ * Make room in the box's scratch buffers for every filter id handed out so
+ * far, doubling them as needed (freed ids are reused, so they only grow with
+ * the most filters the box had at once). Called with the box's lock held.
+ * Returns 0 if successful, -1 if out of memory.
+ */
+static int reserve_filter_scratch(box_t *box) {
+    size_t n_ids = box->filters.n_ids;
+    if (n_ids <= box->filter_ids) {
+        return 0;
+    }
+    size_t ids = box->filter_ids > 0 ? box->filter_ids : 1;
+    while (ids < n_ids) {
+        ids *= 2;
     }
 
+    uint64_t *hits =
+        realloc(box->filter_hits, ids * MAX_HIT_WORDS * sizeof(uint64_t));
+    if (hits == NULL) {
+        return -1;
+    }
+    box->filter_hits = hits;
+    msg_t **frames = realloc(box->filter_frames, 3 * ids * sizeof(msg_t *));
+    if (frames == NULL) {
+        return -1;
+    }
+    memset(frames + 3 * box->filter_ids, 0,
+           3 * (ids - box->filter_ids) * sizeof(msg_t *));
+    box->filter_frames = frames;
+    box->filter_ids = ids;
     return 0;
 }
 
-int handle_box_wrapper(int (*handle_box_func)(char *, char *)) {
-    char client_path[MAX_PIPE_NAME + 1];
-    char box_name[MAX_BOX_NAME + 1];
-    char error_msg[MAX_ERROR_MSG + 1] = {0};
-    ssize_t bytes_read;
-    int ret;
+/**
+ * Match the messages of a batch, or the first chunk of a streamed message,
+ * against the filters of the box's subscribers, with a single walk of the
+ * box's trie per message whatever the number of filters. Sets words to the
+ * length of the rows of hits (see filter_trie_match). Called with the box's
+ * lock held.
+ * Returns the rows, in the box's scratch buffer, or NULL if out of memory.
+ */
+static uint64_t *match_filters(box_t *box, batch_t const *batch,
+                               size_t *words) {
+    if (reserve_filter_scratch(box) != 0) {
+        return NULL;
+    }
+    *words = batch->chunk ? 1 : (batch->count + 63) / 64;
+    uint64_t *hits = box->filter_hits;
+    memset(hits, 0, box->filters.n_ids * *words * sizeof(uint64_t));
 
-    bytes_read = safe_read(fd_in, client_path, sizeof(char) * MAX_PIPE_NAME);
-    client_path[MAX_PIPE_NAME] = '\0';
+    if (batch->chunk && !(batch->chunk_flags & CHUNK_FLAG_FIRST)) {
+        return hits;
+    }
+    size_t n_messages = batch->chunk ? 1 : batch->count;
+    for (size_t i = 0, record = 0; i < n_messages; i++) {
+        uint8_t const *message;
+        uint32_t message_len;
+        record = batch_record(batch, record, &message, &message_len);
+        filter_trie_match(&box->filters, message, message_len, hits, *words,
+                          i);
+    }
+    return hits;
+}
 
-    if (bytes_read != sizeof(char) * MAX_PIPE_NAME) {
-        printf("Error reading from pipe %s\n", in_pipe_path);
-        return -1;
+/**
+ * Which frames of a batch a filtered subscriber is sent, given its row of
+ * hits: those every subscriber shares (if its filter lets everything
+ * through), those of its filter's messages, or none (NULL). Called with the
+ * box's lock held.
+ */
+static msg_t **filtered_frames(session_t *sub, batch_t const *batch,
+                               uint64_t const *pass, msg_t **shared,
+                               msg_t **filtered) {
+    if (batch->chunk) {
+        // the rest of a streamed message follows its first chunk
+        if (batch->chunk_flags & CHUNK_FLAG_FIRST) {
+            sub->chunk_pass = passes(pass, 0);
+        }
+        return sub->chunk_pass ? shared : NULL;
     }
 
-    bytes_read = safe_read(fd_in, box_name, sizeof(char) * MAX_BOX_NAME);
-    box_name[MAX_BOX_NAME] = '\0';
+    size_t hits = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        hits += passes(pass, i);
+    }
+    if (hits == 0) {
+        return NULL;
+    }
+    return hits == batch->count ? shared : filtered;
+}
 
-    if (bytes_read != sizeof(char) * MAX_BOX_NAME) {
-        printf("Error reading from pipe %s\n", in_pipe_path);
-        return -1;
+/**
+ * Whether every subscriber of a box has room for one more message. Called
+ * with the box's lock held.
+ */
+static bool subscribers_have_room(box_t *box) {
+    for (session_t *sub = box->subscribers; sub != NULL; sub = sub->next) {
+        pthread_mutex_lock(&sub->lock);
+        bool full = !sub->closing && session_queue_full(sub);
+        pthread_mutex_unlock(&sub->lock);
+        if (full) {
+            return false;
+        }
     }
+    return true;
+}
 
-    ret = handle_box_func(box_name, error_msg);
+/**
+ * Hand frames to a subscriber, applying the slow consumer policy if its
+ * queue is full. Called with the subscriber's lock held.
+ * Returns -1 if the subscriber must be disconnected, 0 otherwise.
+ */
+static int deliver_message(session_t *session, msg_t *msg) {
+    if (session->closing) {
+        return 0;
+    }
 
-    if (ret < 0) {
-        int client_fd = open(client_path, O_WRONLY);
-        if (client_fd < 0) {
-            printf("Error opening client pipe %s\n", client_path);
+    if (session_queue_full(session)) {
+        switch (slow_policy) {
+        case SLOW_DISCONNECT:
+            session_count_dropped(session, msg->n_msgs);
             return -1;
+        case SLOW_BLOCK:
+        case SLOW_DROP_OLDEST:
+        default:
+            if (session_drop_oldest(session) != 0) {
+                session_count_dropped(session, msg->n_msgs);
+                return 0;
+            }
+            break;
         }
+    }
 
-        safe_write(client_fd, error_msg, sizeof(char) * MAX_ERROR_MSG);
-        close(client_fd);
-        return -1;
-    } else {
+    bool was_idle = session->tx_count == 0;
+    if (session_send(session, msg) != 0) {
+        // the session gets closed once the event loop notices the error
+        WARN("Error delivering message to subscriber: %s", strerror(errno));
         return 0;
     }
+    if (was_idle && session->tx_count > 0 &&
+        event_loop_rearm(session, session_tx_events(session)) != 0) {
+        return -1;
+    }
+    return 0;
 }
 
-int handle_list_boxes(void) {
-    char client_path[MAX_PIPE_NAME + 1];
-    ssize_t bytes_read;
+/**
+ * Store a batch of messages in the publisher's box, with a single write, and
+ * hand it to every subscriber of the box.
+ *
+ * Returns 0 if successful, -1 on error, or 1 if some subscriber has no room
+ * for the batch under the blocking policy: the publisher is then parked until
+ * that subscriber catches up.
+ */
+static int publish_batch(session_t *publisher, batch_t const *batch) {
+    box_t *box = publisher->box;
+    char path[MAX_BOX_NAME + 2];
+    box_path(path, box->name);
 
-    bytes_read = safe_read(fd_in, client_path, sizeof(char) * MAX_PIPE_NAME);
-    client_path[MAX_PIPE_NAME] = '\0';
+    // the clock is only read for the spans of traced frames
+    uint64_t trace_id = publisher->trace.trace_id;
+    uint64_t span_start = trace_id != 0 ? metrics_now() : 0;
+    trace_span("ingress", trace_id, publisher->rx_time, span_start);
 
-    if (bytes_read != sizeof(char) * MAX_PIPE_NAME) {
-        printf("Error reading from pipe %s\n", in_pipe_path);
+    // the box's lock orders messages with subscribers joining the box
+    pthread_mutex_lock(&box->lock);
+    PROBE1(mbroker, box_lock, box);
+    if (trace_id != 0) {
+        uint64_t locked_at = metrics_now();
+        trace_span("box_lock", trace_id, span_start, locked_at);
+        span_start = locked_at;
+    }
+    if (box->removed) {
+        pthread_mutex_unlock(&box->lock);
+        WARN("Box '%s' was removed", box->name);
         return -1;
     }
 
-    int fd_out = open(client_path, O_WRONLY);
-    if (fd_out < 0) {
-        printf("Error opening pipe %s\n", client_path);
+    if (slow_policy == SLOW_BLOCK && !subscribers_have_room(box)) {
+        // check again after parking, so that a subscriber catching up in
+        // between is sure to see the publisher parked
+        atomic_store(&box->parked_publisher, session_token(publisher));
+        if (!subscribers_have_room(box)) {
+            pthread_mutex_unlock(&box->lock);
+            return 1;
+        }
+        atomic_store(&box->parked_publisher, NO_PARKED_PUBLISHER);
+    }
+
+    int fhandle = tfs_open(path, TFS_O_APPEND);
+    if (fhandle == -1) {
+        pthread_mutex_unlock(&box->lock);
+        WARN("Can't open tfs file");
         return -1;
     }
 
-    if (write(fd_out, &box_count, sizeof(int)) < 0) {
-        printf("Error writing to pipe %s\n", client_path);
+    // records are stored with their header, which delimits them
+    ssize_t bytes_written = tfs_write(fhandle, batch->data, batch->len);
+    tfs_close(fhandle);
+    if (bytes_written != batch->len) {
+        box_tail_clear(box);
+        pthread_mutex_unlock(&box->lock);
+        WARN("Error writing to tfs file");
         return -1;
     }
+    atomic_fetch_add(&box->size, batch->len);
+    box_tail_append(box, batch->data, batch->len);
+    uint64_t stored_at = metrics_now();
+    trace_span("tfs_write", trace_id, span_start, stored_at);
+    metrics_t *all[] = {&box->metrics, &broker_metrics};
+    for (size_t i = 0; i < 2; i++) {
+        metrics_add(all[i], METRIC_MSGS_IN, batch->count);
+        metrics_add(all[i], METRIC_BYTES_IN, batch->len);
+        metrics_record(all[i], LATENCY_INGEST,
+                       stored_at - publisher->rx_time);
+    }
+    if (publisher->producer_id != 0) {
+        box_dedup_record(box, publisher->producer_id,
+                         batch->first_seq + batch->count - 1);
+    }
 
-    node_t *cur = head;
-    while (cur) {
-        if (write(fd_out, cur->data, sizeof(box_t)) < 0) {
-            printf("Error writing to pipe %s\n", client_path);
-            return -1;
+    // frames for each framing in use, shared by the subscribers using it
+    // (length-prefixed frames come with the trace context of traced batches
+    // for the subscribers that want it), and the same for each filter that
+    // lets only some of the messages through (in the box's scratch buffer)
+    msg_t *frames[3] = {NULL, NULL, NULL};
+    uint64_t *hits = NULL;
+    size_t words = 0;
+    msg_t **filtered = NULL;
+    size_t n_filtered = 0;
+    if (box->filters.n_filters > 0) {
+        hits = match_filters(box, batch, &words);
+        if (hits != NULL) {
+            filtered = box->filter_frames;
+            n_filtered = 3 * box->filters.n_ids;
+        }
+    }
+
+    session_t *lagging[MAX_LAGGING];
+    uint32_t generations[MAX_LAGGING];
+    size_t n_lagging = 0;
+
+    session_t *next;
+    for (session_t *sub = box->subscribers; sub != NULL; sub = next) {
+        next = sub->next;
+        size_t framing = (sub->flags & REGISTER_FLAG_LEN_PREFIX) ? 1 : 0;
+        if (batch->chunk && framing == 0) {
+            continue; // streamed messages do not fit the fixed framing
+        }
+        if (framing == 1 && trace_id != 0 &&
+            (sub->flags & REGISTER_FLAG_TRACE)) {
+            framing = 2;
+        }
+        msg_t **frame = &frames[framing];
+        uint64_t const *pass = NULL;
+        if (sub->filter_id != FILTER_NONE && hits != NULL &&
+            filtered != NULL) {
+            pass = &hits[sub->filter_id * words];
+            frame = filtered_frames(sub, batch, pass, frame,
+                                    &filtered[3 * sub->filter_id + framing]);
+            if (frame == NULL) {
+                continue; // none of the messages is wanted
+            }
+            if (frame == &frames[framing]) {
+                pass = NULL;
+            }
+        } else if (sub->filter_id != FILTER_NONE) {
+            frame = NULL; // the filters could not be matched
+        }
+
+        pthread_mutex_lock(&sub->lock);
+        if (frame != NULL && *frame == NULL) {
+            *frame = encode_batch(batch, sub->flags,
+                                  framing == 2 ? &publisher->trace : NULL,
+                                  pass);
+            if (*frame != NULL) {
+                (*frame)->stored_at = stored_at;
+            }
+            if (*frame != NULL && (*frame)->len >= SESSION_STAGE_MIN &&
+                atomic_load(&box->n_subscribers) > 1) {
+                session_stage(*frame);
+            }
+        }
+        if (frame == NULL || *frame == NULL) {
+            WARN("Failed to allocate message");
+            session_count_dropped(sub, batch->count);
+        } else if (deliver_message(sub, *frame) != 0 &&
+                   n_lagging < MAX_LAGGING) {
+            sub->closing = true;
+            session_unlink(box, sub);
+            atomic_fetch_sub(&box->n_subscribers, 1);
+            lagging[n_lagging] = sub;
+            generations[n_lagging++] = sub->generation;
+        }
+        pthread_mutex_unlock(&sub->lock);
+    }
+    if (n_filtered > 0) {
+        // the scratch buffer is emptied for the next batch before the lock
+        // is released, so the filtered frames are unstaged first
+        session_unstage();
+        for (size_t i = 0; i < n_filtered; i++) {
+            if (filtered[i] != NULL) {
+                msg_put(filtered[i]);
+                filtered[i] = NULL;
+            }
         }
-        cur = cur->next;
+    }
+    box_list_update(box);
+    pthread_mutex_unlock(&box->lock);
+    // stored and handed to the subscribers, with the box's lock released
+    PROBE3(mbroker, publish, box, batch->count, batch->len);
+    session_unstage();
+    if (trace_id != 0) {
+        trace_span("fanout", trace_id, stored_at, metrics_now());
+    }
+    for (size_t i = 0; i < 3; i++) {
+        if (frames[i] != NULL) {
+            msg_put(frames[i]);
+        }
+    }
+
+    for (size_t i = 0; i < n_lagging; i++) {
+        pthread_mutex_lock(&lagging[i]->lock);
+        if (lagging[i]->generation == generations[i]) {
+            INFO("Disconnecting slow subscriber of '%s'", box->name);
+            release_session(lagging[i]);
+        }
+        pthread_mutex_unlock(&lagging[i]->lock);
     }
 
-    close(fd_out);
     return 0;
 }
 
-int main(int argc, char *argv[]) {
-    // Check the number of arguments
-    if (argc != 3) {
-        print_instructions();
+/**
+ * Add the frame delivering the record at the start of buf (len bytes read
+ * from a box) to the frames for a subscriber catching up, which have room
+ * for it, if its filter lets it through: a message, or a chunk of a streamed
+ * message.
+ * Returns the length of the record, 0 if it is not complete, or -1 if it is
+ * not valid.
+ */
+static ssize_t replay_record(session_t *session, uint8_t const *buf,
+                             size_t len, msg_t *frames) {
+    char const *filter = session->filter[0] != '\0' ? session->filter : NULL;
+    uint8_t kind;
+    uint8_t const *payload;
+    uint32_t payload_len;
+    size_t record_len = decode_record(buf, len, &kind, &payload, &payload_len);
+    if (record_len == 0) {
+        return 0;
+    }
+    if (payload_len > MAX_CHUNK_LEN) {
+        WARN("Invalid record of %u bytes", payload_len);
+        return -1;
     }
 
-    // Parse arguments
-    in_pipe_path = argv[1];
-    int max_sessions = atoi(argv[2]);
+    if (kind & RECORD_CHUNK) {
+        uint8_t chunk_flags = (uint8_t)(kind & ~RECORD_CHUNK);
+        if (!(session->flags & REGISTER_FLAG_LEN_PREFIX)) {
+            return (ssize_t)record_len;
+        }
+        if (filter != NULL && (chunk_flags & CHUNK_FLAG_FIRST)) {
+            session->chunk_pass = filter_match(filter, payload, payload_len);
+        }
+        if (filter != NULL && !session->chunk_pass) {
+            return (ssize_t)record_len;
+        }
+        encode_chunk_header(frames->data + frames->len, TFS_OPCODE_SUB_CHUNK,
+                            payload_len, chunk_flags);
+        memcpy(frames->data + frames->len + CHUNK_HEADER_LEN, payload,
+               payload_len);
+        frames->len += CHUNK_HEADER_LEN + payload_len;
+        frames->n_msgs += (chunk_flags & CHUNK_FLAG_LAST) ? 1 : 0;
+        return (ssize_t)record_len;
+    }
 
-    // Create input pipe
-    if (mkfifo(in_pipe_path, 0666) < 0) {
-        PANIC("Failed to create pipe '%s': %s\n", in_pipe_path, strerror(errno));
+    if (filter != NULL && !filter_match(filter, payload, payload_len)) {
+        return (ssize_t)record_len;
     }
+    frames->len += encode_message(frames->data + frames->len,
+                                  TFS_OPCODE_SUB_MSG, payload,
+                                  payload_len < MAX_PUB_MSG ? payload_len
+                                                            : MAX_PUB_MSG,
+                                  session->flags);
+    frames->n_msgs++;
+    return (ssize_t)record_len;
+}
 
-    // Open input pipe
-    fd_in = open(in_pipe_path, O_RDONLY | O_NONBLOCK);
-    if (fd_in < 0) {
-        PANIC("Failed to open pipe '%s': %s\n", in_pipe_path, strerror(errno));
+/**
+ * Read stored records of a box, from offset on, into buf: from the records
+ * the box holds in memory if offset is among them, from its file otherwise.
+ * Called with the box's lock held.
+ * Returns the number of bytes read, or -1 on error.
+ */
+static ssize_t read_records(box_t *box, uint64_t offset, uint8_t *buf,
+                            size_t len) {
+    box_tail_t const *tail = &box->tail;
+    uint64_t held_from = atomic_load(&box->size) - tail->len;
+    if (tail->data != NULL && offset >= held_from) {
+        size_t skip = (size_t)(offset - held_from);
+        if (len > tail->len - skip) {
+            len = tail->len - skip;
+        }
+        // may wrap around the end of the ring
+        size_t start = (tail->head + skip) % tail->capacity;
+        size_t first_part =
+            tail->capacity - start < len ? tail->capacity - start : len;
+        memcpy(buf, tail->data + start, first_part);
+        memcpy(buf + first_part, tail->data, len - first_part);
+        return (ssize_t)len;
     }
 
-    // Set up signal handlers for clean exit
-    signal(SIGINT, safe_close);
-    signal(SIGTERM, safe_close);
+    char path[MAX_BOX_NAME + 2];
+    box_path(path, box->name);
 
-    // Initialize data structures
-    head = NULL;
+    int fhandle = tfs_open(path, 0);
+    if (fhandle == -1) {
+        WARN("Can't open tfs file");
+        return -1;
+    }
+    ssize_t bytes_read = tfs_pread(fhandle, buf, len, (size_t)offset);
+    tfs_close(fhandle);
+    return bytes_read;
+}
 
-    // Main loop
-    for (int i = 0; i < max_sessions; i++) {
-        char client_path[MAX_PIPE_NAME + 1];
-        ssize_t bytes_read;
+/**
+ * Send a subscriber catching up the next records of its box, from its
+ * replay offset on, in a single write (or queued, if its pipe is full).
+ * Called with the box's lock and the session's lock held.
+ * Returns 1 if records were consumed, 0 if the subscriber caught up, or -1
+ * on error.
+ */
+static int replay_records(session_t *session, box_t *box) {
+    uint64_t size = atomic_load(&box->size);
+    if (session->replay_offset >= size) {
+        return 0;
+    }
+
+    // every record fits, however long
+    uint8_t records[4 * MAX_BOX_RECORD_LEN];
+    size_t room = sizeof(records);
+    if (size - session->replay_offset < room) {
+        room = (size_t)(size - session->replay_offset);
+    }
+    ssize_t len = read_records(box, session->replay_offset, records, room);
+    msg_t *frames = len > 0 ? msg_alloc(CATCH_UP_FRAME_LEN, 0) : NULL;
+    if (frames == NULL) {
+        return -1;
+    }
 
-        // Read from input pipe
-        bytes_read = safe_read(fd_in, client_path, sizeof(char) * MAX_PIPE_NAME);
-        client_path[MAX_PIPE_NAME] = '\0';
+    frames->len = 0;
+    size_t offset = 0;
+    ssize_t record_len = 0;
+    while (offset < (size_t)len &&
+           frames->len + MAX_RECORD_FRAME_LEN <= CATCH_UP_FRAME_LEN &&
+           (record_len = replay_record(session, records + offset,
+                                       (size_t)len - offset, frames)) > 0) {
+        offset += (size_t)record_len;
+    }
+    // a record cut short at the end of a full box is left out
+    session->replay_offset += record_len < 0 || offset == 0 ? (size_t)len
+                                                            : offset;
 
-        if (bytes_read != sizeof(char) * MAX_PIPE_NAME) {
-            printf("Error reading from pipe %s\n", in_pipe_path);
-            continue;
+    int ret = record_len < 0 ? -1 : 1;
+    if (ret == 1 && frames->len > 0 && session_send(session, frames) != 0) {
+        ret = -1;
+    }
+    msg_put(frames);
+    return ret;
+}
+
+/**
+ * Send a subscriber catching up with its box the messages stored before it
+ * joined, as many as its queue takes, and have it join the box once it got
+ * them all: from then on, it gets the messages as they are published.
+ * Called with the session's lock held, which is dropped while the box's lock
+ * is taken (the box's lock is always taken first).
+ * Returns 0 if successful, -1 if the session must be closed.
+ */
+static int catch_up(session_t *session) {
+    box_t *box = session->box;
+    // nothing else closes a subscriber that did not join its box yet
+    pthread_mutex_unlock(&session->lock);
+    pthread_mutex_lock(&box->lock);
+    pthread_mutex_lock(&session->lock);
+
+    int ret = box->removed ? -1 : 1;
+    while (ret == 1 && !session_queue_full(session)) {
+        ret = replay_records(session, box);
+    }
+    if (ret == 0) {
+        // no message can be published between the last one replayed and the
+        // subscriber joining the box
+        char const *filter =
+            session->filter[0] != '\0' ? session->filter : NULL;
+        if (filter != NULL &&
+            (session->filter_id = filter_trie_add(&box->filters, filter)) ==
+                FILTER_NONE) {
+            WARN("Error adding the filter of a subscriber");
+            ret = -1;
+        } else {
+            session_link(box, session);
+            atomic_fetch_add(&box->n_subscribers, 1);
+            box_list_update(box);
+            session->catching_up = false;
         }
+    }
+    pthread_mutex_unlock(&box->lock);
 
-        // Open output pipe
-        int fd_out = open(client_path, O_WRONLY);
-        if (fd_out < 0) {
-            printf("Error opening pipe %s\n", client_path);
-            continue;
+    return ret < 0 ? -1 : 0;
+}
+
+// Bound on the reads done for a session per wake-up, so that a busy publisher
+// does not starve the other sessions served by the same thread
+#define MAX_READS_PER_EVENT (16)
+
+/**
+ * Let an acknowledged publisher know how far its messages are stored, if it
+ * was not told yet (status 0), or that the messages that follow will not be
+ * (status -1).
+ */
+static void send_ack(session_t *session, int32_t status) {
+    if (session->out_fd < 0 ||
+        (status == 0 && session->acked_seq == session->last_seq)) {
+        return;
+    }
+
+    uint8_t frame[ACK_FRAME_LEN];
+    size_t len = encode_ack(frame, session->last_seq, status);
+    ssize_t ret;
+    do {
+        ret = write(session->out_fd, frame, len);
+    } while (ret < 0 && errno == EINTR);
+    if (ret == (ssize_t)len) {
+        session->acked_seq = session->last_seq;
+        return;
+    }
+    // the client may send nothing more: the acknowledgement is left pending
+    // until it makes room (superseded by any stored meanwhile)
+    if (status == 0 && ret < 0 && errno == EAGAIN &&
+        event_loop_watch_out(session, EPOLLOUT) != 0) {
+        WARN("Failed to watch the acknowledgements of a publisher");
+    }
+}
+
+/**
+ * Check that a numbered batch follows the messages of its publisher. The
+ * messages an idempotent producer resends are dropped from the batch, which
+ * may leave it empty.
+ * Returns 0 if the batch can be published, -1 otherwise.
+ */
+static int check_sequence(session_t *session, batch_t *batch) {
+    if (batch->first_seq == 0) {
+        WARN("Invalid sequence number 0");
+        return -1;
+    }
+    if (session->producer_id != 0 && session->last_seq == 0) {
+        // a producer the box does not remember may start anywhere
+        session->last_seq = batch->first_seq - 1;
+    }
+
+    uint64_t expected = session->last_seq + 1;
+    if (session->producer_id != 0 && batch->first_seq < expected) {
+        uint64_t duplicates = expected - batch->first_seq;
+        if (duplicates > batch->count) {
+            duplicates = batch->count;
         }
+        INFO("Dropping %lu messages already stored", duplicates);
+        batch_skip(batch, (size_t)duplicates);
+    }
+    if (batch->count > 0 && batch->first_seq != expected) {
+        WARN("Unexpected sequence number %lu (%lu expected)", batch->first_seq,
+             expected);
+        return -1;
+    }
+    return 0;
+}
 
-        // Read opcode
-        uint8_t opcode;
-        bytes_read = safe_read(fd_in, &opcode, sizeof(uint8_t));
-        if (bytes_read != sizeof(uint8_t)) {
-            printf("Error reading opcode from pipe %s\n", in_pipe_path);
-            close(fd_out);
-            continue;
+/**
+ * Capture a frame of a publisher (starting with opcode) once what it carries
+ * is stored: the sizes of its messages, or of the chunk it streams.
+ */
+static void capture_batch(session_t const *session, uint8_t opcode,
+                          batch_t const *batch) {
+    capture_record_t record = {.kind = CAPTURE_PUBLISH,
+                               .opcode = opcode,
+                               .time = session->rx_time,
+                               .session = session_token(session)};
+    memcpy(record.box_name, session->box_name,
+           strnlen(session->box_name, MAX_BOX_NAME));
+    if (batch->chunk) {
+        record.flags = batch->chunk_flags;
+        record.len = (uint32_t)(batch->len - RECORD_HEADER_LEN);
+    } else {
+        size_t offset = 0;
+        for (size_t i = 0; i < batch->count; i++) {
+            uint8_t const *message;
+            uint32_t len;
+            offset = batch_record(batch, offset, &message, &len);
+            record.sizes[i] = (uint16_t)len;
         }
+        record.count = (uint32_t)batch->count;
+        record.len = (uint32_t)(batch->len - batch->count * RECORD_HEADER_LEN);
+    }
+    capture_write(&record);
+}
 
-        // Handle request
-        switch (opcode) {
-            case TFS_OPCODE_CRT_BOX:
-                handle_box_wrapper(new_box);
-                break;
-            case TFS_OPCODE_RMV_BOX:
-                handle_box_wrapper(remove_box);
-                break;
-            case TFS_OPCODE_LST_BOX:
-                handle_list_boxes();
-                break;
-            case TFS_OPCODE_REG_SUB:
-                subscriber();
-                break;
-            case TFS_OPCODE_REG_PUB:
-                publisher();
-                break;
-            default:
-                printf("Invalid opcode received: %d\n", opcode);
+static void handle_publisher(session_t *session, uint32_t events) {
+    if (events & EVENT_LOOP_OUT_FD) {
+        // room for the acknowledgement left pending; the reads go on as they
+        // were (a parked publisher stays parked)
+        send_ack(session, 0);
+        return;
+    }
+    ssize_t bytes_read = 1;
+
+    for (int i = 0; i <= MAX_READS_PER_EVENT; i++) {
+        // handle the frames already buffered (left over if parked) first
+        batch_t batch;
+        ssize_t frame_len;
+        while ((frame_len = decode_frame(session, &batch)) > 0) {
+            if (batch.trace.trace_id != 0) {
+                session->trace = batch.trace;
+                session_consume(session, (size_t)frame_len);
+                continue;
+            }
+            if ((session->flags & REGISTER_FLAG_ACK) &&
+                check_sequence(session, &batch) != 0) {
+                frame_len = -1;
                 break;
+            }
+            int ret = batch.len > 0 ? publish_batch(session, &batch) : 0;
+            if (ret < 0) {
+                send_ack(session, -1);
+                close_session(session);
+                return;
+            }
+            if (ret > 0) {
+                // not re-armed: resumed by the subscriber that falls behind
+                session->parked = true;
+                send_ack(session, 0);
+                return;
+            }
+            session->last_seq += batch.count;
+            session->trace.trace_id = 0;
+            // per message, so only logged with -v (or compiled out)
+            if (batch.chunk) {
+                DEBUG("Received chunk of %zu bytes",
+                      batch.len - RECORD_HEADER_LEN);
+            } else if (batch.count == 1) {
+                DEBUG("Received message: %.*s",
+                      (int)(batch.len - RECORD_HEADER_LEN),
+                      (char const *)batch.data + RECORD_HEADER_LEN);
+            } else if (batch.count > 1) {
+                DEBUG("Received %zu messages", batch.count);
+            }
+            if (batch.len > 0 && capture_on()) {
+                capture_batch(session, session->rx_buf[0], &batch);
+            }
+            session_consume(session, (size_t)frame_len);
+        }
+        if (frame_len < 0) {
+            send_ack(session, -1);
+            close_session(session);
+            return;
         }
 
-        // Close output pipe
-        close(fd_out);
+        if (i == MAX_READS_PER_EVENT) {
+            break;
+        }
+        bytes_read = session_fill(session);
+        if (bytes_read <= 0) {
+            break;
+        }
+        session->rx_time = metrics_now();
+    }
+
+    // one acknowledgement covers everything stored in this wake-up
+    int read_errno = errno;
+    send_ack(session, 0);
+    if (bytes_read == 0) {
+        INFO("Publisher closed the session");
+        close_session(session);
+    } else if (bytes_read < 0 && read_errno != EAGAIN) {
+        WARN("Error reading from publisher: %s", strerror(read_errno));
+        close_session(session);
+    } else if (event_loop_rearm(session, EPOLLIN) != 0) {
+        close_session(session);
+    }
+}
+
+/**
+ * Let a parked publisher go on publishing. Called with no session lock held.
+ */
+static void resume_publisher(uint64_t token) {
+    if (token == NO_PARKED_PUBLISHER) {
+        return;
+    }
+
+    uint32_t generation;
+    session_t *session = session_from_token(token, &generation);
+    pthread_mutex_lock(&session->lock);
+    if (session->generation == generation && session->parked) {
+        session->parked = false;
+        handle_publisher(session, 0);
+    }
+    pthread_mutex_unlock(&session->lock);
+}
+
+static void handle_subscriber(session_t *session, uint32_t events) {
+    // the client closing its end of the pipe is reported as an error (or as
+    // end of file on the doorbell of ring sessions)
+    if ((events & (EPOLLERR | EPOLLHUP)) ||
+        (session->ring.shared != NULL && session_doorbell(session) != 0)) {
+        INFO("Subscriber closed the session");
+        close_session(session);
+        return;
+    }
+
+    int ret = session_flush(session);
+    if (ret < 0) {
+        WARN("Error delivering message to subscriber: %s", strerror(errno));
+        close_session(session);
+        return;
+    }
+    if (ret == 0 && session->catching_up && catch_up(session) != 0) {
+        WARN("Error catching up subscriber of '%s'", session->box_name);
+        close_session(session);
+        return;
+    }
+    if (event_loop_rearm(session, session_tx_events(session)) != 0) {
+        close_session(session);
+        return;
+    }
+
+    if (!session_queue_full(session)) {
+        uint64_t token = atomic_exchange(&session->box->parked_publisher,
+                                         NO_PARKED_PUBLISHER);
+        if (token != NO_PARKED_PUBLISHER) {
+            pthread_mutex_unlock(&session->lock);
+            resume_publisher(token);
+            pthread_mutex_lock(&session->lock);
+        }
+    }
+}
+
+/**
+ * Open the pipe of a new session, after mapping the ring it asked for if any
+ * (the client removes the ring's name once the pipe is open). Clients that
+ * connected to the broker's socket use their connection (conn_fd) instead.
+ * Returns the pipe's file descriptor, or -1 on error.
+ */
+static int open_client(char const *client_path, int pipe_flags, uint32_t flags,
+                       ring_t *ring, int conn_fd) {
+    ring->shared = NULL;
+    bool use_ring = flags & REGISTER_FLAG_SHM_RING;
+    if (conn_fd >= 0) {
+        if (use_ring) {
+            close(conn_fd);
+            WARN("Rings are only set up for clients using pipes");
+            return -1;
+        }
+        return conn_fd;
+    }
+    if (use_ring) {
+        // the client only writes wake-ups to its pipe
+        pipe_flags = O_RDONLY | O_NONBLOCK;
+        if (flags & REGISTER_FLAG_LEN_PREFIX) {
+            ring_attach(ring, client_path);
+        }
+    }
+
+    int client_fd = open(client_path, pipe_flags);
+    if (client_fd < 0) {
+        WARN("Error opening pipe: '%s' - %s", client_path, strerror(errno));
+        if (ring->shared != NULL) {
+            ring_detach(ring);
+        }
+        return -1;
+    }
+    if (use_ring && ring->shared == NULL) {
+        // closing the pipe lets the client know
+        close(client_fd);
+        WARN("Error mapping the ring of '%s'", client_path);
+        return -1;
+    }
+    return client_fd;
+}
+
+/**
+ * Open the channel an acknowledged publisher reads its acknowledgements from:
+ * the pipe it created next to its session pipe, or its connection (conn_fd).
+ * Returns a non-blocking file descriptor, or -1 on error.
+ */
+static int open_acks(char const *client_path, int conn_fd) {
+    if (conn_fd < 0) {
+        char ack_path[MAX_PIPE_NAME + sizeof(ACK_PIPE_SUFFIX)];
+        snprintf(ack_path, sizeof(ack_path), "%s%s", client_path,
+                 ACK_PIPE_SUFFIX);
+        return open(ack_path, O_WRONLY | O_NONBLOCK);
+    }
+
+    int ack_fd = dup(conn_fd);
+    int fd_flags = ack_fd < 0 ? -1 : fcntl(ack_fd, F_GETFL);
+    if (fd_flags < 0 || fcntl(ack_fd, F_SETFL, fd_flags | O_NONBLOCK) < 0) {
+        if (ack_fd >= 0) {
+            close(ack_fd);
+        }
+        return -1;
+    }
+    return ack_fd;
+}
+
+/**
+ * Undo open_client, for sessions that were not created.
+ */
+static void close_client(int client_fd, ring_t *ring) {
+    close(client_fd);
+    if (ring->shared != NULL) {
+        ring_close(ring);
+        ring_detach(ring);
+    }
+}
+
+/**
+ * Register a subscriber, whose pipe (client_fd) is already open, or which
+ * uses its connection to the broker's socket; subscribers using a ring
+ * (client_fd -1) have their pipe opened here. Filtered subscribers name
+ * their filter (NULL, or empty, for the others).
+ */
+int subscriber(char *client_path, char *box_name, uint32_t flags,
+               char const *filter, int client_fd) {
+    if (filter != NULL && filter[0] == '\0') {
+        filter = NULL;
+    }
+    ring_t ring;
+    client_fd = open_client(client_path, O_WRONLY | O_NONBLOCK, flags, &ring,
+                            client_fd);
+    if (client_fd < 0) {
+        return -1;
+    }
+
+    box_t *box = find_box(&boxes, box_name);
+    if (box == NULL) {
+        close_client(client_fd, &ring);
+        WARN("Error registering subscriber");
+        return -1;
+    }
+
+    session_t *session = session_alloc(SESSION_SUBSCRIBER, client_fd);
+    if (session == NULL) {
+        close_client(client_fd, &ring);
+        box_put(box);
+        WARN("Too many sessions, rejecting subscriber");
+        return -1;
+    }
+
+    pthread_mutex_lock(&session->lock);
+    session->box = box;
+    strncpy(session->box_name, box_name, MAX_BOX_NAME);
+    session->flags = flags;
+    session->ring = ring;
+    // messages are queued rather than written while the client's pipe is
+    // full, from the first one it catches up with
+    int fd_flags = fcntl(client_fd, F_GETFL);
+    if (fd_flags < 0 ||
+        fcntl(client_fd, F_SETFL, fd_flags | O_NONBLOCK) < 0) {
+        release_session(session);
+        pthread_mutex_unlock(&session->lock);
+        WARN("Error registering subscriber");
+        return -1;
+    }
+    if (filter != NULL) {
+        strncpy(session->filter, filter, MAX_FILTER_LEN);
+    }
+    session->catching_up = true;
+    // what its pipe does not take yet is sent as the client makes room
+    if (catch_up(session) != 0) {
+        release_session(session);
+        pthread_mutex_unlock(&session->lock);
+        WARN("Error registering subscriber");
+        return -1;
+    }
+    uint8_t opcode = filter != NULL ? TFS_OPCODE_REG_SUB_FILTER
+                     : flags != 0   ? TFS_OPCODE_REG_SUB_EXT
+                                    : TFS_OPCODE_REG_SUB;
+    capture_request(CAPTURE_REGISTER, opcode, session, box_name, flags);
+
+    if (event_loop_add(session, session_tx_events(session)) != 0) {
+        close_session(session);
+        pthread_mutex_unlock(&session->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    return 0;
+}
+
+/**
+ * Register a publisher. Idempotent publishers name their producer
+ * (producer_id, 0 for the others).
+ */
+int publisher(char *client_path, char *box_name, uint32_t flags,
+              uint64_t producer_id, int conn_fd) {
+    ring_t ring;
+    int client_fd = open_client(client_path, O_RDONLY | O_NONBLOCK, flags,
+                                &ring, conn_fd);
+    if (client_fd < 0) {
+        return -1;
+    }
+
+    box_t *box = find_box(&boxes, box_name);
+    if (box == NULL) {
+        close_client(client_fd, &ring);
+        WARN("Error registering publisher");
+        return -1;
+    }
+
+    session_t *session = session_alloc(SESSION_PUBLISHER, client_fd);
+    if (session == NULL) {
+        close_client(client_fd, &ring);
+        box_put(box);
+        WARN("Too many sessions, rejecting publisher");
+        return -1;
+    }
+
+    pthread_mutex_lock(&box->lock);
+    pthread_mutex_lock(&session->lock);
+    session->box = box;
+    strncpy(session->box_name, box_name, MAX_BOX_NAME);
+    session->flags = flags;
+    session->ring = ring;
+    if ((flags & REGISTER_FLAG_ACK) &&
+        (!(flags & REGISTER_FLAG_LEN_PREFIX) ||
+         (session->out_fd = open_acks(client_path, conn_fd)) < 0)) {
+        pthread_mutex_unlock(&box->lock);
+        release_session(session);
+        pthread_mutex_unlock(&session->lock);
+        WARN("Error opening the acknowledgements of '%s'", client_path);
+        return -1;
+    }
+    if (producer_id != 0 && !(flags & REGISTER_FLAG_ACK)) {
+        pthread_mutex_unlock(&box->lock);
+        release_session(session);
+        pthread_mutex_unlock(&session->lock);
+        WARN("Idempotent publishers must be acknowledged");
+        return -1;
+    }
+    if (box->removed || box->publisher != NULL) {
+        pthread_mutex_unlock(&box->lock);
+        release_session(session);
+        pthread_mutex_unlock(&session->lock);
+        WARN("Error registering publisher");
+        return -1;
+    }
+    box->publisher = session;
+    atomic_fetch_add(&box->n_publishers, 1);
+    if (producer_id != 0) {
+        // the producer learns how far its messages are already stored
+        session->producer_id = producer_id;
+        session->last_seq = box_dedup_last(box, producer_id);
+        session->acked_seq = session->last_seq;
+        uint8_t frame[ACK_FRAME_LEN];
+        size_t len = encode_ack(frame, session->last_seq, 0);
+        if (write(session->out_fd, frame, len) != (ssize_t)len) {
+            box->publisher = NULL;
+            atomic_fetch_sub(&box->n_publishers, 1);
+            pthread_mutex_unlock(&box->lock);
+            release_session(session);
+            pthread_mutex_unlock(&session->lock);
+            WARN("Error acknowledging publisher");
+            return -1;
+        }
+    }
+    box_list_update(box);
+    pthread_mutex_unlock(&box->lock);
+    uint8_t opcode = producer_id != 0 ? TFS_OPCODE_REG_PUB_IDEM
+                     : flags != 0     ? TFS_OPCODE_REG_PUB_EXT
+                                      : TFS_OPCODE_REG_PUB;
+    capture_request(CAPTURE_REGISTER, opcode, session, box_name, flags);
+
+    if (event_loop_add(session, EPOLLIN) != 0) {
+        close_session(session);
+        pthread_mutex_unlock(&session->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    return 0;
+}
+
+/**
+ * Create several boxes, inserted into the registry in a single update.
+ * status[i] is 0 if boxes[i] was created, -1 otherwise; errors[i] describes
+ * what went wrong, or is NULL.
+ */
+static void new_boxes(char const *const *box_names, size_t count,
+                      int32_t *status, char const **errors) {
+    box_t *created[MAX_BULK_BOXES];
+    bool added[MAX_BULK_BOXES];
+
+    for (size_t i = 0; i < count; i++) {
+        status[i] = -1;
+        errors[i] = NULL;
+        created[i] = aligned_alloc(_Alignof(box_t), sizeof(box_t));
+        if (created[i] == NULL) {
+            errors[i] = "Error creating box.";
+            continue;
+        }
+        init_tfs_box(created[i], (char *)box_names[i]);
+        if (tail_records > 0 &&
+            box_tail_init(created[i], tail_records, tail_capacity) != 0) {
+            WARN("Failed to allocate the tail of '%s', reading it from TFS",
+                 box_names[i]);
+        }
+        // nothing is published to the box before its file exists
+        pthread_mutex_lock(&created[i]->lock);
+    }
+
+    append_boxes(&boxes, created, count, added);
+
+    for (size_t i = 0; i < count; i++) {
+        box_t *box = created[i];
+        if (box == NULL) {
+            continue;
+        }
+        if (!added[i]) {
+            pthread_mutex_unlock(&box->lock);
+            box_put(box);
+            errors[i] = "Box name already exists.";
+            continue;
+        }
+
+        char path[MAX_BOX_NAME + 2];
+        box_path(path, box->name);
+        int fhandle = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+        if (fhandle == -1) {
+            box->removed = true;
+            pthread_mutex_unlock(&box->lock);
+            evict_sessions(box);
+            box_put(delete_box(&boxes, box->name));
+            errors[i] = "Error creating file.";
+            continue;
+        }
+        pthread_mutex_unlock(&box->lock);
+
+        status[i] = 0;
+        if (tfs_close(fhandle) != 0) {
+            errors[i] = "Error closing box.";
+        }
+    }
+}
+
+/**
+ * Remove several boxes, taken out of the registry in a single update.
+ * Reports the outcome for each box as new_boxes does.
+ */
+static void remove_boxes(char const *const *box_names, size_t count,
+                         int32_t *status, char const **errors) {
+    box_t *removed[MAX_BULK_BOXES];
+    delete_boxes(&boxes, box_names, count, removed);
+
+    for (size_t i = 0; i < count; i++) {
+        status[i] = -1;
+        errors[i] = NULL;
+        if (removed[i] == NULL) {
+            errors[i] = "Box does not exist.";
+            continue;
+        }
+
+        evict_sessions(removed[i]);
+        box_put(removed[i]);
+
+        char path[MAX_BOX_NAME + 2];
+        box_path(path, box_names[i]);
+        if (tfs_unlink(path) != 0) {
+            errors[i] = "Error deleting box.";
+            continue;
+        }
+        status[i] = 0;
+    }
+}
+
+static int new_box(char *box_name, char *error_msg) {
+    char const *name = box_name;
+    int32_t status;
+    char const *error;
+    new_boxes(&name, 1, &status, &error);
+    if (error != NULL) {
+        snprintf(error_msg, MAX_ERROR_MSG, "%s", error);
+    }
+    return status;
+}
+
+static int remove_box(char *box_name, char *error_msg) {
+    char const *name = box_name;
+    int32_t status;
+    char const *error;
+    remove_boxes(&name, 1, &status, &error);
+    if (error != NULL) {
+        snprintf(error_msg, MAX_ERROR_MSG, "%s", error);
+    }
+    return status;
+}
+
+/**
+ * Write a whole answer to a manager's pipe or connection, which is made
+ * non-blocking: a manager that stops reading is waited for at most
+ * ANSWER_TIMEOUT_MS, rather than holding the worker.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int write_answer(int fd, msg_t const *answer) {
+    int fd_flags = fcntl(fd, F_GETFL);
+    if (fd_flags < 0 || fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK) < 0) {
+        return -1;
+    }
+
+    uint64_t deadline = metrics_now() + ANSWER_TIMEOUT_MS * 1000000ull;
+    size_t written = 0;
+    while (written < answer->len) {
+        struct iovec iov[2];
+        int iovcnt = msg_iov(answer, written, iov);
+        ssize_t ret = writev(fd, iov, iovcnt);
+        if (ret > 0) {
+            written += (size_t)ret;
+            continue;
+        }
+        if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+            return -1;
+        }
+
+        uint64_t now = metrics_now();
+        if (now >= deadline) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+        if (poll(&pfd, 1, (int)((deadline - now) / 1000000) + 1) < 0 &&
+            errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Send a manager its answer (NULL if it could not be built), and close the
+ * pipe or connection it goes through.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int send_answer(int answer_fd, msg_t *answer) {
+    int ret = answer != NULL ? write_answer(answer_fd, answer) : -1;
+    if (ret != 0) {
+        WARN("Error answering manager: %s", strerror(errno));
+    }
+    if (answer != NULL) {
+        msg_put(answer);
+    }
+    close(answer_fd);
+    return ret;
+}
+
+/**
+ * Build the answer to a create or remove request.
+ * Returns NULL on failure.
+ */
+static msg_t *box_answer(uint8_t opcode, int32_t status, char const *error) {
+    msg_t *answer = msg_alloc(BOX_ANSWER_LEN, 0);
+    if (answer != NULL) {
+        answer->len = encode_box_answer(answer->data, opcode, status, error);
+    }
+    return answer;
+}
+
+int handle_box_wrapper(int (*handle_box_func)(char *, char *),
+                       tfs_opcode_t ans_opcode, char *box_name,
+                       int answer_fd) {
+    char error_msg[MAX_ERROR_MSG + 1] = {0};
+
+    int32_t ret = handle_box_func(box_name, error_msg);
+    send_answer(answer_fd, box_answer(ans_opcode, ret, error_msg));
+    return ret;
+}
+
+/**
+ * Build the listing of the boxes.
+ * Returns NULL on failure.
+ */
+static msg_t *list_answer(void) {
+    // the listing is kept serialized by the registry, and sent from there
+    box_list_t *list = get_box_list(&boxes);
+    if (list != NULL) {
+        return msg_list(list);
+    }
+
+    msg_t *answer = msg_alloc(list_answer_len(0, true), 0);
+    if (answer != NULL) {
+        answer->len =
+            encode_list_answer(answer->data, NULL, 0, "Error listing boxes.");
+    }
+    return answer;
+}
+
+int handle_list_boxes(int answer_fd) {
+    return send_answer(answer_fd, list_answer());
+}
+
+/**
+ * Add the sessions of a box, and the frames queued for its subscribers, to
+ * stats.
+ */
+static void add_box_sessions(box_t *box, stats_info_t *stats) {
+    stats->n_publishers += atomic_load(&box->n_publishers);
+    stats->n_subscribers += atomic_load(&box->n_subscribers);
+
+    pthread_mutex_lock(&box->lock);
+    for (session_t *sub = box->subscribers; sub != NULL; sub = sub->next) {
+        pthread_mutex_lock(&sub->lock);
+        stats->queued_frames += sub->tx_count;
+        if (sub->tx_count > stats->max_queued) {
+            stats->max_queued = sub->tx_count;
+        }
+        pthread_mutex_unlock(&sub->lock);
+    }
+    pthread_mutex_unlock(&box->lock);
+}
+
+/**
+ * Gather the metrics of a box, or of the whole broker if box_name is empty.
+ * Returns NULL if successful, the error to report otherwise.
+ */
+static char const *collect_stats(char const *box_name, stats_info_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    if (box_name[0] != '\0') {
+        box_t *box = find_box(&boxes, box_name);
+        if (box == NULL) {
+            return "Box not found.";
+        }
+        metrics_read(&box->metrics, stats);
+        add_box_sessions(box, stats);
+        box_put(box);
+    } else {
+        box_list_t *list = get_box_list(&boxes);
+        if (list == NULL) {
+            return "Error listing boxes.";
+        }
+        metrics_read(&broker_metrics, stats);
+        for (size_t i = 0; i < list->count; i++) {
+            box_t *box = find_box(&boxes, list->boxes[i].name);
+            if (box != NULL) {
+                add_box_sessions(box, stats);
+                box_put(box);
+            }
+        }
+        stats->n_boxes = list->count;
+        put_box_list(list);
+        tfs_lock_stats(&stats->tfs_lock_wait_ns, &stats->tfs_lock_waits);
+    }
+
+    stats->n_sessions = stats->n_publishers + stats->n_subscribers;
+    return NULL;
+}
+
+static int handle_stats(char *box_name, int answer_fd) {
+    stats_info_t stats;
+    char const *error = collect_stats(box_name, &stats);
+
+    msg_t *answer = msg_alloc(stats_answer_len(error != NULL), 0);
+    if (answer != NULL) {
+        answer->len = encode_stats_answer(answer->data, &stats, error);
+    }
+    return send_answer(answer_fd, answer);
+}
+
+/**
+ * Send an answer (NULL if it could not be built) to a manager's session,
+ * whose queue has room for it.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int answer_admin(session_t *session, msg_t *answer) {
+    if (answer == NULL) {
+        return -1;
+    }
+    int ret = session_send(session, answer);
+    msg_put(answer);
+    return ret;
+}
+
+/**
+ * Apply a bulk create or remove request, and write the outcome for every box
+ * back in one go.
+ * Returns 0 if successful, -1 if the answer could not be written.
+ */
+static int handle_bulk_boxes(session_t *session, uint8_t const *frame) {
+    uint32_t count = decode_boxes_count(frame);
+
+    char names[MAX_BULK_BOXES][MAX_BOX_NAME + 1];
+    char const *name_ptrs[MAX_BULK_BOXES];
+    int32_t status[MAX_BULK_BOXES];
+    char const *errors[MAX_BULK_BOXES];
+    for (uint32_t i = 0; i < count; i++) {
+        decode_boxes_name(frame, i, names[i]);
+        name_ptrs[i] = names[i];
+        capture_request(CAPTURE_REQUEST, frame[0], NULL, names[i], 0);
+    }
+
+    uint8_t code;
+    if (frame[0] == TFS_OPCODE_CRT_BOXES) {
+        new_boxes(name_ptrs, count, status, errors);
+        code = TFS_OPCODE_ANS_CRT_BOXES;
+    } else {
+        remove_boxes(name_ptrs, count, status, errors);
+        code = TFS_OPCODE_ANS_RMV_BOXES;
+    }
+
+    msg_t *answer = msg_alloc(boxes_answer_len(errors, count), 0);
+    if (answer != NULL) {
+        answer->len = encode_boxes_answer(answer->data, code, name_ptrs,
+                                          status, errors, count);
+    }
+    return answer_admin(session, answer);
+}
+
+static void handle_admin(session_t *session, uint32_t events) {
+    (void)events;
+    // the answers the manager made room for, if it was sent any
+    if (session_flush(session) < 0) {
+        WARN("Error answering manager: %s", strerror(errno));
+        close_session(session);
+        return;
+    }
+    ssize_t bytes_read = 1;
+
+    for (int i = 0; i <= MAX_READS_PER_EVENT; i++) {
+        // requests are handled back to back, as many as were pipelined and
+        // the queue of answers takes
+        ssize_t frame_len;
+        while (!session_queue_full(session) && session->rx_len > 0 &&
+               (frame_len = admin_frame_len(session->rx_buf,
+                                            session->rx_len)) > 0 &&
+               (size_t)frame_len <= session->rx_len) {
+            int ret;
+            if (session->rx_buf[0] == TFS_OPCODE_LST_BOX) {
+                capture_request(CAPTURE_REQUEST, TFS_OPCODE_LST_BOX, NULL,
+                                NULL, 0);
+                ret = answer_admin(session, list_answer());
+            } else {
+                ret = handle_bulk_boxes(session, session->rx_buf);
+            }
+            if (ret != 0) {
+                WARN("Error answering manager: %s", strerror(errno));
+                close_session(session);
+                return;
+            }
+            session_consume(session, (size_t)frame_len);
+        }
+        if (session->rx_len > 0 &&
+            admin_frame_len(session->rx_buf, session->rx_len) < 0) {
+            WARN("Invalid request from manager: %d", session->rx_buf[0]);
+            close_session(session);
+            return;
+        }
+
+        if (i == MAX_READS_PER_EVENT || session_queue_full(session)) {
+            break;
+        }
+        bytes_read = session_fill(session);
+        if (bytes_read <= 0) {
+            break;
+        }
+    }
+
+    // the manager is not read from again until its answers fit in the queue,
+    // and its session only closes once they were all sent
+    int read_errno = errno;
+    if (session->tx_count > 0 &&
+        event_loop_watch_out(session, EPOLLOUT) != 0) {
+        close_session(session);
+    } else if (bytes_read == 0 && session->tx_count == 0) {
+        INFO("Manager closed the session");
+        close_session(session);
+    } else if (bytes_read < 0 && read_errno != EAGAIN) {
+        WARN("Error reading from manager: %s", strerror(read_errno));
+        close_session(session);
+    } else if (bytes_read != 0 && !session_queue_full(session) &&
+               event_loop_rearm(session, EPOLLIN) != 0) {
+        close_session(session);
+    }
+}
+
+/**
+ * Open a persistent session for a manager, which pipelines its requests
+ * through request_path and reads the answers from answer_fd, the pipe it
+ * opened first. Managers that connected to the broker's socket use their
+ * connection (conn_fd, which answer_fd is then) for both.
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int admin(char const *request_path, int conn_fd, int answer_fd) {
+    int request_fd = conn_fd >= 0 ? conn_fd
+                                  : open(request_path, O_RDONLY | O_NONBLOCK);
+    if (request_fd < 0) {
+        close(answer_fd);
+        WARN("Error opening manager pipe '%s'", request_path);
+        return -1;
+    }
+
+    session_t *session = session_alloc(SESSION_ADMIN, request_fd);
+    if (session == NULL) {
+        close(request_fd);
+        if (answer_fd != conn_fd) {
+            close(answer_fd);
+        }
+        WARN("Too many sessions, rejecting manager");
+        return -1;
+    }
+
+    pthread_mutex_lock(&session->lock);
+    session->out_fd = conn_fd >= 0 ? dup(conn_fd) : answer_fd;
+    // answers the manager does not read yet are queued, not waited for
+    int fd_flags = session->out_fd < 0 ? -1 : fcntl(session->out_fd, F_GETFL);
+    if (fd_flags < 0 ||
+        fcntl(session->out_fd, F_SETFL, fd_flags | O_NONBLOCK) < 0) {
+        WARN("Error opening the answer pipe of a manager");
+        release_session(session);
+        pthread_mutex_unlock(&session->lock);
+        return -1;
+    }
+    if (event_loop_add(session, EPOLLIN) != 0) {
+        release_session(session);
+        pthread_mutex_unlock(&session->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    return 0;
+}
+
+/**
+ * The pipe the client of a request reads from, which the broker opens before
+ * serving the request, or NULL if there is none (publishers, and subscribers
+ * using a ring, only write to their pipe).
+ */
+static char const *client_pipe(request_t const *request) {
+    switch (request->opcode) {
+    case TFS_OPCODE_CRT_BOX:
+    case TFS_OPCODE_RMV_BOX:
+    case TFS_OPCODE_LST_BOX:
+    case TFS_OPCODE_STATS:
+        return request->client_path;
+    case TFS_OPCODE_REG_ADMIN:
+        return request->answer_path;
+    case TFS_OPCODE_REG_SUB:
+    case TFS_OPCODE_REG_SUB_EXT:
+    case TFS_OPCODE_REG_SUB_FILTER:
+        if (request->flags & REGISTER_FLAG_SHM_RING) {
+            return NULL;
+        }
+        return request->client_path;
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * Arm the timer for the first request set aside, or disarm it if there is
+ * none. Called with pending_lock held.
+ */
+static void arm_timer(void) {
+    uint64_t first = 0;
+    for (size_t i = 0; i < n_pending; i++) {
+        if (first == 0 || pending[i].retry_at < first) {
+            first = pending[i].retry_at;
+        }
+    }
+    struct itimerspec when = {
+        .it_value = {.tv_sec = (time_t)(first / 1000000000),
+                     .tv_nsec = (long)(first % 1000000000)}};
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &when, NULL) != 0) {
+        WARN("Failed to arm the timer: %s", strerror(errno));
+    }
+}
+
+/**
+ * Set a request aside until its client opens its pipe, to be tried again
+ * after delay nanoseconds, and dropped once deadline has passed.
+ * Returns 0 if successful, -1 if too many requests are waiting already.
+ */
+static int defer_request(request_t const *request, uint64_t delay,
+                         uint64_t deadline) {
+    pthread_mutex_lock(&pending_lock);
+    if (n_pending == MAX_PENDING_OPENS) {
+        pthread_mutex_unlock(&pending_lock);
+        return -1;
+    }
+    uint64_t now = metrics_now();
+    pending[n_pending++] = (pending_open_t){.request = *request,
+                                            .retry_at = now + delay,
+                                            .delay = delay,
+                                            .deadline = deadline};
+    arm_timer();
+    pthread_mutex_unlock(&pending_lock);
+    return 0;
+}
+
+/**
+ * Serve a request, once the pipe its client reads from (out_fd, -1 if there
+ * is none) is open. Clients that connected to the broker's socket hand over
+ * their connection (conn_fd, -1 otherwise), which out_fd is then.
+ */
+static void serve_request(request_t *request, int conn_fd, int out_fd) {
+    switch (request->opcode) {
+    case TFS_OPCODE_CRT_BOX:
+        handle_box_wrapper(new_box, TFS_OPCODE_ANS_CRT_BOX, request->box_name,
+                           out_fd);
+        break;
+    case TFS_OPCODE_RMV_BOX:
+        handle_box_wrapper(remove_box, TFS_OPCODE_ANS_RMV_BOX,
+                           request->box_name, out_fd);
+        break;
+    case TFS_OPCODE_LST_BOX:
+        handle_list_boxes(out_fd);
+        break;
+    case TFS_OPCODE_STATS:
+        handle_stats(request->box_name, out_fd);
+        break;
+    case TFS_OPCODE_REG_ADMIN:
+        admin(request->client_path, conn_fd, out_fd);
+        break;
+    case TFS_OPCODE_REG_SUB:
+    case TFS_OPCODE_REG_SUB_EXT:
+    case TFS_OPCODE_REG_SUB_FILTER:
+        subscriber(request->client_path, request->box_name, request->flags,
+                   request->filter, out_fd);
+        break;
+    case TFS_OPCODE_REG_PUB:
+    case TFS_OPCODE_REG_PUB_EXT:
+    case TFS_OPCODE_REG_PUB_IDEM:
+        publisher(request->client_path, request->box_name, request->flags,
+                  request->producer_id, conn_fd);
+        break;
+    default:
+        printf("Invalid opcode received: %d\n", request->opcode);
+        if (conn_fd >= 0) {
+            close(conn_fd);
+        }
+        break;
+    }
+}
+
+/**
+ * Serve a request from the register pipe, or from a client that connected to
+ * the broker's socket (conn_fd, -1 otherwise), which is handed over to the
+ * request's handler.
+ *
+ * Clients using pipes open the one they read from only after sending their
+ * request, and opening it for writing would block until they do: it is
+ * opened without blocking, and the request set aside while the client has
+ * not opened it yet, so that no worker waits for a client.
+ */
+static void handle_request(request_t *request, int conn_fd) {
+    PROBE2(mbroker, request, request->opcode, conn_fd);
+    // registrations are captured once they succeed, with their session
+    if (request->opcode == TFS_OPCODE_CRT_BOX ||
+        request->opcode == TFS_OPCODE_RMV_BOX ||
+        request->opcode == TFS_OPCODE_LST_BOX ||
+        request->opcode == TFS_OPCODE_STATS) {
+        capture_request(CAPTURE_REQUEST, request->opcode, NULL,
+                        request->box_name, 0);
+    }
+
+    char const *path = conn_fd < 0 ? client_pipe(request) : NULL;
+    int out_fd = conn_fd;
+    if (path != NULL) {
+        out_fd = open(path, O_WRONLY | O_NONBLOCK);
+        if (out_fd < 0 && errno == ENXIO) {
+            if (defer_request(request, OPEN_RETRY_MIN_MS * 1000000ull,
+                              metrics_now() +
+                                  OPEN_TIMEOUT_MS * 1000000ull) != 0) {
+                WARN("Too many clients opening their pipe, dropping '%s'",
+                     path);
+            }
+            return;
+        }
+        if (out_fd < 0) {
+            WARN("Error opening pipe: '%s' - %s", path, strerror(errno));
+            return;
+        }
+    }
+    serve_request(request, conn_fd, out_fd);
+}
+
+/**
+ * Try again the requests set aside that are due, serving those whose client
+ * opened its pipe meanwhile.
+ */
+static void handle_timer(session_t *session, uint32_t events) {
+    (void)events;
+    uint64_t expirations;
+    if (read(session->fd, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN) {
+        WARN("Error reading the timer: %s", strerror(errno));
+    }
+
+    // the due requests are taken out of the list, which is not locked while
+    // they are served
+    pending_open_t due[MAX_PENDING_OPENS];
+    size_t n_due = 0;
+    uint64_t now = metrics_now();
+    pthread_mutex_lock(&pending_lock);
+    for (size_t i = 0; i < n_pending;) {
+        if (pending[i].retry_at <= now) {
+            due[n_due++] = pending[i];
+            pending[i] = pending[--n_pending];
+        } else {
+            i++;
+        }
+    }
+    arm_timer();
+    pthread_mutex_unlock(&pending_lock);
+
+    for (size_t i = 0; i < n_due; i++) {
+        request_t *request = &due[i].request;
+        char const *path = client_pipe(request);
+        int out_fd = open(path, O_WRONLY | O_NONBLOCK);
+        if (out_fd >= 0) {
+            serve_request(request, -1, out_fd);
+            continue;
+        }
+
+        uint64_t delay = 2 * due[i].delay;
+        if (delay > OPEN_RETRY_MAX_MS * 1000000ull) {
+            delay = OPEN_RETRY_MAX_MS * 1000000ull;
+        }
+        if (errno != ENXIO) {
+            WARN("Error opening pipe: '%s' - %s", path, strerror(errno));
+        } else if (now >= due[i].deadline ||
+                   defer_request(request, delay, due[i].deadline) != 0) {
+            WARN("Client did not open its pipe: '%s'", path);
+        }
+    }
+
+    if (event_loop_rearm(session, EPOLLIN) != 0) {
+        PANIC("Failed to watch the timer");
+    }
+}
+
+static void handle_register(session_t *session, uint32_t events) {
+    (void)events;
+
+    if (session_fill(session) < 0 && errno != EAGAIN) {
+        WARN("Error reading from pipe %s: %s", in_pipe_path, strerror(errno));
+    }
+
+    // handle every complete frame, keeping a partial one for the next read
+    while (session->rx_len > 0) {
+        request_t request;
+        ssize_t frame_len =
+            decode_request(session->rx_buf, session->rx_len, &request);
+        if (frame_len < 0) {
+            printf("Invalid opcode received: %d\n", session->rx_buf[0]);
+            session_consume(session, session->rx_len);
+            break;
+        }
+        if (frame_len == 0) {
+            break;
+        }
+
+        handle_request(&request, -1);
+        session_consume(session, (size_t)frame_len);
+    }
+
+    if (event_loop_rearm(session, EPOLLIN) != 0) {
+        PANIC("Failed to watch pipe '%s'", in_pipe_path);
+    }
+}
+
+/**
+ * Take in the clients connecting to the broker's socket. Each connection is
+ * watched until its first packet, the register request, arrives.
+ */
+static void handle_listen(session_t *session, uint32_t events) {
+    (void)events;
+
+    for (int i = 0; i < MAX_ACCEPTS_PER_EVENT; i++) {
+        int conn_fd = accept(session->fd, NULL, NULL);
+        if (conn_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                WARN("Error accepting connection: %s", strerror(errno));
+            }
+            break;
+        }
+
+        session_t *conn = session_alloc(SESSION_CONNECTION, conn_fd);
+        if (conn == NULL) {
+            close(conn_fd);
+            WARN("Too many sessions, rejecting connection");
+            continue;
+        }
+        pthread_mutex_lock(&conn->lock);
+        if (event_loop_add(conn, EPOLLIN) != 0) {
+            release_session(conn);
+        }
+        pthread_mutex_unlock(&conn->lock);
+    }
+
+    if (event_loop_rearm(session, EPOLLIN) != 0) {
+        PANIC("Failed to watch socket '%s'", in_pipe_path);
+    }
+}
+
+/**
+ * Serve the register request of a connected client, handing the connection
+ * over to the session it asks for.
+ */
+static void handle_connection(session_t *session, uint32_t events) {
+    (void)events;
+
+    ssize_t bytes_read = session_fill(session);
+    if (bytes_read < 0 && errno == EAGAIN) {
+        if (event_loop_rearm(session, EPOLLIN) != 0) {
+            release_session(session);
+        }
+        return;
+    }
+
+    // the request is a single packet
+    request_t request;
+    if (bytes_read <= 0 ||
+        decode_request(session->rx_buf, session->rx_len, &request) <= 0) {
+        if (bytes_read != 0) {
+            WARN("Invalid register request on socket '%s'", in_pipe_path);
+        }
+        release_session(session);
+        return;
+    }
+
+    // the connection's slot is only given back afterwards, so that the new
+    // session cannot take it while its lock is held
+    event_loop_remove(session);
+    int conn_fd = session->fd;
+    session->fd = -1;
+    handle_request(&request, conn_fd);
+    release_session(session);
+}
+
+static void handle_event(session_t *session, uint32_t generation,
+                         uint32_t events) {
+    pthread_mutex_lock(&session->lock);
+    if (session->generation != generation) {
+        // the session was closed after this event was queued
+        pthread_mutex_unlock(&session->lock);
+        return;
+    }
+
+    switch (session->kind) {
+    case SESSION_REGISTER:
+        handle_register(session, events);
+        break;
+    case SESSION_PUBLISHER:
+        handle_publisher(session, events);
+        break;
+    case SESSION_SUBSCRIBER:
+        handle_subscriber(session, events);
+        break;
+    case SESSION_ADMIN:
+        handle_admin(session, events);
+        break;
+    case SESSION_LISTEN:
+        handle_listen(session, events);
+        break;
+    case SESSION_CONNECTION:
+        handle_connection(session, events);
+        break;
+    case SESSION_TIMER:
+        handle_timer(session, events);
+        break;
+    case SESSION_FREE:
+    default:
+        WARN("Event on a closed session");
+        break;
+    }
+    pthread_mutex_unlock(&session->lock);
+}
+
+/**
+ * Create the socket clients connect to, in place of the register pipe.
+ */
+static int listen_socket(char const *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        PANIC("Socket path too long: '%s'\n", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        PANIC("Failed to listen on '%s': %s\n", path, strerror(errno));
+    }
+    int fd_flags = fcntl(fd, F_GETFL);
+    if (fd_flags < 0 || fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK) != 0) {
+        PANIC("Failed to listen on '%s': %s\n", path, strerror(errno));
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    int tx_queue_len = SESSION_TX_QUEUE;
+    tfs_params params = tfs_default_params();
+    char const *trace_file = NULL;
+    char const *capture_path = NULL;
+
+    // Parse options
+    int opt;
+    while ((opt = getopt(argc, argv, "b:c:p:q:t:T:C:v")) != -1) {
+        switch (opt) {
+        case 'b':
+            // each box is a file of a single block, which the whole memory
+            // of TFS is then sized after
+            if (atol(optarg) <= 0) {
+                print_instructions();
+            }
+            params.block_size = (size_t)atol(optarg);
+            params.max_block_count = params.max_inode_count;
+            break;
+        case 'c':
+            // 0 to read the whole box from TFS for every new subscriber
+            if (atol(optarg) < 0) {
+                print_instructions();
+            }
+            tail_records = (size_t)atol(optarg);
+            break;
+        case 'p':
+            if (strcmp(optarg, "block") == 0) {
+                slow_policy = SLOW_BLOCK;
+            } else if (strcmp(optarg, "drop") == 0) {
+                slow_policy = SLOW_DROP_OLDEST;
+            } else if (strcmp(optarg, "disconnect") == 0) {
+                slow_policy = SLOW_DISCONNECT;
+            } else {
+                print_instructions();
+            }
+            break;
+        case 'q':
+            tx_queue_len = atoi(optarg);
+            if (tx_queue_len <= 0) {
+                print_instructions();
+            }
+            break;
+        case 't':
+            if (strcmp(optarg, "fifo") == 0) {
+                use_socket = false;
+            } else if (strcmp(optarg, "socket") == 0) {
+                use_socket = true;
+            } else {
+                print_instructions();
+            }
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        case 'C':
+            capture_path = optarg;
+            break;
+        case 'v':
+            set_log_level(LOG_VERBOSE);
+            break;
+        default:
+            print_instructions();
+        }
+    }
+
+    // Check the number of arguments
+    if (argc - optind != 2) {
+        print_instructions();
+    }
+
+    // Parse arguments
+    in_pipe_path = argv[optind];
+    int max_sessions = atoi(argv[optind + 1]);
+    if (max_sessions <= 0) {
+        print_instructions();
+    }
+
+    if (tfs_init(&params) != 0) {
+        PANIC("Failed to initialize TFS\n");
+    }
+    tail_capacity = tail_records * MAX_BOX_RECORD_LEN;
+    if (tail_capacity > params.block_size) {
+        tail_capacity = params.block_size;
+    }
+    metrics_init(&broker_metrics);
+    // the spans are written when the broker exits
+    if (trace_file != NULL && trace_start(trace_file, "mbroker") != 0) {
+        PANIC("Failed to start tracing to '%s'\n", trace_file);
+    }
+    // as are the last requests captured
+    if (capture_path != NULL && capture_start(capture_path) != 0) {
+        PANIC("Failed to start capturing to '%s'\n", capture_path);
+    }
+
+    // the workers only copy their logs, which are written in the background
+    if (log_start() != 0) {
+        WARN("Failed to start the logging thread, logging synchronously\n");
+    }
+
+    if (use_socket) {
+        fd_in = listen_socket(in_pipe_path);
+        fd_in_keepalive = -1;
+    } else {
+        // Create input pipe
+        if (mkfifo(in_pipe_path, 0666) < 0) {
+            PANIC("Failed to create pipe '%s': %s\n", in_pipe_path,
+                  strerror(errno));
+        }
+
+        // Open input pipe
+        fd_in = open(in_pipe_path, O_RDONLY | O_NONBLOCK);
+        if (fd_in < 0) {
+            PANIC("Failed to open pipe '%s': %s\n", in_pipe_path,
+                  strerror(errno));
+        }
+        fd_in_keepalive = open(in_pipe_path, O_WRONLY);
+        if (fd_in_keepalive < 0) {
+            PANIC("Failed to open pipe '%s': %s\n", in_pipe_path,
+                  strerror(errno));
+        }
+    }
+
+    // Exit cleanly on SIGINT and SIGTERM, which the event loop reads (every
+    // thread started from here on blocks them) so that the workers are
+    // stopped before the broker is torn down
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    int signal_fd = -1;
+    if (pthread_sigmask(SIG_BLOCK, &stop_signals, NULL) == 0) {
+        signal_fd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    }
+    if (signal_fd < 0) {
+        PANIC("Failed to set up signal handling: %s\n", strerror(errno));
+    }
+    // A subscriber leaving is noticed through the event loop
+    signal(SIGPIPE, SIG_IGN);
+
+    // Initialize data structures (extra sessions for the register pipe and
+    // the timer, and for each worker a connection being handed over to its
+    // session)
+    if (box_table_init(&boxes, BOX_TABLE_BUCKETS) != 0) {
+        PANIC("Failed to allocate box registry\n");
+    }
+    size_t n_sessions = (size_t)max_sessions + 2;
+    if (use_socket) {
+        n_sessions += EVENT_LOOP_WORKERS;
+    }
+    if (sessions_init(n_sessions, (size_t)tx_queue_len) != 0) {
+        PANIC("Failed to allocate session table\n");
+    }
+    if (event_loop_init() != 0) {
+        PANIC("Failed to initialize event loop\n");
+    }
+
+    session_t *reg_session =
+        session_alloc(use_socket ? SESSION_LISTEN : SESSION_REGISTER, fd_in);
+    if (reg_session == NULL || event_loop_add(reg_session, EPOLLIN) != 0) {
+        PANIC("Failed to watch pipe '%s'\n", in_pipe_path);
+    }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    session_t *timer_session =
+        timer_fd < 0 ? NULL : session_alloc(SESSION_TIMER, timer_fd);
+    if (timer_session == NULL || event_loop_add(timer_session, EPOLLIN) != 0) {
+        PANIC("Failed to set up the timer\n");
+    }
+
+    // Main loop
+    int status = EXIT_FAILURE;
+    if (event_loop_run(EVENT_LOOP_WORKERS, signal_fd, handle_event) == 0) {
+        struct signalfd_siginfo info;
+        if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            status = (int)info.ssi_signo;
+        }
+        // no worker is left to use the boxes
+        box_table_destroy(&boxes);
     }
 
-    safe_close(EXIT_SUCCESS);
+    safe_close(status);
     return 0;
 }
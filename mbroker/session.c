@@ -0,0 +1,627 @@
+#define _GNU_SOURCE // tee, splice, F_SETPIPE_SZ
+#include "session.h"
+#include "utils/probes.h"
+#include "utils/trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static session_t *session_table;
+static uint32_t *free_slots; // stack of free slots of the session table
+static size_t free_count;
+static size_t table_size;
+static size_t tx_capacity; // length of the send queue of subscribers
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+metrics_t broker_metrics;
+
+// sink for the frames staged for fan-out once every subscriber got them
+static int null_fd = -1;
+
+/**
+ * Frames staged for fan-out by the calling thread: one pipe per frame, as
+ * tee(2) always duplicates from the start of its source pipe.
+ */
+typedef struct {
+    int pipe[2];
+    size_t capacity; // 0 until the pipe is created
+    msg_t *msg;
+} stage_t;
+
+static _Thread_local stage_t stages[SESSION_STAGES];
+
+msg_t *msg_alloc(size_t len, size_t n_msgs) {
+    msg_t *msg = malloc(sizeof(msg_t) + len);
+    if (msg == NULL) {
+        return NULL;
+    }
+    atomic_init(&msg->refs, 1);
+    msg->n_msgs = n_msgs;
+    msg->len = len;
+    msg->stored_at = 0;
+    msg->trace_id = 0;
+    msg->list = NULL;
+    return msg;
+}
+
+msg_t *msg_list(box_list_t *list) {
+    msg_t *msg = msg_alloc(0, 0);
+    if (msg == NULL) {
+        put_box_list(list);
+        return NULL;
+    }
+    msg->list = list;
+    msg->len = LIST_RECORDS_OFFSET + list->count * sizeof(box_info_t);
+    return msg;
+}
+
+void msg_put(msg_t *msg) {
+    if (atomic_fetch_sub(&msg->refs, 1) == 1) {
+        if (msg->list != NULL) {
+            put_box_list(msg->list);
+        }
+        free(msg);
+    }
+}
+
+int msg_iov(msg_t const *msg, size_t offset, struct iovec *iov) {
+    if (msg->list == NULL) {
+        iov[0].iov_base = (uint8_t *)msg->data + offset;
+        iov[0].iov_len = msg->len - offset;
+        return 1;
+    }
+
+    int iovcnt = 0;
+    if (offset < LIST_RECORDS_OFFSET) {
+        iov[iovcnt].iov_base = msg->list->header + offset;
+        iov[iovcnt++].iov_len = LIST_RECORDS_OFFSET - offset;
+        offset = LIST_RECORDS_OFFSET;
+    }
+    iov[iovcnt].iov_base =
+        (uint8_t *)msg->list->boxes + (offset - LIST_RECORDS_OFFSET);
+    iov[iovcnt++].iov_len = msg->len - offset;
+    return iovcnt;
+}
+
+int sessions_init(size_t max_sessions, size_t tx_queue_len) {
+    session_table = calloc(max_sessions, sizeof(session_t));
+    free_slots = malloc(max_sessions * sizeof(uint32_t));
+    if (session_table == NULL || free_slots == NULL) {
+        free(session_table);
+        free(free_slots);
+        return -1;
+    }
+
+    // without a sink, frames are always copied to subscribers
+    null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    table_size = max_sessions;
+    tx_capacity = tx_queue_len;
+    for (size_t i = 0; i < max_sessions; i++) {
+        session_table[i].kind = SESSION_FREE;
+        session_table[i].fd = -1;
+        session_table[i].out_fd = -1;
+        session_table[i].slot = (uint32_t)i;
+        pthread_mutex_init(&session_table[i].lock, NULL);
+        free_slots[i] = (uint32_t)(max_sessions - i - 1);
+    }
+    free_count = max_sessions;
+
+    return 0;
+}
+
+static void session_detach_ring(session_t *session) {
+    if (session->ring.shared != NULL) {
+        ring_close(&session->ring);
+        ring_detach(&session->ring);
+    }
+}
+
+static void session_clear_queue(session_t *session) {
+    while (session->tx_count > 0) {
+        msg_put(session->tx_queue[session->tx_head]);
+        session->tx_head = (session->tx_head + 1) % tx_capacity;
+        session->tx_count--;
+    }
+    session->tx_offset = 0;
+}
+
+void sessions_destroy(void) {
+    for (size_t i = 0; i < table_size; i++) {
+        if (session_table[i].kind != SESSION_FREE) {
+            close(session_table[i].fd);
+            if (session_table[i].out_fd >= 0) {
+                close(session_table[i].out_fd);
+            }
+            free(session_table[i].rx_buf);
+            session_clear_queue(&session_table[i]);
+            free(session_table[i].tx_queue);
+            session_detach_ring(&session_table[i]);
+        }
+        pthread_mutex_destroy(&session_table[i].lock);
+    }
+
+    free(session_table);
+    free(free_slots);
+    if (null_fd >= 0) {
+        close(null_fd);
+        null_fd = -1;
+    }
+    session_table = NULL;
+    free_slots = NULL;
+    table_size = 0;
+    free_count = 0;
+}
+
+session_t *session_alloc(session_kind_t kind, int fd) {
+    uint8_t *rx_buf = NULL;
+    msg_t **tx_queue = NULL;
+    if (kind != SESSION_SUBSCRIBER) {
+        // only sessions that read from their client need to reassemble frames
+        rx_buf = malloc(SESSION_RX_BUF);
+        if (rx_buf == NULL) {
+            return NULL;
+        }
+    }
+    if (kind == SESSION_SUBSCRIBER || kind == SESSION_ADMIN) {
+        tx_queue = malloc(tx_capacity * sizeof(msg_t *));
+        if (tx_queue == NULL) {
+            free(rx_buf);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_lock(&table_lock);
+    if (free_count == 0) {
+        pthread_mutex_unlock(&table_lock);
+        free(rx_buf);
+        free(tx_queue);
+        return NULL;
+    }
+    session_t *session = &session_table[free_slots[--free_count]];
+    pthread_mutex_unlock(&table_lock);
+
+    pthread_mutex_lock(&session->lock);
+    session->kind = kind;
+    session->fd = fd;
+    struct stat st;
+    session->socket = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+    session->closing = false;
+    session->box = NULL;
+    memset(session->box_name, 0, sizeof(session->box_name));
+    session->flags = 0;
+    session->ring.shared = NULL;
+    session->linked = false;
+    session->prev = NULL;
+    session->next = NULL;
+    session->filter_id = FILTER_NONE;
+    session->chunk_pass = true;
+    session->catching_up = false;
+    session->replay_offset = 0;
+    session->filter[0] = '\0';
+    session->rx_buf = rx_buf;
+    session->rx_len = 0;
+    session->parked = false;
+    session->rx_time = 0;
+    session->trace.trace_id = 0;
+    session->last_seq = 0;
+    session->acked_seq = 0;
+    session->producer_id = 0;
+    session->tx_queue = tx_queue;
+    session->tx_head = 0;
+    session->tx_count = 0;
+    session->tx_offset = 0;
+    session->tx_sent = 0;
+    session->tx_dropped = 0;
+    session->tx_max_lag = 0;
+    pthread_mutex_unlock(&session->lock);
+
+    return session;
+}
+
+void session_free(session_t *session) {
+    close(session->fd);
+    session->fd = -1;
+    if (session->out_fd >= 0) {
+        close(session->out_fd);
+        session->out_fd = -1;
+    }
+    session->kind = SESSION_FREE;
+    session->box = NULL;
+    session->generation++;
+
+    free(session->rx_buf);
+    session->rx_buf = NULL;
+    session->rx_len = 0;
+
+    if (session->tx_queue != NULL) {
+        session_clear_queue(session);
+        free(session->tx_queue);
+        session->tx_queue = NULL;
+    }
+    session_detach_ring(session);
+
+    pthread_mutex_lock(&table_lock);
+    free_slots[free_count++] = session->slot;
+    pthread_mutex_unlock(&table_lock);
+}
+
+uint64_t session_token(session_t const *session) {
+    return ((uint64_t)session->generation << 32) | session->slot;
+}
+
+session_t *session_from_token(uint64_t token, uint32_t *generation) {
+    *generation = (uint32_t)(token >> 32);
+    return &session_table[token & UINT32_MAX];
+}
+
+int session_doorbell(session_t *session) {
+    char wakeups[64];
+    while (1) {
+        ssize_t bytes_read = safe_read(session->fd, wakeups, sizeof(wakeups));
+        if (bytes_read == 0) {
+            return -1;
+        }
+        if (bytes_read < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+    }
+}
+
+static ssize_t session_fill_ring(session_t *session) {
+    ring_t *ring = &session->ring;
+    uint8_t *buf = session->rx_buf + session->rx_len;
+    size_t room = SESSION_RX_BUF - session->rx_len;
+
+    ssize_t bytes_read = ring_read(ring, buf, room);
+    if (bytes_read == 0) {
+        // the wake-ups are consumed before sleeping, so that a client writing
+        // to the ring from now on is sure to wake the broker up again
+        bool closed = session_doorbell(session) != 0;
+        ring_prepare_sleep(&ring->shared->reader_waiting);
+        bytes_read = ring_read(ring, buf, room);
+        if (bytes_read == 0) {
+            if (closed) {
+                return 0;
+            }
+            errno = EAGAIN;
+            return -1;
+        }
+        ring_take(&ring->shared->reader_waiting);
+    }
+
+    if (bytes_read > 0) {
+        session->rx_len += (size_t)bytes_read;
+        ring_wake(&ring->shared->writer_waiting);
+    }
+    return bytes_read;
+}
+
+ssize_t session_fill(session_t *session) {
+    if (session->rx_len == SESSION_RX_BUF) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    if (session->ring.shared != NULL) {
+        return session_fill_ring(session);
+    }
+
+    ssize_t bytes_read;
+    if (session->socket) {
+        // whatever the descriptor's flags, shared with out_fd if it is a dup
+        do {
+            bytes_read = recv(session->fd, session->rx_buf + session->rx_len,
+                              SESSION_RX_BUF - session->rx_len, MSG_DONTWAIT);
+        } while (bytes_read < 0 && errno == EINTR);
+    } else {
+        bytes_read = safe_read(session->fd, session->rx_buf + session->rx_len,
+                               SESSION_RX_BUF - session->rx_len);
+    }
+    if (bytes_read > 0) {
+        session->rx_len += (size_t)bytes_read;
+    }
+    return bytes_read;
+}
+
+void session_consume(session_t *session, size_t len) {
+    session->rx_len -= len;
+    memmove(session->rx_buf, session->rx_buf + len, session->rx_len);
+}
+
+bool session_queue_full(session_t const *session) {
+    return session->tx_count == tx_capacity;
+}
+
+/**
+ * Write what fits of a frame, from offset on, to a subscriber, or of an
+ * answer to a manager (through out_fd), without blocking.
+ * Returns the number of bytes written, or -1 on error (errno is EAGAIN if
+ * there was no room).
+ */
+static ssize_t session_write(session_t *session, msg_t const *msg,
+                             size_t offset) {
+    ring_t *ring = &session->ring;
+    if (ring->shared == NULL) {
+        int fd = session->kind == SESSION_ADMIN ? session->out_fd : session->fd;
+        struct iovec iov[2];
+        int iovcnt = msg_iov(msg, offset, iov);
+        ssize_t ret;
+        do {
+            ret = writev(fd, iov, iovcnt);
+        } while (ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+    // only subscribers use rings, and they are never sent listings
+    uint8_t const *data = msg->data + offset;
+    size_t len = msg->len - offset;
+
+    if (atomic_load(&ring->shared->closed)) {
+        errno = EPIPE;
+        return -1;
+    }
+    size_t written = ring_write(ring, data, len);
+    if (written < len) {
+        // the client rings the doorbell once it made room
+        ring_prepare_sleep(&ring->shared->writer_waiting);
+        written += ring_write(ring, data + written, len - written);
+        if (written == len) {
+            ring_take(&ring->shared->writer_waiting);
+        }
+    }
+    if (written == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    ring_wake(&ring->shared->reader_waiting);
+    return (ssize_t)written;
+}
+
+uint32_t session_tx_events(session_t const *session) {
+    if (session->ring.shared != NULL) {
+        return EPOLLIN;
+    }
+    return session->tx_count > 0 ? EPOLLOUT : 0;
+}
+
+static void stage_close(stage_t *stage) {
+    close(stage->pipe[0]);
+    close(stage->pipe[1]);
+    stage->capacity = 0;
+    stage->msg = NULL;
+}
+
+static int stage_open(stage_t *stage) {
+    if (pipe2(stage->pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        return -1;
+    }
+    // room for the largest batch if allowed, the default size otherwise
+    fcntl(stage->pipe[1], F_SETPIPE_SZ, SESSION_STAGE_SIZE);
+    int capacity = fcntl(stage->pipe[1], F_GETPIPE_SZ);
+    if (capacity <= 0) {
+        close(stage->pipe[0]);
+        close(stage->pipe[1]);
+        return -1;
+    }
+    stage->capacity = (size_t)capacity;
+    return 0;
+}
+
+int session_stage(msg_t *msg) {
+    if (null_fd < 0) {
+        return -1;
+    }
+
+    stage_t *stage = NULL;
+    for (size_t i = 0; i < SESSION_STAGES && stage == NULL; i++) {
+        if (stages[i].msg == NULL) {
+            stage = &stages[i];
+        }
+    }
+    if (stage == NULL || (stage->capacity == 0 && stage_open(stage) != 0) ||
+        msg->len > stage->capacity) {
+        return -1;
+    }
+
+    // copied into the pipe's pages once; each tee(2) then only takes
+    // references to them
+    ssize_t ret;
+    do {
+        ret = write(stage->pipe[1], msg->data, msg->len);
+    } while (ret < 0 && errno == EINTR);
+    stage->msg = msg;
+    if (ret != msg->len) {
+        session_unstage();
+        return -1;
+    }
+    return 0;
+}
+
+void session_unstage(void) {
+    for (size_t i = 0; i < SESSION_STAGES; i++) {
+        stage_t *stage = &stages[i];
+        if (stage->msg == NULL) {
+            continue;
+        }
+
+        size_t left = stage->msg->len;
+        while (left > 0) {
+            ssize_t ret = splice(stage->pipe[0], NULL, null_fd, NULL, left,
+                                 SPLICE_F_NONBLOCK);
+            if (ret <= 0 && errno != EINTR) {
+                break;
+            }
+            left -= ret > 0 ? (size_t)ret : 0;
+        }
+        if (left > 0) {
+            // start over with an empty pipe
+            stage_close(stage);
+        }
+        stage->msg = NULL;
+    }
+}
+
+/**
+ * Count a frame written whole to a subscriber.
+ */
+static void session_count_sent(session_t *session, msg_t const *msg) {
+    if (session->box == NULL) {
+        return; // an answer to a manager
+    }
+    session->tx_sent += msg->n_msgs;
+    PROBE3(mbroker, deliver, session, msg->n_msgs, msg->len);
+
+    uint64_t now = metrics_now();
+    metrics_t *all[] = {&session->box->metrics, &broker_metrics};
+    for (size_t i = 0; i < 2; i++) {
+        metrics_add(all[i], METRIC_MSGS_OUT, msg->n_msgs);
+        metrics_add(all[i], METRIC_BYTES_OUT, msg->len);
+        // frames catching a subscriber up hold messages stored long before
+        if (msg->stored_at != 0) {
+            metrics_record(all[i], LATENCY_DELIVER, now - msg->stored_at);
+        }
+    }
+    trace_span("deliver", msg->trace_id, msg->stored_at, now);
+}
+
+void session_count_dropped(session_t *session, size_t n) {
+    session->tx_dropped += n;
+    metrics_add(&session->box->metrics, METRIC_MSGS_DROPPED, n);
+    metrics_add(&broker_metrics, METRIC_MSGS_DROPPED, n);
+}
+
+/**
+ * Write what fits of a whole frame to a subscriber. Frames staged by this
+ * thread are duplicated into the subscriber's pipe, instead of copied.
+ * Returns the number of bytes written, or -1 on error (errno is EAGAIN if
+ * there was no room).
+ */
+static ssize_t session_write_msg(session_t *session, msg_t *msg) {
+    for (size_t i = 0; i < SESSION_STAGES && session->ring.shared == NULL;
+         i++) {
+        if (stages[i].msg != msg) {
+            continue;
+        }
+
+        ssize_t ret;
+        do {
+            ret = tee(stages[i].pipe[0], session->fd, msg->len,
+                      SPLICE_F_NONBLOCK);
+        } while (ret < 0 && errno == EINTR);
+        if (ret > 0 || (ret < 0 && errno != EINVAL)) {
+            return ret;
+        }
+        break; // not a pipe: copy the frame
+    }
+    return session_write(session, msg, 0);
+}
+
+int session_send(session_t *session, msg_t *msg) {
+    size_t written = 0;
+
+    if (session->tx_count == 0) {
+        ssize_t ret = session_write_msg(session, msg);
+        if (ret < 0 && errno != EAGAIN) {
+            return -1;
+        }
+        if (ret == msg->len) {
+            session_count_sent(session, msg);
+            return 0;
+        }
+        written = ret > 0 ? (size_t)ret : 0;
+    }
+
+    if (session_queue_full(session)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    atomic_fetch_add(&msg->refs, 1);
+    session->tx_queue[(session->tx_head + session->tx_count) % tx_capacity] =
+        msg;
+    if (session->tx_count++ == 0) {
+        session->tx_offset = written;
+    }
+    if (session->tx_count > session->tx_max_lag) {
+        session->tx_max_lag = session->tx_count;
+    }
+    return 0;
+}
+
+int session_drop_oldest(session_t *session) {
+    // a frame that was partly written must be finished, or the client would
+    // read garbage
+    size_t skip = session->tx_offset > 0 ? 1 : 0;
+    if (session->tx_count <= skip) {
+        return -1;
+    }
+
+    size_t victim = (session->tx_head + skip) % tx_capacity;
+    session_count_dropped(session, session->tx_queue[victim]->n_msgs);
+    msg_put(session->tx_queue[victim]);
+    if (skip > 0) {
+        session->tx_queue[victim] = session->tx_queue[session->tx_head];
+    }
+    session->tx_head = (session->tx_head + 1) % tx_capacity;
+    session->tx_count--;
+    return 0;
+}
+
+int session_flush(session_t *session) {
+    while (session->tx_count > 0) {
+        msg_t *msg = session->tx_queue[session->tx_head];
+        ssize_t ret = session_write(session, msg, session->tx_offset);
+        if (ret < 0) {
+            return errno == EAGAIN ? 1 : -1;
+        }
+
+        session->tx_offset += (size_t)ret;
+        if (session->tx_offset == msg->len) {
+            session_count_sent(session, msg);
+            msg_put(msg);
+            session->tx_head = (session->tx_head + 1) % tx_capacity;
+            session->tx_count--;
+            session->tx_offset = 0;
+        }
+    }
+    return 0;
+}
+
+void session_link(box_t *box, session_t *session) {
+    session->prev = NULL;
+    session->next = box->subscribers;
+    if (box->subscribers != NULL) {
+        box->subscribers->prev = session;
+    }
+    box->subscribers = session;
+    session->linked = true;
+}
+
+void session_unlink(box_t *box, session_t *session) {
+    if (!session->linked) {
+        return;
+    }
+
+    if (session->prev != NULL) {
+        session->prev->next = session->next;
+    } else {
+        box->subscribers = session->next;
+    }
+    if (session->next != NULL) {
+        session->next->prev = session->prev;
+    }
+    session->prev = NULL;
+    session->next = NULL;
+    session->linked = false;
+    if (session->filter_id != FILTER_NONE) {
+        filter_trie_remove(&box->filters, session->filter_id);
+        session->filter_id = FILTER_NONE;
+    }
+}
@@ -0,0 +1,312 @@
+#ifndef __MBROKER_SESSION_H__
+#define __MBROKER_SESSION_H__
+
+#include "utils/ring.h"
+#include "utils/tools.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Size of the reassembly buffer of sessions that read from their client (room
+// for the largest batch frame)
+#define SESSION_RX_BUF (SEQ_BATCH_HEADER_LEN + MAX_BATCH_LEN)
+
+// Default number of frames a subscriber may have waiting to be sent
+#define SESSION_TX_QUEUE (64)
+
+// Number of frames (one per framing) a thread may stage for fan-out at once
+#define SESSION_STAGES (2)
+
+// Frames shorter than this are copied to every subscriber rather than staged,
+// as copying them costs less than the extra system calls
+#define SESSION_STAGE_MIN (1024)
+
+// Size requested for staging pipes (up to the system's pipe-max-size)
+#define SESSION_STAGE_SIZE (1 << 20)
+
+typedef enum {
+    SESSION_FREE = 0,
+    SESSION_REGISTER,
+    SESSION_PUBLISHER,
+    SESSION_SUBSCRIBER,
+    SESSION_ADMIN,
+    SESSION_LISTEN,     // the broker's socket, when used instead of the pipe
+    SESSION_CONNECTION, // connected to the socket, not registered yet
+    SESSION_TIMER,      // retries the requests waiting for a client's pipe
+} session_kind_t;
+
+/**
+ * Frames waiting to be sent, holding one or more messages. Frames are shared
+ * by the queues of every subscriber they are fanned out to, and freed with
+ * the last reference. A listing of the boxes is sent from the registry's
+ * copy instead of data, by reference.
+ */
+typedef struct msg {
+    _Atomic unsigned refs;
+    size_t n_msgs;
+    size_t len;
+    uint64_t stored_at; // metrics_now() when the messages were stored
+    uint64_t trace_id;  // of the traced batch it delivers (0 if none)
+    box_list_t *list;   // sent instead of data if not NULL
+    uint8_t data[];
+} msg_t;
+
+/**
+ * A client session (or the register pipe itself).
+ *
+ * Every session owns one non-blocking file descriptor that is registered with
+ * the event loop. Sessions that read from their client keep a reassembly
+ * buffer, so frames that arrive split across several reads are only handled
+ * once they are complete. Subscribers instead keep a bounded queue of frames
+ * waiting for their client to make room in its pipe, so that a slow client
+ * never holds up the thread delivering a message. New subscribers first catch
+ * up with the messages already stored through the same queue, and only join
+ * their box once they got them all.
+ *
+ * Admin sessions read a stream of requests from a manager, and write the
+ * answers to a second pipe (out_fd), which is non-blocking: answers the
+ * manager does not read yet are queued like the frames of subscribers, and
+ * its next requests wait while the queue is full.
+ *
+ * Publishers registered with REGISTER_FLAG_ACK get their acknowledgements
+ * through out_fd too, which is non-blocking for them: acknowledgements are
+ * cumulative, so one that does not fit is sent once the client makes room
+ * (out_fd is then watched as well), superseded by any stored meanwhile.
+ *
+ * Clients that connect to the broker's SOCK_SEQPACKET socket instead of
+ * using pipes keep their connection as the session's file descriptor, for
+ * reading and writing alike. Every packet holds whole frames, and reads
+ * from such sessions never block, whatever the descriptor's flags.
+ *
+ * Sessions registered with REGISTER_FLAG_SHM_RING exchange frames through a
+ * shared memory ring instead; their pipe (always written by the client) only
+ * carries wake-ups for the broker, and reports the client leaving.
+ *
+ * Slots of the session table are reused: the generation is bumped every time
+ * a slot is freed, so events and references that outlive a session can be
+ * recognized as stale.
+ */
+typedef struct session {
+    session_kind_t kind;
+    int fd;
+    int out_fd; // answers of admin sessions, acknowledgements of publishers
+                // (-1 for other sessions)
+    bool socket; // fd is a connection to the broker's socket
+    uint32_t slot;
+    uint32_t generation;
+
+    // held while the session is handled, written to, or closed
+    pthread_mutex_t lock;
+    // set once the session started closing; it gets no more messages
+    bool closing;
+
+    box_t *box; // holds a reference to the box
+    char box_name[MAX_BOX_NAME + 1];
+    uint32_t flags; // REGISTER_FLAG_* options of the session
+
+    // box membership (protected by the box's lock)
+    bool linked;
+    struct session *prev;
+    struct session *next;
+    // subscribers: id of their filter in the box's trie (FILTER_NONE if they
+    // take every message), and whether the streamed message being sent
+    // matched it (also protected by the box's lock)
+    uint32_t filter_id;
+    bool chunk_pass;
+    // subscribers that did not join their box yet: offset in the box of the
+    // next record to send them, and their filter (empty if none)
+    bool catching_up;
+    uint64_t replay_offset;
+    char filter[MAX_FILTER_LEN + 1];
+
+    ring_t ring; // ring.shared is NULL for sessions using their pipe
+
+    uint8_t *rx_buf;
+    size_t rx_len;
+
+    // publisher that stopped reading until its subscribers catch up
+    bool parked;
+    // publishers: metrics_now() when bytes were last read from the client
+    uint64_t rx_time;
+    // publishers: context of the next frame (trace_id is 0 if not traced)
+    trace_context_t trace;
+    // acknowledged publishers: sequence number of the last message stored,
+    // and of the last one the client was told about
+    uint64_t last_seq;
+    uint64_t acked_seq;
+    // idempotent publishers: the producer the sequence numbers belong to (0
+    // for other sessions)
+    uint64_t producer_id;
+
+    // send queue: a ring of frames, the first of which may be partly written
+    msg_t **tx_queue;
+    size_t tx_head;
+    size_t tx_count;
+    size_t tx_offset;
+
+    // lag counters (in messages)
+    uint64_t tx_sent;
+    uint64_t tx_dropped;
+    size_t tx_max_lag;
+} session_t;
+
+/**
+ * Metrics of the whole broker (those of each box are kept in the box).
+ * Sessions count the messages they deliver and drop in both.
+ */
+extern metrics_t broker_metrics;
+
+/**
+ * Allocate len bytes of frames holding n_msgs messages, with one reference.
+ * Returns NULL on failure.
+ */
+msg_t *msg_alloc(size_t len, size_t n_msgs);
+
+/**
+ * Make a frame of a listing, taking over the reference to it.
+ * Returns NULL on failure (the listing is then released).
+ */
+msg_t *msg_list(box_list_t *list);
+
+/**
+ * Release a reference to a frame.
+ */
+void msg_put(msg_t *msg);
+
+/**
+ * Point iov (two buffers) at the bytes of a frame from offset on.
+ * Returns the number of buffers used.
+ */
+int msg_iov(msg_t const *msg, size_t offset, struct iovec *iov);
+
+/**
+ * Allocate the session table, with room for max_sessions client sessions,
+ * each subscriber queueing at most tx_queue_len frames.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int sessions_init(size_t max_sessions, size_t tx_queue_len);
+
+/**
+ * Release the session table, closing every open session.
+ */
+void sessions_destroy(void);
+
+/**
+ * Take a free slot of the session table.
+ *
+ * Input:
+ *   - kind: type of the session
+ *   - fd: file descriptor owned by the session from now on
+ *
+ * Returns the session, or NULL if the table is full.
+ */
+session_t *session_alloc(session_kind_t kind, int fd);
+
+/**
+ * Close the session's file descriptor and return its slot to the table.
+ * Called with the session's lock held.
+ */
+void session_free(session_t *session);
+
+/**
+ * Token identifying the current incarnation of a session (slot and
+ * generation), as stored in the event loop.
+ */
+uint64_t session_token(session_t const *session);
+
+/**
+ * Obtain the session slot a token refers to, and the generation the token
+ * was taken at.
+ */
+session_t *session_from_token(uint64_t token, uint32_t *generation);
+
+/**
+ * Read whatever is available from the session's file descriptor into its
+ * reassembly buffer.
+ *
+ * Returns the number of bytes read, 0 on end of file, or -1 on error (errno is
+ * EAGAIN if there was nothing to read).
+ */
+ssize_t session_fill(session_t *session);
+
+/**
+ * Consume the wake-ups a ring session's client sent through its pipe.
+ * Returns 0 if successful, -1 if the client closed its pipe or on error.
+ */
+int session_doorbell(session_t *session);
+
+/**
+ * The epoll events a subscriber must be watched for, depending on whether it
+ * has frames waiting to be sent.
+ */
+uint32_t session_tx_events(session_t const *session);
+
+/**
+ * Drop the first len bytes (one or more complete frames) from the session's
+ * reassembly buffer.
+ */
+void session_consume(session_t *session, size_t len);
+
+/**
+ * Whether a subscriber's send queue is full.
+ */
+bool session_queue_full(session_t const *session);
+
+/**
+ * Stage a frame for fan-out by the calling thread: it is written once into an
+ * internal pipe, from which session_send duplicates it into subscriber pipes
+ * with tee(2), so that the kernel shares its pages instead of copying the
+ * bytes for every subscriber. Ring sessions still get a copy.
+ *
+ * Returns 0 if successful, -1 if the frame cannot be staged (it is then
+ * copied as usual).
+ */
+int session_stage(msg_t *msg);
+
+/**
+ * Discard the frames staged by the calling thread, once they were sent to
+ * every subscriber. Must be called before they are released.
+ */
+void session_unstage(void);
+
+/**
+ * Send a frame to a subscriber (or an answer to a manager): written right away
+ * if nothing is queued and the client's pipe has room, queued otherwise
+ * (taking a reference).
+ *
+ * Returns 0 if successful, -1 if the queue is full or the write failed.
+ */
+int session_send(session_t *session, msg_t *msg);
+
+/**
+ * Count n messages a subscriber lost, in its lag counters and in the metrics
+ * of its box and of the broker.
+ */
+void session_count_dropped(session_t *session, size_t n);
+
+/**
+ * Drop the oldest frame of a subscriber's queue that was not started yet.
+ * Returns 0 if successful, -1 if there was no such frame.
+ */
+int session_drop_oldest(session_t *session);
+
+/**
+ * Write as many queued frames as the client's pipe takes.
+ *
+ * Returns 0 once the queue is empty, 1 if frames are left waiting for room,
+ * or -1 on error.
+ */
+int session_flush(session_t *session);
+
+/**
+ * Add or remove a subscriber from the membership list of its box (removing
+ * its filter from the box's trie along with it).
+ * Called with the box's lock held.
+ */
+void session_link(box_t *box, session_t *session);
+void session_unlink(box_t *box, session_t *session);
+
+#endif // __MBROKER_SESSION_H__
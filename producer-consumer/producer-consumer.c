@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include "producer-consumer.h"
+#include "utils/probes.h"
 
 int pcq_create(pc_queue_t *queue, size_t capacity)
 {
@@ -17,12 +18,14 @@ int pcq_create(pc_queue_t *queue, size_t capacity)
     queue->pcq_head = 0;
     queue->pcq_tail = 0;
 
-    // initialize all mutexes
+    // initialize all mutexes and condition variables
     pthread_mutex_init(&queue->pcq_current_size_lock, NULL);
     pthread_mutex_init(&queue->pcq_head_lock, NULL);
     pthread_mutex_init(&queue->pcq_tail_lock, NULL);
     pthread_mutex_init(&queue->pcq_popper_condvar_lock, NULL);
     pthread_mutex_init(&queue->pcq_pusher_condvar_lock, NULL);
+    pthread_cond_init(&queue->pcq_popper_condvar, NULL);
+    pthread_cond_init(&queue->pcq_pusher_condvar, NULL);
 
     return 0;
 }
@@ -32,53 +35,73 @@ int pcq_destroy(pc_queue_t *queue)
     // free buffer
     free(queue->pcq_buffer);
     
-    // destroy all mutexes
+    // destroy all mutexes and condition variables
     pthread_mutex_destroy(&queue->pcq_current_size_lock);
     pthread_mutex_destroy(&queue->pcq_head_lock);
     pthread_mutex_destroy(&queue->pcq_tail_lock);
     pthread_mutex_destroy(&queue->pcq_popper_condvar_lock);
     pthread_mutex_destroy(&queue->pcq_pusher_condvar_lock);
+    pthread_cond_destroy(&queue->pcq_popper_condvar);
+    pthread_cond_destroy(&queue->pcq_pusher_condvar);
 
     return 0;
 }
 
+/*
+ * Producers take turns at the head, and consumers at the tail, so that the
+ * two sides only meet on the size. The size only counts a slot once it was
+ * written (and only frees it once it was read), so a consumer never reads a
+ * slot before its element is there, nor a producer overwrites one that was
+ * not read yet. The one producer (or consumer) allowed at a time is the only
+ * one that can wait on its condition variable.
+ */
+
 int pcq_enqueue(pc_queue_t *queue, void *elem)
 {
-    pthread_mutex_lock(&queue->pcq_current_size_lock);
+    pthread_mutex_lock(&queue->pcq_head_lock);
 
-    while (&queue->pcq_current_size == &queue->pcq_capacity)
+    pthread_mutex_lock(&queue->pcq_current_size_lock);
+    while (queue->pcq_current_size == queue->pcq_capacity)
     {
         pthread_cond_wait(&queue->pcq_pusher_condvar, &queue->pcq_current_size_lock);
     }
+    pthread_mutex_unlock(&queue->pcq_current_size_lock);
 
+    queue->pcq_buffer[queue->pcq_head] = elem;
+    queue->pcq_head = (queue->pcq_head + 1) % queue->pcq_capacity;
+
+    pthread_mutex_lock(&queue->pcq_current_size_lock);
     queue->pcq_current_size++;
     pthread_cond_signal(&queue->pcq_popper_condvar);
     pthread_mutex_unlock(&queue->pcq_current_size_lock);
 
-    pthread_mutex_lock(&queue->pcq_head_lock);
-    queue->pcq_buffer[queue->pcq_head] = elem;
-    queue->pcq_head = (queue->pcq_head + 1) % queue->pcq_capacity;
     pthread_mutex_unlock(&queue->pcq_head_lock);
 
+    PROBE2(pcq, enqueue, queue, elem);
     return 0;
 }
 
 void *pcq_dequeue(pc_queue_t *queue)
 {
-    pthread_mutex_lock(&queue->pcq_current_size_lock);
+    pthread_mutex_lock(&queue->pcq_tail_lock);
 
+    pthread_mutex_lock(&queue->pcq_current_size_lock);
     while (queue->pcq_current_size == 0)
     {
         pthread_cond_wait(&queue->pcq_popper_condvar, &queue->pcq_current_size_lock);
     }
+    pthread_mutex_unlock(&queue->pcq_current_size_lock);
 
+    void *elem = queue->pcq_buffer[queue->pcq_tail];
+    queue->pcq_tail = (queue->pcq_tail + 1) % queue->pcq_capacity;
+
+    pthread_mutex_lock(&queue->pcq_current_size_lock);
     queue->pcq_current_size--;
     pthread_cond_signal(&queue->pcq_pusher_condvar);
     pthread_mutex_unlock(&queue->pcq_current_size_lock);
 
-    pthread_mutex_lock(&queue->pcq_tail_lock);
-    queue->pcq_tail = (queue->pcq_tail + 1) % queue->pcq_capacity;
     pthread_mutex_unlock(&queue->pcq_tail_lock);
 
-    return 0;
+    PROBE2(pcq, dequeue, queue, elem);
+    return elem;
 }
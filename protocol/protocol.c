@@ -0,0 +1,476 @@
+#include "protocol.h"
+#include "utils/tools.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+
+static uint8_t const zeros[MAX_ERROR_MSG];
+
+static void put_bytes(uint8_t *frame, size_t *offset, void const *data,
+                      size_t len) {
+    memcpy(frame + *offset, data, len);
+    *offset += len;
+}
+
+/**
+ * Put a string as a field of len bytes, padded with zeros.
+ */
+static void put_string(uint8_t *frame, size_t *offset, char const *str,
+                       size_t len) {
+    size_t str_len = str != NULL ? strnlen(str, len) : 0;
+    memcpy(frame + *offset, str, str_len);
+    memset(frame + *offset + str_len, 0, len - str_len);
+    *offset += len;
+}
+
+static void get_bytes(uint8_t const *frame, size_t *offset, void *data,
+                      size_t len) {
+    memcpy(data, frame + *offset, len);
+    *offset += len;
+}
+
+/**
+ * Get a string field of len bytes into str, which has room for a
+ * terminator.
+ */
+static void get_string(uint8_t const *frame, size_t *offset, char *str,
+                       size_t len) {
+    memcpy(str, frame + *offset, len);
+    str[len] = '\0';
+    *offset += len;
+}
+
+size_t request_frame_len(uint8_t opcode) {
+    switch (opcode) {
+    case TFS_OPCODE_REG_PUB:
+    case TFS_OPCODE_REG_SUB:
+    case TFS_OPCODE_CRT_BOX:
+    case TFS_OPCODE_RMV_BOX:
+        return REGISTER_FRAME_LEN;
+    case TFS_OPCODE_REG_PUB_EXT:
+    case TFS_OPCODE_REG_SUB_EXT:
+        return REGISTER_EXT_FRAME_LEN;
+    case TFS_OPCODE_REG_PUB_IDEM:
+        return REGISTER_IDEM_FRAME_LEN;
+    case TFS_OPCODE_REG_SUB_FILTER:
+        return REGISTER_FILTER_FRAME_LEN;
+    case TFS_OPCODE_LST_BOX:
+        return LIST_FRAME_LEN;
+    case TFS_OPCODE_STATS:
+        return STATS_FRAME_LEN;
+    case TFS_OPCODE_REG_ADMIN:
+        return ADMIN_FRAME_LEN;
+    default:
+        return 0;
+    }
+}
+
+size_t encode_request(uint8_t *frame, request_t const *request) {
+    size_t frame_len = request_frame_len(request->opcode);
+    if (frame_len == 0) {
+        return 0;
+    }
+
+    size_t offset = 0;
+    put_bytes(frame, &offset, &request->opcode, sizeof(uint8_t));
+    put_string(frame, &offset, request->client_path, MAX_PIPE_NAME);
+    if (request->opcode == TFS_OPCODE_REG_ADMIN) {
+        put_string(frame, &offset, request->answer_path, MAX_PIPE_NAME);
+    } else if (request->opcode != TFS_OPCODE_LST_BOX) {
+        put_string(frame, &offset, request->box_name, MAX_BOX_NAME);
+    }
+    if (offset < frame_len) {
+        put_bytes(frame, &offset, &request->flags, sizeof(uint32_t));
+    }
+    if (request->opcode == TFS_OPCODE_REG_SUB_FILTER) {
+        put_string(frame, &offset, request->filter, MAX_FILTER_LEN);
+    } else if (offset < frame_len) {
+        put_bytes(frame, &offset, &request->producer_id, sizeof(uint64_t));
+    }
+    return offset;
+}
+
+ssize_t decode_request(uint8_t const *buf, size_t len, request_t *request) {
+    if (len == 0) {
+        return 0;
+    }
+    size_t frame_len = request_frame_len(buf[0]);
+    if (frame_len == 0) {
+        return -1;
+    }
+    if (len < frame_len) {
+        return 0;
+    }
+
+    memset(request, 0, sizeof(*request));
+    size_t offset = 0;
+    get_bytes(buf, &offset, &request->opcode, sizeof(uint8_t));
+    get_string(buf, &offset, request->client_path, MAX_PIPE_NAME);
+    if (request->opcode == TFS_OPCODE_REG_ADMIN) {
+        get_string(buf, &offset, request->answer_path, MAX_PIPE_NAME);
+    } else if (request->opcode != TFS_OPCODE_LST_BOX) {
+        get_string(buf, &offset, request->box_name, MAX_BOX_NAME);
+    }
+    if (offset < frame_len) {
+        get_bytes(buf, &offset, &request->flags, sizeof(uint32_t));
+    }
+    if (request->opcode == TFS_OPCODE_REG_SUB_FILTER) {
+        get_string(buf, &offset, request->filter, MAX_FILTER_LEN);
+    } else if (offset < frame_len) {
+        get_bytes(buf, &offset, &request->producer_id, sizeof(uint64_t));
+    }
+    return (ssize_t)frame_len;
+}
+
+size_t encode_box_answer(uint8_t *frame, uint8_t opcode, int32_t status,
+                         char const *error) {
+    size_t offset = 0;
+    put_bytes(frame, &offset, &opcode, sizeof(uint8_t));
+    put_bytes(frame, &offset, &status, sizeof(int32_t));
+    put_string(frame, &offset, error, MAX_ERROR_MSG);
+    return offset;
+}
+
+void decode_box_answer(uint8_t const *frame, box_answer_t *answer) {
+    size_t offset = 0;
+    get_bytes(frame, &offset, &answer->opcode, sizeof(uint8_t));
+    get_bytes(frame, &offset, &answer->status, sizeof(int32_t));
+    get_string(frame, &offset, answer->error, MAX_ERROR_MSG);
+}
+
+size_t list_answer_len(uint64_t count, bool error) {
+    return LIST_ANSWER_HEADER_LEN +
+           (error ? MAX_ERROR_MSG
+                  : sizeof(uint64_t) + count * sizeof(box_info_t));
+}
+
+size_t encode_list_answer(uint8_t *frame, box_info_t const *boxes,
+                          uint64_t count, char const *error) {
+    if (error == NULL) {
+        // the records are sent as they are kept
+        encode_list_header(frame, count);
+        size_t offset = LIST_RECORDS_OFFSET;
+        put_bytes(frame, &offset, boxes, count * sizeof(box_info_t));
+        return offset;
+    }
+
+    uint8_t const opcode = TFS_OPCODE_ANS_LST_BOX;
+    int32_t status = -1;
+    size_t offset = 0;
+    put_bytes(frame, &offset, &opcode, sizeof(uint8_t));
+    put_bytes(frame, &offset, &status, sizeof(int32_t));
+    put_string(frame, &offset, error, MAX_ERROR_MSG);
+    return offset;
+}
+
+void encode_list_header(uint8_t *frame, uint64_t count) {
+    uint8_t const opcode = TFS_OPCODE_ANS_LST_BOX;
+    int32_t status = 0;
+    size_t offset = 0;
+    put_bytes(frame, &offset, &opcode, sizeof(uint8_t));
+    put_bytes(frame, &offset, &status, sizeof(int32_t));
+    put_bytes(frame, &offset, &count, sizeof(uint64_t));
+}
+
+int32_t decode_list_answer(uint8_t const *header) {
+    int32_t status;
+    memcpy(&status, header + 1, sizeof(int32_t));
+    return status;
+}
+
+size_t stats_answer_len(bool error) {
+    return STATS_ANSWER_HEADER_LEN +
+           (error ? MAX_ERROR_MSG : sizeof(stats_info_t));
+}
+
+size_t encode_stats_answer(uint8_t *frame, stats_info_t const *stats,
+                           char const *error) {
+    uint8_t const opcode = TFS_OPCODE_ANS_STATS;
+    int32_t status = error != NULL ? -1 : 0;
+    size_t offset = 0;
+    put_bytes(frame, &offset, &opcode, sizeof(uint8_t));
+    put_bytes(frame, &offset, &status, sizeof(int32_t));
+    if (error != NULL) {
+        put_string(frame, &offset, error, MAX_ERROR_MSG);
+    } else {
+        put_bytes(frame, &offset, stats, sizeof(stats_info_t));
+    }
+    return offset;
+}
+
+int32_t decode_stats_answer(uint8_t const *header) {
+    int32_t status;
+    memcpy(&status, header + 1, sizeof(int32_t));
+    return status;
+}
+
+size_t encode_message_header(uint8_t *header, uint8_t opcode, size_t len,
+                             uint32_t flags) {
+    size_t offset = 0;
+    put_bytes(header, &offset, &opcode, sizeof(uint8_t));
+    if (flags & REGISTER_FLAG_LEN_PREFIX) {
+        uint32_t payload_len = (uint32_t)len;
+        put_bytes(header, &offset, &payload_len, sizeof(uint32_t));
+    }
+    return offset;
+}
+
+size_t encode_message(uint8_t *frame, uint8_t opcode, void const *payload,
+                      size_t len, uint32_t flags) {
+    size_t offset = encode_message_header(frame, opcode, len, flags);
+    put_bytes(frame, &offset, payload, len);
+    if (!(flags & REGISTER_FLAG_LEN_PREFIX)) {
+        memset(frame + offset, 0, MAX_PUB_MSG - len);
+        offset = MSG_FRAME_LEN;
+    }
+    return offset;
+}
+
+int send_message(int fd, uint8_t opcode, void const *payload, size_t len,
+                 uint32_t flags) {
+    uint8_t header[MSG_HEADER_LEN];
+    struct iovec iov[3] = {
+        {header, encode_message_header(header, opcode, len, flags)},
+        {(void *)payload, len},
+    };
+    int iovcnt = 2;
+    if (!(flags & REGISTER_FLAG_LEN_PREFIX)) {
+        iov[iovcnt++] = (struct iovec){(void *)zeros, MAX_PUB_MSG - len};
+    }
+    return safe_writev(fd, iov, iovcnt) < 0 ? -1 : 0;
+}
+
+ssize_t message_frame_len(uint8_t const *header, uint32_t flags) {
+    if (!(flags & REGISTER_FLAG_LEN_PREFIX)) {
+        return MSG_FRAME_LEN;
+    }
+    uint32_t payload_len;
+    memcpy(&payload_len, header + 1, sizeof(uint32_t));
+    if (payload_len > MAX_PUB_MSG) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (header[0] == TFS_OPCODE_PUB_CHUNK ||
+        header[0] == TFS_OPCODE_SUB_CHUNK) {
+        return (ssize_t)(CHUNK_HEADER_LEN + payload_len);
+    }
+    return (ssize_t)(MSG_HEADER_LEN + payload_len);
+}
+
+void encode_chunk_header(uint8_t *header, uint8_t opcode, uint32_t len,
+                         uint8_t chunk_flags) {
+    size_t offset = 0;
+    put_bytes(header, &offset, &opcode, sizeof(uint8_t));
+    put_bytes(header, &offset, &len, sizeof(uint32_t));
+    put_bytes(header, &offset, &chunk_flags, sizeof(uint8_t));
+}
+
+ssize_t decode_chunk(uint8_t const *buf, size_t len, uint8_t const **payload,
+                     uint32_t *payload_len, uint8_t *chunk_flags) {
+    if (len < CHUNK_HEADER_LEN) {
+        return 0;
+    }
+    ssize_t frame_len = message_frame_len(buf, REGISTER_FLAG_LEN_PREFIX);
+    if (frame_len < 0 || len < (size_t)frame_len) {
+        return frame_len < 0 ? -1 : 0;
+    }
+
+    *payload = buf + CHUNK_HEADER_LEN;
+    *payload_len = (uint32_t)((size_t)frame_len - CHUNK_HEADER_LEN);
+    *chunk_flags = buf[MSG_HEADER_LEN];
+    return frame_len;
+}
+
+size_t encode_trace(uint8_t *frame, trace_context_t const *trace) {
+    size_t offset = encode_message_header(frame, TFS_OPCODE_TRACE,
+                                          TRACE_FRAME_LEN - MSG_HEADER_LEN,
+                                          REGISTER_FLAG_LEN_PREFIX);
+    put_bytes(frame, &offset, &trace->trace_id, sizeof(uint64_t));
+    put_bytes(frame, &offset, &trace->sent_at, sizeof(uint64_t));
+    return offset;
+}
+
+ssize_t decode_trace(uint8_t const *buf, size_t len, trace_context_t *trace) {
+    if (len < MSG_HEADER_LEN) {
+        return 0;
+    }
+    if (message_frame_len(buf, REGISTER_FLAG_LEN_PREFIX) != TRACE_FRAME_LEN) {
+        return -1;
+    }
+    if (len < TRACE_FRAME_LEN) {
+        return 0;
+    }
+
+    size_t offset = MSG_HEADER_LEN;
+    get_bytes(buf, &offset, &trace->trace_id, sizeof(uint64_t));
+    get_bytes(buf, &offset, &trace->sent_at, sizeof(uint64_t));
+    return TRACE_FRAME_LEN;
+}
+
+ssize_t decode_message(uint8_t const *buf, size_t len, uint32_t flags,
+                       uint8_t const **payload, size_t *payload_len) {
+    size_t header_len =
+        flags & REGISTER_FLAG_LEN_PREFIX ? MSG_HEADER_LEN : sizeof(uint8_t);
+    if (len < header_len) {
+        return 0;
+    }
+    ssize_t frame_len = message_frame_len(buf, flags);
+    if (frame_len < 0 || len < (size_t)frame_len) {
+        return frame_len < 0 ? -1 : 0;
+    }
+
+    *payload = buf + header_len;
+    *payload_len = (size_t)frame_len - header_len;
+    return frame_len;
+}
+
+void encode_batch_header(uint8_t *header, uint32_t count, uint32_t body_len) {
+    uint8_t const opcode = TFS_OPCODE_PUB_BATCH;
+    size_t offset = 0;
+    put_bytes(header, &offset, &opcode, sizeof(uint8_t));
+    put_bytes(header, &offset, &count, sizeof(uint32_t));
+    put_bytes(header, &offset, &body_len, sizeof(uint32_t));
+}
+
+size_t encode_batch_record(uint8_t *record, void const *payload,
+                           uint32_t len) {
+    size_t offset = 0;
+    put_bytes(record, &offset, &len, sizeof(uint32_t));
+    put_bytes(record, &offset, payload, len);
+    return offset;
+}
+
+void encode_seq_batch_header(uint8_t *header, uint64_t first_seq,
+                             uint32_t count, uint32_t body_len) {
+    encode_batch_header(header, count, body_len);
+    header[0] = TFS_OPCODE_PUB_SEQ_BATCH;
+    size_t offset = BATCH_HEADER_LEN;
+    put_bytes(header, &offset, &first_seq, sizeof(uint64_t));
+}
+
+ssize_t decode_batch_header(uint8_t const *buf, size_t len,
+                            uint64_t *first_seq, uint32_t *count,
+                            uint32_t *body_len) {
+    size_t header_len = buf[0] == TFS_OPCODE_PUB_SEQ_BATCH
+                            ? SEQ_BATCH_HEADER_LEN
+                            : BATCH_HEADER_LEN;
+    if (len < header_len) {
+        return 0;
+    }
+    size_t offset = 1;
+    get_bytes(buf, &offset, count, sizeof(uint32_t));
+    get_bytes(buf, &offset, body_len, sizeof(uint32_t));
+    *first_seq = 0;
+    if (offset < header_len) {
+        get_bytes(buf, &offset, first_seq, sizeof(uint64_t));
+    }
+    if (*count > MAX_BATCH_MSGS || *body_len > MAX_BATCH_LEN) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return (ssize_t)header_len;
+}
+
+ssize_t decode_batch_record(uint8_t const *record, size_t len,
+                            uint8_t const **payload, uint32_t *payload_len) {
+    if (len < sizeof(uint32_t)) {
+        return -1;
+    }
+    memcpy(payload_len, record, sizeof(uint32_t));
+    if (*payload_len > MAX_PUB_MSG || len - sizeof(uint32_t) < *payload_len) {
+        return -1;
+    }
+    *payload = record + sizeof(uint32_t);
+    return (ssize_t)(sizeof(uint32_t) + *payload_len);
+}
+
+size_t encode_ack(uint8_t *frame, uint64_t seq, int32_t status) {
+    uint8_t const opcode = TFS_OPCODE_PUB_ACK;
+    size_t offset = 0;
+    put_bytes(frame, &offset, &opcode, sizeof(uint8_t));
+    put_bytes(frame, &offset, &seq, sizeof(uint64_t));
+    put_bytes(frame, &offset, &status, sizeof(int32_t));
+    return offset;
+}
+
+void decode_ack(uint8_t const *frame, uint64_t *seq, int32_t *status) {
+    size_t offset = 1;
+    get_bytes(frame, &offset, seq, sizeof(uint64_t));
+    get_bytes(frame, &offset, status, sizeof(int32_t));
+}
+
+void encode_boxes_header(uint8_t *frame, uint8_t opcode, uint32_t count) {
+    size_t offset = 0;
+    put_bytes(frame, &offset, &opcode, sizeof(uint8_t));
+    put_bytes(frame, &offset, &count, sizeof(uint32_t));
+}
+
+void encode_boxes_name(uint8_t *frame, uint32_t i, char const *box_name) {
+    size_t offset = BOXES_HEADER_LEN + i * MAX_BOX_NAME;
+    put_string(frame, &offset, box_name, MAX_BOX_NAME);
+}
+
+ssize_t admin_frame_len(uint8_t const *buf, size_t len) {
+    uint32_t count;
+    switch (buf[0]) {
+    case TFS_OPCODE_LST_BOX:
+        return 1;
+    case TFS_OPCODE_CRT_BOXES:
+    case TFS_OPCODE_RMV_BOXES:
+        if (len < BOXES_HEADER_LEN) {
+            return 0;
+        }
+        count = decode_boxes_count(buf);
+        if (count == 0 || count > MAX_BULK_BOXES) {
+            return -1;
+        }
+        return (ssize_t)(BOXES_HEADER_LEN + count * MAX_BOX_NAME);
+    default:
+        return -1;
+    }
+}
+
+uint32_t decode_boxes_count(uint8_t const *frame) {
+    uint32_t count;
+    memcpy(&count, frame + 1, sizeof(uint32_t));
+    return count;
+}
+
+void decode_boxes_name(uint8_t const *frame, uint32_t i, char *box_name) {
+    size_t offset = BOXES_HEADER_LEN + i * MAX_BOX_NAME;
+    get_string(frame, &offset, box_name, MAX_BOX_NAME);
+}
+
+size_t boxes_answer_len(char const *const *errors, uint32_t count) {
+    size_t len = BOXES_HEADER_LEN + count * BOXES_ENTRY_LEN;
+    for (uint32_t i = 0; i < count; i++) {
+        len += errors[i] != NULL ? strlen(errors[i]) : 0;
+    }
+    return len;
+}
+
+size_t encode_boxes_answer(uint8_t *frame, uint8_t opcode,
+                           char const *const *names, int32_t const *status,
+                           char const *const *errors, uint32_t count) {
+    encode_boxes_header(frame, opcode, count);
+    size_t offset = BOXES_HEADER_LEN;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t error_len =
+            errors[i] != NULL ? (uint32_t)strlen(errors[i]) : 0;
+        put_string(frame, &offset, names[i], MAX_BOX_NAME);
+        put_bytes(frame, &offset, &status[i], sizeof(int32_t));
+        put_bytes(frame, &offset, &error_len, sizeof(uint32_t));
+        if (error_len > 0) {
+            put_bytes(frame, &offset, errors[i], error_len);
+        }
+    }
+    return offset;
+}
+
+void decode_boxes_entry(uint8_t const *entry, char *box_name, int32_t *status,
+                        uint32_t *error_len) {
+    size_t offset = 0;
+    get_string(entry, &offset, box_name, MAX_BOX_NAME);
+    get_bytes(entry, &offset, status, sizeof(int32_t));
+    get_bytes(entry, &offset, error_len, sizeof(uint32_t));
+}
@@ -0,0 +1,515 @@
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Wire format shared by the broker and its clients. Every frame starts with
+ * an opcode; fields are laid out back to back in host byte order, and names
+ * are sent as fixed-size fields padded with zeros.
+ *
+ * Frames are built into buffers provided by the caller (or sent straight from
+ * the caller's memory with writev), so that encoding and decoding never
+ * allocate.
+ */
+
+#define MAX_BOX_NAME 32
+#define MAX_PIPE_NAME 256
+#define MAX_ERROR_MSG 1024
+#define MAX_PUB_MSG 1024
+#define MAX_FILTER_LEN 64
+
+// Frame sizes (opcode included)
+#define REGISTER_FRAME_LEN (1 + MAX_PIPE_NAME + MAX_BOX_NAME)
+#define REGISTER_EXT_FRAME_LEN (REGISTER_FRAME_LEN + sizeof(uint32_t))
+// Idempotent publisher registration: the extended register request followed
+// by the uint64 producer id
+#define REGISTER_IDEM_FRAME_LEN (REGISTER_EXT_FRAME_LEN + sizeof(uint64_t))
+// Filtered subscriber registration: the extended register request followed
+// by the filter
+#define REGISTER_FILTER_FRAME_LEN (REGISTER_EXT_FRAME_LEN + MAX_FILTER_LEN)
+#define LIST_FRAME_LEN (1 + MAX_PIPE_NAME)
+// Stats request: like a register request, an empty box name standing for the
+// whole broker
+#define STATS_FRAME_LEN (REGISTER_FRAME_LEN)
+// Admin registration: opcode, pipe the manager writes requests to, pipe the
+// broker writes answers to
+#define ADMIN_FRAME_LEN (1 + 2 * MAX_PIPE_NAME)
+// Largest request frame
+#define MAX_REQUEST_LEN (ADMIN_FRAME_LEN)
+// Answer to a create or remove request: opcode, int32 status and error
+// message
+#define BOX_ANSWER_LEN (1 + sizeof(int32_t) + MAX_ERROR_MSG)
+// Header of a listing: opcode and int32 status, followed by the uint64 box
+// count and the box_info_t records if the status is 0, or by an error message
+#define LIST_ANSWER_HEADER_LEN (1 + sizeof(int32_t))
+// Everything before the records of a listing: its header and the box count
+#define LIST_RECORDS_OFFSET (LIST_ANSWER_HEADER_LEN + sizeof(uint64_t))
+// Header of an answer to a stats request: opcode and int32 status, followed
+// by a stats_info_t record if the status is 0, or by an error message
+#define STATS_ANSWER_HEADER_LEN (1 + sizeof(int32_t))
+#define MSG_FRAME_LEN (1 + MAX_PUB_MSG)
+// Header of a length-prefixed message frame: opcode and payload length
+#define MSG_HEADER_LEN (1 + sizeof(uint32_t))
+// Header of a chunk frame (length-prefixed sessions only): the message
+// header, whose length is that of the chunk, followed by the chunk flags
+#define CHUNK_HEADER_LEN (MSG_HEADER_LEN + sizeof(uint8_t))
+// Largest chunk of a streamed message
+#define MAX_CHUNK_LEN (MAX_PUB_MSG)
+// Trace context frame: the message header, whose length is that of the
+// context, followed by the uint64 trace id and send time
+#define TRACE_FRAME_LEN (MSG_HEADER_LEN + 2 * sizeof(uint64_t))
+// Header of a batch frame: opcode, message count and body length; the body
+// holds each message as uint32 length | payload
+#define BATCH_HEADER_LEN (1 + 2 * sizeof(uint32_t))
+// Header of a numbered batch frame (acknowledged publishers): the batch
+// header followed by the uint64 sequence number of its first message
+#define SEQ_BATCH_HEADER_LEN (BATCH_HEADER_LEN + sizeof(uint64_t))
+// Acknowledgement: opcode, uint64 sequence number and int32 status. A status
+// of 0 means every message up to the sequence number is stored; otherwise the
+// following messages were not, and the session is over
+#define ACK_FRAME_LEN (1 + sizeof(uint64_t) + sizeof(int32_t))
+// Largest body of a batch frame
+#define MAX_BATCH_LEN (65536)
+// Most messages in a batch frame
+#define MAX_BATCH_MSGS (1024)
+// Header of a bulk create/remove frame (admin sessions only): opcode and box
+// count, followed by the box names, MAX_BOX_NAME bytes each. The answer is
+// the matching opcode and count, then an entry for each box
+#define BOXES_HEADER_LEN (1 + sizeof(uint32_t))
+// Entry of a bulk answer: box name, int32 status and uint32 error length,
+// followed by the error message
+#define BOXES_ENTRY_LEN (MAX_BOX_NAME + sizeof(int32_t) + sizeof(uint32_t))
+// Most boxes in a bulk create/remove frame
+#define MAX_BULK_BOXES (1024)
+#define MAX_BOXES_FRAME_LEN (BOXES_HEADER_LEN + MAX_BULK_BOXES * MAX_BOX_NAME)
+// Largest packet sent to a length-prefixed subscriber connected to the
+// broker's socket (a batch, each message as its own frame)
+#define MAX_SUB_PACKET_LEN (MAX_BATCH_LEN + MAX_BATCH_MSGS)
+
+/**
+ * Session options, sent as a 32-bit flags field after the box name by the
+ * extended register requests (TFS_OPCODE_REG_PUB_EXT, TFS_OPCODE_REG_SUB_EXT).
+ */
+// messages are sent as opcode | uint32 length | payload, instead of being
+// padded to MAX_PUB_MSG bytes; publishers may also send batch frames
+#define REGISTER_FLAG_LEN_PREFIX (1u << 0)
+// frames go through a shared memory ring (see ring.h) created by the client
+// and named after its pipe, which the client writes to wake the broker up;
+// requires REGISTER_FLAG_LEN_PREFIX
+#define REGISTER_FLAG_SHM_RING (1u << 1)
+// the publisher numbers its messages (from 1, in TFS_OPCODE_PUB_SEQ_BATCH
+// frames only), and the broker acknowledges them once stored, through the
+// pipe named after the client's with ACK_PIPE_SUFFIX appended (opened by the
+// client first), or the connection; requires REGISTER_FLAG_LEN_PREFIX
+#define REGISTER_FLAG_ACK (1u << 2)
+
+#define ACK_PIPE_SUFFIX ".ack"
+// the subscriber wants the trace context of traced messages (length-prefixed
+// sessions only)
+#define REGISTER_FLAG_TRACE (1u << 3)
+
+/**
+ * Messages of any size and content are streamed as a run of chunk frames
+ * (TFS_OPCODE_PUB_CHUNK from publishers, TFS_OPCODE_SUB_CHUNK to
+ * subscribers), the first of which has CHUNK_FLAG_FIRST set and the last
+ * CHUNK_FLAG_LAST (both, for a message of a single chunk). The broker appends
+ * each chunk to the box as it arrives, as a record of its own. A message
+ * whose last chunk never came is dropped by the subscriber when anything else
+ * follows it. Only length-prefixed sessions take part: subscribers using the
+ * fixed framing get no streamed messages, and acknowledged publishers cannot
+ * send them.
+ */
+#define CHUNK_FLAG_FIRST (1u << 0)
+#define CHUNK_FLAG_LAST (1u << 1)
+
+/**
+ * Publishers may trace some of their frames (see utils/trace.h): a
+ * TFS_OPCODE_TRACE frame, carrying a trace id and the time the publisher sent
+ * it (on the host's monotonic clock), comes right before each traced frame.
+ * The broker sends it on to the subscribers registered with
+ * REGISTER_FLAG_TRACE, right before the frame delivering the traced messages.
+ * It is neither stored nor replayed.
+ */
+
+/**
+ * Subscribers that only want some of the messages of a box register with
+ * TFS_OPCODE_REG_SUB_FILTER, which carries a filter (see utils/filter.h): a
+ * prefix of the messages wanted, where '?' stands for any one byte. The
+ * broker only sends them the messages that match it, catch-up included, and
+ * the streamed messages whose first chunk does.
+ */
+
+/**
+ * Idempotent publishers register with TFS_OPCODE_REG_PUB_IDEM, which names
+ * the producer their messages come from (any nonzero id). Sequence numbers
+ * then belong to the producer rather than to the session: a producer whose
+ * session broke registers again under the same id and resends what was not
+ * acknowledged, and the broker drops the messages it already stored. On
+ * registration, the broker acknowledges the last message it stored from the
+ * producer (0 if none), so that the producer can skip them. Requires
+ * REGISTER_FLAG_ACK.
+ */
+
+typedef enum {
+    TFS_OPCODE_REG_PUB = 1,
+    TFS_OPCODE_REG_SUB = 2,
+    TFS_OPCODE_ANS_CRT_BOX = 5,
+    TFS_OPCODE_ANS_RMV_BOX = 6,
+    TFS_OPCODE_CRT_BOX = 3,
+    TFS_OPCODE_RMV_BOX = 4,
+    TFS_OPCODE_LST_BOX = 7,
+    TFS_OPCODE_ANS_LST_BOX = 8,
+    TFS_OPCODE_PUB_MSG = 9,
+    TFS_OPCODE_SUB_MSG = 10,
+    TFS_OPCODE_REG_PUB_EXT = 11,
+    TFS_OPCODE_REG_SUB_EXT = 12,
+    TFS_OPCODE_PUB_BATCH = 13,
+    TFS_OPCODE_REG_ADMIN = 14,
+    TFS_OPCODE_CRT_BOXES = 15,
+    TFS_OPCODE_RMV_BOXES = 16,
+    TFS_OPCODE_ANS_CRT_BOXES = 17,
+    TFS_OPCODE_ANS_RMV_BOXES = 18,
+    TFS_OPCODE_PUB_SEQ_BATCH = 19,
+    TFS_OPCODE_PUB_ACK = 20,
+    TFS_OPCODE_REG_PUB_IDEM = 21,
+    TFS_OPCODE_PUB_CHUNK = 22,
+    TFS_OPCODE_SUB_CHUNK = 23,
+    TFS_OPCODE_STATS = 24,
+    TFS_OPCODE_ANS_STATS = 25,
+    TFS_OPCODE_TRACE = 26,
+    TFS_OPCODE_REG_SUB_FILTER = 27,
+} tfs_opcode_t;
+
+/**
+ * A box, as listed to the manager (sent as is).
+ */
+typedef struct {
+    char name[MAX_BOX_NAME + 1];
+    uint64_t size;
+    uint64_t n_subscribers;
+    uint64_t n_publishers;
+} box_info_t;
+
+/**
+ * Distribution of a latency, in nanoseconds, sampled once per frame (a batch
+ * counts once). Percentiles are the upper bound of the histogram bucket they
+ * fall in (within an eighth of the value).
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+} latency_info_t;
+
+/**
+ * Metrics of a box, or of the whole broker when a stats request names no box
+ * (sent as is). Counters start with the broker, or with the box.
+ */
+typedef struct {
+    uint64_t uptime_ns; // since the counters started
+    uint64_t msgs_in;   // stored in boxes
+    uint64_t bytes_in;
+    uint64_t msgs_out; // delivered to subscribers
+    uint64_t bytes_out;
+    uint64_t msgs_dropped; // lost by slow subscribers
+    uint64_t n_boxes;      // broker only
+    uint64_t n_sessions;   // publishers and subscribers
+    uint64_t n_publishers;
+    uint64_t n_subscribers;
+    uint64_t queued_frames; // waiting to be sent to subscribers
+    uint64_t max_queued;    // by a single subscriber
+    uint64_t tfs_lock_wait_ns; // broker only: time spent waiting for TFS
+    uint64_t tfs_lock_waits;
+    latency_info_t ingest;  // from being read to being stored
+    latency_info_t deliver; // from being stored to being sent
+} stats_info_t;
+
+/**
+ * Context of a traced frame.
+ */
+typedef struct {
+    uint64_t trace_id;
+    uint64_t sent_at; // by the publisher, in nanoseconds
+} trace_context_t;
+
+/**
+ * A request sent to the register pipe, or as the first packet of a
+ * connection to the broker's socket. Which fields are sent depends on the
+ * opcode: client_path always is, box_name with every opcode but
+ * TFS_OPCODE_LST_BOX and TFS_OPCODE_REG_ADMIN, answer_path with
+ * TFS_OPCODE_REG_ADMIN (client_path being the pipe requests are read from),
+ * flags with the extended register requests, producer_id with
+ * TFS_OPCODE_REG_PUB_IDEM, and filter with TFS_OPCODE_REG_SUB_FILTER.
+ */
+typedef struct {
+    uint8_t opcode;
+    char client_path[MAX_PIPE_NAME + 1];
+    char answer_path[MAX_PIPE_NAME + 1];
+    char box_name[MAX_BOX_NAME + 1];
+    uint32_t flags;
+    uint64_t producer_id;
+    char filter[MAX_FILTER_LEN + 1];
+} request_t;
+
+/**
+ * An answer to a create or remove request.
+ */
+typedef struct {
+    uint8_t opcode;
+    int32_t status;
+    char error[MAX_ERROR_MSG + 1];
+} box_answer_t;
+
+/**
+ * Length of the request frame starting with the given opcode, or 0 if the
+ * opcode is not a request.
+ */
+size_t request_frame_len(uint8_t opcode);
+
+/**
+ * Build a request frame into frame (MAX_REQUEST_LEN bytes).
+ * Returns the length of the frame, or 0 if the opcode is not a request.
+ */
+size_t encode_request(uint8_t *frame, request_t const *request);
+
+/**
+ * Decode the request frame at the start of buf, holding len bytes.
+ * Returns the length of the frame, 0 if it is not complete yet, or -1 if the
+ * opcode is not a request.
+ */
+ssize_t decode_request(uint8_t const *buf, size_t len, request_t *request);
+
+/**
+ * Build the answer to a create or remove request into frame (BOX_ANSWER_LEN
+ * bytes). error may be NULL.
+ * Returns the length of the frame.
+ */
+size_t encode_box_answer(uint8_t *frame, uint8_t opcode, int32_t status,
+                         char const *error);
+
+/**
+ * Decode the BOX_ANSWER_LEN bytes of an answer to a create or remove request.
+ */
+void decode_box_answer(uint8_t const *frame, box_answer_t *answer);
+
+/**
+ * Length of a listing of count boxes, or of its error if error is true.
+ */
+size_t list_answer_len(uint64_t count, bool error);
+
+/**
+ * Build a listing into frame (list_answer_len bytes): the records of count
+ * boxes, or the error if it is not NULL.
+ * Returns the length of the frame.
+ */
+size_t encode_list_answer(uint8_t *frame, box_info_t const *boxes,
+                          uint64_t count, char const *error);
+
+/**
+ * Build the LIST_RECORDS_OFFSET bytes of a listing of count boxes that come
+ * before their records.
+ */
+void encode_list_header(uint8_t *frame, uint64_t count);
+
+/**
+ * Decode the LIST_ANSWER_HEADER_LEN bytes starting a listing.
+ * Returns the status.
+ */
+int32_t decode_list_answer(uint8_t const *header);
+
+/**
+ * Length of the answer to a stats request, or of its error if error is true.
+ */
+size_t stats_answer_len(bool error);
+
+/**
+ * Build the answer to a stats request into frame (stats_answer_len bytes):
+ * the metrics, or the error if it is not NULL.
+ * Returns the length of the frame.
+ */
+size_t encode_stats_answer(uint8_t *frame, stats_info_t const *stats,
+                           char const *error);
+
+/**
+ * Decode the STATS_ANSWER_HEADER_LEN bytes starting an answer to a stats
+ * request.
+ * Returns the status.
+ */
+int32_t decode_stats_answer(uint8_t const *header);
+
+/**
+ * Build the header of a message frame carrying len bytes, in the framing
+ * selected by the session flags, into header (MSG_HEADER_LEN bytes).
+ * Returns the length of the header; the payload follows it, padded to
+ * MAX_PUB_MSG bytes in the fixed framing.
+ */
+size_t encode_message_header(uint8_t *header, uint8_t opcode, size_t len,
+                             uint32_t flags);
+
+/**
+ * Build a whole message frame into frame (MSG_HEADER_LEN + MAX_PUB_MSG
+ * bytes).
+ * Returns the length of the frame.
+ */
+size_t encode_message(uint8_t *frame, uint8_t opcode, void const *payload,
+                      size_t len, uint32_t flags);
+
+/**
+ * Send a message frame straight from the payload, in a single writev.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int send_message(int fd, uint8_t opcode, void const *payload, size_t len,
+                 uint32_t flags);
+
+/**
+ * Length of the message (or chunk) frame starting with the given header
+ * (MSG_HEADER_LEN bytes in the length-prefixed framing, the opcode otherwise),
+ * or -1 if its payload is too long.
+ */
+ssize_t message_frame_len(uint8_t const *header, uint32_t flags);
+
+/**
+ * Decode the message frame at the start of buf, holding len bytes, in the
+ * framing selected by the session flags. The payload is left in place.
+ * Returns the length of the frame, 0 if it is not complete yet, or -1 if it
+ * is not valid.
+ */
+ssize_t decode_message(uint8_t const *buf, size_t len, uint32_t flags,
+                       uint8_t const **payload, size_t *payload_len);
+
+/**
+ * Build the header of a chunk frame carrying len bytes into header
+ * (CHUNK_HEADER_LEN bytes).
+ */
+void encode_chunk_header(uint8_t *header, uint8_t opcode, uint32_t len,
+                         uint8_t chunk_flags);
+
+/**
+ * Decode the chunk frame at the start of buf, holding len bytes. The payload
+ * is left in place.
+ * Returns the length of the frame, 0 if it is not complete yet, or -1 if the
+ * chunk is too long.
+ */
+ssize_t decode_chunk(uint8_t const *buf, size_t len, uint8_t const **payload,
+                     uint32_t *payload_len, uint8_t *chunk_flags);
+
+/**
+ * Build a trace context frame into frame (TRACE_FRAME_LEN bytes).
+ * Returns the length of the frame.
+ */
+size_t encode_trace(uint8_t *frame, trace_context_t const *trace);
+
+/**
+ * Decode the trace context frame at the start of buf, holding len bytes.
+ * Returns the length of the frame, 0 if it is not complete yet, or -1 if it
+ * is not valid.
+ */
+ssize_t decode_trace(uint8_t const *buf, size_t len, trace_context_t *trace);
+
+/**
+ * Build the header of a batch frame into header (BATCH_HEADER_LEN bytes).
+ */
+void encode_batch_header(uint8_t *header, uint32_t count, uint32_t body_len);
+
+/**
+ * Build the header of a numbered batch frame into header
+ * (SEQ_BATCH_HEADER_LEN bytes).
+ */
+void encode_seq_batch_header(uint8_t *header, uint64_t first_seq,
+                             uint32_t count, uint32_t body_len);
+
+/**
+ * Append a message to the body of a batch frame, at record.
+ * Returns the length of the record.
+ */
+size_t encode_batch_record(uint8_t *record, void const *payload,
+                           uint32_t len);
+
+/**
+ * Decode the header of the batch frame (numbered or not) at the start of buf,
+ * holding len bytes. first_seq is 0 for batches that are not numbered.
+ * Returns the length of the header, 0 if it is not complete yet, or -1 if
+ * the batch is too large.
+ */
+ssize_t decode_batch_header(uint8_t const *buf, size_t len,
+                            uint64_t *first_seq, uint32_t *count,
+                            uint32_t *body_len);
+
+/**
+ * Decode the record at the start of what is left of a batch body (len
+ * bytes).
+ * Returns the length of the record, or -1 if it is truncated or too long.
+ */
+ssize_t decode_batch_record(uint8_t const *record, size_t len,
+                            uint8_t const **payload, uint32_t *payload_len);
+
+/**
+ * Build an acknowledgement into frame (ACK_FRAME_LEN bytes).
+ * Returns the length of the frame.
+ */
+size_t encode_ack(uint8_t *frame, uint64_t seq, int32_t status);
+
+/**
+ * Decode the ACK_FRAME_LEN bytes of an acknowledgement.
+ */
+void decode_ack(uint8_t const *frame, uint64_t *seq, int32_t *status);
+
+/**
+ * Start a bulk create or remove frame in frame (MAX_BOXES_FRAME_LEN bytes).
+ */
+void encode_boxes_header(uint8_t *frame, uint8_t opcode, uint32_t count);
+
+/**
+ * Set the name of the i-th box of a bulk frame.
+ */
+void encode_boxes_name(uint8_t *frame, uint32_t i, char const *box_name);
+
+/**
+ * Length of the admin session request (a bulk frame, or a single
+ * TFS_OPCODE_LST_BOX byte) at the start of buf, holding len bytes, 0 if it
+ * is not complete yet, or -1 if it is not valid.
+ */
+ssize_t admin_frame_len(uint8_t const *buf, size_t len);
+
+/**
+ * Box count of a bulk frame (or answer).
+ */
+uint32_t decode_boxes_count(uint8_t const *frame);
+
+/**
+ * Copy the name of the i-th box of a bulk frame into box_name
+ * (MAX_BOX_NAME + 1 bytes).
+ */
+void decode_boxes_name(uint8_t const *frame, uint32_t i, char *box_name);
+
+/**
+ * Length of the answer to a bulk frame of count boxes, with the given error
+ * messages (errors[i] is NULL for the boxes without one).
+ */
+size_t boxes_answer_len(char const *const *errors, uint32_t count);
+
+/**
+ * Build the answer to a bulk frame into frame (boxes_answer_len bytes): the
+ * outcome for each of the count boxes, with its error message if errors[i]
+ * is not NULL.
+ * Returns the length of the frame.
+ */
+size_t encode_boxes_answer(uint8_t *frame, uint8_t opcode,
+                           char const *const *names, int32_t const *status,
+                           char const *const *errors, uint32_t count);
+
+/**
+ * Decode the BOXES_ENTRY_LEN bytes of an entry of a bulk answer; the error
+ * message (error_len bytes) follows them.
+ */
+void decode_boxes_entry(uint8_t const *entry, char *box_name, int32_t *status,
+                        uint32_t *error_len);
+
+#endif // __PROTOCOL_H__
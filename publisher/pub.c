@@ -1,105 +1,797 @@
 #include "logging.h"
+#include "utils/ring.h"
+#include "utils/tools.h"
+#include "utils/trace.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 
-#include "register_t.h"
-#include "response_t.h"
+static int session_fd;
 
-#define PIPE_NAME "session_pipe"
-#define MESSAGE_SIZE 256
+// Shared memory ring the frames go through, with -s (shared is NULL otherwise)
+static ring_t ring;
+
+// How long to sleep on a full ring before checking the broker is still there
+#define RING_POLL_MS (100)
+
+// Window of unacknowledged messages of idempotent publishers without -a
+#define DEFAULT_WINDOW (64)
+
+// Messages waiting to be sent in a single batch frame, after room for either
+// kind of batch header
+static uint8_t batch[SEQ_BATCH_HEADER_LEN + MAX_BATCH_LEN];
+static uint32_t batch_count = 0;
+static uint32_t batch_len = 0;
+
+// With -a: where acknowledgements come from (-1 otherwise), the sequence
+// number of the next message, the last one acknowledged, and how many
+// messages may be waiting for their acknowledgement
+static int ack_fd = -1;
+static uint64_t next_seq = 1;
+static uint64_t acked_seq = 0;
+static uint64_t window = 0;
+static uint8_t acks[64 * ACK_FRAME_LEN];
+static size_t acks_len = 0;
+
+// With -i: the producer the messages come from (0 otherwise)
+static uint64_t producer_id = 0;
+
+// With -T: one frame out of every trace_every is traced (none without -T)
+#define DEFAULT_TRACE_EVERY (100)
+static long trace_every = 0;
+static uint64_t frames_sent = 0;
+
+// Input not split into messages yet
+static char input[2 * MAX_PUB_MSG];
+static size_t input_len = 0;
+static bool input_eof = false;
+
+static void print_usage_and_exit()
+{
+    fprintf(stderr, "Usage: pub [-s] [-c | -a window] [-i producer_id] "
+                    "[-b batch_size] [-l linger_ms] "
+                    "[-T trace_file [-R trace_every]] "
+                    "<register_pipe_name> <pipe_name> <box_name>\n");
+    exit(EXIT_FAILURE);
+}
+
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Read the next message (line) from stdin, waiting until the deadline (in
+ * milliseconds, or forever if negative). Lines that do not fit in a message
+ * are split.
+ *
+ * Returns 1 if a message was read, 0 if the deadline passed, or -1 on end of
+ * file or error.
+ */
+static int read_message(char *message, uint32_t *len, long deadline)
+{
+    while (1)
+    {
+        char *newline = memchr(input, '\n', input_len);
+        size_t line_len;
+        size_t consumed;
+        if (newline != NULL && newline - input < MAX_PUB_MSG)
+        {
+            line_len = (size_t)(newline - input);
+            consumed = line_len + 1;
+        }
+        else if (input_len >= MAX_PUB_MSG - 1)
+        {
+            line_len = consumed = MAX_PUB_MSG - 1;
+        }
+        else if (input_eof && input_len > 0)
+        {
+            line_len = consumed = input_len;
+        }
+        else if (input_eof)
+        {
+            return -1;
+        }
+        else
+        {
+            int timeout = -1;
+            if (deadline >= 0)
+            {
+                long remaining = deadline - now_ms();
+                timeout = remaining > 0 ? (int)remaining : 0;
+            }
+
+            struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+            int ready = poll(&pfd, 1, timeout);
+            if (ready < 0 && errno != EINTR)
+            {
+                return -1;
+            }
+            if (ready == 0)
+            {
+                return 0;
+            }
+            if (ready < 0)
+            {
+                continue;
+            }
+
+            ssize_t bytes_read = safe_read(STDIN_FILENO, input + input_len,
+                                           sizeof(input) - input_len);
+            if (bytes_read < 0)
+            {
+                return -1;
+            }
+            if (bytes_read == 0)
+            {
+                input_eof = true;
+            }
+            input_len += (size_t)bytes_read;
+            continue;
+        }
+
+        memcpy(message, input, line_len);
+        *len = (uint32_t)line_len;
+        input_len -= consumed;
+        memmove(input, input + consumed, input_len);
+        return 1;
+    }
+}
+
+/**
+ * Whether the broker closed its end of the session pipe.
+ */
+static bool broker_gone()
+{
+    struct pollfd pfd = {.fd = session_fd, .events = POLLOUT};
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLERR);
+}
+
+/**
+ * Copy bytes to the ring, sleeping while it is full. The broker is only woken
+ * up (with a byte written to the pipe) when it found the ring empty.
+ */
+static int ring_send(void const *data, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        if (atomic_load(&ring.shared->closed))
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        size_t written =
+            ring_write(&ring, (uint8_t const *)data + sent, len - sent);
+        if (written > 0)
+        {
+            sent += written;
+            if (ring_take(&ring.shared->reader_waiting) &&
+                safe_write(session_fd, "", 1) != 1)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        ring_prepare_sleep(&ring.shared->writer_waiting);
+        if (ring_used(&ring) < ring.capacity)
+        {
+            ring_take(&ring.shared->writer_waiting);
+            continue;
+        }
+        ring_sleep(&ring.shared->writer_waiting, RING_POLL_MS);
+        if (broker_gone())
+        {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Pick whether the next frame is traced and, if so, send its trace context
+ * ahead of it (trace->trace_id is 0 otherwise).
+ */
+static int trace_next_frame(trace_context_t *trace)
+{
+    trace->trace_id = 0;
+    if (trace_every == 0 || frames_sent++ % (uint64_t)trace_every != 0)
+    {
+        return 0;
+    }
+
+    trace->trace_id = trace_new_id();
+    trace->sent_at = metrics_now();
+    uint8_t frame[TRACE_FRAME_LEN];
+    encode_trace(frame, trace);
+    if (ring.shared != NULL)
+    {
+        return ring_send(frame, sizeof(frame));
+    }
+    ssize_t written = safe_write(session_fd, frame, sizeof(frame));
+    return written == sizeof(frame) ? 0 : -1;
+}
+
+static void trace_frame_sent(trace_context_t const *trace)
+{
+    if (trace->trace_id != 0)
+    {
+        trace_span("publish", trace->trace_id, trace->sent_at, metrics_now());
+    }
+}
+
+/**
+ * Send a frame through the ring or the session pipe.
+ */
+static int send_frame(void const *frame, size_t len)
+{
+    trace_context_t trace;
+    if (trace_next_frame(&trace) != 0)
+    {
+        return -1;
+    }
+
+    int ret;
+    if (ring.shared != NULL)
+    {
+        ret = ring_send(frame, len);
+    }
+    else
+    {
+        ret = safe_write(session_fd, frame, len) == len ? 0 : -1;
+    }
+    trace_frame_sent(&trace);
+    return ret;
+}
+
+/**
+ * Send the messages waiting in the batch, all in one write. Acknowledged
+ * messages go in a numbered batch.
+ */
+static int flush_batch()
+{
+    if (batch_count == 0)
+    {
+        return 0;
+    }
+
+    uint8_t *frame = batch;
+    size_t header_len = SEQ_BATCH_HEADER_LEN;
+    if (ack_fd >= 0)
+    {
+        encode_seq_batch_header(frame, next_seq - batch_count, batch_count,
+                                batch_len);
+    }
+    else
+    {
+        header_len = BATCH_HEADER_LEN;
+        frame += SEQ_BATCH_HEADER_LEN - BATCH_HEADER_LEN;
+        encode_batch_header(frame, batch_count, batch_len);
+    }
+
+    size_t frame_len = header_len + batch_len;
+    batch_count = 0;
+    batch_len = 0;
+    return send_frame(frame, frame_len);
+}
+
+static void batch_add(char const *message, uint32_t len)
+{
+    batch_len += (uint32_t)encode_batch_record(
+        batch + SEQ_BATCH_HEADER_LEN + batch_len, message, len);
+    batch_count++;
+    next_seq++;
+}
+
+/**
+ * Send a single message frame.
+ */
+static int publish_message(char const *message, uint32_t len)
+{
+    if (ack_fd >= 0)
+    {
+        // only batch frames carry sequence numbers
+        batch_add(message, len);
+        return flush_batch();
+    }
+    if (ring.shared == NULL)
+    {
+        // the header goes out along with the message, in a single writev
+        trace_context_t trace;
+        if (trace_next_frame(&trace) != 0)
+        {
+            return -1;
+        }
+        int ret = send_message(session_fd, TFS_OPCODE_PUB_MSG, message, len,
+                               REGISTER_FLAG_LEN_PREFIX);
+        trace_frame_sent(&trace);
+        return ret;
+    }
+
+    uint8_t frame[MSG_HEADER_LEN + MAX_PUB_MSG];
+    size_t frame_len = encode_message(frame, TFS_OPCODE_PUB_MSG, message, len,
+                                      REGISTER_FLAG_LEN_PREFIX);
+    return send_frame(frame, frame_len);
+}
+
+/**
+ * Send the whole input as a single streamed message, a chunk frame for every
+ * MAX_CHUNK_LEN bytes read, so that it is never held in memory at once.
+ */
+static int stream_input()
+{
+    uint8_t frame[CHUNK_HEADER_LEN + MAX_CHUNK_LEN];
+    uint8_t chunk_flags = CHUNK_FLAG_FIRST;
+    while (true)
+    {
+        ssize_t bytes_read =
+            read_all(STDIN_FILENO, frame + CHUNK_HEADER_LEN, MAX_CHUNK_LEN);
+        if (bytes_read < 0)
+        {
+            return -1;
+        }
+
+        // a short read means the input is over
+        if (bytes_read < MAX_CHUNK_LEN)
+        {
+            chunk_flags |= CHUNK_FLAG_LAST;
+        }
+        encode_chunk_header(frame, TFS_OPCODE_PUB_CHUNK, (uint32_t)bytes_read,
+                            chunk_flags);
+        if (send_frame(frame, CHUNK_HEADER_LEN + (size_t)bytes_read) != 0)
+        {
+            return -1;
+        }
+        if (chunk_flags & CHUNK_FLAG_LAST)
+        {
+            return 0;
+        }
+        chunk_flags = 0;
+    }
+}
+
+/**
+ * Take in the acknowledgements that arrived, waiting for some for up to
+ * timeout milliseconds (forever if negative).
+ * Returns the number of acknowledgements taken in, or -1 if the broker went
+ * away or could not store a message.
+ */
+static int read_acks(int timeout)
+{
+    struct pollfd pfd = {.fd = ack_fd, .events = POLLIN};
+    int ready = poll(&pfd, 1, timeout);
+    if (ready <= 0)
+    {
+        return ready == 0 || errno == EINTR ? 0 : -1;
+    }
+
+    ssize_t bytes_read = read(ack_fd, acks + acks_len, sizeof(acks) - acks_len);
+    if (bytes_read < 0)
+    {
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    if (bytes_read == 0)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    acks_len += (size_t)bytes_read;
+
+    size_t offset = 0;
+    int count = 0;
+    for (; acks_len - offset >= ACK_FRAME_LEN; offset += ACK_FRAME_LEN, count++)
+    {
+        int32_t status;
+        decode_ack(acks + offset, &acked_seq, &status);
+        if (status != 0)
+        {
+            fprintf(stderr, "Messages from #%lu on were not stored\n",
+                    acked_seq + 1);
+            errno = EIO;
+            return -1;
+        }
+    }
+    acks_len -= offset;
+    memmove(acks, acks + offset, acks_len);
+    return count;
+}
+
+/**
+ * Wait until one more message fits in the window of unacknowledged ones,
+ * sending the batch first if the window is taken up by its messages.
+ */
+static int wait_window()
+{
+    // (the broker may have acknowledged messages an idempotent producer did
+    // not send yet, which were stored by an earlier session)
+    while (next_seq - 1 > acked_seq && next_seq - 1 - acked_seq >= window)
+    {
+        if (flush_batch() != 0 || read_acks(-1) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write the trace out when interrupted (it is otherwise written on exit).
+ */
+static void stop_tracing(int sig)
+{
+    trace_stop();
+    _exit(128 + sig);
+}
 
 int main(int argc, char *argv[])
 {
+    long batch_size = 1;
+    char const *trace_file = NULL;
+    long linger_ms = 0;
+    bool use_ring = false;
+    bool stream = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "sca:b:i:l:T:R:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            use_ring = true;
+            break;
+        case 'c':
+            stream = true;
+            break;
+        case 'a':
+            if (atol(optarg) <= 0)
+            {
+                print_usage_and_exit();
+            }
+            window = (uint64_t)atol(optarg);
+            break;
+        case 'i':
+            producer_id = strtoull(optarg, NULL, 0);
+            if (producer_id == 0)
+            {
+                print_usage_and_exit();
+            }
+            break;
+        case 'b':
+            batch_size = atol(optarg);
+            if (batch_size <= 0 || batch_size > MAX_BATCH_MSGS)
+            {
+                print_usage_and_exit();
+            }
+            break;
+        case 'l':
+            linger_ms = atol(optarg);
+            if (linger_ms < 0)
+            {
+                print_usage_and_exit();
+            }
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        case 'R':
+            trace_every = atol(optarg);
+            if (trace_every <= 0)
+            {
+                print_usage_and_exit();
+            }
+            break;
+        default:
+            print_usage_and_exit();
+        }
+    }
+
     // Check command line arguments
-    if (argc < 4) 
+    if (argc - optind < 3) 
     {
-        printf("Usage: pub <register_pipe_name> <pipe_name <box_name>\n");
-        exit(EXIT_FAILURE);
+        print_usage_and_exit();
     }
 
-    char *register_pipe_name = argv[1];
-    char *pipe_name = argv[2];
-    char *box_name = argv[3];
+    char *register_pipe_name = argv[optind];
+    char *pipe_name = argv[optind + 1];
+    char *box_name = argv[optind + 2];
 
+    // Idempotent publishing relies on acknowledgements, which streamed
+    // messages do not get
+    if (producer_id != 0 && window == 0)
+    {
+        window = DEFAULT_WINDOW;
+    }
+    if (stream && window > 0)
+    {
+        print_usage_and_exit();
+    }
+    if (trace_file == NULL)
+    {
+        trace_every = 0;
+    }
+    else
+    {
+        if (trace_every == 0)
+        {
+            trace_every = DEFAULT_TRACE_EVERY;
+        }
+        if (trace_start(trace_file, "pub") != 0)
+        {
+            perror("Error starting to trace");
+            return 1;
+        }
+        signal(SIGINT, stop_tracing);
+        signal(SIGTERM, stop_tracing);
+    }
+
+    // A broker listening on a socket takes the session over the connection
+    bool use_socket = broker_uses_socket(register_pipe_name);
+    if (use_socket && use_ring)
+    {
+        fprintf(stderr, "Rings are only set up for clients using pipes\n");
+        return 1;
+    }
 
     // Create session pipe
-    if (mkfifo(PIPE_NAME, 0666) < 0) 
+    if (!use_socket && unlink(pipe_name) != 0 && errno != ENOENT)
+    {
+        perror("Error unlinking session pipe");
+        return 1;
+    }
+    if (!use_socket && mkfifo(pipe_name, 0666) < 0) 
     {
         perror("Error creating session pipe");
         return 1;
     }
 
+    // Create the pipe acknowledgements come back through, with -a (it is
+    // opened before registering, so that the broker can open it right away)
+    uint32_t flags = REGISTER_FLAG_LEN_PREFIX;
+    char ack_path[MAX_PIPE_NAME + sizeof(ACK_PIPE_SUFFIX)] = {0};
+    if (window > 0 && !use_socket)
+    {
+        snprintf(ack_path, sizeof(ack_path), "%s%s", pipe_name,
+                 ACK_PIPE_SUFFIX);
+        unlink(ack_path);
+        if (mkfifo(ack_path, 0666) < 0 ||
+            (ack_fd = open(ack_path, O_RDONLY | O_NONBLOCK)) < 0)
+        {
+            perror("Error creating acknowledgement pipe");
+            unlink(ack_path);
+            unlink(pipe_name);
+            return 1;
+        }
+    }
+    if (window > 0)
+    {
+        flags |= REGISTER_FLAG_ACK;
+    }
+
+    // Create the shared memory ring, with -s
+    if (use_ring)
+    {
+        if (ring_create(&ring, pipe_name, RING_CAPACITY) != 0)
+        {
+            perror("Error creating shared memory ring");
+            unlink(ack_path);
+            unlink(pipe_name);
+            return 1;
+        }
+        flags |= REGISTER_FLAG_SHM_RING;
+    }
+
     // Connect to server
-    int server_fd = open(register_pipe_name, O_WRONLY);
+    int server_fd = use_socket ? connect_broker(register_pipe_name)
+                               : open(register_pipe_name, O_WRONLY);
     if (server_fd < 0) 
     {
         perror("Error connecting to server");
+        if (!use_socket)
+        {
+            unlink(ack_path);
+            unlink(pipe_name);
+        }
+        ring_unlink(pipe_name);
         return 1;
     }
 
-    // Send register message to server
-    register_t register_msg;
+    // Send register message to server, asking for length-prefixed frames
+    request_t request = {
+        .opcode = producer_id != 0 ? TFS_OPCODE_REG_PUB_IDEM
+                                   : TFS_OPCODE_REG_PUB_EXT,
+        .flags = flags,
+        .producer_id = producer_id,
+    };
+    strncpy(request.client_path, pipe_name, MAX_PIPE_NAME);
+    strncpy(request.box_name, box_name, MAX_BOX_NAME);
 
-    register_msg.code = 1;
-    memset(register_msg.client_named_pipe_path, 0, 256);
-    strcpy(register_msg.client_named_pipe_path, pipe_name);
-    memset(register_msg.box_name, 0, 32);
-    strcpy(register_msg.box_name, box_name);
-
-
-    if (write(server_fd, &register_msg, sizeof(register_t)) < 0) 
+    uint8_t register_msg[MAX_REQUEST_LEN];
+    size_t register_len = encode_request(register_msg, &request);
+    if (safe_write(server_fd, register_msg, register_len) != register_len) 
     {
         perror("Error sending register message to server");
+        if (!use_socket)
+        {
+            unlink(ack_path);
+            unlink(pipe_name);
+        }
+        ring_unlink(pipe_name);
         return 1;
     }
+    if (use_socket)
+    {
+        session_fd = server_fd;
+        if (window > 0)
+        {
+            ack_fd = server_fd;
+        }
+    }
+    else
+    {
+        close(server_fd);
 
-    // Open session pipe
-    int session_fd = open(pipe_name, O_WRONLY);
+        // Open session pipe (blocks until the server accepts the session, by
+        // which time it mapped the ring)
+        session_fd = open(pipe_name, O_WRONLY);
+    }
+    if (use_ring)
+    {
+        ring_unlink(pipe_name);
+    }
+    if (session_fd >= 0 && !use_socket)
+    {
+        unlink(ack_path);
+    }
     if (session_fd < 0) 
     {
         perror("Error opening session pipe");
+        if (!use_socket)
+        {
+            unlink(ack_path);
+            unlink(pipe_name);
+        }
         return 1;
     }
 
-    // Wait for response from server
-    response_t response;
-    if (read(session_fd, &response, sizeof(response_t)) < 0)
+    // With -i, the broker tells first how far the producer's messages are
+    // already stored
+    int acked = 0;
+    while (producer_id != 0 && acked == 0)
+    {
+        acked = read_acks(-1);
+    }
+    if (acked < 0)
     {
-        perror("Error reading response from server");
+        perror("Error registering producer");
+        close(session_fd);
+        if (!use_socket)
+        {
+            unlink(pipe_name);
+        }
         return 1;
     }
 
-    if (response.code == 0)
+    // With -c, the whole input is a single message, of any size and content
+    if (stream)
     {
-        // Successful registration
-        printf("Successfully registered with server.\n");
+        int status = 0;
+        if (stream_input() != 0)
+        {
+            perror("Error streaming message to session pipe");
+            status = 1;
+        }
+        close(session_fd);
+        if (!use_socket)
+        {
+            unlink(pipe_name);
+        }
+        return status;
+    }
 
-        // Begin publishing messages
-        char message[MESSAGE_SIZE];
-        while (1)
+    // Begin publishing messages, one per line, until EOF
+    // (with -b, up to batch_size messages go in each write: the batch is sent
+    // once full, or linger_ms after its first message if no more input comes;
+    // with -a, at most window messages are sent ahead of their
+    // acknowledgement)
+    char message[MAX_PUB_MSG];
+    uint32_t len;
+    long deadline = -1;
+    int ret;
+    while ((ret = read_message(message, &len, deadline)) >= 0)
+    {
+        if (ret > 0 && batch_count == 0 && next_seq <= acked_seq)
+        {
+            // stored by an earlier session of the same producer
+            next_seq++;
+            continue;
+        }
+        if (ret > 0 && ack_fd >= 0 && wait_window() != 0)
+        {
+            perror("Error waiting for acknowledgements");
+            break;
+        }
+        if (batch_size == 1)
         {
-            printf("Enter message to publish: ");
-            scanf("%s", message);
-            if (write(session_fd, message, sizeof(message)) < 0)
+            if (ret > 0 && publish_message(message, len) != 0)
             {
                 perror("Error writing message to session pipe");
                 break;
             }
+            continue;
+        }
+
+        if (ret > 0)
+        {
+            if (batch_len + sizeof(uint32_t) + len > MAX_BATCH_LEN &&
+                flush_batch() != 0)
+            {
+                perror("Error writing message to session pipe");
+                break;
+            }
+            if (batch_count == 0)
+            {
+                deadline = now_ms() + linger_ms;
+            }
+            batch_add(message, len);
+        }
+
+        if (ret == 0 || batch_count == batch_size)
+        {
+            if (flush_batch() != 0)
+            {
+                perror("Error writing message to session pipe");
+                break;
+            }
+            deadline = -1;
         }
     }
-    else
+    if (ret < 0 && flush_batch() != 0)
     {
-        // Registration failed
-        printf("Registration failed. Error code: %d\n", response.code);
+        perror("Error writing message to session pipe");
+        ret = 0;
+    }
+
+    // With -a, every message must be acknowledged before leaving
+    int status = 0;
+    if (ack_fd >= 0)
+    {
+        while (ret < 0 && acked_seq < next_seq - 1)
+        {
+            if (read_acks(-1) < 0)
+            {
+                break;
+            }
+        }
+        if (acked_seq < next_seq - 1)
+        {
+            fprintf(stderr, "%lu messages were not acknowledged\n",
+                    next_seq - 1 - acked_seq);
+            status = 1;
+        }
     }
 
     // Close pipes and exit 
     close(session_fd);
-    close(server_fd);
-    unlink(PIPE_NAME);
-    return 0;
+    if (ack_fd >= 0 && ack_fd != session_fd)
+    {
+        close(ack_fd);
+    }
+    if (!use_socket)
+    {
+        unlink(pipe_name);
+    }
+    return status;
 }
\ No newline at end of file
@@ -1,17 +1,42 @@
 #include "logging.h"
+#include "utils/ring.h"
 #include "utils/tools.h"
+#include "utils/trace.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+// How long to sleep on an empty ring before checking the broker is still there
+#define RING_POLL_MS (100)
+
 static int reg_fd;
+static int in_fd;
+// Shared memory ring the messages come through, with -s (shared is NULL
+// otherwise); the session pipe is then only written, to wake the broker up
+static ring_t ring;
+// Connection to the broker's socket, if it uses one (fd is -1 otherwise)
+static uint8_t packet_buf[MAX_SUB_PACKET_LEN];
+static packet_reader_t conn = {
+    .fd = -1, .buf = packet_buf, .capacity = sizeof(packet_buf)};
+// Streamed message being put back together from its chunks
+static uint8_t *streamed = NULL;
+static size_t streamed_len = 0;
+static size_t streamed_capacity = 0;
+static bool streaming = false;
+// With -T: trace contexts are asked for, and received ahead of traced frames
+static bool tracing = false;
+// With -f: only the messages the filter lets through are sent by the broker
+static char filter[MAX_FILTER_LEN + 1] = {0};
 char out_pipe_name[MAX_PIPE_NAME + 1] = {0};
 char in_pipe_name[MAX_PIPE_NAME + 1] = {0};
 char box_name[MAX_BOX_NAME + 1] = {0};
 
 void print_usage_and_exit() {
-    fprintf(stderr, "usage: sub <register_pipe_name> <pipe_name> <box_name>\n");
+    fprintf(stderr, "usage: sub [-s] [-T trace_file] [-f filter] "
+                    "<register_pipe_name> <pipe_name> <box_name>\n");
     exit(EXIT_FAILURE);
 }
 
@@ -37,17 +62,40 @@ int open_out_pipe() {
     return 0;
 }
 
-int send_register_request() {
-    const uint8_t reg_opcode = TFS_OPCODE_REG_SUB;
-    size_t offset = 0;
-    size_t packet_len = sizeof(uint8_t) + (sizeof(char) * MAX_PIPE_NAME) +
-                        (sizeof(char) * MAX_BOX_NAME);
+/**
+ * Connect to the broker's socket, which carries the session from then on.
+ */
+int connect_out_socket() {
+    reg_fd = connect_broker(out_pipe_name);
+    if (reg_fd < 0) {
+        WARN("Error connecting to socket: '%s'", out_pipe_name);
+        return -1;
+    }
+    conn.fd = reg_fd;
+    in_fd = reg_fd;
+    return 0;
+}
 
-    void *packet = malloc(packet_len);
-    packet_cpy(packet, &offset, &reg_opcode, sizeof(uint8_t));
-    packet_cpy(packet, &offset, in_pipe_name, sizeof(char) * MAX_PIPE_NAME);
-    packet_cpy(packet, &offset, box_name, sizeof(char) * MAX_BOX_NAME);
+int send_register_request() {
+    // messages are asked for with a length prefix, so that only their bytes
+    // go through the pipe
+    request_t request = {.opcode = TFS_OPCODE_REG_SUB_EXT,
+                         .flags = REGISTER_FLAG_LEN_PREFIX};
+    if (ring.shared != NULL) {
+        request.flags |= REGISTER_FLAG_SHM_RING;
+    }
+    if (tracing) {
+        request.flags |= REGISTER_FLAG_TRACE;
+    }
+    memcpy(request.client_path, in_pipe_name, sizeof(in_pipe_name));
+    memcpy(request.box_name, box_name, sizeof(box_name));
+    if (filter[0] != '\0') {
+        request.opcode = TFS_OPCODE_REG_SUB_FILTER;
+        memcpy(request.filter, filter, sizeof(filter));
+    }
 
+    uint8_t packet[MAX_REQUEST_LEN];
+    size_t packet_len = encode_request(packet, &request);
     ssize_t bytes_written = safe_write(reg_fd, packet, packet_len);
     if (bytes_written != packet_len) {
         WARN("Error writing to pipe: '%s'", out_pipe_name);
@@ -56,18 +104,118 @@ int send_register_request() {
     return 0;
 }
 
-int main(int argc, char **argv) {
-    if (argc < 4) {
-        print_usage_and_exit();
+/**
+ * Copy len bytes out of the ring, sleeping while it is empty. The broker is
+ * only woken up (with a byte written to the pipe) when it found the ring full.
+ * Returns the number of bytes read, short if the broker closed the session.
+ */
+ssize_t ring_recv(void *buf, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        // anything written before the session was closed is read first
+        bool closed = atomic_load(&ring.shared->closed);
+        ssize_t bytes_read =
+            ring_read(&ring, (uint8_t *)buf + received, len - received);
+        if (bytes_read < 0) {
+            return -1;
+        }
+        if (bytes_read > 0) {
+            received += (size_t)bytes_read;
+            if (ring_take(&ring.shared->writer_waiting) &&
+                safe_write(in_fd, "", 1) != 1) {
+                break;
+            }
+            continue;
+        }
+        if (closed) {
+            break;
+        }
+
+        ring_prepare_sleep(&ring.shared->reader_waiting);
+        if (ring_used(&ring) > 0 || atomic_load(&ring.shared->closed)) {
+            ring_take(&ring.shared->reader_waiting);
+            continue;
+        }
+        ring_sleep(&ring.shared->reader_waiting, RING_POLL_MS);
+
+        struct pollfd pfd = {.fd = in_fd, .events = POLLOUT};
+        if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLERR)) {
+            break; // the broker is gone
+        }
+    }
+    return (ssize_t)received;
+}
+
+/**
+ * Read len bytes of the session, from the ring, the connection or the pipe.
+ */
+ssize_t recv_bytes(void *buf, size_t len) {
+    if (ring.shared != NULL) {
+        return ring_recv(buf, len);
+    }
+    if (conn.fd >= 0) {
+        return packet_read(&conn, buf, len);
+    }
+    return read_all(in_fd, buf, len);
+}
+
+/**
+ * Add a chunk to the streamed message, which is printed once whole. A message
+ * cut short (by a new one starting) is dropped.
+ */
+void receive_chunk(uint8_t const *frame, size_t frame_len) {
+    uint8_t const *payload;
+    uint32_t len;
+    uint8_t chunk_flags;
+    decode_chunk(frame, frame_len, &payload, &len, &chunk_flags);
+    if (chunk_flags & CHUNK_FLAG_FIRST) {
+        streamed_len = 0;
+        streaming = true;
+    }
+    if (!streaming) {
+        return;
+    }
+
+    if (streamed_len + len > streamed_capacity) {
+        size_t capacity =
+            streamed_capacity > 0 ? streamed_capacity : MAX_CHUNK_LEN;
+        while (capacity < streamed_len + len) {
+            capacity *= 2;
+        }
+        uint8_t *grown = realloc(streamed, capacity);
+        if (grown == NULL) {
+            unlink(in_pipe_name);
+            PANIC("Out of memory for a streamed message of %zu bytes",
+                  streamed_len + len);
+        }
+        streamed = grown;
+        streamed_capacity = capacity;
     }
+    memcpy(streamed + streamed_len, payload, len);
+    streamed_len += len;
 
-    memcpy(out_pipe_name, argv[1], MAX_PIPE_NAME);
-    memcpy(in_pipe_name, argv[2], MAX_PIPE_NAME);
-    memcpy(box_name, argv[3], MAX_BOX_NAME);
+    if (chunk_flags & CHUNK_FLAG_LAST) {
+        fwrite(streamed, 1, streamed_len, stdout);
+        fputc('\n', stdout);
+        streaming = false;
+    }
+}
 
+/**
+ * Register through the broker's pipe, and open the session pipe.
+ */
+void open_session_pipe(bool use_ring) {
     if (create_in_pipe() != 0) {
         PANIC("Error creating client pipe: '%s'", in_pipe_name);
     }
+    if (use_ring) {
+        if (ring_create(&ring, in_pipe_name, RING_CAPACITY) != 0) {
+            unlink(in_pipe_name);
+            PANIC("Error creating shared memory ring");
+        }
+        // the broker leaving is noticed when waking it up fails
+        signal(SIGPIPE, SIG_IGN);
+    }
     if (open_out_pipe() != 0) {
         unlink(in_pipe_name);
         PANIC("Error opening registration pipe: '%s'", out_pipe_name);
@@ -75,36 +223,133 @@ int main(int argc, char **argv) {
     if (send_register_request() != 0) {
         close(reg_fd);
         unlink(in_pipe_name);
+        ring_unlink(in_pipe_name);
         PANIC("Error registering subscriber");
     }
     close(reg_fd);
 
-    int in_fd = open(in_pipe_name, O_RDONLY);
+    // blocks until the broker accepts the session, by which time it mapped
+    // the ring
+    in_fd = open(in_pipe_name, use_ring ? O_WRONLY : O_RDONLY);
+    if (use_ring) {
+        ring_unlink(in_pipe_name);
+    }
     if (in_fd < 0) {
         unlink(in_pipe_name);
         PANIC("Error opening client pipe: '%s'", in_pipe_name);
     }
+}
 
-    uint8_t ret_op_code;
-    char message[MAX_PUB_MSG + 1] = {0};
+/**
+ * Write the trace out when interrupted, as subscribers usually are.
+ */
+void stop_tracing(int sig) {
+    trace_stop();
+    unlink(in_pipe_name);
+    _exit(128 + sig);
+}
 
-    ssize_t bytes_read = safe_read(in_fd, &ret_op_code, sizeof(uint8_t));
+int main(int argc, char **argv) {
+    bool use_ring = false;
+    char const *trace_file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "sT:f:")) != -1) {
+        switch (opt) {
+        case 's':
+            use_ring = true;
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        case 'f':
+            if (strlen(optarg) > MAX_FILTER_LEN) {
+                PANIC("Filter longer than %d bytes", MAX_FILTER_LEN);
+            }
+            strcpy(filter, optarg);
+            break;
+        default:
+            print_usage_and_exit();
+        }
+    }
+    if (argc - optind < 3) {
+        print_usage_and_exit();
+    }
+
+    strncpy(out_pipe_name, argv[optind], MAX_PIPE_NAME);
+    strncpy(in_pipe_name, argv[optind + 1], MAX_PIPE_NAME);
+    strncpy(box_name, argv[optind + 2], MAX_BOX_NAME);
+
+    if (trace_file != NULL) {
+        if (trace_start(trace_file, "sub") != 0) {
+            PANIC("Error starting to trace to '%s'", trace_file);
+        }
+        tracing = true;
+        signal(SIGINT, stop_tracing);
+        signal(SIGTERM, stop_tracing);
+    }
+
+    if (broker_uses_socket(out_pipe_name)) {
+        // no pipe to create: messages come back through the connection
+        if (use_ring) {
+            PANIC("Rings are only set up for clients using pipes");
+        }
+        if (connect_out_socket() != 0 || send_register_request() != 0) {
+            PANIC("Error registering subscriber");
+        }
+        in_pipe_name[0] = '\0';
+    } else {
+        open_session_pipe(use_ring);
+    }
+
+    // the header of each frame tells how much of it is left to read
+    uint8_t frame[CHUNK_HEADER_LEN + MAX_CHUNK_LEN];
+    uint8_t const *message;
+    size_t len;
+    // context of the next frame, if traced
+    trace_context_t trace = {.trace_id = 0};
+
+    ssize_t bytes_read = recv_bytes(frame, MSG_HEADER_LEN);
     while (bytes_read > 0) {
-        if (bytes_read < 0) {
+        if (frame[0] != TFS_OPCODE_SUB_MSG &&
+            frame[0] != TFS_OPCODE_SUB_CHUNK &&
+            (frame[0] != TFS_OPCODE_TRACE || !tracing)) {
+            PANIC("Invalid opcode %d", frame[0]);
+        }
+        ssize_t frame_len =
+            bytes_read == MSG_HEADER_LEN
+                ? message_frame_len(frame, REGISTER_FLAG_LEN_PREFIX)
+                : -1;
+        if (frame_len < 0 ||
+            recv_bytes(frame + MSG_HEADER_LEN,
+                       (size_t)frame_len - MSG_HEADER_LEN) !=
+                frame_len - (ssize_t)MSG_HEADER_LEN) {
             unlink(in_pipe_name);
-            PANIC("Error reading from pipe: '%s' - %s", in_pipe_name, strerror(errno));
+            PANIC("Error reading from pipe: '%s' - %s", in_pipe_name,
+                  strerror(errno));
         }
-        if (ret_op_code != TFS_OPCODE_SUB_MSG) {
-            PANIC("Invalid opcode %d", ret_op_code);
+        if (frame[0] == TFS_OPCODE_TRACE) {
+            if (decode_trace(frame, (size_t)frame_len, &trace) <= 0) {
+                unlink(in_pipe_name);
+                PANIC("Invalid trace context");
+            }
+            bytes_read = recv_bytes(frame, MSG_HEADER_LEN);
+            continue;
         }
-        bytes_read = safe_read(in_fd, message, sizeof(char) * MAX_PUB_MSG);
-        if (bytes_read != sizeof(char) * MAX_PUB_MSG) {
-            unlink(in_pipe_name);
-            PANIC("Error reading from pipe: '%s' - %s", in_pipe_name, strerror(errno));
+        if (trace.trace_id != 0) {
+            // from the publisher sending the frame to it arriving here
+            trace_span("receive", trace.trace_id, trace.sent_at, metrics_now());
+            trace.trace_id = 0;
+        }
+        if (frame[0] == TFS_OPCODE_SUB_CHUNK) {
+            receive_chunk(frame, (size_t)frame_len);
+            bytes_read = recv_bytes(frame, MSG_HEADER_LEN);
+            continue;
         }
-        fprintf(stdout, "%s\n", message);
-        memset(message, 0, sizeof(message));
-        bytes_read = safe_read(in_fd, &ret_op_code, sizeof(uint8_t));
+        streaming = false;
+        decode_message(frame, (size_t)frame_len, REGISTER_FLAG_LEN_PREFIX,
+                       &message, &len);
+        fprintf(stdout, "%.*s\n", (int)len, (char const *)message);
+        bytes_read = recv_bytes(frame, MSG_HEADER_LEN);
     }
 
     unlink(in_pipe_name);
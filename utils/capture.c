@@ -0,0 +1,181 @@
+#include "capture.h"
+#include "utils/metrics.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Room for the longest record
+#define CAPTURE_MAX_RECORD_LEN                                                 \
+    (CAPTURE_RECORD_HEADER_LEN + MAX_BOX_NAME + MAX_FILTER_LEN +               \
+     MAX_BATCH_MSGS * sizeof(uint16_t))
+
+// Buffer of the capture file: records are written out in blocks this large
+#define CAPTURE_BUFFER_LEN (1 << 20)
+
+// How long capture_stop waits for a record being written, in milliseconds
+#define CAPTURE_STOP_WAIT_MS (100)
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_file = NULL;
+static _Atomic bool capturing = false;
+static uint64_t started_at;
+
+int capture_start(char const *path) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    setvbuf(file, NULL, _IOFBF, CAPTURE_BUFFER_LEN);
+    if (fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, file) !=
+        CAPTURE_MAGIC_LEN) {
+        fclose(file);
+        return -1;
+    }
+
+    pthread_mutex_lock(&capture_lock);
+    capture_file = file;
+    started_at = metrics_now();
+    pthread_mutex_unlock(&capture_lock);
+    atomic_store(&capturing, true);
+    atexit(capture_stop);
+    return 0;
+}
+
+void capture_stop(void) {
+    if (!atomic_exchange(&capturing, false)) {
+        return;
+    }
+    // called on exit, possibly after a PANIC while other threads still
+    // write records: the rest of the capture is then lost rather than
+    // waited for forever
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 1000000};
+    for (int i = 0; i < CAPTURE_STOP_WAIT_MS; i++) {
+        if (pthread_mutex_trylock(&capture_lock) == 0) {
+            fclose(capture_file);
+            capture_file = NULL;
+            pthread_mutex_unlock(&capture_lock);
+            return;
+        }
+        nanosleep(&pause, NULL);
+    }
+}
+
+bool capture_on(void) {
+    return atomic_load_explicit(&capturing, memory_order_relaxed);
+}
+
+static void put_bytes(uint8_t *buf, size_t *offset, void const *data,
+                      size_t len) {
+    memcpy(buf + *offset, data, len);
+    *offset += len;
+}
+
+static void get_bytes(uint8_t const *buf, size_t *offset, void *data,
+                      size_t len) {
+    memcpy(data, buf + *offset, len);
+    *offset += len;
+}
+
+void capture_write(capture_record_t *record) {
+    if (!capture_on()) {
+        return;
+    }
+    if (record->time == 0) {
+        record->time = metrics_now();
+    }
+
+    uint8_t buf[CAPTURE_MAX_RECORD_LEN];
+    size_t offset = 0;
+    uint16_t name_len = (uint16_t)strnlen(record->box_name, MAX_BOX_NAME);
+    uint32_t count = record->kind == CAPTURE_PUBLISH ? record->count : 0;
+    if (count > MAX_BATCH_MSGS) {
+        count = MAX_BATCH_MSGS;
+    }
+    uint16_t filter_len =
+        record->kind == CAPTURE_REGISTER
+            ? (uint16_t)strnlen(record->filter, MAX_FILTER_LEN)
+            : 0;
+    put_bytes(buf, &offset, &record->kind, sizeof(uint8_t));
+    put_bytes(buf, &offset, &record->opcode, sizeof(uint8_t));
+    put_bytes(buf, &offset, &name_len, sizeof(uint16_t));
+    put_bytes(buf, &offset, &record->flags, sizeof(uint32_t));
+    size_t time_offset = offset;
+    offset += sizeof(uint64_t); // set under the lock, relative to the start
+    put_bytes(buf, &offset, &record->session, sizeof(uint64_t));
+    put_bytes(buf, &offset, &count, sizeof(uint32_t));
+    put_bytes(buf, &offset, &record->len, sizeof(uint32_t));
+    put_bytes(buf, &offset, &filter_len, sizeof(uint16_t));
+    put_bytes(buf, &offset, record->box_name, name_len);
+    put_bytes(buf, &offset, record->filter, filter_len);
+    put_bytes(buf, &offset, record->sizes, count * sizeof(uint16_t));
+
+    pthread_mutex_lock(&capture_lock);
+    if (capture_file != NULL) {
+        uint64_t time =
+            record->time > started_at ? record->time - started_at : 0;
+        memcpy(buf + time_offset, &time, sizeof(uint64_t));
+        if (fwrite(buf, 1, offset, capture_file) != offset) {
+            // a capture with a hole in it would replay something else
+            fclose(capture_file);
+            capture_file = NULL;
+            atomic_store(&capturing, false);
+        }
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+FILE *capture_open(char const *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    char magic[CAPTURE_MAGIC_LEN];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+int capture_read(FILE *file, capture_record_t *record) {
+    uint8_t header[CAPTURE_RECORD_HEADER_LEN];
+    size_t header_len = fread(header, 1, sizeof(header), file);
+    if (header_len == 0 && feof(file)) {
+        return 0;
+    }
+    if (header_len != sizeof(header)) {
+        return -1;
+    }
+
+    size_t offset = 0;
+    uint16_t name_len;
+    uint16_t filter_len;
+    get_bytes(header, &offset, &record->kind, sizeof(uint8_t));
+    get_bytes(header, &offset, &record->opcode, sizeof(uint8_t));
+    get_bytes(header, &offset, &name_len, sizeof(uint16_t));
+    get_bytes(header, &offset, &record->flags, sizeof(uint32_t));
+    get_bytes(header, &offset, &record->time, sizeof(uint64_t));
+    get_bytes(header, &offset, &record->session, sizeof(uint64_t));
+    get_bytes(header, &offset, &record->count, sizeof(uint32_t));
+    get_bytes(header, &offset, &record->len, sizeof(uint32_t));
+    get_bytes(header, &offset, &filter_len, sizeof(uint16_t));
+    if (record->kind > CAPTURE_CLOSE || name_len > MAX_BOX_NAME ||
+        record->count > MAX_BATCH_MSGS || filter_len > MAX_FILTER_LEN ||
+        (record->kind != CAPTURE_PUBLISH && record->count != 0) ||
+        (record->kind != CAPTURE_REGISTER && filter_len != 0)) {
+        return -1;
+    }
+
+    if (fread(record->box_name, 1, name_len, file) != name_len ||
+        fread(record->filter, 1, filter_len, file) != filter_len ||
+        fread(record->sizes, sizeof(uint16_t), record->count, file) !=
+            record->count) {
+        return -1;
+    }
+    record->box_name[name_len] = '\0';
+    record->filter[filter_len] = '\0';
+    return 1;
+}
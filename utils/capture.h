@@ -0,0 +1,90 @@
+#ifndef __UTILS_CAPTURE_H__
+#define __UTILS_CAPTURE_H__
+
+#include "protocol/protocol.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Capture of the requests a broker serves, to be replayed against another
+ * broker (see bench/replay.c).
+ *
+ * A capture file starts with CAPTURE_MAGIC, followed by a record per
+ * request, in the order they were served. Records are laid out back to back,
+ * in host byte order:
+ *
+ *     u8 kind, u8 opcode, u16 name_len, u32 flags, u64 time (ns),
+ *     u64 session, u32 count, u32 len, u16 filter_len,
+ *     name_len bytes of box name, filter_len bytes of filter (of filtered
+ *     subscribers' registrations), and, for published messages, count u16
+ *     message lengths
+ *
+ * time is taken from the start of the capture. session tells apart the
+ * sessions of publishers and subscribers (which the publishes and closes
+ * that follow their registration refer to), and is 0 for requests that need
+ * none. Only sizes are kept, never the contents of the messages.
+ */
+
+#define CAPTURE_MAGIC "TFSCAP02"
+#define CAPTURE_MAGIC_LEN (8)
+#define CAPTURE_RECORD_HEADER_LEN (34)
+
+typedef enum {
+    CAPTURE_REQUEST = 0, // a request on its own (opcode: that of the request)
+    CAPTURE_REGISTER,    // a publisher or subscriber registered
+    CAPTURE_PUBLISH,     // a frame stored (opcode: that of the frame)
+    CAPTURE_CLOSE,       // a publisher or subscriber session closed
+} capture_kind_t;
+
+typedef struct {
+    uint8_t kind;
+    uint8_t opcode;
+    uint32_t flags; // register flags, or chunk flags of streamed messages
+    uint64_t time;
+    uint64_t session;
+    uint32_t count; // messages of a publish
+    uint32_t len;   // bytes of a publish
+    char box_name[MAX_BOX_NAME + 1];
+    char filter[MAX_FILTER_LEN + 1]; // of a filtered subscriber's register
+    uint16_t sizes[MAX_BATCH_MSGS];  // of the count messages of a publish
+} capture_record_t;
+
+/**
+ * Start capturing to path (truncated), until capture_stop is called (done on
+ * exit).
+ * Returns 0 if successful, -1 otherwise.
+ */
+int capture_start(char const *path);
+
+/**
+ * Write out what is left of the capture, and stop capturing.
+ */
+void capture_stop(void);
+
+/**
+ * Whether requests are being captured, for callers to skip building records
+ * otherwise.
+ */
+bool capture_on(void);
+
+/**
+ * Append a record to the capture, stamped with the current time if its time
+ * is 0. Does nothing while not capturing. Thread-safe.
+ */
+void capture_write(capture_record_t *record);
+
+/**
+ * Open a capture file to be read, checking its header.
+ * Returns the file if successful, NULL otherwise.
+ */
+FILE *capture_open(char const *path);
+
+/**
+ * Read the next record of a capture file.
+ * Returns 1 if a record was read, 0 at the end of the file, or -1 if the
+ * record is not valid.
+ */
+int capture_read(FILE *file, capture_record_t *record);
+
+#endif // __UTILS_CAPTURE_H__
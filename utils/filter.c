@@ -0,0 +1,178 @@
+#include "filter.h"
+#include <stdlib.h>
+#include <string.h>
+
+void filter_trie_init(filter_trie_t *trie) {
+    memset(trie, 0, sizeof(*trie));
+    trie->free_node = FILTER_NONE;
+}
+
+void filter_trie_destroy(filter_trie_t *trie) {
+    free(trie->nodes);
+    free(trie->id_nodes);
+    free(trie->stack);
+    filter_trie_init(trie);
+}
+
+/**
+ * A new node, with no filter nor children.
+ * Returns its index, or FILTER_NONE if out of memory.
+ */
+static uint32_t new_node(filter_trie_t *trie, uint32_t parent, uint8_t label) {
+    uint32_t node = trie->free_node;
+    if (node != FILTER_NONE) {
+        trie->free_node = trie->nodes[node].next_sibling;
+    } else {
+        if (trie->n_nodes == trie->capacity) {
+            uint32_t capacity = trie->capacity > 0 ? 2 * trie->capacity : 64;
+            filter_node_t *nodes =
+                realloc(trie->nodes, capacity * sizeof(filter_node_t));
+            if (nodes == NULL) {
+                return FILTER_NONE;
+            }
+            trie->nodes = nodes;
+            uint32_t *stack =
+                realloc(trie->stack, capacity * sizeof(uint32_t));
+            if (stack == NULL) {
+                return FILTER_NONE;
+            }
+            trie->stack = stack;
+            trie->capacity = capacity;
+        }
+        node = trie->n_nodes++;
+    }
+
+    filter_node_t *n = &trie->nodes[node];
+    n->first_child = FILTER_NONE;
+    n->next_sibling = FILTER_NONE;
+    n->parent = parent;
+    n->depth = parent != FILTER_NONE ? trie->nodes[parent].depth + 1 : 0;
+    n->id = FILTER_NONE;
+    n->refs = 0;
+    n->label = label;
+    return node;
+}
+
+static uint32_t find_child(filter_trie_t const *trie, uint32_t node,
+                           uint8_t label) {
+    uint32_t child = trie->nodes[node].first_child;
+    while (child != FILTER_NONE && trie->nodes[child].label != label) {
+        child = trie->nodes[child].next_sibling;
+    }
+    return child;
+}
+
+/**
+ * Free the nodes that no filter goes through any more, from node up.
+ */
+static void prune(filter_trie_t *trie, uint32_t node) {
+    while (node != 0 && trie->nodes[node].refs == 0 &&
+           trie->nodes[node].first_child == FILTER_NONE) {
+        uint32_t parent = trie->nodes[node].parent;
+        uint32_t *link = &trie->nodes[parent].first_child;
+        while (*link != node) {
+            link = &trie->nodes[*link].next_sibling;
+        }
+        *link = trie->nodes[node].next_sibling;
+
+        trie->nodes[node].next_sibling = trie->free_node;
+        trie->free_node = node;
+        node = parent;
+    }
+}
+
+uint32_t filter_trie_add(filter_trie_t *trie, char const *filter) {
+    if (trie->n_nodes == 0) {
+        if (new_node(trie, FILTER_NONE, 0) == FILTER_NONE) {
+            return FILTER_NONE;
+        }
+    }
+
+    uint32_t node = 0;
+    for (uint8_t const *c = (uint8_t const *)filter; *c != '\0'; c++) {
+        uint32_t child = find_child(trie, node, *c);
+        if (child == FILTER_NONE) {
+            child = new_node(trie, node, *c);
+            if (child == FILTER_NONE) {
+                prune(trie, node);
+                return FILTER_NONE;
+            }
+            trie->nodes[child].next_sibling = trie->nodes[node].first_child;
+            trie->nodes[node].first_child = child;
+        }
+        node = child;
+    }
+
+    filter_node_t *end = &trie->nodes[node];
+    if (end->id == FILTER_NONE) {
+        uint32_t id = 0;
+        while (id < trie->n_ids && trie->id_nodes[id] != FILTER_NONE) {
+            id++;
+        }
+        if (id == trie->n_ids) {
+            uint32_t *id_nodes =
+                realloc(trie->id_nodes, (id + 1) * sizeof(uint32_t));
+            if (id_nodes == NULL) {
+                prune(trie, node);
+                return FILTER_NONE;
+            }
+            trie->id_nodes = id_nodes;
+            trie->n_ids++;
+        }
+        trie->id_nodes[id] = node;
+        end->id = id;
+    }
+    end->refs++;
+    trie->n_filters++;
+    return end->id;
+}
+
+void filter_trie_remove(filter_trie_t *trie, uint32_t id) {
+    uint32_t node = trie->id_nodes[id];
+    trie->n_filters--;
+    if (--trie->nodes[node].refs > 0) {
+        return;
+    }
+    trie->nodes[node].id = FILTER_NONE;
+    trie->id_nodes[id] = FILTER_NONE;
+    prune(trie, node);
+}
+
+void filter_trie_match(filter_trie_t *trie, uint8_t const *msg, size_t len,
+                       uint64_t *hits, size_t words, size_t index) {
+    if (trie->n_nodes == 0) {
+        return;
+    }
+
+    // a node is reached by a single path, so it is pushed once at most, and
+    // its depth tells which byte of the message its children match
+    size_t top = 0;
+    trie->stack[top++] = 0;
+    while (top > 0) {
+        uint32_t node = trie->stack[--top];
+        filter_node_t const *n = &trie->nodes[node];
+        if (n->id != FILTER_NONE) {
+            hits[n->id * words + index / 64] |= 1ull << (index % 64);
+        }
+        if (n->depth == len) {
+            continue;
+        }
+        for (uint32_t child = n->first_child; child != FILTER_NONE;
+             child = trie->nodes[child].next_sibling) {
+            uint8_t label = trie->nodes[child].label;
+            if (label == msg[n->depth] || label == FILTER_ANY_BYTE) {
+                trie->stack[top++] = child;
+            }
+        }
+    }
+}
+
+bool filter_match(char const *filter, uint8_t const *msg, size_t len) {
+    for (size_t i = 0; filter[i] != '\0'; i++) {
+        if (i == len ||
+            (filter[i] != FILTER_ANY_BYTE && (uint8_t)filter[i] != msg[i])) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,80 @@
+#ifndef __UTILS_FILTER_H__
+#define __UTILS_FILTER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Subscription filters: a filter lets through the messages that start with
+ * it, where '?' stands for any one byte (e.g. "temp.?." takes "temp.a.x" and
+ * "temp.b.", but not "temp.ab"). The empty filter lets everything through.
+ *
+ * The filters of the subscribers of a box are kept in a single trie, which a
+ * message is matched against once, for all of them: the walk follows the
+ * bytes of the message (and the '?' branches), so its cost is bounded by the
+ * length of the message and the nodes that share a prefix with it, not by the
+ * number of filters. Subscribers with the same filter share its node, and
+ * the id it is matched under.
+ */
+
+// Id of no filter (sessions that take every message)
+#define FILTER_NONE (UINT32_MAX)
+
+#define FILTER_ANY_BYTE '?'
+
+typedef struct {
+    uint32_t first_child; // FILTER_NONE if none
+    uint32_t next_sibling;
+    uint32_t parent;
+    uint32_t depth; // bytes of the filters going through it
+    uint32_t id;   // of the filter ending here, FILTER_NONE if none
+    uint32_t refs; // subscribers whose filter ends here
+    uint8_t label;
+} filter_node_t;
+
+/**
+ * A trie of filters. Node 0 is the root, once the first filter is added.
+ * Nodes and ids that are no longer used are reused.
+ */
+typedef struct {
+    filter_node_t *nodes;
+    uint32_t n_nodes;
+    uint32_t capacity;
+    uint32_t free_node; // chain of free nodes, through next_sibling
+    uint32_t *id_nodes; // node of each id, FILTER_NONE if the id is free
+    uint32_t n_ids;     // ids handed out so far (free or not)
+    uint32_t n_filters; // subscribers with a filter
+    uint32_t *stack;    // room for the walk of a message (a node each)
+} filter_trie_t;
+
+void filter_trie_init(filter_trie_t *trie);
+
+void filter_trie_destroy(filter_trie_t *trie);
+
+/**
+ * Add a subscriber's filter (a nonempty string) to the trie.
+ * Returns the id the filter is matched under (less than n_ids), or
+ * FILTER_NONE if out of memory.
+ */
+uint32_t filter_trie_add(filter_trie_t *trie, char const *filter);
+
+/**
+ * Remove a subscriber's filter, given the id filter_trie_add returned.
+ */
+void filter_trie_remove(filter_trie_t *trie, uint32_t id);
+
+/**
+ * Match a message (len bytes) against every filter of the trie, setting bit
+ * index of the row of hits of each filter that lets it through: rows are
+ * words 64-bit words long, one per id (n_ids of them).
+ */
+void filter_trie_match(filter_trie_t *trie, uint8_t const *msg, size_t len,
+                       uint64_t *hits, size_t words, size_t index);
+
+/**
+ * Whether a single filter lets a message (len bytes) through.
+ */
+bool filter_match(char const *filter, uint8_t const *msg, size_t len);
+
+#endif // __UTILS_FILTER_H__
@@ -1,5 +1,490 @@
+#define _DEFAULT_SOURCE // nanosleep
 #include "logging.h"
+#include "ring.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 
 log_level_t g_level = LOG_QUIET;
 
 void set_log_level(log_level_t level) { g_level = level; }
+
+// Longest message, once formatted (longer ones are cut)
+#define LOG_MAX_MESSAGE (2048)
+// Capacity of the ring of each thread
+#define LOG_RING_CAPACITY (1 << 16)
+// Longest record: header, and arguments of which strings are cut to fit
+#define LOG_MAX_RECORD (LOG_MAX_MESSAGE + 256)
+// How long the background thread sleeps when it finds every ring empty
+#define LOG_FLUSH_MS (10)
+// Formatted lines written at once by the background thread
+#define LOG_OUT_BUF (1 << 16)
+
+/**
+ * A record in a thread's ring: the header, then an 8-byte slot for each
+ * argument of the format (star widths and precisions included), in order.
+ * Strings take a slot for their length, followed by their bytes padded to a
+ * whole number of slots.
+ */
+typedef struct {
+    uint32_t len; // of the whole record
+    uint32_t line;
+    char const *tag;
+    char const *file;
+    char const *func;
+    char const *fmt;
+} log_header_t;
+
+typedef struct log_ring {
+    ring_t ring;
+    _Atomic uint64_t dropped;
+    struct log_ring *next;
+} log_ring_t;
+
+/**
+ * A conversion of a format, as parsed by next_conversion.
+ */
+typedef struct {
+    char const *start; // the '%'
+    size_t len;
+    size_t n_stars;  // width and precision taken from the arguments
+    bool precision;  // a precision is given (as digits or a star)
+    long max_len;    // the precision given as digits, -1 otherwise
+    char length[3];  // length modifier
+    char conversion; // 0 for "%%"
+} log_conversion_t;
+
+// Rings of the threads that logged since log_start (only ever added to, so
+// that the background thread can walk the list without a lock)
+static log_ring_t *_Atomic rings = NULL;
+static _Thread_local log_ring_t *thread_ring = NULL;
+
+static _Atomic bool async = false;
+static _Atomic bool stopping = false;
+static pthread_t flusher;
+// the rings have a single consumer at a time: the background thread, or
+// log_stop once it left
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Parse the conversion starting at fmt (a '%').
+ * Returns a pointer past it.
+ */
+static char const *next_conversion(char const *fmt, log_conversion_t *conv) {
+    char const *c = fmt + 1;
+    conv->start = fmt;
+    conv->n_stars = 0;
+    conv->precision = false;
+    conv->max_len = -1;
+    memset(conv->length, 0, sizeof(conv->length));
+
+    while (*c != '\0' && strchr("-+ #0'", *c) != NULL) {
+        c++;
+    }
+    if (*c == '*') {
+        conv->n_stars++;
+        c++;
+    }
+    while (*c >= '0' && *c <= '9') {
+        c++;
+    }
+    if (*c == '.') {
+        conv->precision = true;
+        c++;
+        if (*c == '*') {
+            conv->n_stars++;
+            c++;
+        } else {
+            conv->max_len = 0;
+            while (*c >= '0' && *c <= '9') {
+                conv->max_len = conv->max_len * 10 + (*c++ - '0');
+            }
+        }
+    }
+    for (size_t i = 0; i < 2 && *c != '\0' && strchr("hljztLq", *c) != NULL;
+         i++) {
+        conv->length[i] = *c++;
+    }
+
+    conv->conversion = *c == '%' ? 0 : *c;
+    if (*c != '\0') {
+        c++;
+    }
+    conv->len = (size_t)(c - fmt);
+    return c;
+}
+
+static bool is_signed_conversion(char conversion) {
+    return conversion == 'd' || conversion == 'i';
+}
+
+static bool is_float_conversion(char conversion) {
+    return conversion != 0 && strchr("eEfFgGaA", conversion) != NULL;
+}
+
+/**
+ * Length of a string of len bytes rounded up to whole slots.
+ */
+static size_t slot_len(size_t len) {
+    return (len + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+static void put_slot(uint8_t *record, size_t *offset, void const *value) {
+    if (*offset + sizeof(uint64_t) <= LOG_MAX_RECORD) {
+        memcpy(record + *offset, value, sizeof(uint64_t));
+        *offset += sizeof(uint64_t);
+    }
+}
+
+static uint64_t get_slot(uint8_t const *record, size_t *offset, size_t len) {
+    uint64_t value = 0;
+    if (*offset + sizeof(uint64_t) <= len) {
+        memcpy(&value, record + *offset, sizeof(uint64_t));
+        *offset += sizeof(uint64_t);
+    }
+    return value;
+}
+
+/**
+ * Copy the arguments of a format into the slots of a record, at offset.
+ * Returns the length of the record.
+ */
+static size_t encode_args(uint8_t *record, size_t offset, char const *fmt,
+                          va_list ap) {
+    while ((fmt = strchr(fmt, '%')) != NULL) {
+        log_conversion_t conv;
+        fmt = next_conversion(fmt, &conv);
+
+        long max_len = conv.max_len;
+        for (size_t i = 0; i < conv.n_stars; i++) {
+            int64_t star = va_arg(ap, int);
+            put_slot(record, &offset, &star);
+            // the last star of a string is its precision
+            if (conv.precision && i == conv.n_stars - 1) {
+                max_len = star;
+            }
+        }
+
+        char const length = conv.length[0];
+        bool wide = length == 'l' || length == 'j' || length == 'z' ||
+                    length == 't' || length == 'q';
+        if (conv.conversion == 's') {
+            char const *str = va_arg(ap, char const *);
+            if (str == NULL) {
+                str = "(null)";
+            }
+            size_t room = LOG_MAX_RECORD - offset - sizeof(uint64_t);
+            if (offset + sizeof(uint64_t) > LOG_MAX_RECORD) {
+                room = 0;
+            }
+            if (max_len >= 0 && (size_t)max_len < room) {
+                room = (size_t)max_len;
+            }
+            uint64_t str_len = strnlen(str, room);
+            put_slot(record, &offset, &str_len);
+            memcpy(record + offset, str, str_len);
+            offset += slot_len(str_len);
+        } else if (conv.conversion == 'p') {
+            void *value = va_arg(ap, void *);
+            put_slot(record, &offset, &value);
+        } else if (is_float_conversion(conv.conversion)) {
+            double value = length == 'L' ? (double)va_arg(ap, long double)
+                                         : va_arg(ap, double);
+            put_slot(record, &offset, &value);
+        } else if (conv.conversion == 'n') {
+            (void)va_arg(ap, void *);
+        } else if (conv.conversion != 0) {
+            // integers (and characters) of every size, widened
+            int64_t value;
+            if (length == 'l' && conv.length[1] == 'l') {
+                value = va_arg(ap, long long);
+            } else if (wide) {
+                value = va_arg(ap, long);
+            } else {
+                value = va_arg(ap, int);
+            }
+            put_slot(record, &offset, &value);
+        }
+    }
+    return offset < LOG_MAX_RECORD ? offset : LOG_MAX_RECORD;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+
+/**
+ * Format a single conversion, rebuilt with the widest length modifier, with
+ * its star arguments.
+ */
+#define FORMAT_CONVERSION(out, room, spec, stars, n_stars, value)             \
+    ((n_stars) == 0   ? snprintf(out, room, spec, value)                       \
+     : (n_stars) == 1 ? snprintf(out, room, spec, stars[0], value)             \
+                      : snprintf(out, room, spec, stars[0], stars[1], value))
+
+/**
+ * Format the message of a record into out (LOG_MAX_MESSAGE bytes).
+ */
+static void format_record(uint8_t const *record, size_t len, char *out) {
+    log_header_t header;
+    memcpy(&header, record, sizeof(header));
+    size_t offset = sizeof(header);
+
+    size_t out_len = 0;
+    char const *fmt = header.fmt;
+    while (*fmt != '\0' && out_len < LOG_MAX_MESSAGE - 1) {
+        char const *next = strchr(fmt, '%');
+        size_t literal = next != NULL ? (size_t)(next - fmt) : strlen(fmt);
+        if (literal > LOG_MAX_MESSAGE - 1 - out_len) {
+            literal = LOG_MAX_MESSAGE - 1 - out_len;
+        }
+        memcpy(out + out_len, fmt, literal);
+        out_len += literal;
+        if (next == NULL || out_len == LOG_MAX_MESSAGE - 1) {
+            break;
+        }
+
+        log_conversion_t conv;
+        fmt = next_conversion(next, &conv);
+        if (conv.conversion == 0) {
+            out[out_len++] = '%';
+            continue;
+        }
+
+        int stars[2] = {0, 0};
+        for (size_t i = 0; i < conv.n_stars; i++) {
+            stars[i] = (int)(int64_t)get_slot(record, &offset, len);
+        }
+
+        // the conversion, without its length modifier, which is replaced
+        char spec[64];
+        size_t spec_len = conv.len - strlen(conv.length);
+        if (spec_len >= sizeof(spec) - 3) {
+            continue;
+        }
+        memcpy(spec, conv.start, spec_len - 1);
+        spec[spec_len - 1] = '\0';
+
+        size_t room = LOG_MAX_MESSAGE - out_len;
+        int written = 0;
+        if (conv.conversion == 's') {
+            uint64_t str_len = get_slot(record, &offset, len);
+            if (str_len > len - offset) {
+                str_len = len - offset;
+            }
+            char str[LOG_MAX_MESSAGE];
+            if (str_len >= sizeof(str)) {
+                str_len = sizeof(str) - 1;
+            }
+            memcpy(str, record + offset, str_len);
+            str[str_len] = '\0';
+            offset += slot_len(str_len);
+            strcat(spec, "s");
+            written = FORMAT_CONVERSION(out + out_len, room, spec, stars,
+                                        conv.n_stars, str);
+        } else if (conv.conversion == 'p') {
+            uint64_t value = get_slot(record, &offset, len);
+            strcat(spec, "p");
+            written = FORMAT_CONVERSION(out + out_len, room, spec, stars,
+                                        conv.n_stars, (void *)(uintptr_t)value);
+        } else if (is_float_conversion(conv.conversion)) {
+            uint64_t bits = get_slot(record, &offset, len);
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            char conversion[2] = {conv.conversion, '\0'};
+            strcat(spec, conversion);
+            written = FORMAT_CONVERSION(out + out_len, room, spec, stars,
+                                        conv.n_stars, value);
+        } else if (conv.conversion == 'c') {
+            int value = (int)(int64_t)get_slot(record, &offset, len);
+            strcat(spec, "c");
+            written = FORMAT_CONVERSION(out + out_len, room, spec, stars,
+                                        conv.n_stars, value);
+        } else if (conv.conversion != 'n') {
+            int64_t value = (int64_t)get_slot(record, &offset, len);
+            char conversion[4] = {'l', 'l', conv.conversion, '\0'};
+            strcat(spec, conversion);
+            if (is_signed_conversion(conv.conversion)) {
+                written = FORMAT_CONVERSION(out + out_len, room, spec, stars,
+                                            conv.n_stars, (long long)value);
+            } else {
+                written = FORMAT_CONVERSION(out + out_len, room, spec, stars,
+                                            conv.n_stars,
+                                            (unsigned long long)value);
+            }
+        }
+        if (written > 0) {
+            out_len += (size_t)written < room ? (size_t)written : room - 1;
+        }
+    }
+    out[out_len] = '\0';
+}
+
+#pragma GCC diagnostic pop
+
+/**
+ * The ring of the calling thread, allocated on its first record.
+ */
+static log_ring_t *get_thread_ring(void) {
+    if (thread_ring != NULL) {
+        return thread_ring;
+    }
+
+    log_ring_t *ring = malloc(sizeof(log_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    if (ring_alloc(&ring->ring, LOG_RING_CAPACITY) != 0) {
+        free(ring);
+        return NULL;
+    }
+    atomic_init(&ring->dropped, 0);
+
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+    }
+    thread_ring = ring;
+    return ring;
+}
+
+void log_record(char const *tag, char const *file, int line, char const *func,
+                char const *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+
+    log_ring_t *ring = atomic_load(&async) ? get_thread_ring() : NULL;
+    if (ring == NULL) {
+        char buf[LOG_MAX_MESSAGE];
+        vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+        fprintf(stderr, "%s%s:%d :: %s :: %s\n", tag, file, line, func, buf);
+        return;
+    }
+
+    _Alignas(uint64_t) uint8_t record[LOG_MAX_RECORD];
+    log_header_t header = {
+        .line = (uint32_t)line,
+        .tag = tag,
+        .file = file,
+        .func = func,
+        .fmt = fmt,
+    };
+    size_t len = encode_args(record, sizeof(header), fmt, ap);
+    va_end(ap);
+    header.len = (uint32_t)len;
+    memcpy(record, &header, sizeof(header));
+
+    // only whole records go in, so that the reader always finds them whole
+    if (ring->ring.capacity - ring_used(&ring->ring) < len) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    ring_write(&ring->ring, record, len);
+}
+
+/**
+ * Format and write every record in the rings. Called with drain_lock held.
+ * Returns the number of records written.
+ */
+static size_t drain_rings(void) {
+    static char out[LOG_OUT_BUF];
+    size_t out_len = 0;
+    size_t count = 0;
+
+    for (log_ring_t *ring = atomic_load(&rings); ring != NULL;
+         ring = ring->next) {
+        uint64_t dropped = atomic_exchange(&ring->dropped, 0);
+        if (dropped > 0) {
+            fprintf(stderr, "[WARN]:  %lu log records dropped\n", dropped);
+        }
+
+        log_header_t header;
+        while (ring_used(&ring->ring) >= sizeof(header)) {
+            _Alignas(uint64_t) uint8_t record[LOG_MAX_RECORD];
+            ring_read(&ring->ring, record, sizeof(header));
+            memcpy(&header, record, sizeof(header));
+            ring_read(&ring->ring, record + sizeof(header),
+                      header.len - sizeof(header));
+
+            char message[LOG_MAX_MESSAGE];
+            format_record(record, header.len, message);
+            if (out_len + LOG_MAX_MESSAGE + 512 > sizeof(out)) {
+                fwrite(out, 1, out_len, stderr);
+                out_len = 0;
+            }
+            int written =
+                snprintf(out + out_len, sizeof(out) - out_len,
+                         "%s%s:%u :: %s :: %s\n", header.tag, header.file,
+                         header.line, header.func, message);
+            if (written > 0) {
+                out_len += (size_t)written;
+            }
+            count++;
+        }
+    }
+
+    fwrite(out, 1, out_len, stderr);
+    fflush(stderr);
+    return count;
+}
+
+static void *flush_logs(void *arg) {
+    (void)arg;
+    struct timespec pause = {.tv_sec = 0,
+                             .tv_nsec = LOG_FLUSH_MS * 1000000L};
+    while (!atomic_load(&stopping)) {
+        pthread_mutex_lock(&drain_lock);
+        size_t count = drain_rings();
+        pthread_mutex_unlock(&drain_lock);
+        if (count == 0) {
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+int log_start(void) {
+    static bool registered = false;
+    if (atomic_load(&async)) {
+        return 0;
+    }
+    if (!registered) {
+        atexit(log_stop);
+        registered = true;
+    }
+
+    // signals are handled by the other threads, which may then stop this one
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    atomic_store(&stopping, false);
+    int ret = pthread_create(&flusher, NULL, flush_logs, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (ret != 0) {
+        return -1;
+    }
+
+    atomic_store(&async, true);
+    return 0;
+}
+
+void log_stop(void) {
+    if (!atomic_exchange(&async, false)) {
+        return;
+    }
+    atomic_store(&stopping, true);
+    if (!pthread_equal(pthread_self(), flusher)) {
+        pthread_join(flusher, NULL);
+    }
+
+    // records may still be coming from threads that saw logs asynchronous
+    pthread_mutex_lock(&drain_lock);
+    drain_rings();
+    pthread_mutex_unlock(&drain_lock);
+}
@@ -13,51 +13,65 @@ typedef enum {
 void set_log_level(log_level_t level);
 extern log_level_t g_level;
 
-#define INFO(...)                                                              \
+/**
+ * Highest level compiled in (make LOG_LEVEL=n): the logs of the levels above
+ * it are optimized out, arguments included, though their formats are still
+ * checked. INFO and PANIC always print, WARN and LOG at LOG_NORMAL, and DEBUG
+ * at LOG_VERBOSE.
+ */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_VERBOSE
+#endif
+
+/**
+ * Logs are written synchronously until log_start is called. From then on,
+ * each thread copies its records (the format and the raw values of its
+ * arguments, not the formatted text) into a lock-free ring of its own, and a
+ * background thread formats and writes them. A record that does not fit in
+ * its thread's ring is dropped (and counted), so logging never blocks.
+ *
+ * Returns 0 if successful, -1 otherwise (logs stay synchronous).
+ */
+int log_start(void);
+
+/**
+ * Write the records still in the rings and stop the background thread (also
+ * done on exit, and before a PANIC is printed). Logs are synchronous again
+ * afterwards.
+ */
+void log_stop(void);
+
+/**
+ * Log a record, in the background once log_start was called. tag starts the
+ * line, and every pointer but the arguments of the format must stay valid
+ * (they are string literals).
+ */
+void log_record(char const *tag, char const *file, int line, char const *func,
+                char const *fmt, ...) __attribute__((format(printf, 5, 6)));
+
+#define LOG_AT(level, tag, ...)                                                \
     do {                                                                       \
-        char buf[2048];                                                        \
-        snprintf(buf, 2048, __VA_ARGS__);                                      \
-        fprintf(stderr, "[INFO]:  %s:%d :: %s :: %s\n", __FILE__, __LINE__,    \
-                __func__, buf);                                                \
-    } while (0);
+        if ((level) <= LOG_MAX_LEVEL && g_level >= (level)) {                  \
+            log_record(tag, __FILE__, __LINE__, __func__, __VA_ARGS__);        \
+        }                                                                      \
+    } while (0)
+
+#define INFO(...) LOG_AT(LOG_QUIET, "[INFO]:  ", __VA_ARGS__)
 
 #define PANIC(...)                                                             \
     do {                                                                       \
         char buf[2048];                                                        \
         snprintf(buf, 2048, __VA_ARGS__);                                      \
+        log_stop();                                                            \
         fprintf(stderr, "[PANIC]: %s:%d :: %s :: %s\n", __FILE__, __LINE__,    \
                 __func__, buf);                                                \
         exit(EXIT_FAILURE);                                                    \
     } while (0);
 
-#define WARN(...)                                                              \
-    do {                                                                       \
-        if (g_level == LOG_NORMAL || g_level == LOG_VERBOSE) {                 \
-            char buf[2048];                                                    \
-            snprintf(buf, 2048, __VA_ARGS__);                                  \
-            fprintf(stderr, "[WARN]:  %s:%d :: %s :: %s\n", __FILE__,          \
-                    __LINE__, __func__, buf);                                  \
-        }                                                                      \
-    } while (0);
+#define WARN(...) LOG_AT(LOG_NORMAL, "[WARN]:  ", __VA_ARGS__)
 
-#define LOG(...)                                                               \
-    do {                                                                       \
-        if (g_level == LOG_NORMAL || g_level == LOG_VERBOSE) {                 \
-            char buf[2048];                                                    \
-            snprintf(buf, 2048, __VA_ARGS__);                                  \
-            fprintf(stderr, "[LOG]:   %s:%d :: %s :: %s\n", __FILE__,          \
-                    __LINE__, __func__, buf);                                  \
-        }                                                                      \
-    } while (0);
+#define LOG(...) LOG_AT(LOG_NORMAL, "[LOG]:   ", __VA_ARGS__)
 
-#define DEBUG(...)                                                             \
-    do {                                                                       \
-        if (g_level == LOG_VERBOSE) {                                          \
-            char buf[2048];                                                    \
-            snprintf(buf, 2048, __VA_ARGS__);                                  \
-            fprintf(stderr, "[DEBUG]: %s:%d :: %s :: %s\n", __FILE__,          \
-                    __LINE__, __func__, buf);                                  \
-        }                                                                      \
-    } while (0);
+#define DEBUG(...) LOG_AT(LOG_VERBOSE, "[DEBUG]: ", __VA_ARGS__)
 
 #endif // __UTILS_LOGGING_H__
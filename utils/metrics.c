@@ -0,0 +1,136 @@
+#include "metrics.h"
+#include <string.h>
+#include <time.h>
+
+// Shard of the calling thread (see metrics_set_shard)
+static _Thread_local unsigned thread_shard = 0;
+
+void metrics_set_shard(unsigned index) {
+    thread_shard = index % METRICS_SHARDS;
+}
+
+static metrics_shard_t *get_shard(metrics_t *metrics) {
+    return &metrics->shards[thread_shard];
+}
+
+void metrics_init(metrics_t *metrics) {
+    for (size_t i = 0; i < METRICS_SHARDS; i++) {
+        metrics_shard_t *shard = &metrics->shards[i];
+        for (size_t j = 0; j < METRIC_COUNT; j++) {
+            atomic_init(&shard->counters[j], 0);
+        }
+        for (size_t j = 0; j < LATENCY_COUNT; j++) {
+            for (size_t k = 0; k < HIST_BUCKETS; k++) {
+                atomic_init(&shard->latencies[j][k], 0);
+            }
+        }
+    }
+    metrics->start = metrics_now();
+}
+
+uint64_t metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+void metrics_add(metrics_t *metrics, metric_t metric, uint64_t value) {
+    atomic_fetch_add_explicit(&get_shard(metrics)->counters[metric], value,
+                              memory_order_relaxed);
+}
+
+/**
+ * Bucket of a latency: values below 2^HIST_SUB_BITS have one each, and every
+ * power of two above is split into 2^HIST_SUB_BITS equal buckets.
+ */
+static size_t hist_bucket(uint64_t ns) {
+    if (ns >= (1ull << HIST_MAX_BITS)) {
+        return HIST_BUCKETS - 1;
+    }
+    if (ns < (1u << HIST_SUB_BITS)) {
+        return (size_t)ns;
+    }
+    unsigned exponent = 63 - (unsigned)__builtin_clzll(ns);
+    unsigned shift = exponent - HIST_SUB_BITS;
+    return ((size_t)(shift + 1) << HIST_SUB_BITS) +
+           (size_t)((ns >> shift) - (1u << HIST_SUB_BITS));
+}
+
+/**
+ * Highest latency that falls in a bucket.
+ */
+static uint64_t hist_upper_bound(size_t bucket) {
+    if (bucket < (1u << HIST_SUB_BITS)) {
+        return bucket;
+    }
+    unsigned shift = (unsigned)(bucket >> HIST_SUB_BITS) - 1;
+    uint64_t sub =
+        (1u << HIST_SUB_BITS) + (bucket & ((1u << HIST_SUB_BITS) - 1));
+    return ((sub + 1) << shift) - 1;
+}
+
+void metrics_record(metrics_t *metrics, latency_t latency, uint64_t ns) {
+    atomic_fetch_add_explicit(
+        &get_shard(metrics)->latencies[latency][hist_bucket(ns)], 1,
+        memory_order_relaxed);
+}
+
+/**
+ * Percentiles of a histogram, added up across the shards.
+ */
+static void read_latency(metrics_t *metrics, latency_t latency,
+                         latency_info_t *info) {
+    uint64_t buckets[HIST_BUCKETS] = {0};
+    uint64_t count = 0;
+    for (size_t i = 0; i < METRICS_SHARDS; i++) {
+        for (size_t j = 0; j < HIST_BUCKETS; j++) {
+            uint64_t n = atomic_load_explicit(
+                &metrics->shards[i].latencies[latency][j],
+                memory_order_relaxed);
+            buckets[j] += n;
+            count += n;
+        }
+    }
+
+    // in ten thousandths
+    uint64_t const quantiles[] = {5000, 9000, 9900, 9990};
+    uint64_t *const results[] = {&info->p50, &info->p90, &info->p99,
+                                 &info->p999};
+    memset(info, 0, sizeof(*info));
+    info->count = count;
+    if (count == 0) {
+        return;
+    }
+
+    size_t q = 0;
+    uint64_t seen = 0;
+    for (size_t j = 0; j < HIST_BUCKETS; j++) {
+        if (buckets[j] == 0) {
+            continue;
+        }
+        seen += buckets[j];
+        while (q < 4 && seen * 10000 >= quantiles[q] * count) {
+            *results[q++] = hist_upper_bound(j);
+        }
+        info->max = hist_upper_bound(j);
+    }
+}
+
+void metrics_read(metrics_t *metrics, stats_info_t *info) {
+    uint64_t counters[METRIC_COUNT] = {0};
+    for (size_t i = 0; i < METRICS_SHARDS; i++) {
+        for (size_t j = 0; j < METRIC_COUNT; j++) {
+            counters[j] += atomic_load_explicit(
+                &metrics->shards[i].counters[j], memory_order_relaxed);
+        }
+    }
+
+    info->uptime_ns = metrics_now() - metrics->start;
+    info->msgs_in = counters[METRIC_MSGS_IN];
+    info->bytes_in = counters[METRIC_BYTES_IN];
+    info->msgs_out = counters[METRIC_MSGS_OUT];
+    info->bytes_out = counters[METRIC_BYTES_OUT];
+    info->msgs_dropped = counters[METRIC_MSGS_DROPPED];
+    read_latency(metrics, LATENCY_INGEST, &info->ingest);
+    read_latency(metrics, LATENCY_DELIVER, &info->deliver);
+}
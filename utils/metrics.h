@@ -0,0 +1,86 @@
+#ifndef __UTILS_METRICS_H__
+#define __UTILS_METRICS_H__
+
+#include "protocol/protocol.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Shards of a set of metrics: each thread updates one of them (the one of its
+// index, for the workers of the broker's event loop, so that no two workers
+// share one)
+#define METRICS_SHARDS (4)
+
+#define CACHE_LINE (64)
+
+// Latency histograms split every power of two into 2^HIST_SUB_BITS buckets,
+// for a relative error of at most an eighth, from 0 up to 2^HIST_MAX_BITS - 1
+// nanoseconds (about 18 minutes, longer latencies land in the last bucket)
+#define HIST_SUB_BITS (3)
+#define HIST_MAX_BITS (40)
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef enum {
+    METRIC_MSGS_IN = 0,
+    METRIC_BYTES_IN,
+    METRIC_MSGS_OUT,
+    METRIC_BYTES_OUT,
+    METRIC_MSGS_DROPPED,
+    METRIC_COUNT,
+} metric_t;
+
+typedef enum {
+    LATENCY_INGEST = 0,
+    LATENCY_DELIVER,
+    LATENCY_COUNT,
+} latency_t;
+
+/**
+ * The metrics updated by the threads sharing a shard, alone in their cache
+ * lines.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint64_t counters[METRIC_COUNT];
+    _Atomic uint64_t latencies[LATENCY_COUNT][HIST_BUCKETS];
+} metrics_shard_t;
+
+/**
+ * Counters and latency histograms of a box, or of the whole broker.
+ *
+ * Updates only touch the calling thread's shard, with relaxed atomics, so
+ * that threads serving different sessions never write to the same cache
+ * line. Readers add up the shards on demand: the totals are not a snapshot
+ * taken at a single instant, but every update is eventually counted.
+ */
+typedef struct {
+    metrics_shard_t shards[METRICS_SHARDS];
+    uint64_t start; // metrics_now() when the counters started
+} metrics_t;
+
+void metrics_init(metrics_t *metrics);
+
+/**
+ * Have the calling thread update the shard of the given index (modulo
+ * METRICS_SHARDS) from now on: each worker of the broker's event loop passes
+ * its own index. Threads that never call it update the first shard.
+ */
+void metrics_set_shard(unsigned index);
+
+/**
+ * Monotonic clock reading, in nanoseconds.
+ */
+uint64_t metrics_now(void);
+
+void metrics_add(metrics_t *metrics, metric_t metric, uint64_t value);
+
+/**
+ * Record a latency (in nanoseconds) in its histogram.
+ */
+void metrics_record(metrics_t *metrics, latency_t latency, uint64_t ns);
+
+/**
+ * Add up the shards into info: the counters, the time since the counters
+ * started, and the percentiles of the latencies.
+ */
+void metrics_read(metrics_t *metrics, stats_info_t *info);
+
+#endif // __UTILS_METRICS_H__
@@ -0,0 +1,79 @@
+#ifndef __UTILS_PROBES_H__
+#define __UTILS_PROBES_H__
+
+#include <stdint.h>
+
+/**
+ * Static tracepoints (USDT), for perf and bpftrace to attach to by name, e.g.
+ *
+ *     perf probe -x mbroker/mbroker sdt_tfs:write
+ *     bpftrace -e 'usdt:mbroker/mbroker:mbroker:deliver { @[arg0] = count(); }'
+ *
+ * Each probe is a single nop where it is placed, described by a note in the
+ * .note.stapsdt section of the binary (the layout sys/sdt.h produces, written
+ * out here so that no header from systemtap is needed): where the nop is, the
+ * provider and name of the probe, and where each argument is found when the
+ * nop is reached. Arguments are taken as 64-bit signed integers (pointers
+ * included), and are evaluated even if nothing is attached, so they should
+ * be values at hand.
+ *
+ * Probes are compiled out entirely with make PROBES=no, and on architectures
+ * other than x86-64 and AArch64.
+ */
+#if !defined(NO_PROBES) && (defined(__x86_64__) || defined(__aarch64__))
+
+#define PROBE_NOTE(provider, name, args)                                       \
+    "990: nop\n"                                                               \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                              \
+    ".balign 4\n"                                                              \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                         \
+    "991: .asciz \"stapsdt\"\n"                                                \
+    "992: .balign 4\n"                                                         \
+    "993: .8byte 990b\n"                                                       \
+    ".8byte _.stapsdt.base\n"                                                  \
+    ".8byte 0\n" /* no semaphore: the probe is always there */                 \
+    ".asciz \"" #provider "\"\n"                                               \
+    ".asciz \"" #name "\"\n"                                                   \
+    ".asciz \"" args "\"\n"                                                    \
+    "994: .balign 4\n"                                                         \
+    ".popsection\n"                                                            \
+    /* the base address tools use to tell how far the binary was moved */      \
+    ".ifndef _.stapsdt.base\n"                                                 \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"    \
+    ".weak _.stapsdt.base\n"                                                   \
+    ".hidden _.stapsdt.base\n"                                                 \
+    "_.stapsdt.base: .space 1\n"                                               \
+    ".size _.stapsdt.base, 1\n"                                                \
+    ".popsection\n"                                                            \
+    ".endif\n"
+
+// an argument in a register, in memory or an immediate
+#define PROBE_ARG(arg) "nor"((int64_t)(arg))
+
+#define PROBE(provider, name)                                                  \
+    __asm__ __volatile__(PROBE_NOTE(provider, name, ""))
+#define PROBE1(provider, name, a1)                                             \
+    __asm__ __volatile__(PROBE_NOTE(provider, name, "-8@%0")                   \
+                         :                                                     \
+                         : PROBE_ARG(a1))
+#define PROBE2(provider, name, a1, a2)                                         \
+    __asm__ __volatile__(PROBE_NOTE(provider, name, "-8@%0 -8@%1")             \
+                         :                                                     \
+                         : PROBE_ARG(a1), PROBE_ARG(a2))
+#define PROBE3(provider, name, a1, a2, a3)                                     \
+    __asm__ __volatile__(PROBE_NOTE(provider, name, "-8@%0 -8@%1 -8@%2")       \
+                         :                                                     \
+                         : PROBE_ARG(a1), PROBE_ARG(a2), PROBE_ARG(a3))
+
+#else
+
+// the arguments are still checked, but never evaluated
+#define PROBE(provider, name) ((void)0)
+#define PROBE1(provider, name, a1) ((void)sizeof(a1))
+#define PROBE2(provider, name, a1, a2) ((void)sizeof(a1), (void)sizeof(a2))
+#define PROBE3(provider, name, a1, a2, a3)                                     \
+    ((void)sizeof(a1), (void)sizeof(a2), (void)sizeof(a3))
+
+#endif
+
+#endif // __UTILS_PROBES_H__
@@ -0,0 +1,220 @@
+#define _DEFAULT_SOURCE // syscall
+#include "ring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Shared memory names are flat: the client's pipe path, with its slashes
+ * replaced, under a common prefix.
+ */
+static void ring_name(char *name, char const *client_path) {
+    snprintf(name, NAME_MAX, "/mbroker-%s", client_path);
+    for (char *c = name + 1; *c != '\0'; c++) {
+        if (*c == '/') {
+            *c = '_';
+        }
+    }
+}
+
+static int ring_map(ring_t *ring, int fd, size_t map_len) {
+    void *addr =
+        mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+
+    ring->shared = addr;
+    ring->data = (uint8_t *)addr + sizeof(ring_header_t);
+    ring->capacity = map_len - sizeof(ring_header_t);
+    ring->map_len = map_len;
+    return 0;
+}
+
+int ring_create(ring_t *ring, char const *client_path, size_t capacity) {
+    char name[NAME_MAX];
+    ring_name(name, client_path);
+    shm_unlink(name);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+
+    size_t map_len = sizeof(ring_header_t) + capacity;
+    if (ftruncate(fd, (off_t)map_len) != 0 || ring_map(ring, fd, map_len)) {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    close(fd);
+
+    // the object starts zeroed; the reader starts out waiting for data
+    ring->shared->capacity = capacity;
+    atomic_store(&ring->shared->reader_waiting, 1);
+    return 0;
+}
+
+int ring_attach(ring_t *ring, char const *client_path) {
+    char name[NAME_MAX];
+    ring_name(name, client_path);
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= (off_t)sizeof(ring_header_t)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t map_len = (size_t)st.st_size;
+    size_t capacity = map_len - sizeof(ring_header_t);
+    if ((capacity & (capacity - 1)) != 0 || ring_map(ring, fd, map_len)) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    if (ring->shared->capacity != capacity) {
+        ring_detach(ring);
+        return -1;
+    }
+    return 0;
+}
+
+int ring_alloc(ring_t *ring, size_t capacity) {
+    // the header's alignment makes its size a multiple of a cache line
+    size_t map_len = sizeof(ring_header_t) + capacity;
+    void *addr = aligned_alloc(_Alignof(ring_header_t), map_len);
+    if (addr == NULL) {
+        return -1;
+    }
+    memset(addr, 0, sizeof(ring_header_t));
+
+    ring->shared = addr;
+    ring->data = (uint8_t *)addr + sizeof(ring_header_t);
+    ring->capacity = capacity;
+    ring->map_len = map_len;
+    ring->shared->capacity = capacity;
+    return 0;
+}
+
+void ring_free(ring_t *ring) {
+    free(ring->shared);
+    ring->shared = NULL;
+    ring->data = NULL;
+}
+
+void ring_unlink(char const *client_path) {
+    char name[NAME_MAX];
+    ring_name(name, client_path);
+    shm_unlink(name);
+}
+
+void ring_detach(ring_t *ring) {
+    munmap(ring->shared, ring->map_len);
+    ring->shared = NULL;
+    ring->data = NULL;
+}
+
+size_t ring_used(ring_t const *ring) {
+    return (size_t)(atomic_load_explicit(&ring->shared->head,
+                                         memory_order_acquire) -
+                    atomic_load_explicit(&ring->shared->tail,
+                                         memory_order_acquire));
+}
+
+size_t ring_write(ring_t *ring, void const *data, size_t len) {
+    uint64_t head =
+        atomic_load_explicit(&ring->shared->head, memory_order_relaxed);
+    uint64_t tail =
+        atomic_load_explicit(&ring->shared->tail, memory_order_acquire);
+
+    size_t used = (size_t)(head - tail);
+    if (used > ring->capacity) {
+        return 0; // the consumer broke the ring
+    }
+    size_t room = ring->capacity - used;
+    if (len > room) {
+        len = room;
+    }
+
+    size_t start = (size_t)head & (ring->capacity - 1);
+    size_t first = ring->capacity - start < len ? ring->capacity - start : len;
+    memcpy(ring->data + start, data, first);
+    memcpy(ring->data, (uint8_t const *)data + first, len - first);
+
+    atomic_store_explicit(&ring->shared->head, head + len,
+                          memory_order_release);
+    return len;
+}
+
+ssize_t ring_read(ring_t *ring, void *buf, size_t len) {
+    uint64_t tail =
+        atomic_load_explicit(&ring->shared->tail, memory_order_relaxed);
+    uint64_t head =
+        atomic_load_explicit(&ring->shared->head, memory_order_acquire);
+
+    size_t used = (size_t)(head - tail);
+    if (used > ring->capacity) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (len > used) {
+        len = used;
+    }
+
+    size_t start = (size_t)tail & (ring->capacity - 1);
+    size_t first = ring->capacity - start < len ? ring->capacity - start : len;
+    memcpy(buf, ring->data + start, first);
+    memcpy((uint8_t *)buf + first, ring->data, len - first);
+
+    atomic_store_explicit(&ring->shared->tail, tail + len,
+                          memory_order_release);
+    return (ssize_t)len;
+}
+
+void ring_prepare_sleep(_Atomic uint32_t *flag) {
+    atomic_store(flag, 1);
+    // the ring is checked again after the flag is visible
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+bool ring_take(_Atomic uint32_t *flag) {
+    // the flag is checked after the ring update is visible
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load(flag) != 0 && atomic_exchange(flag, 0) != 0;
+}
+
+void ring_sleep(_Atomic uint32_t *flag, int timeout_ms) {
+    struct timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L,
+    };
+    // returns right away if the flag was cleared meanwhile
+    syscall(SYS_futex, flag, FUTEX_WAIT, 1, &timeout, NULL, 0);
+}
+
+void ring_wake(_Atomic uint32_t *flag) {
+    if (ring_take(flag)) {
+        syscall(SYS_futex, flag, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+void ring_close(ring_t *ring) {
+    atomic_store(&ring->shared->closed, 1);
+    ring_wake(&ring->shared->reader_waiting);
+    ring_wake(&ring->shared->writer_waiting);
+}
@@ -0,0 +1,127 @@
+#ifndef __UTILS_RING_H__
+#define __UTILS_RING_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Capacity (in bytes) of the rings created by clients
+#define RING_CAPACITY (1 << 20)
+
+/**
+ * Header of a single-producer single-consumer byte ring, at the start of a
+ * POSIX shared memory object created by a client and mapped by the broker.
+ *
+ * The ring carries the same frames as the session pipe would. Each side that
+ * finds the ring empty (reader) or full (writer) sets its waiting flag before
+ * sleeping, and the other side only wakes it up when the flag is set, so no
+ * system call is made while both sides keep up.
+ */
+typedef struct {
+    // written by the producer
+    _Alignas(64) _Atomic uint64_t head;
+    // written by the consumer
+    _Alignas(64) _Atomic uint64_t tail;
+
+    _Alignas(64) _Atomic uint32_t reader_waiting;
+    _Atomic uint32_t writer_waiting;
+    // set by the broker when it closes the session
+    _Atomic uint32_t closed;
+    uint64_t capacity;
+} ring_header_t;
+
+/**
+ * A mapped ring. The capacity is kept privately, as the shared header can be
+ * written by the other process at any time.
+ */
+typedef struct {
+    ring_header_t *shared;
+    uint8_t *data;
+    size_t capacity;
+    size_t map_len;
+} ring_t;
+
+/**
+ * Create and map the ring of a session, named after the client's pipe.
+ * capacity must be a power of two.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int ring_create(ring_t *ring, char const *client_path, size_t capacity);
+
+/**
+ * Map the ring created by a client.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int ring_attach(ring_t *ring, char const *client_path);
+
+/**
+ * Allocate a ring in private memory, for threads of the same process.
+ * capacity must be a power of two.
+ * Returns 0 if successful, -1 otherwise.
+ */
+int ring_alloc(ring_t *ring, size_t capacity);
+
+/**
+ * Free a ring allocated with ring_alloc.
+ */
+void ring_free(ring_t *ring);
+
+/**
+ * Remove the name of a ring (the mappings stay valid).
+ */
+void ring_unlink(char const *client_path);
+
+/**
+ * Unmap a ring.
+ */
+void ring_detach(ring_t *ring);
+
+/**
+ * Copy up to len bytes into the ring.
+ * Returns the number of bytes written (0 if the ring is full).
+ */
+size_t ring_write(ring_t *ring, void const *data, size_t len);
+
+/**
+ * Copy up to len bytes out of the ring.
+ * Returns the number of bytes read (0 if the ring is empty), or -1 if the
+ * indices in the shared header are not consistent.
+ */
+ssize_t ring_read(ring_t *ring, void *buf, size_t len);
+
+/**
+ * Number of bytes waiting in the ring.
+ */
+size_t ring_used(ring_t const *ring);
+
+/**
+ * Set a waiting flag. The ring must be checked again afterwards, before
+ * sleeping: the other side may have updated it before seeing the flag.
+ */
+void ring_prepare_sleep(_Atomic uint32_t *flag);
+
+/**
+ * Clear a waiting flag. Returns whether it was set, meaning the other side
+ * must be woken up.
+ */
+bool ring_take(_Atomic uint32_t *flag);
+
+/**
+ * Sleep while a waiting flag is set (it is cleared by whoever wakes us), for
+ * at most timeout_ms milliseconds.
+ */
+void ring_sleep(_Atomic uint32_t *flag, int timeout_ms);
+
+/**
+ * Wake up a side sleeping on the given flag, if it is set.
+ */
+void ring_wake(_Atomic uint32_t *flag);
+
+/**
+ * Mark a ring as closed and wake up both sides.
+ */
+void ring_close(ring_t *ring);
+
+#endif // __UTILS_RING_H__
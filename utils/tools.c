@@ -1,64 +1,501 @@
 #include "tools.h"
 #include <errno.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
-
-void packet_cpy(void *packet, size_t *offset, const void *buff, size_t len) {
-    memcpy(packet + *offset, buff, len);
-    *offset += len;
-}
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 void init_tfs_box(box_t *box, char *box_name) {
-    box->n_publishers = 0;
-    box->n_subscribers = 0;
-    box->size = 0;
+    atomic_init(&box->n_publishers, 0);
+    atomic_init(&box->n_subscribers, 0);
+    atomic_init(&box->size, 0);
+    atomic_init(&box->refs, 1);
+    atomic_init(&box->parked_publisher, NO_PARKED_PUBLISHER);
+    memset(box->name, 0, sizeof(box->name));
     strncpy(box->name, box_name, MAX_BOX_NAME);
+
+    pthread_mutex_init(&box->lock, NULL);
+    box->removed = false;
+    box->publisher = NULL;
+    box->subscribers = NULL;
+    memset(box->dedup, 0, sizeof(box->dedup));
+    box->dedup_clock = 0;
+    memset(&box->tail, 0, sizeof(box->tail));
+    filter_trie_init(&box->filters);
+    box->list = NULL;
+    box->record = NULL;
+    box->filter_hits = NULL;
+    box->filter_frames = NULL;
+    box->filter_ids = 0;
+    metrics_init(&box->metrics);
+}
+
+void box_get(box_t *box) { atomic_fetch_add(&box->refs, 1); }
+
+void box_put(box_t *box) {
+    if (atomic_fetch_sub(&box->refs, 1) == 1) {
+        pthread_mutex_destroy(&box->lock);
+        free(box->tail.data);
+        free(box->tail.lengths);
+        filter_trie_destroy(&box->filters);
+        if (box->list != NULL) {
+            put_box_list(box->list);
+        }
+        free(box->filter_hits);
+        free(box->filter_frames);
+        free(box);
+    }
+}
+
+uint64_t box_dedup_last(box_t *box, uint64_t producer_id) {
+    for (size_t i = 0; i < DEDUP_PRODUCERS; i++) {
+        if (box->dedup[i].producer_id == producer_id) {
+            return box->dedup[i].last_seq;
+        }
+    }
+    return 0;
+}
+
+void box_dedup_record(box_t *box, uint64_t producer_id, uint64_t last_seq) {
+    // the producer's entry, or else a free one, or else the least recently
+    // used
+    dedup_entry_t *entry = &box->dedup[0];
+    for (size_t i = 0; i < DEDUP_PRODUCERS; i++) {
+        dedup_entry_t *candidate = &box->dedup[i];
+        if (candidate->producer_id == producer_id) {
+            entry = candidate;
+            break;
+        }
+        if (entry->producer_id != 0 &&
+            (candidate->producer_id == 0 ||
+             candidate->last_used < entry->last_used)) {
+            entry = candidate;
+        }
+    }
+
+    entry->producer_id = producer_id;
+    entry->last_seq = last_seq;
+    entry->last_used = ++box->dedup_clock;
+}
+
+int box_tail_init(box_t *box, size_t max_records, size_t capacity) {
+    box_tail_t *tail = &box->tail;
+    tail->data = malloc(capacity);
+    tail->lengths = malloc(max_records * sizeof(uint32_t));
+    if (tail->data == NULL || tail->lengths == NULL) {
+        free(tail->data);
+        free(tail->lengths);
+        memset(tail, 0, sizeof(*tail));
+        return -1;
+    }
+    tail->capacity = capacity;
+    tail->max_records = max_records;
+    return 0;
+}
+
+void encode_record_header(uint8_t *buf, uint8_t kind, uint32_t len) {
+    buf[0] = kind;
+    memcpy(buf + 1, &len, sizeof(uint32_t));
+}
+
+size_t decode_record(uint8_t const *buf, size_t len, uint8_t *kind,
+                     uint8_t const **payload, uint32_t *payload_len) {
+    if (len < RECORD_HEADER_LEN) {
+        return 0;
+    }
+    uint32_t record_len;
+    memcpy(&record_len, buf + 1, sizeof(uint32_t));
+    if (len - RECORD_HEADER_LEN < record_len) {
+        return 0;
+    }
+
+    *kind = buf[0];
+    *payload = buf + RECORD_HEADER_LEN;
+    *payload_len = record_len;
+    return RECORD_HEADER_LEN + record_len;
+}
+
+static void box_tail_drop_oldest(box_tail_t *tail) {
+    tail->head = (tail->head + tail->lengths[tail->first]) % tail->capacity;
+    tail->len -= tail->lengths[tail->first];
+    tail->first = (tail->first + 1) % tail->max_records;
+    tail->count--;
+}
+
+void box_tail_append(box_t *box, uint8_t const *records, size_t len) {
+    box_tail_t *tail = &box->tail;
+    if (tail->data == NULL) {
+        return;
+    }
+
+    for (size_t offset = 0; offset < len;) {
+        uint8_t const *record = records + offset;
+        uint8_t kind;
+        uint8_t const *payload;
+        uint32_t payload_len;
+        size_t record_len = decode_record(record, len - offset, &kind,
+                                          &payload, &payload_len);
+        if (record_len == 0) {
+            record_len = len - offset;
+        }
+        offset += record_len;
+
+        if (record_len > tail->capacity) {
+            // the records held would no longer end the file
+            tail->head = 0;
+            tail->len = 0;
+            tail->first = 0;
+            tail->count = 0;
+            continue;
+        }
+        while (tail->count == tail->max_records ||
+               tail->len + record_len > tail->capacity) {
+            box_tail_drop_oldest(tail);
+        }
+        size_t end = (tail->head + tail->len) % tail->capacity;
+        size_t first_part = tail->capacity - end < record_len
+                                ? tail->capacity - end
+                                : record_len;
+        memcpy(tail->data + end, record, first_part);
+        memcpy(tail->data, record + first_part, record_len - first_part);
+        tail->len += record_len;
+        tail->lengths[(tail->first + tail->count) % tail->max_records] =
+            (uint32_t)record_len;
+        tail->count++;
+    }
+}
+
+void box_tail_clear(box_t *box) {
+    free(box->tail.data);
+    free(box->tail.lengths);
+    memset(&box->tail, 0, sizeof(box->tail));
+}
+
+static size_t hash_box_name(char const *box_name) {
+    // FNV-1a
+    size_t hash = 14695981039346656037UL;
+    for (; *box_name != '\0'; box_name++) {
+        hash ^= (unsigned char)*box_name;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static node_t *_Atomic *box_bucket(box_table_t *table, char const *box_name) {
+    return &table->buckets[hash_box_name(box_name) & (table->n_buckets - 1)];
+}
+
+int box_table_init(box_table_t *table, size_t n_buckets) {
+    size_t size = 1;
+    while (size < n_buckets) {
+        size <<= 1;
+    }
+
+    table->buckets = calloc(size, sizeof(node_t *));
+    if (table->buckets == NULL) {
+        return -1;
+    }
+    table->n_buckets = size;
+    atomic_init(&table->count, 0);
+    atomic_init(&table->epoch, 0);
+    atomic_init(&table->readers[0], 0);
+    atomic_init(&table->readers[1], 0);
+    pthread_mutex_init(&table->write_lock, NULL);
+    pthread_mutex_init(&table->list_lock, NULL);
+    table->list = NULL;
+    atomic_init(&table->list_stale, true);
+
+    return 0;
+}
+
+void box_table_destroy(box_table_t *table) {
+    for (size_t i = 0; i < table->n_buckets; i++) {
+        node_t *node = atomic_load(&table->buckets[i]);
+        while (node != NULL) {
+            node_t *next = atomic_load(&node->next);
+            box_put(node->data);
+            free(node);
+            node = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = NULL;
+    pthread_mutex_destroy(&table->write_lock);
+
+    if (table->list != NULL) {
+        put_box_list(table->list);
+        table->list = NULL;
+    }
+    pthread_mutex_destroy(&table->list_lock);
+}
+
+size_t box_table_count(box_table_t *table) {
+    return atomic_load(&table->count);
+}
+
+/**
+ * Mark the cached listing as out of date (boxes were added or removed).
+ */
+static void box_table_touch(box_table_t *table) {
+    // only write the shared flag when it changes
+    if (!atomic_load_explicit(&table->list_stale, memory_order_relaxed)) {
+        atomic_store(&table->list_stale, true);
+    }
+}
+
+/**
+ * Enter a read-side critical section. Returns the reader slot to pass to
+ * read_unlock.
+ */
+static unsigned read_lock(box_table_t *table) {
+    while (1) {
+        unsigned slot = atomic_load(&table->epoch) & 1;
+        atomic_fetch_add(&table->readers[slot], 1);
+        // if a writer flipped the epoch meanwhile, it may not have waited for
+        // us: retry on the new slot
+        if ((atomic_load(&table->epoch) & 1) == slot) {
+            return slot;
+        }
+        atomic_fetch_sub(&table->readers[slot], 1);
+    }
+}
+
+static void read_unlock(box_table_t *table, unsigned slot) {
+    atomic_fetch_sub(&table->readers[slot], 1);
+}
+
+/**
+ * Wait until every reader that may have seen an unlinked node has left.
+ * Called with the write lock held.
+ */
+static void synchronize_readers(box_table_t *table) {
+    unsigned slot = atomic_fetch_add(&table->epoch, 1) & 1;
+    while (atomic_load(&table->readers[slot]) != 0) {
+        sched_yield();
+    }
+}
+
+box_t *find_box(box_table_t *table, char const *box_name) {
+    box_t *box = NULL;
+    unsigned slot = read_lock(table);
+
+    node_t *tmp = atomic_load(box_bucket(table, box_name));
+    while (tmp != NULL) {
+        if (!strcmp(tmp->data->name, box_name)) {
+            // the registry's reference keeps the box alive until we are done
+            box = tmp->data;
+            box_get(box);
+            break;
+        }
+        tmp = atomic_load(&tmp->next);
+    }
+
+    read_unlock(table, slot);
+    return box;
+}
+
+// Unlinked nodes freed after each wait for readers when removing many boxes
+#define DELETE_BATCH (256)
+
+int append_box(box_table_t *table, box_t *data) {
+    bool added;
+    append_boxes(table, &data, 1, &added);
+    return added ? 0 : -1;
 }
 
-void append_box(node_t **head, box_t *data) {
-    node_t *new_node = malloc(sizeof(node_t));
-    new_node->data = data;
-    new_node->next = NULL;
+size_t append_boxes(box_table_t *table, box_t *const *boxes, size_t count,
+                    bool *added) {
+    size_t n_added = 0;
 
-    if (*head == NULL) {
-        *head = new_node;
-    } else {
-        node_t *last_node = *head;
+    pthread_mutex_lock(&table->write_lock);
+    for (size_t i = 0; i < count; i++) {
+        added[i] = false;
+        node_t *new_node = boxes[i] != NULL ? malloc(sizeof(node_t)) : NULL;
+        if (new_node == NULL) {
+            continue;
+        }
+        new_node->data = boxes[i];
 
-        while (last_node->next != NULL) {
-            last_node = last_node->next;
+        node_t *_Atomic *bucket = box_bucket(table, boxes[i]->name);
+        node_t *tmp = atomic_load(bucket);
+        while (tmp != NULL && strcmp(tmp->data->name, boxes[i]->name)) {
+            tmp = atomic_load(&tmp->next);
+        }
+        if (tmp != NULL) {
+            free(new_node);
+            continue;
         }
 
-        last_node->next = new_node;
+        // publish the fully initialized node at the head of the chain
+        atomic_init(&new_node->next, atomic_load(bucket));
+        atomic_store(bucket, new_node);
+        added[i] = true;
+        n_added++;
     }
+    atomic_fetch_add(&table->count, n_added);
+    pthread_mutex_unlock(&table->write_lock);
+    box_table_touch(table);
+
+    return n_added;
+}
+
+box_t *delete_box(box_table_t *table, char const *box_name) {
+    box_t *box;
+    delete_boxes(table, &box_name, 1, &box);
+    return box;
 }
 
-void delete_box(node_t **head, char *box_name) {
-    node_t *tmp;
+void delete_boxes(box_table_t *table, char const *const *box_names,
+                  size_t count, box_t **removed) {
+    node_t *unlinked[DELETE_BATCH];
+    size_t n_unlinked = 0;
 
-    if (!strcmp((*head)->data->name, box_name)) {
-        tmp = *head;
-        *head = (*head)->next;
-        free(tmp);
-    } else {
-        node_t *current = *head;
-        while (current->next != NULL) {
-            if (!strcmp(current->next->data->name, box_name)) {
-                tmp = current->next;
-                // node will be disconnected from the linked list.
-                current->next = current->next->next;
-                free(tmp);
+    pthread_mutex_lock(&table->write_lock);
+    for (size_t i = 0; i < count; i++) {
+        removed[i] = NULL;
+        node_t *_Atomic *link = box_bucket(table, box_names[i]);
+        node_t *current;
+        while ((current = atomic_load(link)) != NULL) {
+            if (!strcmp(current->data->name, box_names[i])) {
+                // node will be disconnected from the chain, but readers may
+                // still be traversing it
+                atomic_store(link, atomic_load(&current->next));
+                atomic_fetch_sub(&table->count, 1);
+                removed[i] = current->data;
+                unlinked[n_unlinked++] = current;
                 break;
-            } else {
-                current = current->next;
+            }
+            link = &current->next;
+        }
+
+        // one wait covers every node unlinked so far
+        if (n_unlinked == DELETE_BATCH || (i + 1 == count && n_unlinked > 0)) {
+            synchronize_readers(table);
+            while (n_unlinked > 0) {
+                free(unlinked[--n_unlinked]);
             }
         }
     }
+    pthread_mutex_unlock(&table->write_lock);
+    box_table_touch(table);
+}
+
+static int compare_box_names(const void *b1, const void *b2) {
+    box_t *const *box1 = b1;
+    box_t *const *box2 = b2;
+
+    return strcmp((*box1)->name, (*box2)->name);
+}
+
+/**
+ * Take up to capacity boxes out of the table (with a reference to each),
+ * sorted by name.
+ */
+static size_t snapshot_boxes(box_table_t *table, box_t **boxes,
+                             size_t capacity) {
+    size_t count = 0;
+    unsigned slot = read_lock(table);
+
+    for (size_t i = 0; i < table->n_buckets && count < capacity; i++) {
+        node_t *tmp = atomic_load(&table->buckets[i]);
+        for (; tmp != NULL && count < capacity; tmp = atomic_load(&tmp->next)) {
+            box_get(tmp->data);
+            boxes[count++] = tmp->data;
+        }
+    }
+    read_unlock(table, slot);
+
+    qsort(boxes, count, sizeof(box_t *), compare_box_names);
+    return count;
+}
+
+/**
+ * List boxes, pointing each one at its record.
+ */
+static void fill_box_list(box_list_t *list, box_t *const *boxes,
+                          size_t count) {
+    list->count = count;
+    encode_list_header(list->header, count);
+    for (size_t i = 0; i < count; i++) {
+        box_t *box = boxes[i];
+        box_info_t *record = &list->boxes[i];
+        memset(record, 0, sizeof(*record));
+        memcpy(record->name, box->name, sizeof(record->name));
+
+        pthread_mutex_lock(&box->lock);
+        if (box->list != NULL) {
+            put_box_list(box->list);
+        }
+        atomic_fetch_add(&list->refs, 1);
+        box->list = list;
+        box->record = record;
+        box_list_update(box);
+        pthread_mutex_unlock(&box->lock);
+    }
+}
+
+box_list_t *get_box_list(box_table_t *table) {
+    pthread_mutex_lock(&table->list_lock);
+
+    // clear the flag before reading the boxes, so that changes made while
+    // the listing is rebuilt mark it stale again
+    if (atomic_exchange(&table->list_stale, false) || table->list == NULL) {
+        // boxes created meanwhile are left out, but they mark the listing
+        // stale again
+        size_t capacity = atomic_load(&table->count);
+        box_list_t *list =
+            malloc(sizeof(box_list_t) + capacity * sizeof(box_info_t));
+        box_t **listed =
+            capacity > 0 ? malloc(capacity * sizeof(box_t *)) : NULL;
+        if (list == NULL || (listed == NULL && capacity > 0)) {
+            free(list);
+            free(listed);
+            atomic_store(&table->list_stale, true);
+            pthread_mutex_unlock(&table->list_lock);
+            return NULL;
+        }
+        atomic_init(&list->refs, 1);
+        size_t count = snapshot_boxes(table, listed, capacity);
+        fill_box_list(list, listed, count);
+        for (size_t i = 0; i < count; i++) {
+            box_put(listed[i]);
+        }
+        free(listed);
+
+        if (table->list != NULL) {
+            put_box_list(table->list);
+        }
+        table->list = list;
+    }
+
+    box_list_t *list = table->list;
+    atomic_fetch_add(&list->refs, 1);
+    pthread_mutex_unlock(&table->list_lock);
+
+    return list;
+}
+
+void put_box_list(box_list_t *list) {
+    if (atomic_fetch_sub(&list->refs, 1) == 1) {
+        free(list);
+    }
+}
+
+void box_list_update(box_t *box) {
+    // the record may be in the middle of being sent: each field is written
+    // whole, so a listing shows every value either before or after
+    if (box->record != NULL) {
+        box->record->size = atomic_load(&box->size);
+        box->record->n_subscribers = atomic_load(&box->n_subscribers);
+        box->record->n_publishers = atomic_load(&box->n_publishers);
+    }
 }
 
 int compare_boxes(const void *b1, const void *b2) {
-    box_t *box1 = (box_t *)b1;
-    box_t *box2 = (box_t *)b2;
+    box_info_t *box1 = (box_info_t *)b1;
+    box_info_t *box2 = (box_info_t *)b2;
 
     return strcmp(box1->name, box2->name);
 }
@@ -72,6 +509,22 @@ ssize_t safe_read(int fd, void *buff, size_t len) {
     return b_read;
 }
 
+ssize_t read_all(int fd, void *buff, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t b_read = safe_read(fd, (char *)buff + total, len - total);
+        if (b_read < 0) {
+            return -1;
+        }
+        if (b_read == 0) {
+            break;
+        }
+        total += (size_t)b_read;
+    }
+
+    return (ssize_t)total;
+}
+
 ssize_t safe_write(int fd, const void *buff, size_t len) {
     ssize_t written;
     do {
@@ -81,13 +534,91 @@ ssize_t safe_write(int fd, const void *buff, size_t len) {
     return written;
 }
 
-box_t *find_box(node_t *head, char *box_name) {
-    node_t *tmp = head;
-    while (tmp != NULL) {
-        if (!strcmp(tmp->data->name, box_name)) {
-            return tmp->data;
+ssize_t safe_writev(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += written;
+
+        // skip what was written, which may end in the middle of a buffer
+        size_t left = (size_t)written;
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+
+    return total;
+}
+
+bool broker_uses_socket(char const *register_path) {
+    struct stat st;
+    return stat(register_path, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+int connect_broker(char const *register_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(register_path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, register_path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+ssize_t packet_read(packet_reader_t *reader, void *buff, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        if (reader->pos == reader->len) {
+            ssize_t b_read;
+            do {
+                // MSG_TRUNC reports the whole length of a packet that did
+                // not fit
+                b_read = recv(reader->fd, reader->buf, reader->capacity,
+                              MSG_TRUNC);
+            } while (b_read < 0 && errno == EINTR);
+            if (b_read < 0) {
+                return -1;
+            }
+            if (b_read == 0) {
+                break;
+            }
+            if ((size_t)b_read > reader->capacity) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            reader->len = (size_t)b_read;
+            reader->pos = 0;
         }
-        tmp = tmp->next;
+
+        size_t n = reader->len - reader->pos;
+        if (n > len - total) {
+            n = len - total;
+        }
+        memcpy((char *)buff + total, reader->buf + reader->pos, n);
+        reader->pos += n;
+        total += n;
     }
-    return NULL;
-}
\ No newline at end of file
+
+    return (ssize_t)total;
+}
@@ -1,54 +1,254 @@
 #ifndef __TOOLS_H__
 #define __TOOLS_H__
 
+#include "protocol/protocol.h"
+#include "utils/filter.h"
+#include "utils/metrics.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #define MAX_BOX_COUNT 16
-#define MAX_BOX_NAME 32
-#define MAX_PIPE_NAME 256
-#define MAX_ERROR_MSG 1024
-#define MAX_PUB_MSG 1024
-
-typedef enum {
-    TFS_OPCODE_REG_PUB = 1,
-    TFS_OPCODE_REG_SUB = 2,
-    TFS_OPCODE_ANS_CRT_BOX = 5,
-    TFS_OPCODE_ANS_RMV_BOX = 6,
-    TFS_OPCODE_CRT_BOX = 3,
-    TFS_OPCODE_RMV_BOX = 4,
-    TFS_OPCODE_LST_BOX = 7,
-    TFS_OPCODE_ANS_LST_BOX = 8,
-    TFS_OPCODE_PUB_MSG = 9,
-    TFS_OPCODE_SUB_MSG = 10,
-} tfs_opcode_t;
 
+struct session;
+struct box_list;
+struct msg;
+
+// Value of box_t.parked_publisher when no publisher is waiting
+#define NO_PARKED_PUBLISHER (UINT64_MAX)
+
+// Idempotent producers a box remembers (the least recently seen is forgotten
+// first, after which its duplicates are no longer detected)
+#define DEDUP_PRODUCERS (16)
+
+/**
+ * Last message stored in a box from an idempotent producer.
+ */
+typedef struct {
+    uint64_t producer_id; // 0 if the entry is free
+    uint64_t last_seq;
+    uint64_t last_used;
+} dedup_entry_t;
+
+/**
+ * Records are stored in a box as a kind byte, a uint32 length and that many
+ * bytes: a message (RECORD_MESSAGE), or a chunk of a streamed message
+ * (RECORD_CHUNK, or'ed with its chunk flags).
+ */
+#define RECORD_HEADER_LEN (sizeof(uint8_t) + sizeof(uint32_t))
+#define RECORD_MESSAGE (0)
+#define RECORD_CHUNK (1u << 7)
+
+// Longest record stored in a box
+#define MAX_BOX_RECORD_LEN (RECORD_HEADER_LEN + MAX_CHUNK_LEN)
+
+// Write the header of a record of the given kind and length into buf
+// (RECORD_HEADER_LEN bytes)
+void encode_record_header(uint8_t *buf, uint8_t kind, uint32_t len);
+
+// Decode the record at the start of buf (len bytes). Returns its length, or 0
+// if buf does not hold all of it
+size_t decode_record(uint8_t const *buf, size_t len, uint8_t *kind,
+                     uint8_t const **payload, uint32_t *payload_len);
+
+/**
+ * The most recent records stored in a box, kept in memory so that new
+ * subscribers are sent them without reading the box's file: a ring of their
+ * bytes, as stored, and one of their lengths. The records it holds are the
+ * last ones of the file, which ends at the box's size. Empty (and never
+ * filled) if data is NULL.
+ */
+typedef struct {
+    uint8_t *data;
+    size_t capacity; // bytes
+    size_t head;     // offset in data of the oldest byte
+    size_t len;      // bytes held
+    uint32_t *lengths;
+    size_t max_records;
+    size_t first; // index in lengths of the oldest record
+    size_t count; // records held
+} box_tail_t;
+
+/**
+ * A box, as kept by the broker.
+ *
+ * The counters can be read at any time; membership (the publisher and the
+ * list of subscribers) is protected by the box's lock. Boxes are reference
+ * counted: the registry and every session attached to the box hold a
+ * reference. Boxes hold their metrics, so they must be allocated aligned
+ * (with aligned_alloc).
+ */
 typedef struct {
     char name[MAX_BOX_NAME + 1];
-    uint64_t size;
-    uint64_t n_subscribers;
-    uint64_t n_publishers;
+    _Atomic uint64_t size;
+    _Atomic uint64_t n_subscribers;
+    _Atomic uint64_t n_publishers;
+    _Atomic unsigned refs;
+    // token of the publisher waiting for room in the subscribers' queues
+    _Atomic uint64_t parked_publisher;
+
+    pthread_mutex_t lock;
+    bool removed;
+    struct session *publisher;
+    struct session *subscribers;
+    // dedup window, also protected by the lock
+    dedup_entry_t dedup[DEDUP_PRODUCERS];
+    uint64_t dedup_clock;
+    // recent records, and the filters of the subscribers, also protected by
+    // the lock
+    box_tail_t tail;
+    filter_trie_t filters;
+    // record of the box in the listing it was last listed in (NULL if none),
+    // holding a reference to it, also protected by the lock
+    struct box_list *list;
+    box_info_t *record;
+    // scratch buffers of the box's publisher, with room for filter_ids ids:
+    // a row of hits per filter and the frames of each filter, empty between
+    // batches, also protected by the lock
+    uint64_t *filter_hits;
+    struct msg **filter_frames;
+    size_t filter_ids;
+
+    metrics_t metrics;
 } box_t;
 
 typedef struct node {
     box_t *data;
-    struct node *next;
+    struct node *_Atomic next;
 } node_t;
 
-box_t *find_box(node_t *head, char *box_name);
+/**
+ * Sorted listing of the boxes, kept ready to be sent to managers as is: the
+ * start of the answer, then the records. Listed boxes update their record in
+ * place, so it is only rebuilt when boxes are added or removed.
+ */
+typedef struct box_list {
+    _Atomic unsigned refs;
+    size_t count;
+    uint8_t header[LIST_RECORDS_OFFSET];
+    box_info_t boxes[];
+} box_list_t;
+
+/**
+ * Box registry: a hash table of boxes keyed by name.
+ *
+ * Lookups never take a lock: readers traverse the bucket chains inside a
+ * read-side critical section, and writers (which are serialized by a mutex)
+ * only free a node once every reader that could still see it has left.
+ */
+typedef struct {
+    node_t *_Atomic *buckets;
+    size_t n_buckets; // power of two
+    _Atomic size_t count;
+
+    pthread_mutex_t write_lock;
+    _Atomic unsigned epoch;
+    _Atomic size_t readers[2];
+
+    // cached listing, rebuilt when boxes were added or removed since
+    pthread_mutex_t list_lock;
+    box_list_t *list;
+    _Atomic bool list_stale;
+} box_table_t;
+
+int box_table_init(box_table_t *table, size_t n_buckets);
+
+void box_table_destroy(box_table_t *table);
+
+size_t box_table_count(box_table_t *table);
 
-void packet_cpy(void *packet, size_t *offset, const void *buff, size_t len);
+// Returns the current listing with a reference taken (release it with
+// put_box_list), or NULL on allocation failure
+box_list_t *get_box_list(box_table_t *table);
+
+void put_box_list(box_list_t *list);
+
+// Copy the size and counters of a box to its record in the listing. Called
+// with the box's lock held
+void box_list_update(box_t *box);
+
+// Returns the box with a reference taken (release it with box_put)
+box_t *find_box(box_table_t *table, char const *box_name);
 
 ssize_t safe_write(int fd, const void *buff, size_t len);
 
 ssize_t safe_read(int fd, void *buff, size_t len);
 
+// Read exactly len bytes, unless end of file or an error comes first
+ssize_t read_all(int fd, void *buff, size_t len);
+
+// Write every buffer, retrying on interruptions and partial writes
+ssize_t safe_writev(int fd, struct iovec *iov, int iovcnt);
+
+/**
+ * Clients of a broker started with a socket (mbroker -t socket) connect to it
+ * instead of writing to the register pipe: the register request is the first
+ * packet of the connection, which then carries the session. No client pipe is
+ * created. Packets hold whole frames, and must be read whole.
+ */
+typedef struct {
+    int fd;
+    uint8_t *buf; // room for the largest packet expected
+    size_t capacity;
+    size_t len;
+    size_t pos;
+} packet_reader_t;
+
+// Whether the broker listens on a socket at register_path, rather than a pipe
+bool broker_uses_socket(char const *register_path);
+
+// Returns a connection to the broker's socket, or -1 on error
+int connect_broker(char const *register_path);
+
+// Read exactly len bytes from the packets of a connection, unless it ends or
+// an error comes first (errno is EMSGSIZE if a packet does not fit the buffer)
+ssize_t packet_read(packet_reader_t *reader, void *buff, size_t len);
+
 void init_tfs_box(box_t *box, char *box_name);
 
-void append_box(node_t **head, box_t *data);
+void box_get(box_t *box);
+
+void box_put(box_t *box);
+
+// Returns the sequence number of the last message stored in the box from a
+// producer, or 0 if it is not remembered. Called with the box's lock held
+uint64_t box_dedup_last(box_t *box, uint64_t producer_id);
+
+// Remember the last message stored in the box from a producer. Called with
+// the box's lock held
+void box_dedup_record(box_t *box, uint64_t producer_id, uint64_t last_seq);
+
+// Keep the last max_records records stored in the box (capacity bytes at
+// most) in memory. Returns 0 if successful, -1 otherwise
+int box_tail_init(box_t *box, size_t max_records, size_t capacity);
+
+// Append records just stored in the box (len bytes), dropping the oldest
+// ones to make room. Called with the box's lock held
+void box_tail_append(box_t *box, uint8_t const *records, size_t len);
+
+// Stop keeping records of the box in memory (its file no longer ends with
+// them). Called with the box's lock held
+void box_tail_clear(box_t *box);
+
+int append_box(box_table_t *table, box_t *data);
+
+// Returns the removed box, along with the registry's reference to it
+box_t *delete_box(box_table_t *table, char const *box_name);
+
+// Insert several boxes under one update of the registry; added[i] tells
+// whether boxes[i] (which may be NULL) was inserted. Returns how many were
+size_t append_boxes(box_table_t *table, box_t *const *boxes, size_t count,
+                    bool *added);
 
-void delete_box(node_t **head, char *box_name);
+// Remove several boxes under one update of the registry, waiting for readers
+// once for the whole lot; removed[i] is the box named box_names[i] (with the
+// registry's reference), or NULL if there was none
+void delete_boxes(box_table_t *table, char const *const *box_names,
+                  size_t count, box_t **removed);
 
 int compare_boxes(const void *b1, const void *b2);
 
@@ -0,0 +1,159 @@
+#include "trace.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    char const *name;
+    uint64_t trace_id;
+    uint64_t start;
+    uint64_t end;
+    unsigned tid;
+    _Atomic bool ready; // set once the span is written whole
+} span_t;
+
+// NULL while tracing is off
+static span_t *_Atomic spans = NULL;
+static _Atomic size_t next_span = 0;
+static _Atomic uint64_t next_id = 0;
+
+static char trace_path[PATH_MAX];
+static char const *trace_process = "";
+
+// Small ids for the threads that recorded spans, in order of their first one
+static _Thread_local unsigned thread_id = 0;
+static _Atomic unsigned next_thread_id = 0;
+
+int trace_start(char const *path, char const *process_name) {
+    if (strlen(path) >= sizeof(trace_path)) {
+        return -1;
+    }
+    span_t *buf = calloc(TRACE_CAPACITY, sizeof(span_t));
+    if (buf == NULL) {
+        return -1;
+    }
+    strcpy(trace_path, path);
+    trace_process = process_name;
+    atomic_store(&spans, buf);
+    atexit(trace_stop);
+    return 0;
+}
+
+uint64_t trace_new_id(void) {
+    return ((uint64_t)getpid() << 32) | (atomic_fetch_add(&next_id, 1) + 1);
+}
+
+void trace_span(char const *name, uint64_t trace_id, uint64_t start,
+                uint64_t end) {
+    span_t *buf = atomic_load_explicit(&spans, memory_order_acquire);
+    if (trace_id == 0 || buf == NULL) {
+        return;
+    }
+
+    size_t i = atomic_fetch_add_explicit(&next_span, 1, memory_order_relaxed);
+    if (i >= TRACE_CAPACITY) {
+        return;
+    }
+    if (thread_id == 0) {
+        thread_id = atomic_fetch_add(&next_thread_id, 1) + 1;
+    }
+    buf[i].name = name;
+    buf[i].trace_id = trace_id;
+    buf[i].start = start;
+    buf[i].end = end >= start ? end : start;
+    buf[i].tid = thread_id;
+    atomic_store_explicit(&buf[i].ready, true, memory_order_release);
+}
+
+/**
+ * A line of the trace being written, formatted by hand (snprintf is not
+ * async-signal-safe).
+ */
+typedef struct {
+    char data[512];
+    size_t len;
+} line_t;
+
+static void put_str(line_t *line, char const *str) {
+    size_t len = strlen(str);
+    if (len > sizeof(line->data) - line->len) {
+        len = sizeof(line->data) - line->len;
+    }
+    memcpy(line->data + line->len, str, len);
+    line->len += len;
+}
+
+static void put_u64(line_t *line, uint64_t value, unsigned base,
+                    unsigned min_digits) {
+    char digits[24];
+    size_t n = 0;
+    do {
+        digits[n++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value > 0 || n < min_digits);
+    while (n > 0 && line->len < sizeof(line->data)) {
+        line->data[line->len++] = digits[--n];
+    }
+}
+
+// Timestamps are in microseconds, with nanoseconds as decimals
+static void put_us(line_t *line, uint64_t ns) {
+    put_u64(line, ns / 1000, 10, 1);
+    put_str(line, ".");
+    put_u64(line, ns % 1000, 10, 3);
+}
+
+void trace_stop(void) {
+    span_t *buf = atomic_exchange(&spans, NULL);
+    if (buf == NULL) {
+        return;
+    }
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return;
+    }
+    uint64_t pid = (uint64_t)getpid();
+
+    line_t line = {.len = 0};
+    put_str(&line, "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":");
+    put_u64(&line, pid, 10, 1);
+    put_str(&line, ",\"args\":{\"name\":\"");
+    put_str(&line, trace_process);
+    put_str(&line, "\"}}");
+    ssize_t ret = write(fd, line.data, line.len);
+
+    size_t count = atomic_load(&next_span);
+    for (size_t i = 0; i < count && i < TRACE_CAPACITY && ret >= 0; i++) {
+        span_t *span = &buf[i];
+        if (!atomic_load_explicit(&span->ready, memory_order_acquire)) {
+            continue;
+        }
+        line.len = 0;
+        put_str(&line, ",\n{\"name\":\"");
+        put_str(&line, span->name);
+        put_str(&line, "\",\"cat\":\"");
+        put_str(&line, trace_process);
+        put_str(&line, "\",\"ph\":\"X\",\"ts\":");
+        put_us(&line, span->start);
+        put_str(&line, ",\"dur\":");
+        put_us(&line, span->end - span->start);
+        put_str(&line, ",\"pid\":");
+        put_u64(&line, pid, 10, 1);
+        put_str(&line, ",\"tid\":");
+        put_u64(&line, span->tid, 10, 1);
+        put_str(&line, ",\"args\":{\"trace_id\":\"0x");
+        put_u64(&line, span->trace_id, 16, 16);
+        put_str(&line, "\"}}");
+        ret = write(fd, line.data, line.len);
+    }
+    if (ret >= 0) {
+        ret = write(fd, "]\n", 2);
+    }
+    close(fd);
+    // spans may still be recorded by threads that saw tracing on: the buffer
+    // is left allocated
+}
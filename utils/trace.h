@@ -0,0 +1,52 @@
+#ifndef __UTILS_TRACE_H__
+#define __UTILS_TRACE_H__
+
+#include <stdint.h>
+
+// Spans a process keeps (those recorded once it is full are dropped)
+#define TRACE_CAPACITY (1 << 16)
+
+/**
+ * Sampled tracing of messages from end to end.
+ *
+ * The publisher picks the frames to trace, and sends a trace context (see
+ * TFS_OPCODE_TRACE) ahead of each; the broker and the subscribers follow the
+ * id it carries. Every process that was started with a trace file records
+ * the spans of the traced frames it handles, timed with the monotonic clock
+ * shared by the processes of the host, and writes them to its file on exit,
+ * in the JSON array format of Chrome's trace viewer (and Perfetto). The files
+ * of several processes are merged by concatenating the arrays, e.g. with
+ * `jq -s add`.
+ *
+ * Recording only costs anything for traced frames: when tracing is off, or
+ * for frames that were not sampled, trace_span returns right away.
+ */
+
+/**
+ * Start recording spans, to be written to path, under the given process
+ * name, when trace_stop is called (done on exit).
+ * Returns 0 if successful, -1 otherwise.
+ */
+int trace_start(char const *path, char const *process_name);
+
+/**
+ * Write the spans recorded to the trace file, and stop recording. Only uses
+ * async-signal-safe functions, so that it can be called from a signal
+ * handler.
+ */
+void trace_stop(void);
+
+/**
+ * A new trace id, never 0, unique across the processes of the host.
+ */
+uint64_t trace_new_id(void);
+
+/**
+ * Record a span of a traced frame (trace_id 0 for frames not traced), from
+ * start to end (metrics_now() readings). name must stay valid (it is a
+ * string literal).
+ */
+void trace_span(char const *name, uint64_t trace_id, uint64_t start,
+                uint64_t end);
+
+#endif // __UTILS_TRACE_H__